@@ -67,6 +67,12 @@ struct fuse_cmd;
 typedef int (*fuse_fill_dir_t) (void *buf, const char *name,
 				const struct stat *stbuf, off_t off);
 
+/** Completion handle of an asynchronous operation
+ *
+ * See the *_async methods of struct fuse_operations
+ */
+struct fuse_async;
+
 /* Used by deprecated getdir() method */
 typedef struct fuse_dirhandle *fuse_dirh_t;
 typedef int (*fuse_dirfil_t) (fuse_dirh_t h, const char *name, int type,
@@ -475,7 +481,8 @@ struct fuse_operations {
 	 * as the first argument for the following operations:
 	 *
 	 * read, write, flush, release, fsync, readdir, releasedir,
-	 * fsyncdir, ftruncate, fgetattr, lock, ioctl, poll and fsetattr_x
+	 * fsyncdir, ftruncate, fgetattr, getattr_async, lock, ioctl,
+	 * poll and fsetattr_x
 	 *
 	 * If this flag is set these operations continue to work on
 	 * unlinked files even if "-ohard_remove" option was specified.
@@ -487,7 +494,8 @@ struct fuse_operations {
 	 * the following operations:
 	 *
 	 * read, write, flush, release, fsync, readdir, releasedir,
-	 * fsyncdir, ftruncate, fgetattr, lock, ioctl, poll and fsetattr_x
+	 * fsyncdir, ftruncate, fgetattr, getattr_async, lock, ioctl,
+	 * poll and fsetattr_x
 	 *
 	 * Closely related to flag_nullpath_ok, but if this flag is
 	 * set then the path will not be calculaged even if the file
@@ -502,10 +510,20 @@ struct fuse_operations {
 	 */
 	unsigned int flag_utime_omit_ok:1;
 
+	/**
+	 * Flag indicating that the attributes passed to the filler by
+	 * readdir are complete, as getattr would return them.  A lookup
+	 * following the readdir may then be answered from them without
+	 * calling getattr.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	unsigned int flag_readdir_attr:1;
+
 	/**
 	 * Reserved flags, don't set
 	 */
-	unsigned int flag_reserved:29;
+	unsigned int flag_reserved:28;
 
 	/**
 	 * Ioctl
@@ -640,6 +658,129 @@ struct fuse_operations {
 	int (*fsetattr_x) (const char *, struct setattr_x *,
 			   struct fuse_file_info *);
 #endif /* __APPLE__ */
+
+	/**
+	 * Get file attributes asynchronously
+	 *
+	 * If implemented, this is called instead of getattr() and
+	 * fgetattr() for lookup and getattr requests.  Instead of
+	 * returning the result, the filesystem completes the operation
+	 * with fuse_async_reply_attr(), from any thread and at any
+	 * time, even before this method returns.  The path and
+	 * fuse_file_info arguments remain valid until then.  The
+	 * fuse_file_info argument is NULL if the attributes are
+	 * requested by path.  Otherwise the path may be NULL, as for
+	 * fgetattr(), see flag_nullpath_ok and flag_nopath.
+	 *
+	 * The synchronous getattr() method is still used where the
+	 * library needs the result immediately, e.g. after create().
+	 *
+	 * The asynchronous methods are only used if they are
+	 * implemented by the topmost filesystem in the stack.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	void (*getattr_async) (const char *, struct fuse_file_info *,
+			       struct fuse_async *);
+
+	/**
+	 * Open a file asynchronously
+	 *
+	 * Like open(), but completed with fuse_async_complete().  A
+	 * file handle may be stored in the fuse_file_info before
+	 * completion.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	void (*open_async) (const char *, struct fuse_file_info *,
+			    struct fuse_async *);
+
+	/**
+	 * Read data from an open file asynchronously
+	 *
+	 * Like read_buf(), but completed with fuse_async_reply_data().
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	void (*read_async) (const char *, size_t, off_t,
+			    struct fuse_file_info *, struct fuse_async *);
+
+	/**
+	 * Write data to an open file asynchronously
+	 *
+	 * Like write(), but completed with fuse_async_complete()
+	 * passing the number of bytes written or -errno.  The data
+	 * buffer remains valid until then.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	void (*write_async) (const char *, const char *, size_t, off_t,
+			     struct fuse_file_info *, struct fuse_async *);
+
+	/**
+	 * Change several file attributes at once
+	 *
+	 * valid is a mask of FUSE_SET_ATTR_* flags telling which
+	 * fields of attr are to be set.  On success the resulting
+	 * attributes of the file are stored in stbuf, as getattr()
+	 * would return them.  The fuse_file_info argument is NULL
+	 * unless the attributes are changed through an open file, in
+	 * which case the path may be NULL as for ftruncate().
+	 *
+	 * If implemented, a single call replaces the sequence of
+	 * chmod(), chown(), truncate() or ftruncate(), utimens() and
+	 * getattr() or fgetattr() calls that a setattr request is
+	 * otherwise split into.  Returning -ENOSYS falls back to that
+	 * sequence.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	int (*setattr) (const char *, const struct stat *attr, int valid,
+			struct stat *stbuf, struct fuse_file_info *);
+
+	/**
+	 * Create a file node and return its attributes
+	 *
+	 * Like mknod(), but on success the attributes of the new node
+	 * are stored in the last argument, so that no getattr() call
+	 * is needed to reply.  Returning -ENOSYS falls back to
+	 * mknod().  The same applies to the other *_attr methods.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	int (*mknod_attr) (const char *, mode_t, dev_t, struct stat *);
+
+	/**
+	 * Create a directory and return its attributes
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	int (*mkdir_attr) (const char *, mode_t, struct stat *);
+
+	/**
+	 * Create a symbolic link and return its attributes
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	int (*symlink_attr) (const char *, const char *, struct stat *);
+
+	/**
+	 * Create a hard link and return the attributes of the file
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	int (*link_attr) (const char *, const char *, struct stat *);
+
+	/**
+	 * Create and open a file and return its attributes
+	 *
+	 * Like create(), the attributes replace the fgetattr() call
+	 * that follows it.
+	 *
+	 * Introduced in version 2.9.9
+	 */
+	int (*create_attr) (const char *, mode_t, struct fuse_file_info *,
+			    struct stat *);
 };
 
 /** Extra context that may be needed by some filesystems
@@ -812,6 +953,52 @@ int fuse_getgroups(int size, gid_t list[]);
  */
 int fuse_interrupted(void);
 
+/**
+ * Complete an asynchronous getattr operation
+ *
+ * This finishes the request: for a lookup the node is created, the
+ * path lock is released and the reply is sent.  The handle is freed
+ * and must not be used afterwards.
+ *
+ * @param a the completion handle
+ * @param err zero on success, -errno on failure
+ * @param stbuf the file attributes, ignored on failure
+ */
+void fuse_async_reply_attr(struct fuse_async *a, int err,
+			   const struct stat *stbuf);
+
+/**
+ * Complete an asynchronous read operation
+ *
+ * The buffer is not freed, it may be released or reused by the
+ * caller after this function returns.  The handle is freed.
+ *
+ * @param a the completion handle
+ * @param err zero on success, -errno on failure
+ * @param buf the data read, ignored on failure
+ */
+void fuse_async_reply_data(struct fuse_async *a, int err,
+			   struct fuse_bufvec *buf);
+
+/**
+ * Complete an asynchronous open or write operation
+ *
+ * The handle is freed and must not be used afterwards.
+ *
+ * @param a the completion handle
+ * @param res result of the operation, -errno on failure
+ */
+void fuse_async_complete(struct fuse_async *a, int res);
+
+/**
+ * Check if the request of an asynchronous operation has been
+ * interrupted
+ *
+ * @param a the completion handle
+ * @return 1 if the request has been interrupted, 0 otherwise
+ */
+int fuse_async_interrupted(struct fuse_async *a);
+
 /**
  * Invalidates cache for the given path.
  *
@@ -844,7 +1031,8 @@ int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op,
 		   size_t op_size, void *user_data);
 
 /**
- * Start the cleanup thread when using option "remember".
+ * Start the cleanup thread when using option "remember" or "node_spill",
+ * and the tuning thread when using option "auto_tune".
  *
  * This is done automatically by fuse_loop_mt() and fuse_loop_dispatch()
  * @param fuse struct fuse pointer for fuse instance
@@ -853,7 +1041,8 @@ int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op,
 int fuse_start_cleanup_thread(struct fuse *fuse);
 
 /**
- * Stop the cleanup thread when using option "remember".
+ * Stop the cleanup thread when using option "remember" or "node_spill",
+ * and the tuning thread when using option "auto_tune".
  *
  * This is done automatically by fuse_loop_mt() and fuse_loop_dispatch()
  * @param fuse struct fuse pointer for fuse instance
@@ -861,8 +1050,8 @@ int fuse_start_cleanup_thread(struct fuse *fuse);
 void fuse_stop_cleanup_thread(struct fuse *fuse);
 
 /**
- * Iterate over cache removing stale entries
- * use in conjunction with "-oremember"
+ * Iterate over cache removing stale entries and spilling unused ones
+ * use in conjunction with "-oremember" or "-onode_spill"
  *
  * NOTE: This is already done for the standard sessions
  *
@@ -962,6 +1151,9 @@ int fuse_fs_setchgtime(struct fuse_fs *fs, const char *path,
 int fuse_fs_setcrtime(struct fuse_fs *fs, const char *path,
 		      const struct timespec *tv);
 #endif /* __APPLE__ */
+int fuse_fs_setattr(struct fuse_fs *fs, const char *path,
+		    const struct stat *attr, int valid, struct stat *stbuf,
+		    struct fuse_file_info *fi);
 int fuse_fs_chmod(struct fuse_fs *fs, const char *path, mode_t mode);
 int fuse_fs_chown(struct fuse_fs *fs, const char *path, uid_t uid, gid_t gid);
 int fuse_fs_truncate(struct fuse_fs *fs, const char *path, off_t size);
@@ -974,6 +1166,16 @@ int fuse_fs_readlink(struct fuse_fs *fs, const char *path, char *buf,
 		     size_t len);
 int fuse_fs_mknod(struct fuse_fs *fs, const char *path, mode_t mode,
 		  dev_t rdev);
+int fuse_fs_mknod_attr(struct fuse_fs *fs, const char *path, mode_t mode,
+		       dev_t rdev, struct stat *stbuf);
+int fuse_fs_mkdir_attr(struct fuse_fs *fs, const char *path, mode_t mode,
+		       struct stat *stbuf);
+int fuse_fs_symlink_attr(struct fuse_fs *fs, const char *linkname,
+			 const char *path, struct stat *stbuf);
+int fuse_fs_link_attr(struct fuse_fs *fs, const char *oldpath,
+		      const char *newpath, struct stat *stbuf);
+int fuse_fs_create_attr(struct fuse_fs *fs, const char *path, mode_t mode,
+			struct fuse_file_info *fi, struct stat *stbuf);
 int fuse_fs_mkdir(struct fuse_fs *fs, const char *path, mode_t mode);
 #ifdef __APPLE__
 int fuse_fs_setxattr(struct fuse_fs *fs, const char *path, const char *name,
@@ -200,6 +200,22 @@ struct fuse_file_info {
 
 #define FUSE_IOCTL_MAX_IOV	256
 
+/* 'to_set' flags in setattr, 'valid' flags in the high level setattr */
+#define FUSE_SET_ATTR_MODE	(1 << 0)
+#define FUSE_SET_ATTR_UID	(1 << 1)
+#define FUSE_SET_ATTR_GID	(1 << 2)
+#define FUSE_SET_ATTR_SIZE	(1 << 3)
+#define FUSE_SET_ATTR_ATIME	(1 << 4)
+#define FUSE_SET_ATTR_MTIME	(1 << 5)
+#define FUSE_SET_ATTR_ATIME_NOW	(1 << 7)
+#define FUSE_SET_ATTR_MTIME_NOW	(1 << 8)
+#ifdef __APPLE__
+#define FUSE_SET_ATTR_CRTIME	(1 << 28)
+#define FUSE_SET_ATTR_CHGTIME	(1 << 29)
+#define FUSE_SET_ATTR_BKUPTIME	(1 << 30)
+#define FUSE_SET_ATTR_FLAGS	(1 << 31)
+#endif /* __APPLE__ */
+
 /**
  * Connection information, passed to the ->init() method
  *
@@ -0,0 +1,808 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef _FUSE_CORO_HPP_
+#define _FUSE_CORO_HPP_
+
+/** @file
+ *
+ * C++20 coroutine front-end for the low level API
+ *
+ * Each low level operation is implemented as a coroutine which
+ * co_returns a typed reply (or fuse_coro::error).  The reply is sent
+ * when the coroutine returns, so every request is answered exactly
+ * once, forget gets fuse_reply_none() and an escaping exception is
+ * turned into EIO.  Failing to allocate the coroutine frame is
+ * answered with ENOMEM.
+ *
+ * Example:
+ *
+ *   struct myfs : fuse_coro::filesystem<myfs> {
+ *	fuse_coro::op<fuse_coro::attr>
+ *	getattr(fuse_coro::request req, fuse_ino_t ino,
+ *		fuse_coro::file_info fi)
+ *	{
+ *		struct stat st = co_await backend.stat(ino);
+ *		co_return fuse_coro::attr{st, 1.0};
+ *	}
+ *   };
+ *
+ *   myfs fs;
+ *   struct fuse_session *se = fs.session_new(&args);
+ *
+ * Operation arguments must be taken by value: the name and
+ * fuse_file_info arguments are copied into the coroutine frame, but
+ * the data of write() points into the request buffer and is only
+ * valid until the coroutine first suspends.
+ *
+ * Coroutines are started inline from the session loop and frames are
+ * allocated from a per-thread pool, so apart from the frame no memory
+ * is allocated per request.  The executor class runs a session loop
+ * which also resumes coroutines scheduled on it from other threads.
+ */
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include "fuse_lowlevel.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace fuse_coro {
+
+/* ----------------------------------------------------------- *
+ * Coroutine frame pool					       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Per-thread free lists of coroutine frames
+ *
+ * Frames are rounded up to a multiple of 'granularity' bytes; frames
+ * larger than 'max_size' come from the global allocator.  A frame
+ * released on another thread is kept on that thread's free list.
+ */
+class frame_pool {
+public:
+	static constexpr std::size_t granularity = 128;
+	static constexpr std::size_t max_size = 4096;
+	static constexpr std::size_t max_free = 256;
+
+	static void *allocate(std::size_t size)
+	{
+		std::size_t cls = size_class(size);
+
+		if (cls < nclasses) {
+			lists &l = local();
+			if (l.head[cls] != nullptr) {
+				free_frame *fr = l.head[cls];
+				l.head[cls] = fr->next;
+				l.count[cls]--;
+				return fr;
+			}
+			return ::operator new((cls + 1) * granularity);
+		}
+		return ::operator new(size);
+	}
+
+	static void deallocate(void *p, std::size_t size) noexcept
+	{
+		std::size_t cls = size_class(size);
+
+		if (cls < nclasses) {
+			lists &l = local();
+			if (l.count[cls] < max_free) {
+				free_frame *fr = static_cast<free_frame *>(p);
+				fr->next = l.head[cls];
+				l.head[cls] = fr;
+				l.count[cls]++;
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+
+private:
+	static constexpr std::size_t nclasses = max_size / granularity;
+
+	struct free_frame {
+		free_frame *next;
+	};
+
+	struct lists {
+		free_frame *head[nclasses] = {};
+		std::size_t count[nclasses] = {};
+
+		~lists()
+		{
+			for (std::size_t i = 0; i < nclasses; i++) {
+				while (head[i] != nullptr) {
+					free_frame *fr = head[i];
+					head[i] = fr->next;
+					::operator delete(fr);
+				}
+			}
+		}
+	};
+
+	static std::size_t size_class(std::size_t size)
+	{
+		return (size + granularity - 1) / granularity - 1;
+	}
+
+	static lists &local()
+	{
+		static thread_local lists l;
+		return l;
+	}
+};
+
+/* ----------------------------------------------------------- *
+ * Request handle and arguments				       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Request handle passed to every operation
+ *
+ * Cancellation follows fuse_req_interrupt_func(): cancelled() polls
+ * the interrupt state, and a cancel_callback registers a function
+ * which is called if the request is interrupted while it exists.
+ */
+namespace detail { class promise_base; }
+
+class request {
+public:
+	explicit request(fuse_req_t req) : req_(req) { }
+
+	fuse_req_t get() const { return req_; }
+	const struct fuse_ctx *ctx() const { return fuse_req_ctx(req_); }
+	bool cancelled() const { return fuse_req_interrupted(req_) != 0; }
+
+	/* The request handle is freed once the reply has been sent */
+	bool replied() const { return replied_ != nullptr && *replied_; }
+
+private:
+	friend class detail::promise_base;
+
+	fuse_req_t req_;
+	const bool *replied_ = nullptr;
+};
+
+/**
+ * Interrupt callback registration
+ *
+ * The callback runs on the thread processing the INTERRUPT request,
+ * or immediately if the request was already interrupted.  It must
+ * not reply to the request; it should only make the pending
+ * operation finish early (e.g. cancel a backend RPC).  Only one
+ * registration may exist per request at a time.
+ */
+template <typename F>
+class cancel_callback {
+public:
+	cancel_callback(const request &req, F fn) : req_(req), fn_(std::move(fn))
+	{
+		fuse_req_interrupt_func(req_.get(), &cancel_callback::invoke,
+					this);
+	}
+
+	/* Locals are destroyed after the reply, which unregisters it */
+	~cancel_callback()
+	{
+		if (!req_.replied())
+			fuse_req_interrupt_func(req_.get(), nullptr, nullptr);
+	}
+
+	cancel_callback(const cancel_callback &) = delete;
+	cancel_callback &operator=(const cancel_callback &) = delete;
+
+private:
+	static void invoke(fuse_req_t, void *data)
+	{
+		static_cast<cancel_callback *>(data)->fn_();
+	}
+
+	request req_;
+	F fn_;
+};
+
+/**
+ * A name argument, copied into the coroutine frame
+ *
+ * Names of up to inline_size - 1 bytes are stored in the argument
+ * itself, longer ones (symlink targets may be up to PATH_MAX) in a
+ * block from the frame pool.  Names are never cut short.
+ */
+class name_arg {
+public:
+	static constexpr std::size_t inline_size = 256;
+
+	explicit name_arg(const char *name)
+	{
+		assign(name, std::strlen(name));
+	}
+
+	name_arg(const name_arg &other)
+	{
+		assign(other.ptr_, other.len_);
+	}
+
+	name_arg(name_arg &&other) noexcept
+	{
+		if (other.ptr_ == other.buf_) {
+			std::memcpy(buf_, other.buf_, other.len_ + 1);
+			ptr_ = buf_;
+		} else {
+			ptr_ = other.ptr_;
+			other.ptr_ = other.buf_;
+			other.buf_[0] = '\0';
+		}
+		len_ = other.len_;
+		other.len_ = 0;
+	}
+
+	name_arg &operator=(const name_arg &) = delete;
+	name_arg &operator=(name_arg &&) = delete;
+
+	~name_arg()
+	{
+		if (ptr_ != buf_)
+			frame_pool::deallocate(ptr_, len_ + 1);
+	}
+
+	const char *c_str() const { return ptr_; }
+	std::size_t size() const { return len_; }
+
+private:
+	void assign(const char *name, std::size_t len)
+	{
+		if (len < inline_size)
+			ptr_ = buf_;
+		else
+			ptr_ = static_cast<char *>(frame_pool::allocate(len + 1));
+		std::memcpy(ptr_, name, len + 1);
+		len_ = len;
+	}
+
+	char *ptr_;
+	std::size_t len_;
+	char buf_[inline_size];
+};
+
+/** An optional fuse_file_info argument, copied into the frame */
+class file_info {
+public:
+	explicit file_info(const struct fuse_file_info *fi)
+		: valid_(fi != nullptr)
+	{
+		if (fi)
+			fi_ = *fi;
+		else
+			std::memset(&fi_, 0, sizeof(fi_));
+	}
+
+	explicit operator bool() const { return valid_; }
+	struct fuse_file_info *get() { return valid_ ? &fi_ : nullptr; }
+	struct fuse_file_info *operator->() { return &fi_; }
+
+private:
+	struct fuse_file_info fi_;
+	bool valid_;
+};
+
+/* ----------------------------------------------------------- *
+ * Typed replies						       *
+ * ----------------------------------------------------------- */
+
+/** Error reply, 'value' is a positive errno value */
+struct error { int value; };
+
+/** Reply for forget; the operation returns no value */
+struct none { };
+
+struct entry { struct fuse_entry_param e; };
+struct attr { struct stat st; double timeout; };
+struct open_file { struct fuse_file_info fi; };
+struct created { struct fuse_entry_param e; struct fuse_file_info fi; };
+struct written { std::size_t count; };
+struct buf { const char *data; std::size_t size; };
+struct data { struct fuse_bufvec *bufv; enum fuse_buf_copy_flags flags; };
+struct link_target { const char *link; };
+struct fs_stat { struct statvfs st; };
+struct ok { };
+
+/*
+ * Send functions, called while the locals of the coroutine are still
+ * alive, so replies may point to data owned by the coroutine.
+ */
+inline int send(fuse_req_t req, const error &r) { return fuse_reply_err(req, r.value); }
+inline int send(fuse_req_t req, const entry &r) { return fuse_reply_entry(req, &r.e); }
+inline int send(fuse_req_t req, const attr &r) { return fuse_reply_attr(req, &r.st, r.timeout); }
+inline int send(fuse_req_t req, const open_file &r) { return fuse_reply_open(req, &r.fi); }
+inline int send(fuse_req_t req, const created &r) { return fuse_reply_create(req, &r.e, &r.fi); }
+inline int send(fuse_req_t req, const written &r) { return fuse_reply_write(req, r.count); }
+inline int send(fuse_req_t req, const buf &r) { return fuse_reply_buf(req, r.data, r.size); }
+inline int send(fuse_req_t req, const data &r) { return fuse_reply_data(req, r.bufv, r.flags); }
+inline int send(fuse_req_t req, const link_target &r) { return fuse_reply_readlink(req, r.link); }
+inline int send(fuse_req_t req, const fs_stat &r) { return fuse_reply_statfs(req, &r.st); }
+inline int send(fuse_req_t req, const ok &) { return fuse_reply_err(req, 0); }
+
+/* ----------------------------------------------------------- *
+ * Operation coroutine type				       *
+ * ----------------------------------------------------------- */
+
+template <typename R> class op;
+
+namespace detail {
+
+class promise_base {
+public:
+	/*
+	 * Operations are members taking the request first; the
+	 * arguments are the copies in the frame.
+	 */
+	template <typename Self, typename... Args>
+	promise_base(Self &, request &req, Args &...) : req_(req.get())
+	{
+		req.replied_ = &replied_;
+	}
+
+	static void *operator new(std::size_t size)
+	{
+		return frame_pool::allocate(size);
+	}
+
+	static void operator delete(void *p, std::size_t size) noexcept
+	{
+		frame_pool::deallocate(p, size);
+	}
+
+	/* Run eagerly on the thread that received the request */
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_never final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() noexcept
+	{
+		if (!replied_)
+			finish(error{EIO});
+	}
+
+protected:
+	template <typename T>
+	void finish(const T &reply) noexcept
+	{
+		replied_ = true;
+		/* Make sure no interrupt callback refers to the frame */
+		fuse_req_interrupt_func(req_, nullptr, nullptr);
+		send(req_, reply);
+	}
+
+	fuse_req_t req_;
+	bool replied_ = false;
+};
+
+template <typename R>
+class promise : public promise_base {
+public:
+	using promise_base::promise_base;
+	op<R> get_return_object() noexcept { return {}; }
+	void return_value(const R &r) noexcept { finish(r); }
+	void return_value(const error &e) noexcept { finish(e); }
+};
+
+template <>
+class promise<none> : public promise_base {
+public:
+	using promise_base::promise_base;
+	op<none> get_return_object() noexcept;
+	void return_void() noexcept
+	{
+		replied_ = true;
+		fuse_reply_none(req_);
+	}
+	void unhandled_exception() noexcept { return_void(); }
+};
+
+} /* namespace detail */
+
+/**
+ * Return type of an operation coroutine
+ *
+ * The coroutine starts running immediately and destroys itself after
+ * replying, so the returned object carries no state.
+ */
+template <typename R>
+class op {
+public:
+	using promise_type = detail::promise<R>;
+};
+
+inline op<none> detail::promise<none>::get_return_object() noexcept
+{
+	return {};
+}
+
+/* ----------------------------------------------------------- *
+ * Executor						       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Session loop which also resumes scheduled coroutines
+ *
+ * Requests are processed on the thread calling run(), which starts
+ * their coroutines inline.  A coroutine resumed by a completion on
+ * another thread may 'co_await ex.schedule()' to continue on the
+ * loop thread.  The awaiter is linked into the queue, so scheduling
+ * doesn't allocate.
+ */
+class executor {
+public:
+	class schedule_awaiter {
+	public:
+		explicit schedule_awaiter(executor &ex) : ex_(ex) { }
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			handle_ = h;
+			ex_.post(this);
+		}
+		void await_resume() const noexcept { }
+
+	private:
+		friend class executor;
+		executor &ex_;
+		std::coroutine_handle<> handle_;
+		schedule_awaiter *next_ = nullptr;
+	};
+
+	explicit executor(struct fuse_session *se) : se_(se)
+	{
+		if (pipe(wake_) == -1)
+			wake_[0] = wake_[1] = -1;
+	}
+
+	~executor()
+	{
+		if (wake_[0] != -1) {
+			close(wake_[0]);
+			close(wake_[1]);
+		}
+	}
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	schedule_awaiter schedule() { return schedule_awaiter(*this); }
+
+	/** Run the loop until the session exits; like fuse_session_loop() */
+	int run()
+	{
+		struct fuse_chan *ch = fuse_session_next_chan(se_, NULL);
+		std::size_t bufsize = fuse_chan_bufsize(ch);
+		char *mem = static_cast<char *>(::operator new(bufsize));
+		int res = 0;
+
+		if (wake_[0] == -1) {
+			::operator delete(mem);
+			return -1;
+		}
+
+		while (!fuse_session_exited(se_)) {
+			struct pollfd fds[2] = {
+				{ fuse_chan_fd(ch), POLLIN, 0 },
+				{ wake_[0], POLLIN, 0 },
+			};
+
+			res = ::poll(fds, 2, -1);
+			if (res == -1) {
+				if (errno == EINTR)
+					continue;
+				res = -errno;
+				break;
+			}
+			if (fds[1].revents)
+				drain();
+			if (fds[0].revents) {
+				struct fuse_chan *tmpch = ch;
+				struct fuse_buf fbuf = {};
+
+				fbuf.mem = mem;
+				fbuf.size = bufsize;
+				res = fuse_session_receive_buf(se_, &fbuf,
+							       &tmpch);
+				if (res == -EINTR || res == -EAGAIN)
+					continue;
+				if (res <= 0)
+					break;
+
+				fuse_session_process_buf(se_, &fbuf, tmpch);
+			}
+		}
+
+		::operator delete(mem);
+		fuse_session_reset(se_);
+
+		return res < 0 ? -1 : 0;
+	}
+
+private:
+	void post(schedule_awaiter *aw) noexcept
+	{
+		bool wake;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			wake = head_ == nullptr;
+			aw->next_ = nullptr;
+			if (tail_)
+				tail_->next_ = aw;
+			else
+				head_ = aw;
+			tail_ = aw;
+		}
+		if (wake) {
+			char c = 0;
+			(void) !write(wake_[1], &c, 1);
+		}
+	}
+
+	void drain()
+	{
+		schedule_awaiter *aw;
+		char c;
+
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			(void) !read(wake_[0], &c, 1);
+			aw = head_;
+			head_ = tail_ = nullptr;
+		}
+		while (aw) {
+			/* The awaiter lives in the frame being resumed */
+			schedule_awaiter *next = aw->next_;
+			aw->handle_.resume();
+			aw = next;
+		}
+	}
+
+	struct fuse_session *se_;
+	int wake_[2];
+	std::mutex lock_;
+	schedule_awaiter *head_ = nullptr;
+	schedule_awaiter *tail_ = nullptr;
+};
+
+/* ----------------------------------------------------------- *
+ * Binding to fuse_lowlevel_ops				       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Base class of a coroutine filesystem
+ *
+ * FS derives from filesystem<FS> and defines any of the operations
+ * below as member coroutines.  Only operations which FS defines are
+ * registered with the session.
+ *
+ *   op<entry>     lookup(request, fuse_ino_t parent, name_arg)
+ *   op<none>      forget(request, fuse_ino_t, unsigned long nlookup)
+ *   op<attr>      getattr(request, fuse_ino_t, file_info)
+ *   op<attr>      setattr(request, fuse_ino_t, struct stat, int to_set,
+ *			   file_info)
+ *   op<link_target> readlink(request, fuse_ino_t)
+ *   op<entry>     mknod(request, fuse_ino_t parent, name_arg, mode_t,
+ *			 dev_t)
+ *   op<entry>     mkdir(request, fuse_ino_t parent, name_arg, mode_t)
+ *   op<ok>        unlink(request, fuse_ino_t parent, name_arg)
+ *   op<ok>        rmdir(request, fuse_ino_t parent, name_arg)
+ *   op<entry>     symlink(request, name_arg link, fuse_ino_t parent,
+ *			   name_arg)
+ *   op<ok>        rename(request, fuse_ino_t parent, name_arg,
+ *			  fuse_ino_t newparent, name_arg newname)
+ *   op<entry>     link(request, fuse_ino_t, fuse_ino_t newparent,
+ *			name_arg)
+ *   op<open_file> open(request, fuse_ino_t, file_info)
+ *   op<buf>       read(request, fuse_ino_t, size_t, off_t, file_info)
+ *   op<written>   write(request, fuse_ino_t, const char *, size_t,
+ *			 off_t, file_info)
+ *   op<ok>        flush(request, fuse_ino_t, file_info)
+ *   op<ok>        release(request, fuse_ino_t, file_info)
+ *   op<ok>        fsync(request, fuse_ino_t, int datasync, file_info)
+ *   op<open_file> opendir(request, fuse_ino_t, file_info)
+ *   op<buf>       readdir(request, fuse_ino_t, size_t, off_t,
+ *			   file_info)
+ *   op<ok>        releasedir(request, fuse_ino_t, file_info)
+ *   op<ok>        fsyncdir(request, fuse_ino_t, int datasync,
+ *			    file_info)
+ *   op<fs_stat>   statfs(request, fuse_ino_t)
+ *   op<ok>        access(request, fuse_ino_t, int mask)
+ *   op<created>   create(request, fuse_ino_t parent, name_arg, mode_t,
+ *			  file_info)
+ *
+ * The reply type of read and readdir may also be 'data'.  init() and
+ * destroy() are ordinary member functions taking a fuse_conn_info
+ * pointer and no arguments respectively.
+ */
+template <typename FS>
+class filesystem {
+public:
+	/** Create a low level session for this filesystem */
+	struct fuse_session *session_new(struct fuse_args *args)
+	{
+		struct fuse_lowlevel_ops op = ops();
+
+		return fuse_lowlevel_new(args, &op, sizeof(op),
+					 static_cast<FS *>(this));
+	}
+
+	/** The operations table, userdata must point to the FS */
+	static struct fuse_lowlevel_ops ops()
+	{
+		struct fuse_lowlevel_ops op;
+
+		std::memset(&op, 0, sizeof(op));
+		if constexpr (requires(FS &fs) { fs.init((struct fuse_conn_info *) 0); })
+			op.init = [](void *ud, struct fuse_conn_info *conn) noexcept {
+				static_cast<FS *>(ud)->init(conn);
+			};
+		if constexpr (requires(FS &fs) { fs.destroy(); })
+			op.destroy = [](void *ud) noexcept {
+				static_cast<FS *>(ud)->destroy();
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n) { fs.lookup(r, i, n); })
+			op.lookup = [](fuse_req_t req, fuse_ino_t parent, const char *name) noexcept {
+				guard(req, [&] { start(req).lookup(request(req), parent, name_arg(name)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, unsigned long n) { fs.forget(r, i, n); })
+			op.forget = [](fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) noexcept {
+				guard_none(req, [&] { start(req).forget(request(req), ino, nlookup); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, file_info fi) { fs.getattr(r, i, fi); })
+			op.getattr = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).getattr(request(req), ino, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, struct stat st, int s, file_info fi) { fs.setattr(r, i, st, s, fi); })
+			op.setattr = [](fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).setattr(request(req), ino, *attr, to_set, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i) { fs.readlink(r, i); })
+			op.readlink = [](fuse_req_t req, fuse_ino_t ino) noexcept {
+				guard(req, [&] { start(req).readlink(request(req), ino); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n, mode_t m, dev_t d) { fs.mknod(r, i, n, m, d); })
+			op.mknod = [](fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) noexcept {
+				guard(req, [&] { start(req).mknod(request(req), parent, name_arg(name), mode, rdev); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n, mode_t m) { fs.mkdir(r, i, n, m); })
+			op.mkdir = [](fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) noexcept {
+				guard(req, [&] { start(req).mkdir(request(req), parent, name_arg(name), mode); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n) { fs.unlink(r, i, n); })
+			op.unlink = [](fuse_req_t req, fuse_ino_t parent, const char *name) noexcept {
+				guard(req, [&] { start(req).unlink(request(req), parent, name_arg(name)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n) { fs.rmdir(r, i, n); })
+			op.rmdir = [](fuse_req_t req, fuse_ino_t parent, const char *name) noexcept {
+				guard(req, [&] { start(req).rmdir(request(req), parent, name_arg(name)); });
+			};
+		if constexpr (requires(FS &fs, request r, name_arg l, fuse_ino_t i, name_arg n) { fs.symlink(r, l, i, n); })
+			op.symlink = [](fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) noexcept {
+				guard(req, [&] { start(req).symlink(request(req), name_arg(link), parent, name_arg(name)); });
+			};
+#ifndef __APPLE__
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n) { fs.rename(r, i, n, i, n); })
+			op.rename = [](fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) noexcept {
+				guard(req, [&] { start(req).rename(request(req), parent, name_arg(name), newparent, name_arg(newname)); });
+			};
+#endif
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n) { fs.link(r, i, i, n); })
+			op.link = [](fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) noexcept {
+				guard(req, [&] { start(req).link(request(req), ino, newparent, name_arg(newname)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, file_info fi) { fs.open(r, i, fi); })
+			op.open = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).open(request(req), ino, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, std::size_t s, off_t o, file_info fi) { fs.read(r, i, s, o, fi); })
+			op.read = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).read(request(req), ino, size, off, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, const char *b, std::size_t s, off_t o, file_info fi) { fs.write(r, i, b, s, o, fi); })
+			op.write = [](fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).write(request(req), ino, buf, size, off, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, file_info fi) { fs.flush(r, i, fi); })
+			op.flush = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).flush(request(req), ino, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, file_info fi) { fs.release(r, i, fi); })
+			op.release = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).release(request(req), ino, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, int d, file_info fi) { fs.fsync(r, i, d, fi); })
+			op.fsync = [](fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).fsync(request(req), ino, datasync, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, file_info fi) { fs.opendir(r, i, fi); })
+			op.opendir = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).opendir(request(req), ino, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, std::size_t s, off_t o, file_info fi) { fs.readdir(r, i, s, o, fi); })
+			op.readdir = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).readdir(request(req), ino, size, off, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, file_info fi) { fs.releasedir(r, i, fi); })
+			op.releasedir = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).releasedir(request(req), ino, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, int d, file_info fi) { fs.fsyncdir(r, i, d, fi); })
+			op.fsyncdir = [](fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).fsyncdir(request(req), ino, datasync, file_info(fi)); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i) { fs.statfs(r, i); })
+			op.statfs = [](fuse_req_t req, fuse_ino_t ino) noexcept {
+				guard(req, [&] { start(req).statfs(request(req), ino); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, int m) { fs.access(r, i, m); })
+			op.access = [](fuse_req_t req, fuse_ino_t ino, int mask) noexcept {
+				guard(req, [&] { start(req).access(request(req), ino, mask); });
+			};
+		if constexpr (requires(FS &fs, request r, fuse_ino_t i, name_arg n, mode_t m, file_info fi) { fs.create(r, i, n, m, fi); })
+			op.create = [](fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) noexcept {
+				guard(req, [&] { start(req).create(request(req), parent, name_arg(name), mode, file_info(fi)); });
+			};
+
+		return op;
+	}
+
+private:
+	static FS &start(fuse_req_t req)
+	{
+		return *static_cast<FS *>(fuse_req_userdata(req));
+	}
+
+	/*
+	 * Exceptions thrown before the coroutine body runs, e.g. when
+	 * allocating the frame or copying a name, must not unwind into
+	 * the library.  The request has not been answered then.
+	 */
+	template <typename F>
+	static void guard(fuse_req_t req, F &&fn) noexcept
+	{
+		try {
+			fn();
+		} catch (const std::bad_alloc &) {
+			fuse_reply_err(req, ENOMEM);
+		} catch (...) {
+			fuse_reply_err(req, EIO);
+		}
+	}
+
+	template <typename F>
+	static void guard_none(fuse_req_t req, F &&fn) noexcept
+	{
+		try {
+			fn();
+		} catch (...) {
+			fuse_reply_none(req);
+		}
+	}
+};
+
+} /* namespace fuse_coro */
+
+#endif /* _FUSE_CORO_HPP_ */
@@ -116,6 +116,24 @@ struct fuse_entry_param {
 	double entry_timeout;
 };
 
+/** Directory entry supplied to fuse_add_direntries() */
+struct fuse_direntry {
+	/** Name of the entry, need not be null terminated */
+	const char *name;
+
+	/** Length of the name */
+	size_t namelen;
+
+	/** Inode number */
+	fuse_ino_t ino;
+
+	/** File type, only the S_IFMT bits are used */
+	mode_t mode;
+
+	/** Offset of the next entry */
+	off_t off;
+};
+
 /**
  * Additional context associated with requests.
  *
@@ -143,22 +161,6 @@ struct fuse_forget_data {
 	uint64_t nlookup;
 };
 
-/* 'to_set' flags in setattr */
-#define FUSE_SET_ATTR_MODE	(1 << 0)
-#define FUSE_SET_ATTR_UID	(1 << 1)
-#define FUSE_SET_ATTR_GID	(1 << 2)
-#define FUSE_SET_ATTR_SIZE	(1 << 3)
-#define FUSE_SET_ATTR_ATIME	(1 << 4)
-#define FUSE_SET_ATTR_MTIME	(1 << 5)
-#define FUSE_SET_ATTR_ATIME_NOW	(1 << 7)
-#define FUSE_SET_ATTR_MTIME_NOW	(1 << 8)
-#ifdef __APPLE__
-#define FUSE_SET_ATTR_CRTIME	(1 << 28)
-#define FUSE_SET_ATTR_CHGTIME	(1 << 29)
-#define FUSE_SET_ATTR_BKUPTIME	(1 << 30)
-#define FUSE_SET_ATTR_FLAGS	(1 << 31)
-#endif /* __APPLE__ */
-
 /* ----------------------------------------------------------- *
  * Request methods and replies				       *
  * ----------------------------------------------------------- */
@@ -938,7 +940,11 @@ struct fuse_lowlevel_ops {
 	 * correctness.
 	 *
 	 * The callee is responsible for destroying ph with
-	 * fuse_pollhandle_destroy() when no longer in use.
+	 * fuse_pollhandle_destroy() when no longer in use.  Each poll
+	 * of an open file is passed the same handle, holding a separate
+	 * reference.  Instead of keeping the handles, the filesystem
+	 * may wake up all pollers of an inode with
+	 * fuse_lowlevel_notify_poll_ino().
 	 *
 	 * Valid replies:
 	 *   fuse_reply_poll
@@ -966,6 +972,10 @@ struct fuse_lowlevel_ops {
 	 * bufv->off is correctly updated (reflecting the number of
 	 * bytes read from bufv->buf[0]).
 	 *
+	 * To complete the write after returning, without copying the
+	 * data out of the pipe first, take ownership of it with
+	 * fuse_req_detach_buf().
+	 *
 	 * Introduced in version 2.9
 	 *
 	 * Valid replies:
@@ -1355,6 +1365,27 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf,
 			 off_t off);
 
+/**
+ * Add an array of directory entries to the buffer
+ *
+ * Entries are added in order until the next one doesn't fit into the
+ * remaining buffer space.  This avoids the per entry overhead of
+ * fuse_add_direntry() when listing large directories.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param req request handle
+ * @param buf the point where the new entries will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param entries the entries to add
+ * @param count number of entries
+ * @param used set to the number of bytes filled in
+ * @return the number of entries added
+ */
+size_t fuse_add_direntries(fuse_req_t req, char *buf, size_t bufsize,
+			   const struct fuse_direntry *entries, size_t count,
+			   size_t *used);
+
 /**
  * Reply to ask for data fetch and output buffer preparation.  ioctl
  * will be retried with the specified input data fetched and output
@@ -1422,6 +1453,26 @@ int fuse_reply_poll(fuse_req_t req, unsigned revents);
  */
 int fuse_lowlevel_notify_poll(struct fuse_pollhandle *ph);
 
+/**
+ * Notify IO readiness event for all open files of an inode
+ *
+ * The library keeps the poll handle of every open file which asked for
+ * a notification, until the file is released.  This sends one wakeup
+ * to each of them which was polled since its last wakeup; repeated
+ * calls before the kernel polls again are coalesced.  Large numbers of
+ * wakeups are sent from several threads.
+ *
+ * The filesystem doesn't need to keep the poll handles itself to use
+ * this, it may destroy them in the poll method right away.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param ch a channel of the session
+ * @param ino the inode number
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_poll_ino(struct fuse_chan *ch, fuse_ino_t ino);
+
 /**
  * Notify to invalidate cache for an inode
  *
@@ -1524,6 +1575,48 @@ int fuse_lowlevel_notify_store(struct fuse_chan *ch, fuse_ino_t ino,
 int fuse_lowlevel_notify_retrieve(struct fuse_chan *ch, fuse_ino_t ino,
 				  size_t size, off_t offset, void *cookie);
 
+/**
+ * A range of an inode's kernel buffers to retrieve
+ *
+ * Introduced in version 2.9.9
+ */
+struct fuse_retrieve_range {
+	/** The inode number */
+	fuse_ino_t ino;
+
+	/** The number of bytes to retrieve */
+	size_t size;
+
+	/** The starting offset into the file */
+	off_t offset;
+
+	/** User data to supply to the reply callback */
+	void *cookie;
+};
+
+/**
+ * Retrieve several ranges of data from the kernel buffers
+ *
+ * Like fuse_lowlevel_notify_retrieve(), but sends one retrieve
+ * notification for each range, setting them up in batches.  Any number
+ * of retrieves, including several for the same inode, may be
+ * outstanding; the retrieve_reply() method is called once for each
+ * range, in no particular order, with the cookie of that range.
+ *
+ * If fewer ranges than requested were sent, the remaining ones will
+ * not be completed and no reply will be sent for them.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param ch the channel through which to send the notifications
+ * @param ranges the ranges to retrieve
+ * @param count the number of ranges
+ * @return the number of ranges sent, or -errno if none was sent
+ */
+int fuse_lowlevel_notify_retrieve_batch(struct fuse_chan *ch,
+				const struct fuse_retrieve_range *ranges,
+				size_t count);
+
 
 /* ----------------------------------------------------------- *
  * Utility functions					       *
@@ -1599,6 +1692,43 @@ void fuse_req_interrupt_func(fuse_req_t req, fuse_interrupt_func_t func,
  */
 int fuse_req_interrupted(fuse_req_t req);
 
+/**
+ * Take ownership of the data of a write_buf request
+ *
+ * Only valid for the buffer passed to the write_buf method, called
+ * from within write_buf before the request is replied to.  The
+ * unconsumed data of bufv is transferred to the returned buffer
+ * vector, which remains valid after write_buf returns and after the
+ * reply has been sent.  bufv is marked as consumed.
+ *
+ * If the data is in a pipe, then the pipe itself is detached from the
+ * calling thread, which gets a fresh pipe for the next request.  The
+ * data stays in the kernel and can be spliced to its destination
+ * with fuse_buf_copy().  Otherwise the data is copied.
+ *
+ * Each detached pipe holds two file descriptors and the pipe buffer
+ * until freed, so the number outstanding should be bounded.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param req request handle
+ * @param bufv buffer passed to write_buf
+ * @return the detached data, or NULL on failure
+ */
+struct fuse_bufvec *fuse_req_detach_buf(fuse_req_t req,
+					struct fuse_bufvec *bufv);
+
+/**
+ * Free a buffer vector returned by fuse_req_detach_buf()
+ *
+ * Closes the pipe holding the data, if any.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param bufv the detached buffer vector
+ */
+void fuse_detached_buf_free(struct fuse_bufvec *bufv);
+
 /* ----------------------------------------------------------- *
  * Filesystem setup					       *
  * ----------------------------------------------------------- */
@@ -1801,6 +1931,136 @@ int fuse_session_loop(struct fuse_session *se);
  */
 int fuse_session_loop_mt(struct fuse_session *se);
 
+/**
+ * Enter a multi-process event loop
+ *
+ * The INIT request is processed in the calling process, which then
+ * forks 'numworker' worker processes.  Each worker receives requests
+ * from its own clone of the device fd (or from the shared fd if the
+ * kernel doesn't support cloning) and dispatches them independently,
+ * with its own request lists.  This allows filesystems whose language
+ * runtime serializes threads to use multiple cores.
+ *
+ * The unique counter of notifications is kept in shared memory, and
+ * retrieve replies are routed to the worker which sent the retrieve
+ * request.  An interrupt is only effective if it is received by the
+ * worker processing the interrupted request.
+ *
+ * Filesystem state changed by one worker is not visible to the
+ * others, so this is only usable with the low level API and
+ * filesystems which keep shared state outside the process.  The
+ * destroy() method is called in the calling process when the session
+ * is destroyed.  Threads the filesystem started in init() don't exist
+ * in the workers; the metrics exporter and the tuner are stopped before
+ * the workers are forked, and started again in the first one.
+ *
+ * The function returns when all workers have exited, e.g. because
+ * the filesystem was unmounted or the calling process was signalled.
+ *
+ * @param se the session
+ * @param numworker number of worker processes, at most 256
+ * @return 0 on success, -1 on error
+ */
+int fuse_session_loop_mp(struct fuse_session *se, int numworker);
+
+/** Request header field identifying the tenant in fair queuing */
+enum fuse_fair_key {
+	FUSE_FAIR_UID,
+	FUSE_FAIR_GID,
+	FUSE_FAIR_PID,
+};
+
+/** Parameters of fuse_session_loop_fair() */
+struct fuse_fair_param {
+	/** Which id of the caller identifies the tenant */
+	enum fuse_fair_key key;
+
+	/** Number of worker threads, zero means 10 */
+	unsigned int numworker;
+
+	/**
+	 * Maximum number of requests of one tenant processed at the
+	 * same time, zero means no limit
+	 */
+	unsigned int max_inflight;
+
+	/**
+	 * Weight of a tenant: the number of its requests dispatched in
+	 * a row before the next tenant is served.  Called once per
+	 * tenant.  If NULL, all tenants have weight 1.
+	 */
+	unsigned int (*weight)(uint32_t tenant, void *data);
+
+	/** User data passed to weight() */
+	void *data;
+};
+
+/** Per tenant statistics of fuse_session_loop_fair() */
+struct fuse_fair_stats {
+	/** The uid, gid or pid of the tenant */
+	uint32_t tenant;
+
+	/** Weight of the tenant */
+	unsigned int weight;
+
+	/** Number of requests waiting to be dispatched */
+	unsigned int queued;
+
+	/** Number of requests being processed */
+	unsigned int inflight;
+
+	/** Number of requests processed */
+	uint64_t requests;
+
+	/**
+	 * Sum and maximum of the time between reading a request from
+	 * the device and returning from its handler, in seconds
+	 */
+	double total_latency;
+	double max_latency;
+};
+
+/**
+ * Enter a multi-threaded event loop with fair queuing
+ *
+ * Requests are read by the calling thread and queued per tenant, the
+ * tenant being the uid, gid or pid of the caller.  A fixed pool of
+ * worker threads takes requests from the queues in weighted round
+ * robin order, so that one busy tenant cannot delay the requests of
+ * the others for long.  INIT, FORGET, INTERRUPT and notify replies
+ * are processed immediately by the reading thread.
+ *
+ * A request counts as in flight until its handler returns, replies
+ * sent later by the filesystem are not taken into account.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param param scheduling parameters
+ * @return 0 on success, -1 on error
+ */
+int fuse_session_loop_fair(struct fuse_session *se,
+			   const struct fuse_fair_param *param);
+
+/**
+ * Get the per tenant statistics of a running fair queuing loop
+ *
+ * Tenants seen by fuse_session_loop_fair() are recorded until they have
+ * had no request for a minute, when they are forgotten together with
+ * their statistics.  Up to 4096 tenants are recorded at a time; when all
+ * of them are busy, new tenants are accounted to tenant (uint32_t) -1.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param stats array to fill in
+ * @param count number of elements in the array
+ * @return the number of tenants, which may be larger than count, or
+ *	   -1 if no fair queuing loop is running
+ */
+int fuse_session_fair_stats(struct fuse_session *se,
+			    struct fuse_fair_stats *stats, int count);
+
 /**
  * Enter a multi-threaded event loop based on libdispatch
  *
@@ -1809,6 +2069,357 @@ int fuse_session_loop_mt(struct fuse_session *se);
  */
 int fuse_session_loop_dispatch(struct fuse_session *se);
 
+/**
+ * Load of a connection
+ *
+ * waiting is the kernel's count of requests waiting for a reply, from
+ * the "waiting" attribute of the connection in fusectl.  inflight is
+ * the number of requests which this process received but has not yet
+ * replied to.
+ */
+struct fuse_conn_load {
+	unsigned int waiting;
+	unsigned int inflight;
+};
+
+/**
+ * Limits of a connection which may be changed at runtime
+ *
+ * When setting limits, zero fields are left unchanged.
+ */
+struct fuse_conn_limits {
+	unsigned int max_background;
+	unsigned int congestion_threshold;
+	/* Readahead in bytes, changed through the backing device */
+	unsigned int max_readahead;
+};
+
+/**
+ * Policy hook for fuse_session_tune_start()
+ *
+ * Called periodically with the current load and limits.  Limits
+ * changed by the function are applied to the connection.
+ *
+ * @param data user data passed to fuse_session_tune_start()
+ * @param load current load of the connection
+ * @param limits current limits, to be updated
+ */
+typedef void (*fuse_tune_func_t)(void *data, const struct fuse_conn_load *load,
+				 struct fuse_conn_limits *limits);
+
+/**
+ * Find the fusectl attributes of the connection mounted at mountpoint
+ *
+ * This must be called before the load and limits can be queried or
+ * changed.  The mount itself is not accessed.  fusectl must be
+ * mounted at /sys/fs/fuse/connections, and changing the limits
+ * requires root privileges.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param mountpoint the absolute path of the mount point
+ * @return 0 on success or -errno on failure
+ */
+int fuse_session_conn_attach(struct fuse_session *se, const char *mountpoint);
+
+/**
+ * Query the load and the limits of the connection
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param load the load is stored here, may be NULL
+ * @param limits the limits are stored here, may be NULL
+ * @return 0 on success or -errno on failure
+ */
+int fuse_session_conn_load(struct fuse_session *se,
+			   struct fuse_conn_load *load,
+			   struct fuse_conn_limits *limits);
+
+/**
+ * Change the limits of the connection
+ *
+ * Unlike the values sent in reply to INIT, these take effect on a
+ * live connection.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param limits the new limits, zero fields are left unchanged
+ * @return 0 on success or -errno on failure
+ */
+int fuse_session_conn_set_limits(struct fuse_session *se,
+				 const struct fuse_conn_limits *limits);
+
+/**
+ * Start adjusting the limits of the connection to its load
+ *
+ * A thread calls func every interval seconds and applies the limits it
+ * returns.  If func is NULL, then a default policy is used, which grows
+ * max_background up to eight times its initial value while the
+ * kernel's queue is nearly full, and shrinks it back when the queue
+ * drains.  The connection must have been attached with
+ * fuse_session_conn_attach(), until then nothing is changed.
+ *
+ * Under fuse_session_loop_mp() the tuner is moved to the first worker
+ * process.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param interval seconds between adjustments
+ * @param func the policy or NULL
+ * @param data user data passed to func
+ * @return 0 on success, -1 on failure
+ */
+int fuse_session_tune_start(struct fuse_session *se, double interval,
+			    fuse_tune_func_t func, void *data);
+
+/**
+ * Stop adjusting the limits of the connection
+ *
+ * The limits are left at their current values.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ */
+void fuse_session_tune_stop(struct fuse_session *se);
+
+/** Classes of requests with separate limits in admission control */
+enum fuse_admit_class {
+	/** Lookups, attributes, open, directory listing and the like */
+	FUSE_ADMIT_META,
+	/** Reading file data */
+	FUSE_ADMIT_READ,
+	/** Writing, syncing and changes to the namespace or attributes */
+	FUSE_ADMIT_WRITE,
+	FUSE_ADMIT_NCLASS
+};
+
+/** Parameters of admission control */
+struct fuse_admit_param {
+	/**
+	 * Maximum number of requests of one class processed at the
+	 * same time, zero disables admission control
+	 */
+	unsigned int max_limit;
+
+	/** The limits are never decreased below this, zero means 1 */
+	unsigned int min_limit;
+
+	/**
+	 * Limits are decreased when the average latency of a class
+	 * exceeds its lowest recent latency by this factor.  Zero
+	 * means limits only change through
+	 * fuse_session_admit_overload().
+	 */
+	double latency_factor;
+
+	/**
+	 * Error replied to requests of a class arriving while it is at
+	 * its limit, zero to make them wait instead
+	 */
+	int shed_errno[FUSE_ADMIT_NCLASS];
+};
+
+/** Statistics of one class in admission control */
+struct fuse_admit_stats {
+	/** Current limit */
+	unsigned int limit;
+
+	/** Number of requests being processed */
+	unsigned int inflight;
+
+	/** Number of requests waiting to be admitted */
+	unsigned int waiting;
+
+	/** Number of requests admitted */
+	uint64_t admitted;
+
+	/** Number of requests failed with shed_errno */
+	uint64_t shed;
+
+	/** Number of times the limit was decreased */
+	uint64_t decreases;
+
+	/** Average and lowest recent latency, in seconds */
+	double latency;
+	double base_latency;
+};
+
+/**
+ * Start admission control
+ *
+ * Requests of each class are limited to a number being processed at
+ * the same time, the time between receiving and replying.  The limits
+ * grow additively while a class is saturated and its latency stays
+ * low, and shrink multiplicatively, at most once per average latency,
+ * when latency rises or the filesystem signals overload.
+ *
+ * A request over the limit of its class waits for admission in the
+ * thread which received it, while the multi-threaded loops go on
+ * reading the device in other threads.  FORGET, INTERRUPT, RELEASE,
+ * FLUSH, blocking locks and notify replies are never held back.  In
+ * fuse_session_loop() the waiting request also holds up the only
+ * thread, so admission control is meant for the multi-threaded loops.
+ *
+ * Also enabled with the "admit_limit=N" option.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param param the parameters
+ * @return 0 on success, -1 on failure
+ */
+int fuse_session_admit_start(struct fuse_session *se,
+			     const struct fuse_admit_param *param);
+
+/**
+ * Stop admission control
+ *
+ * Waiting requests are admitted.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ */
+void fuse_session_admit_stop(struct fuse_session *se);
+
+/**
+ * Signal that the backend is overloaded for a class of requests
+ *
+ * Decreases the limit of the class as if its latency had risen.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param cls the class of requests
+ */
+void fuse_session_admit_overload(struct fuse_session *se,
+				 enum fuse_admit_class cls);
+
+/**
+ * Get the statistics of a class in admission control
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param cls the class of requests
+ * @param stats the statistics are stored here
+ * @return 0 on success, -1 if admission control is not running
+ */
+int fuse_session_admit_stats(struct fuse_session *se,
+			     enum fuse_admit_class cls,
+			     struct fuse_admit_stats *stats);
+
+/** Text being written by a metrics source */
+struct fuse_metrics_out;
+
+/**
+ * Metrics source, see fuse_session_metrics_add()
+ *
+ * Called by the exporter thread on each scrape, to write its metric
+ * families with fuse_metrics_family() and fuse_metrics_sample().
+ *
+ * @param data user data passed to fuse_session_metrics_add()
+ * @param out the text being written
+ */
+typedef void (*fuse_metrics_func_t)(void *data, struct fuse_metrics_out *out);
+
+/**
+ * Start exporting metrics in the OpenMetrics text format
+ *
+ * A thread serves the metrics on a Unix domain socket, accessible to
+ * the owner only, or on a TCP port of the loopback address.  Clients
+ * sending an HTTP request get an HTTP reply, so that Prometheus can
+ * scrape it directly, others get the bare text.
+ *
+ * Exported are the number and latency histogram of requests by
+ * opcode, the requests in flight, the threads processing requests and
+ * the time they were busy, how requests were received and data
+ * replies sent with or without splice, admission control, memory in
+ * use, and whatever the sources added with fuse_session_metrics_add()
+ * provide.  The high level library adds its node table and caches.
+ *
+ * Requests are counted in counters owned by the thread completing
+ * them, so that no lock is taken on the request path.  They are
+ * summed up on each scrape.  Only requests arriving while the
+ * exporter runs are counted.  Under fuse_session_loop_mp() the
+ * exporter is moved to the first worker process, and counts the
+ * requests processed by that worker only.
+ *
+ * Also started on INIT with the "metrics_socket=PATH" or
+ * "metrics_port=N" option.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param path the path of the socket, an existing socket is replaced
+ * @param port the TCP port, used if path is NULL
+ * @return 0 on success, -1 on failure
+ */
+int fuse_session_metrics_start(struct fuse_session *se, const char *path,
+			       unsigned int port);
+
+/**
+ * Stop exporting metrics
+ *
+ * The socket is removed.  The counters are kept, and continue if the
+ * exporter is started again.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ */
+void fuse_session_metrics_stop(struct fuse_session *se);
+
+/**
+ * Add a source of metrics
+ *
+ * Sources can't be removed; the data must stay valid until the
+ * exporter is stopped or the session is destroyed.  Each source must
+ * use metric names of its own, as the samples of a family can't be
+ * split up.
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param se the session
+ * @param func the source
+ * @param data user data passed to func
+ * @return 0 on success, -1 if there are too many sources
+ */
+int fuse_session_metrics_add(struct fuse_session *se, fuse_metrics_func_t func,
+			     void *data);
+
+/**
+ * Start a metric family
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param out the text being written
+ * @param name the name of the family
+ * @param type the OpenMetrics type, such as "counter" or "gauge"
+ * @param help the description of the family
+ */
+void fuse_metrics_family(struct fuse_metrics_out *out, const char *name,
+			 const char *type, const char *help);
+
+/**
+ * Write a sample of the current metric family
+ *
+ * Introduced in version 2.9.9
+ *
+ * @param out the text being written
+ * @param name the name of the sample, with the "_total" suffix for
+ *	       counters
+ * @param labels the labels, such as "op=\"READ\"", or NULL
+ * @param value the value
+ */
+void fuse_metrics_sample(struct fuse_metrics_out *out, const char *name,
+			 const char *labels, double value);
+
 /* ----------------------------------------------------------- *
  * Channel interface					       *
  * ----------------------------------------------------------- */
@@ -74,12 +74,23 @@ struct fuse_config {
 	double attr_timeout;
 	double ac_attr_timeout;
 	int ac_attr_timeout_set;
+	double read_coalesce;
+	int aligned_buffers;
+	double auto_tune;
+	unsigned int max_nodeid;
 	int remember;
+	int node_spill;
+	char *node_spill_dir;
+	char *warm_log;
+	double warm_record;
+	unsigned int warm_budget;
+	double handle_cache;
 	int nopath;
 	int debug;
 	int hard_remove;
 	int use_ino;
 	int readdir_ino;
+	int readdir_attr;
 	int set_mode;
 	int set_uid;
 	int set_gid;
@@ -152,12 +163,42 @@ struct node_slab {
 	int used;
 };
 
+struct id_range {
+	fuse_ino_t start;
+	fuse_ino_t end;		/* exclusive */
+};
+
+/*
+ * Node ids are handed out in increasing order until max_nodeid has been
+ * reached.  After that the ids of deleted nodes are reused: the ids which
+ * were free at the time of the wrap-around are kept as ranges, and ids
+ * freed later are pushed on the released stack.
+ */
+struct id_pool {
+	fuse_ino_t max;
+	int recycle;
+	struct id_range *ranges;
+	size_t nranges;
+	size_t currange;
+	fuse_ino_t *released;
+	size_t nreleased;
+	size_t released_size;
+};
+
 struct fuse {
 	struct fuse_session *se;
 	struct node_table name_table;
 	struct node_table id_table;
 	struct list_head lru_table;
+	struct cold_table *cold;
+	struct warm *warm;
+	struct dir_attr_table *dir_attr;
+	struct handle_table *handles;
+	struct read_batch *read_batches;
+	uint64_t read_requests;
+	uint64_t read_calls;
 	fuse_ino_t ctr;
+	struct id_pool ids;
 	unsigned int generation;
 	unsigned int hidectr;
 	pthread_mutex_t lock;
@@ -166,6 +207,7 @@ struct fuse {
 	struct fuse_fs *fs;
 	int nullpath_ok;
 	int utime_omit_ok;
+	int readdir_attr_ok;
 #ifdef __APPLE__
 	int statfs_x_ok;
 #endif
@@ -201,6 +243,7 @@ struct node {
 	struct lock *locks;
 	unsigned int is_hidden : 1;
 	unsigned int cache_valid : 1;
+	unsigned int accessed : 1;
 	int treelock;
 	char inline_name[32];
 };
@@ -226,6 +269,7 @@ struct fuse_dh {
 	int filled;
 	uint64_t fh;
 	int error;
+	uint64_t attr_start;
 	fuse_ino_t nodeid;
 };
 
@@ -386,6 +430,11 @@ static inline int lru_enabled(struct fuse *f)
 	return f->conf.remember > 0;
 }
 
+static inline int cleanup_enabled(struct fuse *f)
+{
+	return lru_enabled(f) || f->cold != NULL || f->handles != NULL;
+}
+
 static struct node_lru *node_lru(struct node *node)
 {
 	return (struct node_lru *) node;
@@ -504,6 +553,247 @@ static void free_node_mem(struct fuse *f, struct node *node)
 }
 #endif
 
+/*
+ * Cold nodes.  Leaf nodes which have not been used for a whole spill
+ * interval are moved out of the node tables into fixed size records of
+ * a file mapped into memory, and faulted back in when they are looked
+ * up again.  Only the hash chain heads of the cold table stay resident.
+ * A cold node keeps its reference on the parent, so parents are always
+ * hot.
+ */
+#define COLD_TABLE_MIN_SIZE 1024
+#define COLD_NAME_MAX 32
+
+struct cold_node {
+	fuse_ino_t nodeid;		/* zero if the slot is free */
+	fuse_ino_t parent;
+	uint64_t nlookup;
+	unsigned int generation;
+	uint32_t id_next;
+	uint32_t name_next;		/* next free slot if unused */
+	char name[COLD_NAME_MAX];
+};
+
+struct cold_table {
+	int fd;
+	struct cold_node *map;
+	uint32_t mapsize;		/* slot zero is never used */
+	uint32_t end;
+	uint32_t freelist;
+	uint32_t use;
+	uint32_t size;
+	uint32_t *id_array;
+	uint32_t *name_array;
+};
+
+static struct cold_table *cold_table_new(const char *dir)
+{
+	struct cold_table *t;
+	char *tmpl;
+
+	t = (struct cold_table *) calloc(1, sizeof(struct cold_table));
+	tmpl = malloc(strlen(dir) + sizeof("/fuse-nodes.XXXXXX"));
+	if (t == NULL || tmpl == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		goto out_free;
+	}
+
+	/* The file is only scratch space, it is removed right away */
+	sprintf(tmpl, "%s/fuse-nodes.XXXXXX", dir);
+	t->fd = mkstemp(tmpl);
+	if (t->fd == -1) {
+		fprintf(stderr, "fuse: failed to create node spill file in %s: %s\n",
+			dir, strerror(errno));
+		goto out_free;
+	}
+	unlink(tmpl);
+	free(tmpl);
+
+	t->size = COLD_TABLE_MIN_SIZE;
+	t->id_array = calloc(t->size, sizeof(uint32_t));
+	t->name_array = calloc(t->size, sizeof(uint32_t));
+	if (t->id_array == NULL || t->name_array == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		free(t->id_array);
+		free(t->name_array);
+		close(t->fd);
+		free(t);
+		return NULL;
+	}
+
+	t->end = 1;
+	return t;
+
+out_free:
+	free(tmpl);
+	free(t);
+	return NULL;
+}
+
+static void cold_table_free(struct cold_table *t)
+{
+	if (t->map)
+		munmap(t->map, (size_t) t->mapsize * sizeof(struct cold_node));
+	close(t->fd);
+	free(t->id_array);
+	free(t->name_array);
+	free(t);
+}
+
+static uint32_t cold_id_hash(struct cold_table *t, fuse_ino_t ino)
+{
+	return ((uint32_t) ino * 2654435761U) & (t->size - 1);
+}
+
+static uint32_t cold_name_hash(struct cold_table *t, fuse_ino_t parent,
+			       const char *name)
+{
+	uint64_t hash = parent;
+
+	for (; *name; name++)
+		hash = hash * 31 + (unsigned char) *name;
+
+	return (hash ^ (hash >> 32)) & (t->size - 1);
+}
+
+static int cold_grow_map(struct cold_table *t)
+{
+	uint32_t newsize = t->mapsize ? t->mapsize * 2 : COLD_TABLE_MIN_SIZE;
+	size_t len = (size_t) newsize * sizeof(struct cold_node);
+	void *newmap;
+
+	if (newsize <= t->mapsize || ftruncate(t->fd, len) == -1)
+		return -1;
+
+	/* Map the new size before dropping the old one, both share the file */
+	newmap = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (newmap == MAP_FAILED)
+		return -1;
+
+	if (t->map)
+		munmap(t->map, (size_t) t->mapsize * sizeof(struct cold_node));
+	t->map = newmap;
+	t->mapsize = newsize;
+
+	return 0;
+}
+
+static void cold_hash(struct cold_table *t, uint32_t idx)
+{
+	struct cold_node *cn = &t->map[idx];
+	uint32_t hash;
+
+	hash = cold_id_hash(t, cn->nodeid);
+	cn->id_next = t->id_array[hash];
+	t->id_array[hash] = idx;
+
+	hash = cold_name_hash(t, cn->parent, cn->name);
+	cn->name_next = t->name_array[hash];
+	t->name_array[hash] = idx;
+}
+
+static void cold_table_resize(struct cold_table *t)
+{
+	uint32_t newsize = t->size * 2;
+	uint32_t *id_array = calloc(newsize, sizeof(uint32_t));
+	uint32_t *name_array = calloc(newsize, sizeof(uint32_t));
+	uint32_t idx;
+
+	if (id_array == NULL || name_array == NULL) {
+		/* Keep the longer chains */
+		free(id_array);
+		free(name_array);
+		return;
+	}
+
+	free(t->id_array);
+	free(t->name_array);
+	t->id_array = id_array;
+	t->name_array = name_array;
+	t->size = newsize;
+
+	for (idx = 1; idx < t->end; idx++) {
+		if (t->map[idx].nodeid)
+			cold_hash(t, idx);
+	}
+}
+
+static int cold_insert(struct cold_table *t, const struct node *node)
+{
+	struct cold_node *cn;
+	uint32_t idx;
+
+	if (t->freelist) {
+		idx = t->freelist;
+		t->freelist = t->map[idx].name_next;
+	} else {
+		if (t->end >= t->mapsize && cold_grow_map(t) == -1)
+			return -1;
+		idx = t->end++;
+	}
+
+	cn = &t->map[idx];
+	cn->nodeid = node->nodeid;
+	cn->parent = node->parent->nodeid;
+	cn->nlookup = node->nlookup;
+	cn->generation = node->generation;
+	strcpy(cn->name, node->name);
+	cold_hash(t, idx);
+
+	t->use++;
+	if (t->use > t->size)
+		cold_table_resize(t);
+
+	return 0;
+}
+
+static uint32_t cold_find_id(struct cold_table *t, fuse_ino_t nodeid)
+{
+	uint32_t idx;
+
+	for (idx = t->id_array[cold_id_hash(t, nodeid)]; idx;
+	     idx = t->map[idx].id_next)
+		if (t->map[idx].nodeid == nodeid)
+			return idx;
+
+	return 0;
+}
+
+static uint32_t cold_find_name(struct cold_table *t, fuse_ino_t parent,
+			       const char *name)
+{
+	uint32_t idx;
+
+	for (idx = t->name_array[cold_name_hash(t, parent, name)]; idx;
+	     idx = t->map[idx].name_next)
+		if (t->map[idx].parent == parent &&
+		    strcmp(t->map[idx].name, name) == 0)
+			return idx;
+
+	return 0;
+}
+
+static void cold_remove(struct cold_table *t, uint32_t idx)
+{
+	struct cold_node *cn = &t->map[idx];
+	uint32_t *idxp;
+
+	idxp = &t->id_array[cold_id_hash(t, cn->nodeid)];
+	while (*idxp != idx)
+		idxp = &t->map[*idxp].id_next;
+	*idxp = cn->id_next;
+
+	idxp = &t->name_array[cold_name_hash(t, cn->parent, cn->name)];
+	while (*idxp != idx)
+		idxp = &t->map[*idxp].name_next;
+	*idxp = cn->name_next;
+
+	cn->nodeid = 0;
+	cn->name_next = t->freelist;
+	t->freelist = idx;
+	t->use--;
+}
+
 static size_t id_hash(struct fuse *f, fuse_ino_t ino)
 {
 	uint64_t hash = ((uint32_t) ino * 2654435761U) % f->id_table.size;
@@ -515,7 +805,7 @@ static size_t id_hash(struct fuse *f, fuse_ino_t ino)
 		return hash;
 }
 
-static struct node *get_node_nocheck(struct fuse *f, fuse_ino_t nodeid)
+static struct node *get_hot_node(struct fuse *f, fuse_ino_t nodeid)
 {
 	size_t hash = id_hash(f, nodeid);
 	struct node *node;
@@ -527,6 +817,20 @@ static struct node *get_node_nocheck(struct fuse *f, fuse_ino_t nodeid)
 	return NULL;
 }
 
+static struct node *unspill_node(struct fuse *f, uint32_t idx);
+
+static struct node *get_node_nocheck(struct fuse *f, fuse_ino_t nodeid)
+{
+	struct node *node = get_hot_node(f, nodeid);
+
+	if (node == NULL && f->cold)
+		node = unspill_node(f, cold_find_id(f->cold, nodeid));
+	if (node != NULL)
+		node->accessed = 1;
+
+	return node;
+}
+
 static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 {
 	struct node *node = get_node_nocheck(f, nodeid);
@@ -541,6 +845,7 @@ static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 static void curr_time(struct timespec *now);
 static double diff_timespec(const struct timespec *t1,
 			   const struct timespec *t2);
+static void dir_attr_forget(struct fuse *f, struct node *node);
 
 static void remove_node_lru(struct node *node)
 {
@@ -724,7 +1029,7 @@ static void remerge_name(struct fuse *f)
 	}
 }
 
-static void unhash_name(struct fuse *f, struct node *node)
+static void unhash_name_common(struct fuse *f, struct node *node, bool shrink)
 {
 	if (node->name) {
 		size_t hash = name_hash(f, node->parent->nodeid, node->name);
@@ -741,7 +1046,8 @@ static void unhash_name(struct fuse *f, struct node *node)
 				node->parent = NULL;
 				f->name_table.use--;
 
-				if (f->name_table.use < f->name_table.size / 4)
+				if (shrink &&
+				    f->name_table.use < f->name_table.size / 4)
 					remerge_name(f);
 				return;
 			}
@@ -752,6 +1058,11 @@ static void unhash_name(struct fuse *f, struct node *node)
 	}
 }
 
+static void unhash_name(struct fuse *f, struct node *node)
+{
+	unhash_name_common(f, node, true);
+}
+
 static void rehash_name(struct fuse *f)
 {
 	struct node_table *t = &f->name_table;
@@ -829,6 +1140,27 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 	return 0;
 }
 
+static void release_id(struct fuse *f, fuse_ino_t nodeid)
+{
+	struct id_pool *p = &f->ids;
+
+	if (!p->recycle)
+		return;
+
+	if (p->nreleased == p->released_size) {
+		size_t newsize = p->released_size ? p->released_size * 2 : 64;
+		fuse_ino_t *newarray;
+
+		/* On failure the id is found again by rebuild_id_ranges() */
+		newarray = realloc(p->released, newsize * sizeof(fuse_ino_t));
+		if (newarray == NULL)
+			return;
+		p->released = newarray;
+		p->released_size = newsize;
+	}
+	p->released[p->nreleased++] = nodeid;
+}
+
 static void delete_node(struct fuse *f, struct node *node)
 {
 	if (f->conf.debug)
@@ -836,10 +1168,12 @@ static void delete_node(struct fuse *f, struct node *node)
 			(unsigned long long) node->nodeid);
 
 	assert(node->treelock == 0);
+	dir_attr_forget(f, node);
 	unhash_name(f, node);
 	if (lru_enabled(f))
 		remove_node_lru(node);
 	unhash_id(f, node);
+	release_id(f, node->nodeid);
 	free_node(f, node);
 }
 
@@ -851,19 +1185,124 @@ static void unref_node(struct fuse *f, struct node *node)
 		delete_node(f, node);
 }
 
+static int id_cmp(const void *a, const void *b)
+{
+	fuse_ino_t x = *(const fuse_ino_t *) a;
+	fuse_ino_t y = *(const fuse_ino_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Collect the ids of all live nodes, hot and cold, and turn the gaps
+ * between them into the ranges of free ids.  This is O(n log n) in the
+ * number of nodes, but only happens when the free ids have run out.
+ */
+static int rebuild_id_ranges(struct fuse *f)
+{
+	struct id_pool *p = &f->ids;
+	size_t num = f->id_table.use + (f->cold ? f->cold->use : 0);
+	struct id_range *ranges;
+	fuse_ino_t *live;
+	fuse_ino_t prev;
+	size_t nlive = 0;
+	size_t nranges = 0;
+	size_t i;
+
+	live = malloc((num + 1) * sizeof(fuse_ino_t));
+	ranges = malloc((num + 1) * sizeof(struct id_range));
+	if (live == NULL || ranges == NULL) {
+		free(live);
+		free(ranges);
+		return -1;
+	}
+
+	for (i = 0; i < f->id_table.size; i++) {
+		struct node *node;
+
+		for (node = f->id_table.array[i]; node != NULL;
+		     node = node->id_next)
+			live[nlive++] = node->nodeid;
+	}
+	if (f->cold) {
+		for (i = 0; i < f->cold->size; i++) {
+			uint32_t idx;
+
+			for (idx = f->cold->id_array[i]; idx;
+			     idx = f->cold->map[idx].id_next)
+				live[nlive++] = f->cold->map[idx].nodeid;
+		}
+	}
+	assert(nlive == num);
+	qsort(live, nlive, sizeof(fuse_ino_t), id_cmp);
+
+	prev = 0;
+	for (i = 0; i < nlive && live[i] <= p->max; i++) {
+		if (live[i] > prev + 1) {
+			ranges[nranges].start = prev + 1;
+			ranges[nranges].end = live[i];
+			nranges++;
+		}
+		prev = live[i];
+	}
+	if (prev < p->max) {
+		ranges[nranges].start = prev + 1;
+		ranges[nranges].end = p->max + 1;
+		nranges++;
+	}
+	free(live);
+
+	if (f->conf.debug)
+		fprintf(stderr, "fuse: %zu live nodes, %zu free id ranges\n",
+			nlive, nranges);
+
+	free(p->ranges);
+	p->ranges = ranges;
+	p->nranges = nranges;
+	p->currange = 0;
+	/* Released ids are part of the new ranges */
+	p->nreleased = 0;
+	p->recycle = 1;
+	/* Ids may now be reused, so the (nodeid, generation) pair changes */
+	f->generation++;
+
+	return nranges ? 0 : -1;
+}
+
+/* Returns zero if all ids are in use */
 static fuse_ino_t next_id(struct fuse *f)
 {
-	do {
-		f->ctr = (f->ctr + 1) & 0xffffffff;
-		if (!f->ctr)
-			f->generation ++;
-	} while (f->ctr == 0 || f->ctr == FUSE_UNKNOWN_INO ||
-		 get_node_nocheck(f, f->ctr) != NULL);
-	return f->ctr;
+	struct id_pool *p = &f->ids;
+	struct id_range *r;
+
+	while (!p->recycle && f->ctr < p->max) {
+		f->ctr++;
+		/* Before the first wrap-around only the root can be in the way */
+		if (get_hot_node(f, f->ctr) == NULL)
+			return f->ctr;
+	}
+
+	if (p->nreleased) {
+		f->generation++;
+		return p->released[--p->nreleased];
+	}
+	for (; p->currange < p->nranges; p->currange++) {
+		r = &p->ranges[p->currange];
+		if (r->start < r->end)
+			return r->start++;
+	}
+	if (rebuild_id_ranges(f) == -1)
+		return 0;
+
+	return p->ranges[0].start++;
 }
 
-static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
-				const char *name)
+/*
+ * If cold_ino is not NULL, a cold node is not faulted in, only its
+ * nodeid is returned there.
+ */
+static struct node *lookup_node_ino(struct fuse *f, fuse_ino_t parent,
+				    const char *name, fuse_ino_t *cold_ino)
 {
 #ifdef __APPLE__
 	if (f->conf.norm_insensitive) {
@@ -892,10 +1331,145 @@ static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
 
 	for (node = f->name_table.array[hash]; node != NULL; node = node->name_next)
 		if (node->parent->nodeid == parent &&
-		    strcmp(node->name, name) == 0)
+		    strcmp(node->name, name) == 0) {
+			node->accessed = 1;
 			return node;
+		}
 
-	return NULL;
+	if (f->cold) {
+		uint32_t idx = cold_find_name(f->cold, parent, name);
+
+		if (cold_ino != NULL) {
+			if (idx)
+				*cold_ino = f->cold->map[idx].nodeid;
+			return NULL;
+		}
+		node = unspill_node(f, idx);
+		if (node != NULL)
+			node->accessed = 1;
+	}
+
+	return node;
+}
+
+static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
+				const char *name)
+{
+	return lookup_node_ino(f, parent, name, NULL);
+}
+
+/* Move a cold node back into the node tables */
+static struct node *unspill_node(struct fuse *f, uint32_t idx)
+{
+	struct cold_node *cn;
+	struct node *node;
+
+	if (!idx)
+		return NULL;
+
+	node = alloc_node(f);
+	if (node == NULL)
+		return NULL;
+
+	cn = &f->cold->map[idx];
+	node->nodeid = cn->nodeid;
+	node->generation = cn->generation;
+	node->nlookup = cn->nlookup;
+	node->refctr = 1;
+	if (lru_enabled(f)) {
+		struct node_lru *lnode = node_lru(node);
+		init_list_head(&lnode->lru);
+	}
+
+	/* The name is short enough to be stored inline, this cannot fail */
+	hash_name(f, node, cn->parent, cn->name);
+	/* hash_name() took the reference that the cold node was holding */
+	node->parent->refctr--;
+	hash_id(f, node);
+	cold_remove(f->cold, idx);
+
+	if (f->conf.debug)
+		fprintf(stderr, "UNSPILL: %llu\n",
+			(unsigned long long) node->nodeid);
+
+	return node;
+}
+
+static int node_spillable(struct fuse *f, struct node *node)
+{
+	/* Only leaves which are referenced by the kernel alone */
+	if (node->parent == NULL || node->refctr != 1 || !node->nlookup)
+		return 0;
+
+	/* Nodes waiting on the remember list are pruned instead */
+	if (lru_enabled(f) && node->nlookup == 1)
+		return 0;
+
+	return !node->open_count && !node->locks && !node->treelock &&
+		!node->is_hidden && strlen(node->name) < COLD_NAME_MAX;
+}
+
+/*
+ * Clear the accessed flag of every node, spilling those which were
+ * not used since the previous call.
+ */
+static void spill_nodes(struct fuse *f)
+{
+	size_t i;
+
+	for (i = 0; i < f->id_table.size; i++) {
+		struct node **nodep = &f->id_table.array[i];
+
+		while (*nodep != NULL) {
+			struct node *node = *nodep;
+
+			if (node->accessed || !node_spillable(f, node)) {
+				node->accessed = 0;
+				nodep = &node->id_next;
+				continue;
+			}
+			if (cold_insert(f->cold, node) == -1)
+				return;
+
+			if (f->conf.debug)
+				fprintf(stderr, "SPILL: %llu\n",
+					(unsigned long long) node->nodeid);
+
+			/* The cold node keeps the reference on the parent */
+			node->parent->refctr++;
+			unhash_name(f, node);
+			*nodep = node->id_next;
+			f->id_table.use--;
+			free_node(f, node);
+		}
+	}
+}
+
+/* Drop lookups of a cold node without faulting it in */
+static int forget_cold_node(struct fuse *f, fuse_ino_t nodeid,
+			    uint64_t nlookup)
+{
+	uint32_t idx = cold_find_id(f->cold, nodeid);
+	struct cold_node *cn;
+	fuse_ino_t parent;
+
+	if (!idx)
+		return 0;
+
+	cn = &f->cold->map[idx];
+	assert(cn->nlookup >= nlookup);
+	/* It is going onto the remember list, which needs a hot node */
+	if (lru_enabled(f) && cn->nlookup - nlookup == 1)
+		return 0;
+
+	cn->nlookup -= nlookup;
+	if (!cn->nlookup) {
+		parent = cn->parent;
+		release_id(f, cn->nodeid);
+		cold_remove(f->cold, idx);
+		unref_node(f, get_node(f, parent));
+	}
+	return 1;
 }
 
 static void inc_nlookup(struct node *node)
@@ -921,11 +1495,17 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 			goto out_err;
 
 		node->nodeid = next_id(f);
+		if (!node->nodeid) {
+			free_node(f, node);
+			node = NULL;
+			goto out_err;
+		}
 		node->generation = f->generation;
 		if (f->conf.remember)
 			inc_nlookup(node);
 
 		if (hash_name(f, node, parent, name) == -1) {
+			release_id(f, node->nodeid);
 			free_node(f, node);
 			node = NULL;
 			goto out_err;
@@ -1432,19 +2012,25 @@ static void free_path2(struct fuse *f, fuse_ino_t nodeid1, fuse_ino_t nodeid2,
 	pthread_mutex_lock(&f->lock);
 	unlock_path(f, nodeid1, wnode1, NULL);
 	unlock_path(f, nodeid2, wnode2, NULL);
-	wake_up_queued(f);
+	if (f->lockq)
+		wake_up_queued(f);
 	pthread_mutex_unlock(&f->lock);
 	free(path1);
 	free(path2);
 }
 
-static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+/* Called with f->lock held */
+static void forget_node_locked(struct fuse *f, fuse_ino_t nodeid,
+			       uint64_t nlookup)
 {
 	struct node *node;
 	if (nodeid == FUSE_ROOT_ID)
 		return;
-	pthread_mutex_lock(&f->lock);
-	node = get_node(f, nodeid);
+	node = get_hot_node(f, nodeid);
+	if (node == NULL && f->cold && forget_cold_node(f, nodeid, nlookup))
+		return;
+	if (node == NULL)
+		node = get_node(f, nodeid);
 
 	/*
 	 * Node may still be locked due to interrupt idiocy in open,
@@ -1473,16 +2059,22 @@ static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 	} else if (lru_enabled(f) && node->nlookup == 1) {
 		set_forget_time(f, node);
 	}
+}
+
+static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+{
+	pthread_mutex_lock(&f->lock);
+	forget_node_locked(f, nodeid, nlookup);
 	pthread_mutex_unlock(&f->lock);
 }
 
-static void unlink_node(struct fuse *f, struct node *node)
+static void unlink_node(struct fuse *f, struct node *node, bool shrink)
 {
 	if (f->conf.remember) {
 		assert(node->nlookup > 1);
 		node->nlookup--;
 	}
-	unhash_name(f, node);
+	unhash_name_common(f, node, shrink);
 }
 
 static void remove_node(struct fuse *f, fuse_ino_t dir, const char *name)
@@ -1492,21 +2084,82 @@ static void remove_node(struct fuse *f, fuse_ino_t dir, const char *name)
 	pthread_mutex_lock(&f->lock);
 	node = lookup_node(f, dir, name);
 	if (node != NULL)
-		unlink_node(f, node);
+		unlink_node(f, node, true);
 	pthread_mutex_unlock(&f->lock);
 }
 
-static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
-		       fuse_ino_t newdir, const char *newname, int hide)
+/*
+ * Move a node to a new name in place.  The name table keeps its use
+ * count, so it is never resized here, and a name too long for the
+ * inline buffer was allocated by the caller before taking the lock.
+ * Returns the old name if the caller has to free it.
+ */
+static char *move_name(struct fuse *f, struct node *node, fuse_ino_t newdir,
+		       const char *newname, char *heapname)
+{
+	size_t hash = name_hash(f, node->parent->nodeid, node->name);
+	struct node **nodep = &f->name_table.array[hash];
+	char *oldname = NULL;
+
+	for (; *nodep != node; nodep = &(*nodep)->name_next) {
+		if (*nodep == NULL) {
+			fprintf(stderr,
+				"fuse internal error: unable to unhash node: %llu\n",
+				(unsigned long long) node->nodeid);
+			abort();
+		}
+	}
+	*nodep = node->name_next;
+
+	if (node->parent->nodeid != newdir) {
+		struct node *parent = get_node(f, newdir);
+
+		parent->refctr ++;
+		unref_node(f, node->parent);
+		node->parent = parent;
+	}
+
+	if (node->name != node->inline_name)
+		oldname = node->name;
+	if (heapname) {
+		node->name = heapname;
+	} else {
+		strcpy(node->inline_name, newname);
+		node->name = node->inline_name;
+	}
+
+	hash = name_hash(f, newdir, node->name);
+	node->name_next = f->name_table.array[hash];
+	f->name_table.array[hash] = node;
+
+	return oldname;
+}
+
+/*
+ * If the caller holds the source node write locked from get_path2(), it
+ * is passed in 'node' and the lookup is skipped.
+ */
+static int rename_node(struct fuse *f, struct node *node, fuse_ino_t olddir,
+		       const char *oldname, fuse_ino_t newdir,
+		       const char *newname, int hide)
 {
-	struct node *node;
 	struct node *newnode;
+	char *heapname = NULL;
+	char *freename = NULL;
 	int err = 0;
 
+	if (strlen(newname) >= sizeof(node->inline_name)) {
+		heapname = strdup(newname);
+		if (heapname == NULL)
+			return -ENOMEM;
+	}
+
 	pthread_mutex_lock(&f->lock);
-	node  = lookup_node(f, olddir, oldname);
+	if (node == NULL || node->parent == NULL ||
+	    node->parent->nodeid != olddir || strcmp(node->name, oldname) != 0)
+		node = lookup_node(f, olddir, oldname);
 	newnode	 = lookup_node(f, newdir, newname);
-	if (node == NULL)
+	if (node == NULL || node == newnode)
 		goto out;
 
 	if (newnode != NULL) {
@@ -1515,13 +2168,22 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
 			err = -EBUSY;
 			goto out;
 		}
-		unlink_node(f, newnode);
+		/* The renamed node takes over its slot in the table */
+		unlink_node(f, newnode, false);
 	}
 
-	unhash_name(f, node);
-	if (hash_name(f, node, newdir, newname) == -1) {
-		err = -ENOMEM;
-		goto out;
+#ifdef __APPLE__
+	if (f->conf.norm_insensitive) {
+		unhash_name(f, node);
+		if (hash_name(f, node, newdir, newname) == -1) {
+			err = -ENOMEM;
+			goto out;
+		}
+	} else
+#endif /* __APPLE__ */
+	{
+		freename = move_name(f, node, newdir, newname, heapname);
+		heapname = NULL;
 	}
 
 	if (hide)
@@ -1529,6 +2191,8 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
 
 out:
 	pthread_mutex_unlock(&f->lock);
+	free(heapname);
+	free(freename);
 	return err;
 }
 
@@ -2035,6 +2699,20 @@ int fuse_fs_symlink(struct fuse_fs *fs, const char *linkname, const char *path)
 	}
 }
 
+int fuse_fs_symlink_attr(struct fuse_fs *fs, const char *linkname,
+			 const char *path, struct stat *stbuf)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.symlink_attr) {
+		if (fs->debug)
+			fprintf(stderr, "symlink_attr %s %s\n", linkname, path);
+
+		return fs->op.symlink_attr(linkname, path, stbuf);
+	} else {
+		return -ENOSYS;
+	}
+}
+
 int fuse_fs_link(struct fuse_fs *fs, const char *oldpath, const char *newpath)
 {
 	fuse_get_context()->private_data = fs->user_data;
@@ -2048,6 +2726,20 @@ int fuse_fs_link(struct fuse_fs *fs, const char *oldpath, const char *newpath)
 	}
 }
 
+int fuse_fs_link_attr(struct fuse_fs *fs, const char *oldpath,
+		      const char *newpath, struct stat *stbuf)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.link_attr) {
+		if (fs->debug)
+			fprintf(stderr, "link_attr %s %s\n", oldpath, newpath);
+
+		return fs->op.link_attr(oldpath, newpath, stbuf);
+	} else {
+		return -ENOSYS;
+	}
+}
+
 int fuse_fs_release(struct fuse_fs *fs,	 const char *path,
 		    struct fuse_file_info *fi)
 {
@@ -2121,6 +2813,20 @@ static void fuse_free_buf(struct fuse_bufvec *buf)
 	}
 }
 
+/* Allocate a data buffer, page aligned with "-o aligned_buffers" */
+static void *fuse_alloc_data(struct fuse *f, size_t size)
+{
+	void *mem;
+
+	if (f == NULL || !f->conf.aligned_buffers)
+		return malloc(size ? size : 1);
+
+	if (posix_memalign(&mem, f->pagesize, size ? size : 1) != 0)
+		return NULL;
+
+	return mem;
+}
+
 int fuse_fs_read_buf(struct fuse_fs *fs, const char *path,
 		     struct fuse_bufvec **bufp, size_t size, off_t off,
 		     struct fuse_file_info *fi)
@@ -2145,7 +2851,7 @@ int fuse_fs_read_buf(struct fuse_fs *fs, const char *path,
 			if (buf == NULL)
 				return -ENOMEM;
 
-			mem = malloc(size);
+			mem = fuse_alloc_data(fuse_get_context()->fuse, size);
 			if (mem == NULL) {
 				free(buf);
 				return -ENOMEM;
@@ -2225,7 +2931,8 @@ int fuse_fs_write_buf(struct fuse_fs *fs, const char *path,
 				flatbuf = &buf->buf[0];
 			} else {
 				res = -ENOMEM;
-				mem = malloc(size);
+				mem = fuse_alloc_data(fuse_get_context()->fuse,
+						      size);
 				if (mem == NULL)
 					goto out;
 
@@ -2427,6 +3134,31 @@ int fuse_fs_create(struct fuse_fs *fs, const char *path, mode_t mode,
 	}
 }
 
+int fuse_fs_create_attr(struct fuse_fs *fs, const char *path, mode_t mode,
+			struct fuse_file_info *fi, struct stat *stbuf)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.create_attr) {
+		int err;
+
+		if (fs->debug)
+			fprintf(stderr,
+				"create_attr flags: 0x%x %s 0%o umask=0%03o\n",
+				fi->flags, path, mode,
+				fuse_get_context()->umask);
+
+		err = fs->op.create_attr(path, mode, fi, stbuf);
+
+		if (fs->debug && !err)
+			fprintf(stderr, "   create_attr[%llu] flags: 0x%x %s\n",
+				(unsigned long long) fi->fh, fi->flags, path);
+
+		return err;
+	} else {
+		return -ENOSYS;
+	}
+}
+
 int fuse_fs_lock(struct fuse_fs *fs, const char *path,
 		 struct fuse_file_info *fi, int cmd, struct flock *lock)
 {
@@ -2593,6 +3325,22 @@ int fuse_fs_mknod(struct fuse_fs *fs, const char *path, mode_t mode,
 	}
 }
 
+int fuse_fs_mknod_attr(struct fuse_fs *fs, const char *path, mode_t mode,
+		       dev_t rdev, struct stat *stbuf)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.mknod_attr) {
+		if (fs->debug)
+			fprintf(stderr, "mknod_attr %s 0%o 0x%llx umask=0%03o\n",
+				path, mode, (unsigned long long) rdev,
+				fuse_get_context()->umask);
+
+		return fs->op.mknod_attr(path, mode, rdev, stbuf);
+	} else {
+		return -ENOSYS;
+	}
+}
+
 int fuse_fs_mkdir(struct fuse_fs *fs, const char *path, mode_t mode)
 {
 	fuse_get_context()->private_data = fs->user_data;
@@ -2607,6 +3355,21 @@ int fuse_fs_mkdir(struct fuse_fs *fs, const char *path, mode_t mode)
 	}
 }
 
+int fuse_fs_mkdir_attr(struct fuse_fs *fs, const char *path, mode_t mode,
+		       struct stat *stbuf)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.mkdir_attr) {
+		if (fs->debug)
+			fprintf(stderr, "mkdir_attr %s 0%o umask=0%03o\n",
+				path, mode, fuse_get_context()->umask);
+
+		return fs->op.mkdir_attr(path, mode, stbuf);
+	} else {
+		return -ENOSYS;
+	}
+}
+
 #ifdef __APPLE__
 int fuse_fs_setxattr(struct fuse_fs *fs, const char *path, const char *name,
 		     const char *value, size_t size, int flags,
@@ -2829,7 +3592,8 @@ static int hide_node(struct fuse *f, const char *oldpath,
 	if (newpath) {
 		err = fuse_fs_rename(f->fs, oldpath, newpath);
 		if (!err)
-			err = rename_node(f, dir, oldname, dir, newname, 1);
+			err = rename_node(f, NULL, dir, oldname, dir, newname,
+					  1);
 		free(newpath);
 	}
 	return err;
@@ -2881,6 +3645,32 @@ static void update_stat(struct node *node, const struct stat *stbuf)
 	curr_time(&node->stat_updated);
 }
 
+/* Look up or create the node for an entry, whose attributes are in e->attr */
+static int lookup_entry(struct fuse *f, fuse_ino_t nodeid, const char *name,
+			struct fuse_entry_param *e)
+{
+	struct node *node;
+
+	node = find_node(f, nodeid, name);
+	if (node == NULL)
+		return -ENOMEM;
+
+	e->ino = node->nodeid;
+	e->generation = node->generation;
+	e->entry_timeout = f->conf.entry_timeout;
+	e->attr_timeout = f->conf.attr_timeout;
+	if (f->conf.auto_cache) {
+		pthread_mutex_lock(&f->lock);
+		update_stat(node, &e->attr);
+		pthread_mutex_unlock(&f->lock);
+	}
+	set_stat(f, e->ino, &e->attr);
+	if (f->conf.debug)
+		fprintf(stderr, "   NODEID: %lu\n", (unsigned long) e->ino);
+
+	return 0;
+}
+
 static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
 		       const char *name, const char *path,
 		       struct fuse_entry_param *e, struct fuse_file_info *fi)
@@ -2892,31 +3682,23 @@ static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
 		res = fuse_fs_fgetattr(f->fs, path, &e->attr, fi);
 	else
 		res = fuse_fs_getattr(f->fs, path, &e->attr);
-	if (res == 0) {
-		struct node *node;
+	if (res == 0)
+		res = lookup_entry(f, nodeid, name, e);
 
-		node = find_node(f, nodeid, name);
-		if (node == NULL)
-			res = -ENOMEM;
-		else {
-			e->ino = node->nodeid;
-			e->generation = node->generation;
-			e->entry_timeout = f->conf.entry_timeout;
-			e->attr_timeout = f->conf.attr_timeout;
-			if (f->conf.auto_cache) {
-				pthread_mutex_lock(&f->lock);
-				update_stat(node, &e->attr);
-				pthread_mutex_unlock(&f->lock);
-			}
-			set_stat(f, e->ino, &e->attr);
-			if (f->conf.debug)
-				fprintf(stderr, "   NODEID: %lu\n",
-					(unsigned long) e->ino);
-		}
-	}
 	return res;
 }
 
+/* Look up a new entry, whose attributes are in e->attr if have_attr is set */
+static int lookup_created(struct fuse *f, fuse_ino_t nodeid, const char *name,
+			  const char *path, struct fuse_entry_param *e,
+			  struct fuse_file_info *fi, int have_attr)
+{
+	if (have_attr)
+		return lookup_entry(f, nodeid, name, e);
+
+	return lookup_path(f, nodeid, name, path, e, fi);
+}
+
 static struct fuse_context_i *fuse_get_context_internal(void)
 {
 	struct fuse_context_i *c;
@@ -2972,115 +3754,1616 @@ static void fuse_delete_context_key(void)
 	pthread_mutex_unlock(&fuse_context_lock);
 }
 
-static struct fuse *req_fuse_prepare(fuse_req_t req)
+/*
+ * Warm start.  The paths looked up and the ranges read during the first
+ * warm_record seconds after mounting are recorded and written to the
+ * warm_log file.  When the file exists at the next mount, a background
+ * thread replays it: it fetches the attributes of each path and reads
+ * the recorded ranges through the filesystem, and with kernel_cache or
+ * auto_cache it stores the data in the kernel's page cache.  The kernel
+ * only accepts data for inodes it has looked up, so the ranges of a path
+ * which has not been looked up yet are stored when it is.  The thread
+ * backs off while requests are arriving, and reads at most warm_budget
+ * megabytes.
+ *
+ * Requests don't take w->lock: they record lookups and reads into a ring
+ * of their own thread, which the background thread drains.  A lookup is
+ * only published once its reply was sent, so that the data of a pending
+ * path is not stored before the kernel knows the inode.
+ */
+#define WARM_HASH_SIZE 16384
+#define WARM_MAX_PATHS 65536
+#define WARM_MAX_RANGES 32
+#define WARM_CHUNK (128 * 1024)
+/* Quiet period awaited before each step, doubled while requests arrive */
+#define WARM_BACKOFF_MIN 0.001
+#define WARM_BACKOFF_MAX 0.064
+#define WARM_MAGIC "fuse-warm 1\n"
+#define WARM_RING_SIZE 256
+/* How often the rings are drained while recording or waiting for lookups */
+#define WARM_DRAIN_INTERVAL 0.01
+
+enum warm_state {
+	WARM_IDLE,
+	WARM_PENDING,		/* waiting for the kernel to look it up */
+	WARM_QUEUED,
+	WARM_DONE,
+};
+
+struct warm_range {
+	off_t off;
+	off_t len;
+};
+
+struct warm_path {
+	struct warm_path *hash_next;
+	struct warm_path *next;		/* in order of first access */
+	struct warm_path *queue_next;
+	char *path;
+	enum warm_state state;
+	fuse_ino_t nodeid;
+	struct warm_range *ranges;
+	unsigned int nranges;
+	unsigned int alloc;
+};
+
+/* A lookup if len is zero, a read otherwise */
+struct warm_event {
+	char *path;
+	fuse_ino_t nodeid;
+	off_t off;
+	off_t len;
+};
+
+/*
+ * Only the thread owning the ring advances head, and only the background
+ * thread advances tail.  Events are dropped while the ring is full.
+ */
+struct warm_ring {
+	struct warm_ring *next;
+	int orphaned;			/* the owning thread exited */
+	int staged;			/* ev[head] filled, not yet published */
+	unsigned int head;
+	unsigned int tail;
+	struct warm_event ev[WARM_RING_SIZE];
+};
+
+struct warm_table {
+	struct warm_path **hash;
+	struct warm_path *first;
+	struct warm_path **lastp;
+	unsigned int count;
+};
+
+struct warm {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int started;
+	int stop;
+	int recording;
+	int replaying;			/* paths to replay or queued */
+	unsigned int pending;		/* paths in the WARM_PENDING state */
+	double record_end;
+	unsigned int foreground;
+	unsigned int seen;
+	pthread_key_t ring_key;
+	struct warm_ring *rings;	/* pushed with compare and swap */
+	struct warm_table rec;
+	struct warm_table replay;
+	struct warm_path *queue;
+	struct warm_path **queue_tail;
+	uint64_t budget;
+	uint64_t bytes;
+	unsigned int attrs;
+	unsigned int stored;
+};
+
+static double warm_now(void)
 {
-	struct fuse_context_i *c = fuse_get_context_internal();
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
-	c->req = req;
-	c->ctx.fuse = req_fuse(req);
-	c->ctx.uid = ctx->uid;
-	c->ctx.gid = ctx->gid;
-	c->ctx.pid = ctx->pid;
-	c->ctx.umask = ctx->umask;
-	return c->ctx.fuse;
+	struct timespec now;
+
+	curr_time(&now);
+	return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-static inline void reply_err(fuse_req_t req, int err)
+static void warm_deadline(struct timespec *ts, double secs)
 {
-	/* fuse_reply_err() uses non-negated errno values */
-	fuse_reply_err(req, -err);
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += (time_t) secs;
+	ts->tv_nsec += (secs - (time_t) secs) * 1e9;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
 }
 
-static void reply_entry(fuse_req_t req, const struct fuse_entry_param *e,
-			int err)
+static size_t warm_hash(const char *path)
 {
-	if (!err) {
-		struct fuse *f = req_fuse(req);
-		if (fuse_reply_entry(req, e) == -ENOENT) {
-			/* Skip forget for negative result */
-			if  (e->ino != 0)
-				forget_node(f, e->ino, 1);
-		}
-	} else
-		reply_err(req, err);
+	uint64_t hash = 0;
+
+	for (; *path; path++)
+		hash = hash * 31 + (unsigned char) *path;
+
+	return hash % WARM_HASH_SIZE;
 }
 
-void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn)
+static int warm_table_init(struct warm_table *t)
 {
-	fuse_get_context()->private_data = fs->user_data;
-	if (!fs->op.write_buf)
-		conn->want &= ~FUSE_CAP_SPLICE_READ;
-	if (!fs->op.lock)
-		conn->want &= ~FUSE_CAP_POSIX_LOCKS;
-	if (!fs->op.flock)
-		conn->want &= ~FUSE_CAP_FLOCK_LOCKS;
-#ifdef __APPLE__
-	if (!fs->op.renamex)
-		conn->want &= ~(FUSE_CAP_RENAME_SWAP | FUSE_CAP_RENAME_EXCL);
-	if (!fs->op.fallocate)
-		conn->want &= ~FUSE_CAP_ALLOCATE;
-	if (!fs->op.exchange)
-		conn->want &= ~FUSE_CAP_EXCHANGE_DATA;
-	if (!fs->op.setvolname)
-		conn->want &= ~FUSE_CAP_VOL_RENAME;
-	if (!fs->op.getxtimes)
-		conn->want &= ~FUSE_CAP_XTIMES;
-#endif /* __APPLE__ */
-	if (fs->op.init)
-		fs->user_data = fs->op.init(conn);
+	t->hash = calloc(WARM_HASH_SIZE, sizeof(struct warm_path *));
+	if (t->hash == NULL)
+		return -1;
+
+	t->first = NULL;
+	t->lastp = &t->first;
+	t->count = 0;
+	return 0;
 }
 
-static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
+static void warm_table_free(struct warm_table *t)
 {
-	struct fuse *f = (struct fuse *) data;
-	struct fuse_context_i *c = fuse_get_context_internal();
+	struct warm_path *p;
+	struct warm_path *next;
 
-	memset(c, 0, sizeof(*c));
-	c->ctx.fuse = f;
-	conn->want |= FUSE_CAP_EXPORT_SUPPORT;
-	fuse_fs_init(f->fs, conn);
+	for (p = t->first; p != NULL; p = next) {
+		next = p->next;
+		free(p->path);
+		free(p->ranges);
+		free(p);
+	}
+	free(t->hash);
 }
 
-void fuse_fs_destroy(struct fuse_fs *fs)
+static struct warm_path *warm_find(struct warm_table *t, const char *path)
 {
-	fuse_get_context()->private_data = fs->user_data;
-	if (fs->op.destroy)
-		fs->op.destroy(fs->user_data);
-	if (fs->m)
-		fuse_put_module(fs->m);
-	free(fs);
+	struct warm_path *p;
+
+	for (p = t->hash[warm_hash(path)]; p != NULL; p = p->hash_next) {
+		if (strcmp(p->path, path) == 0)
+			return p;
+	}
+	return NULL;
 }
 
-static void fuse_lib_destroy(void *data)
+/* Returns NULL if the path is new and can't be added */
+static struct warm_path *warm_add(struct warm_table *t, const char *path)
 {
-	struct fuse *f = (struct fuse *) data;
-	struct fuse_context_i *c = fuse_get_context_internal();
+	struct warm_path *p;
+	size_t hash;
 
-	memset(c, 0, sizeof(*c));
-	c->ctx.fuse = f;
-	fuse_fs_destroy(f->fs);
-	f->fs = NULL;
+	p = warm_find(t, path);
+	if (p != NULL || t->count >= WARM_MAX_PATHS)
+		return p;
+
+	p = (struct warm_path *) calloc(1, sizeof(struct warm_path));
+	if (p == NULL)
+		return NULL;
+	p->path = strdup(path);
+	if (p->path == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	hash = warm_hash(path);
+	p->hash_next = t->hash[hash];
+	t->hash[hash] = p;
+	*t->lastp = p;
+	t->lastp = &p->next;
+	t->count++;
+	return p;
 }
 
-static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
-			    const char *name)
+/* Sequential reads extend the last range, so the search starts there */
+static void warm_add_range(struct warm_path *p, off_t off, off_t len)
 {
-	struct fuse *f = req_fuse_prepare(req);
-	struct fuse_entry_param e;
-	char *path;
-	int err;
-	struct node *dot = NULL;
+	struct warm_range *r;
+	unsigned int i;
 
-	if (name[0] == '.') {
-		int len = strlen(name);
+	for (i = p->nranges; i-- > 0;) {
+		r = &p->ranges[i];
+		if (off <= r->off + r->len && r->off <= off + len) {
+			off_t end = MAX(r->off + r->len, off + len);
 
-		if (len == 1 || (name[1] == '.' && len == 2)) {
-			pthread_mutex_lock(&f->lock);
-			if (len == 1) {
-				if (f->conf.debug)
-					fprintf(stderr, "LOOKUP-DOT\n");
-				dot = get_node_nocheck(f, parent);
-				if (dot == NULL) {
+			r->off = MIN(r->off, off);
+			r->len = end - r->off;
+			return;
+		}
+	}
+
+	if (p->nranges == p->alloc) {
+		unsigned int alloc = p->alloc ? p->alloc * 2 : 4;
+
+		if (alloc > WARM_MAX_RANGES)
+			return;
+		r = realloc(p->ranges, alloc * sizeof(struct warm_range));
+		if (r == NULL)
+			return;
+		p->ranges = r;
+		p->alloc = alloc;
+	}
+	p->ranges[p->nranges].off = off;
+	p->ranges[p->nranges].len = len;
+	p->nranges++;
+}
+
+/*
+ * The log is text: a header line, then for each path a line with the
+ * length of the path, the number of ranges and the path itself, followed
+ * by one line of offset and length per range.
+ */
+static int warm_load(struct warm_table *t, const char *file)
+{
+	char magic[sizeof(WARM_MAGIC)];
+	unsigned int nranges;
+	unsigned int i;
+	size_t len;
+	FILE *fp;
+	int res = 0;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return errno == ENOENT ? 0 : -errno;
+
+	if (fgets(magic, sizeof(magic), fp) == NULL ||
+	    strcmp(magic, WARM_MAGIC) != 0) {
+		res = -EINVAL;
+		goto out;
+	}
+	while (fscanf(fp, "%zu %u ", &len, &nranges) == 2) {
+		struct warm_path *p;
+		char *path;
+
+		if (len == 0 || len > PATH_MAX || nranges > WARM_MAX_RANGES) {
+			res = -EINVAL;
+			goto out;
+		}
+		path = malloc(len + 1);
+		if (path == NULL) {
+			res = -ENOMEM;
+			goto out;
+		}
+		if (fread(path, 1, len, fp) != len || getc(fp) != '\n') {
+			free(path);
+			res = -EINVAL;
+			goto out;
+		}
+		path[len] = '\0';
+		p = warm_add(t, path);
+		free(path);
+
+		for (i = 0; i < nranges; i++) {
+			unsigned long long off;
+			unsigned long long rlen;
+
+			if (fscanf(fp, "%llu %llu", &off, &rlen) != 2 ||
+			    off > OFFSET_MAX || rlen > OFFSET_MAX - off) {
+				res = -EINVAL;
+				goto out;
+			}
+			if (p != NULL && rlen)
+				warm_add_range(p, off, rlen);
+		}
+	}
+	if (!feof(fp))
+		res = -EINVAL;
+out:
+	fclose(fp);
+	return res;
+}
+
+static int warm_save(struct warm_table *t, const char *file)
+{
+	struct warm_path *p;
+	unsigned int i;
+	char *tmp;
+	FILE *fp;
+	int res;
+
+	tmp = malloc(strlen(file) + sizeof(".tmp"));
+	if (tmp == NULL)
+		return -ENOMEM;
+
+	sprintf(tmp, "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		res = -errno;
+		free(tmp);
+		return res;
+	}
+	fputs(WARM_MAGIC, fp);
+	for (p = t->first; p != NULL; p = p->next) {
+		fprintf(fp, "%zu %u %s\n", strlen(p->path), p->nranges,
+			p->path);
+		for (i = 0; i < p->nranges; i++)
+			fprintf(fp, "%llu %llu\n",
+				(unsigned long long) p->ranges[i].off,
+				(unsigned long long) p->ranges[i].len);
+	}
+	res = ferror(fp) ? -EIO : 0;
+	if (fclose(fp) == EOF && !res)
+		res = -errno;
+	if (!res && rename(tmp, file) == -1)
+		res = -errno;
+	if (res)
+		unlink(tmp);
+	free(tmp);
+	return res;
+}
+
+/* The ring stays on the list, for the next thread to take over */
+static void warm_ring_orphan(void *data)
+{
+	struct warm_ring *r = (struct warm_ring *) data;
+
+	if (r->staged) {
+		free(r->ev[r->head % WARM_RING_SIZE].path);
+		r->staged = 0;
+	}
+	__sync_synchronize();
+	r->orphaned = 1;
+}
+
+static struct warm *warm_new(const char *file)
+{
+	struct warm *w;
+	int res;
+
+	w = (struct warm *) calloc(1, sizeof(struct warm));
+	if (w == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		return NULL;
+	}
+	if (warm_table_init(&w->rec) == -1 ||
+	    warm_table_init(&w->replay) == -1) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		free(w->rec.hash);
+		free(w);
+		return NULL;
+	}
+
+	/* A missing or damaged log only means a cold start */
+	res = warm_load(&w->replay, file);
+	if (res)
+		fprintf(stderr, "fuse: failed to read warm log %s: %s\n",
+			file, strerror(-res));
+
+	if (pthread_key_create(&w->ring_key, warm_ring_orphan) != 0) {
+		fprintf(stderr, "fuse: failed to create thread specific key\n");
+		warm_table_free(&w->rec);
+		warm_table_free(&w->replay);
+		free(w);
+		return NULL;
+	}
+	fuse_mutex_init(&w->lock);
+	pthread_cond_init(&w->cond, NULL);
+	w->queue_tail = &w->queue;
+	return w;
+}
+
+static void warm_free(struct warm *w)
+{
+	struct warm_ring *r;
+
+	pthread_key_delete(w->ring_key);
+	while ((r = w->rings) != NULL) {
+		w->rings = r->next;
+		for (; r->tail != r->head + r->staged; r->tail++)
+			free(r->ev[r->tail % WARM_RING_SIZE].path);
+		free(r);
+	}
+	warm_table_free(&w->rec);
+	warm_table_free(&w->replay);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+/* Called for every request, so only counts while replaying */
+static void warm_foreground(struct fuse *f)
+{
+	struct warm *w = f->warm;
+
+	if (w->replaying)
+		__sync_fetch_and_add(&w->foreground, 1);
+}
+
+static struct warm_ring *warm_ring(struct warm *w)
+{
+	struct warm_ring *r = pthread_getspecific(w->ring_key);
+
+	if (r != NULL)
+		return r;
+
+	for (r = w->rings; r != NULL; r = r->next) {
+		if (r->orphaned &&
+		    __sync_bool_compare_and_swap(&r->orphaned, 1, 0))
+			break;
+	}
+	if (r == NULL) {
+		r = (struct warm_ring *) calloc(1, sizeof(struct warm_ring));
+		if (r == NULL)
+			return NULL;
+		do {
+			r->next = w->rings;
+		} while (!__sync_bool_compare_and_swap(&w->rings, r->next, r));
+	}
+	pthread_setspecific(w->ring_key, r);
+
+	return r;
+}
+
+/* Fills the next slot of the thread's ring, published unless staged */
+static void warm_record(struct warm *w, const char *path, fuse_ino_t nodeid,
+			off_t off, off_t len, int staged)
+{
+	struct warm_ring *r = warm_ring(w);
+	struct warm_event *ev;
+
+	if (r == NULL)
+		return;
+
+	ev = &r->ev[r->head % WARM_RING_SIZE];
+	if (r->staged) {
+		free(ev->path);
+		r->staged = 0;
+	}
+	if (r->head - *(volatile unsigned int *) &r->tail >= WARM_RING_SIZE)
+		return;
+
+	ev->path = strdup(path);
+	if (ev->path == NULL)
+		return;
+	ev->nodeid = nodeid;
+	ev->off = off;
+	ev->len = len;
+	if (staged) {
+		r->staged = 1;
+	} else {
+		__sync_synchronize();
+		r->head++;
+	}
+}
+
+/*
+ * Called after the kernel looked up path, before the path is released.
+ * The lookup is only passed on by warm_lookup_replied().
+ */
+static void warm_lookup(struct fuse *f, const char *path, fuse_ino_t nodeid)
+{
+	struct warm *w = f->warm;
+
+	if (w->recording || *(volatile unsigned int *) &w->pending)
+		warm_record(w, path, nodeid, 0, 0, 1);
+}
+
+/* Called after the reply to a lookup was sent */
+static void warm_lookup_replied(struct fuse *f)
+{
+	struct warm_ring *r;
+
+	if (f->warm == NULL)
+		return;
+
+	r = pthread_getspecific(f->warm->ring_key);
+	if (r != NULL && r->staged) {
+		r->staged = 0;
+		__sync_synchronize();
+		r->head++;
+	}
+}
+
+static void warm_read(struct fuse *f, fuse_ino_t ino, const char *path,
+		      off_t off, size_t size)
+{
+	struct warm *w = f->warm;
+	char *tmp = NULL;
+
+	if (!w->recording || !size)
+		return;
+
+	if (path == NULL) {
+		if (get_path(f, ino, &tmp) != 0)
+			return;
+		path = tmp;
+	}
+	warm_record(w, path, ino, off, size, 0);
+	if (tmp != NULL)
+		free_path(f, ino, tmp);
+}
+
+/* Called with w->lock held */
+static void warm_drain_event(struct warm *w, struct warm_event *ev)
+{
+	struct warm_path *p;
+
+	if (ev->len) {
+		if (w->recording) {
+			p = warm_add(&w->rec, ev->path);
+			if (p != NULL)
+				warm_add_range(p, ev->off, ev->len);
+		}
+		return;
+	}
+
+	p = warm_find(&w->replay, ev->path);
+	if (w->recording) {
+		struct warm_path *r = warm_add(&w->rec, ev->path);
+		unsigned int i;
+
+		/*
+		 * Reads served from the stored data don't reach the library,
+		 * so carry the replayed ranges over to the next log.
+		 */
+		if (r != NULL && p != NULL && !r->nranges) {
+			for (i = 0; i < p->nranges; i++)
+				warm_add_range(r, p->ranges[i].off,
+					       p->ranges[i].len);
+		}
+	}
+	if (p != NULL && p->state == WARM_PENDING) {
+		p->state = WARM_QUEUED;
+		p->nodeid = ev->nodeid;
+		p->queue_next = NULL;
+		*w->queue_tail = p;
+		w->queue_tail = &p->queue_next;
+		w->pending--;
+		w->replaying = 1;
+	}
+}
+
+/* Called with w->lock held, by the background thread */
+static void warm_drain(struct warm *w)
+{
+	struct warm_ring *r;
+
+	for (r = w->rings; r != NULL; r = r->next) {
+		unsigned int head = *(volatile unsigned int *) &r->head;
+
+		__sync_synchronize();
+		for (; r->tail != head; ) {
+			struct warm_event *ev = &r->ev[r->tail % WARM_RING_SIZE];
+
+			warm_drain_event(w, ev);
+			free(ev->path);
+			__sync_synchronize();
+			r->tail++;
+		}
+	}
+}
+
+/*
+ * Called with w->lock held.  Waits until no request has arrived for a
+ * while, returns non-zero if the thread is being stopped.
+ */
+static int warm_yield(struct warm *w)
+{
+	double delay = WARM_BACKOFF_MIN;
+
+	while (!w->stop && w->foreground != w->seen) {
+		struct timespec timeout;
+
+		w->seen = w->foreground;
+		warm_deadline(&timeout, delay);
+		pthread_cond_timedwait(&w->cond, &w->lock, &timeout);
+		delay = MIN(delay * 2, WARM_BACKOFF_MAX);
+	}
+	return w->stop;
+}
+
+static int warm_store_enabled(struct fuse *f)
+{
+	return (f->conf.kernel_cache || f->conf.auto_cache) &&
+		!f->conf.direct_io;
+}
+
+/* Data is not stored for open files, whose cache the kernel maintains */
+static int warm_node_idle(struct fuse *f, fuse_ino_t nodeid)
+{
+	struct node *node;
+	int idle;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node_nocheck(f, nodeid);
+	idle = node != NULL && !node->open_count;
+	pthread_mutex_unlock(&f->lock);
+
+	return idle;
+}
+
+static int warm_stat_eq(const struct stat *a, const struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+		a->st_mtime == b->st_mtime &&
+		ST_MTIM_NSEC(a) == ST_MTIM_NSEC(b);
+}
+
+/*
+ * Reads the recorded ranges of a file through the filesystem, and if
+ * nodeid is set stores the data in the kernel's cache of the inode.
+ * Each chunk is only stored if the file did not change while it was
+ * being read.
+ */
+static void warm_read_ranges(struct fuse *f, struct warm_path *p,
+			     fuse_ino_t nodeid)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(f->se, NULL);
+	struct warm *w = f->warm;
+	struct fuse_file_info fi;
+	struct stat before;
+	struct stat after;
+	unsigned int i;
+	int stored = 0;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if (fuse_fs_open(f->fs, p->path, &fi) != 0)
+		return;
+	if (fuse_fs_fgetattr(f->fs, p->path, &before, &fi) != 0)
+		goto out_release;
+
+	/* Pages cached earlier may be stale, the stored ones replace them */
+	if (nodeid && warm_node_idle(f, nodeid))
+		fuse_lowlevel_notify_inval_inode(ch, nodeid, 0, 0);
+	else
+		nodeid = 0;
+
+	for (i = 0; i < p->nranges; i++) {
+		off_t off = p->ranges[i].off;
+		off_t end = MIN(off + p->ranges[i].len, before.st_size);
+
+		while (off < end) {
+			struct fuse_bufvec *buf = NULL;
+			size_t size = MIN(end - off, WARM_CHUNK);
+			int res;
+
+			pthread_mutex_lock(&w->lock);
+			res = warm_yield(w) || w->bytes >= w->budget;
+			if (!res)
+				w->bytes += size;
+			pthread_mutex_unlock(&w->lock);
+			if (res)
+				goto out_cache;
+
+			res = fuse_fs_read_buf(f->fs, p->path, &buf, size, off,
+					       &fi);
+			size = res ? 0 : fuse_buf_size(buf);
+			if (size && nodeid &&
+			    fuse_fs_fgetattr(f->fs, p->path, &after, &fi) == 0 &&
+			    warm_stat_eq(&before, &after) &&
+			    warm_node_idle(f, nodeid) &&
+			    fuse_lowlevel_notify_store(ch, nodeid, off, buf,
+						       0) == 0)
+				stored = 1;
+			fuse_free_buf(buf);
+			if (!size)
+				break;
+			off += size;
+		}
+	}
+
+out_cache:
+	/* Keep the stored pages at the next open */
+	if (stored && f->conf.auto_cache) {
+		struct node *node;
+
+		pthread_mutex_lock(&f->lock);
+		node = get_node_nocheck(f, nodeid);
+		if (node != NULL && !node->open_count) {
+			update_stat(node, &before);
+			node->cache_valid = 1;
+		}
+		pthread_mutex_unlock(&f->lock);
+	}
+	if (stored) {
+		pthread_mutex_lock(&w->lock);
+		w->stored++;
+		pthread_mutex_unlock(&w->lock);
+	}
+out_release:
+	fuse_fs_release(f->fs, p->path, &fi);
+}
+
+static void warm_set_state(struct warm *w, struct warm_path *p,
+			   enum warm_state state)
+{
+	pthread_mutex_lock(&w->lock);
+	p->state = state;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void warm_replay_path(struct fuse *f, struct warm_path *p)
+{
+	struct warm *w = f->warm;
+	struct stat stbuf;
+	fuse_ino_t nodeid;
+	int queued;
+
+	if (fuse_fs_getattr(f->fs, p->path, &stbuf) != 0)
+		goto out_done;
+
+	pthread_mutex_lock(&w->lock);
+	w->attrs++;
+	pthread_mutex_unlock(&w->lock);
+	if (!S_ISREG(stbuf.st_mode) || !p->nranges)
+		goto out_done;
+
+	if (!warm_store_enabled(f)) {
+		warm_read_ranges(f, p, 0);
+		goto out_done;
+	}
+
+	/* Mark it first, so that a lookup racing with the check queues it */
+	pthread_mutex_lock(&w->lock);
+	p->state = WARM_PENDING;
+	w->pending++;
+	pthread_mutex_unlock(&w->lock);
+	if (lookup_path_in_cache(f, p->path, &nodeid) != 0)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	warm_drain(w);
+	queued = p->state != WARM_PENDING;
+	if (!queued) {
+		p->state = WARM_DONE;
+		w->pending--;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (!queued)
+		warm_read_ranges(f, p, nodeid);
+	return;
+
+out_done:
+	warm_set_state(w, p, WARM_DONE);
+}
+
+static void *warm_thread(void *data)
+{
+	struct fuse *f = (struct fuse *) data;
+	struct fuse_context_i *c = fuse_get_context_internal();
+	struct warm *w = f->warm;
+	struct warm_path *next = w->replay.first;
+	struct warm_path *p;
+	int res;
+
+	memset(c, 0, sizeof(*c));
+	c->ctx.fuse = f;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		warm_drain(w);
+		if (w->queue == NULL && next == NULL)
+			w->replaying = 0;
+
+		/* The kernel just looked these up, they are likely opened */
+		if (w->queue != NULL) {
+			p = w->queue;
+			w->queue = p->queue_next;
+			if (w->queue == NULL)
+				w->queue_tail = &w->queue;
+			p->state = WARM_DONE;
+			pthread_mutex_unlock(&w->lock);
+			warm_read_ranges(f, p, p->nodeid);
+			pthread_mutex_lock(&w->lock);
+		} else if (next != NULL) {
+			p = next;
+			next = p->next;
+			if (warm_yield(w))
+				break;
+			pthread_mutex_unlock(&w->lock);
+			warm_replay_path(f, p);
+			pthread_mutex_lock(&w->lock);
+		} else if (warm_now() < w->record_end) {
+			struct timespec timeout;
+
+			warm_deadline(&timeout, MIN(w->record_end - warm_now(),
+						    WARM_DRAIN_INTERVAL));
+			pthread_cond_timedwait(&w->cond, &w->lock, &timeout);
+		} else if (w->recording) {
+			/* No more changes to the table once this is cleared */
+			warm_drain(w);
+			w->recording = 0;
+			pthread_mutex_unlock(&w->lock);
+			res = warm_save(&w->rec, f->conf.warm_log);
+			if (res)
+				fprintf(stderr, "fuse: failed to write warm log %s: %s\n",
+					f->conf.warm_log, strerror(-res));
+			pthread_mutex_lock(&w->lock);
+		} else {
+			break;
+		}
+	}
+	w->replaying = 0;
+	if (f->conf.debug)
+		fprintf(stderr, "WARM: %u of %u paths, %u files stored, %llu bytes read\n",
+			w->attrs, w->replay.count, w->stored,
+			(unsigned long long) w->bytes);
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+static void warm_start(struct fuse *f)
+{
+	struct warm *w = f->warm;
+
+	w->budget = (uint64_t) f->conf.warm_budget << 20;
+	w->record_end = warm_now() + MAX(f->conf.warm_record, 0);
+	w->recording = f->conf.warm_record > 0;
+	w->replaying = 1;
+	if (fuse_start_thread(&w->thread, warm_thread, f) == 0)
+		w->started = 1;
+	else
+		w->recording = w->replaying = 0;
+}
+
+/* Writes the log if the mount ends before the recording period */
+static void warm_stop(struct fuse *f)
+{
+	struct warm *w = f->warm;
+	int res;
+
+	if (w == NULL || !w->started)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	w->started = 0;
+
+	if (w->recording) {
+		pthread_mutex_lock(&w->lock);
+		warm_drain(w);
+		w->recording = 0;
+		pthread_mutex_unlock(&w->lock);
+		res = warm_save(&w->rec, f->conf.warm_log);
+		if (res)
+			fprintf(stderr, "fuse: failed to write warm log %s: %s\n",
+				f->conf.warm_log, strerror(-res));
+	}
+}
+
+/*
+ * Attributes from readdir.  If the stat passed to the filler is complete
+ * (flag_readdir_attr, or the readdir_attr option), readdir keeps it for
+ * attr_timeout seconds, and the lookup which usually follows is answered
+ * from it without calling getattr.  An entry is used once, since the
+ * kernel caches the result of the lookup.  An entry is ignored if the
+ * library changed the directory or the node itself after the readdir
+ * which kept it started.  Changes are recorded as the time of the last
+ * one, in slots indexed by the nodeid, so that changes to unrelated
+ * nodes rarely touch the same slot.
+ */
+#define DIR_ATTR_HASH_SIZE 16384
+#define DIR_ATTR_MAX 65536
+#define DIR_ATTR_CHANGED_SIZE 1024
+
+struct dir_attr {
+	struct dir_attr *next;
+	struct list_head list;		/* in order of insertion */
+	fuse_ino_t parent;
+	uint64_t start;			/* when the readdir started, in ns */
+	struct timespec stored;
+	struct stat stat;
+	char name[];
+};
+
+struct dir_attr_table {
+	pthread_mutex_t lock;
+	struct dir_attr **array;
+	struct list_head list;
+	size_t use;
+	uint64_t hits;
+	/* Time of the last change, in ns, by nodeid */
+	uint64_t changed[DIR_ATTR_CHANGED_SIZE];
+};
+
+static double diff_timespec(const struct timespec *t1,
+			    const struct timespec *t2);
+
+static struct dir_attr_table *dir_attr_new(void)
+{
+	struct dir_attr_table *t;
+
+	t = (struct dir_attr_table *) calloc(1, sizeof(struct dir_attr_table));
+	if (t == NULL)
+		goto out_err;
+
+	t->array = calloc(DIR_ATTR_HASH_SIZE, sizeof(struct dir_attr *));
+	if (t->array == NULL) {
+		free(t);
+		goto out_err;
+	}
+	init_list_head(&t->list);
+	fuse_mutex_init(&t->lock);
+	return t;
+
+out_err:
+	fprintf(stderr, "fuse: memory allocation failed\n");
+	return NULL;
+}
+
+static void dir_attr_free(struct dir_attr_table *t)
+{
+	while (!list_empty(&t->list)) {
+		struct dir_attr *a = list_entry(t->list.next, struct dir_attr,
+						list);
+
+		list_del(&a->list);
+		free(a);
+	}
+	pthread_mutex_destroy(&t->lock);
+	free(t->array);
+	free(t);
+}
+
+static size_t dir_attr_hash(fuse_ino_t parent, const char *name)
+{
+	uint64_t hash = parent;
+
+	for (; *name; name++)
+		hash = hash * 31 + (unsigned char) *name;
+
+	return hash % DIR_ATTR_HASH_SIZE;
+}
+
+static struct dir_attr **dir_attr_find(struct dir_attr_table *t,
+				       fuse_ino_t parent, const char *name)
+{
+	struct dir_attr **ap;
+
+	for (ap = &t->array[dir_attr_hash(parent, name)]; *ap != NULL;
+	     ap = &(*ap)->next) {
+		if ((*ap)->parent == parent && strcmp((*ap)->name, name) == 0)
+			break;
+	}
+	return ap;
+}
+
+static void dir_attr_remove(struct dir_attr_table *t, struct dir_attr **ap)
+{
+	struct dir_attr *a = *ap;
+
+	*ap = a->next;
+	list_del(&a->list);
+	free(a);
+	t->use--;
+}
+
+/* Called with t->lock held */
+static void dir_attr_expire(struct fuse *f, struct dir_attr_table *t,
+			    const struct timespec *now)
+{
+	while (!list_empty(&t->list)) {
+		struct dir_attr *a = list_entry(t->list.next, struct dir_attr,
+						list);
+
+		if (t->use < DIR_ATTR_MAX &&
+		    diff_timespec(now, &a->stored) < f->conf.attr_timeout)
+			break;
+		dir_attr_remove(t, dir_attr_find(t, a->parent, a->name));
+	}
+}
+
+static uint64_t dir_attr_now(void)
+{
+	struct timespec now;
+
+	curr_time(&now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void dir_attr_mark(struct dir_attr_table *t, fuse_ino_t nodeid,
+			  uint64_t when)
+{
+	uint64_t *slot = &t->changed[nodeid % DIR_ATTR_CHANGED_SIZE];
+	uint64_t old;
+
+	do {
+		old = *slot;
+		if (old >= when)
+			return;
+	} while (!__sync_bool_compare_and_swap(slot, old, when));
+}
+
+/*
+ * Called after every change made through the library, with the node
+ * changed, or the directory whose entries changed.
+ */
+static void dir_attr_changed(struct fuse *f, fuse_ino_t nodeid)
+{
+	if (f->dir_attr)
+		dir_attr_mark(f->dir_attr, nodeid, dir_attr_now());
+}
+
+/*
+ * Called with f->lock held, when the node is deleted.  A later lookup
+ * gets a new nodeid, so changes to the node are charged to the parent.
+ */
+static void dir_attr_forget(struct fuse *f, struct node *node)
+{
+	struct dir_attr_table *t = f->dir_attr;
+
+	if (t != NULL && node->parent != NULL)
+		dir_attr_mark(t, node->parent->nodeid,
+			      t->changed[node->nodeid % DIR_ATTR_CHANGED_SIZE]);
+}
+
+static int dir_attr_valid(struct dir_attr_table *t, fuse_ino_t nodeid,
+			  uint64_t start)
+{
+	volatile uint64_t *slot = &t->changed[nodeid % DIR_ATTR_CHANGED_SIZE];
+
+	return *slot < start;
+}
+
+static void dir_attr_store(struct fuse *f, fuse_ino_t parent,
+			   const char *name, const struct stat *stbuf,
+			   uint64_t start)
+{
+	struct dir_attr_table *t = f->dir_attr;
+	struct dir_attr **ap;
+	struct dir_attr *a;
+	struct timespec now;
+	size_t len;
+
+	if (!dir_attr_valid(t, parent, start) || f->conf.attr_timeout <= 0 ||
+	    (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))))
+		return;
+
+	len = strlen(name);
+	a = (struct dir_attr *) malloc(sizeof(struct dir_attr) + len + 1);
+	if (a == NULL)
+		return;
+
+	a->parent = parent;
+	a->start = start;
+	a->stat = *stbuf;
+	memcpy(a->name, name, len + 1);
+	curr_time(&now);
+	a->stored = now;
+
+	pthread_mutex_lock(&t->lock);
+	dir_attr_expire(f, t, &now);
+	ap = dir_attr_find(t, parent, name);
+	if (*ap != NULL)
+		dir_attr_remove(t, ap);
+	a->next = t->array[dir_attr_hash(parent, name)];
+	t->array[dir_attr_hash(parent, name)] = a;
+	list_add_tail(&a->list, &t->list);
+	t->use++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* Returns non-zero if the attributes of the entry were found */
+static int dir_attr_take(struct fuse *f, fuse_ino_t parent, const char *name,
+			 struct stat *stbuf)
+{
+	struct dir_attr_table *t = f->dir_attr;
+	struct dir_attr **ap;
+	struct timespec now;
+	fuse_ino_t child = 0;
+	struct node *node;
+	int found = 0;
+
+	if (!t->use)
+		return 0;
+
+	/* The node may have been changed since, if the kernel knows it */
+	pthread_mutex_lock(&f->lock);
+	node = lookup_node_ino(f, parent, name, &child);
+	if (node != NULL)
+		child = node->nodeid;
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_mutex_lock(&t->lock);
+	if (t->use) {
+		ap = dir_attr_find(t, parent, name);
+		if (*ap != NULL) {
+			curr_time(&now);
+			if (dir_attr_valid(t, parent, (*ap)->start) &&
+			    (!child || dir_attr_valid(t, child, (*ap)->start)) &&
+			    diff_timespec(&now, &(*ap)->stored) <
+			    f->conf.attr_timeout) {
+				*stbuf = (*ap)->stat;
+				t->hits++;
+				found = 1;
+			}
+			dir_attr_remove(t, ap);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return found;
+}
+
+/*
+ * Reuse of read-only file handles.  With the handle_cache option, a
+ * handle the filesystem opened read-only is not released when the
+ * kernel releases it, but parked for handle_cache seconds.  An open of
+ * the same node with the same flags by the same user takes it over
+ * instead of calling open.  Parked handles are released by the cleanup
+ * run, and before the file is unlinked or replaced.
+ */
+#define HANDLE_HASH_SIZE 1024
+#define HANDLE_MAX_PARKED 1024
+
+struct handle {
+	struct handle *next;
+	struct list_head parked;	/* empty while the file is open */
+	struct node *node;
+	uid_t uid;
+	gid_t gid;
+	struct timespec released;
+	struct fuse_file_info fi;
+};
+
+struct handle_table {
+	struct handle *array[HANDLE_HASH_SIZE];
+	struct list_head parked;	/* oldest first */
+	unsigned int nparked;
+	uint64_t fs_opens;
+	uint64_t fs_releases;
+	uint64_t misses;	/* read-only opens which weren't reused */
+	uint64_t reuses;
+};
+
+static struct handle_table *handle_table_new(void)
+{
+	struct handle_table *t = calloc(1, sizeof(struct handle_table));
+
+	if (t == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		return NULL;
+	}
+	init_list_head(&t->parked);
+
+	return t;
+}
+
+/* Nodes are gone by now, handles don't drop their references */
+static void handle_table_free(struct handle_table *t)
+{
+	struct handle *h;
+	size_t i;
+
+	for (i = 0; i < HANDLE_HASH_SIZE; i++) {
+		while ((h = t->array[i]) != NULL) {
+			t->array[i] = h->next;
+			free(h);
+		}
+	}
+	free(t);
+}
+
+/* Called with f->lock held */
+static void handle_unhash(struct fuse *f, struct handle *h)
+{
+	struct handle_table *t = f->handles;
+	struct handle **hp = &t->array[h->node->nodeid % HANDLE_HASH_SIZE];
+
+	while (*hp != h)
+		hp = &(*hp)->next;
+	*hp = h->next;
+	h->next = NULL;
+
+	if (!list_empty(&h->parked)) {
+		list_del(&h->parked);
+		init_list_head(&h->parked);
+		t->nparked--;
+	}
+}
+
+/* Remember a handle the filesystem opened, before open_setup() */
+static void handle_opened(struct fuse *f, fuse_ino_t ino,
+			  const struct fuse_file_info *fi)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	struct handle_table *t = f->handles;
+	struct handle *h = NULL;
+	int rdonly = (fi->flags & O_ACCMODE) == O_RDONLY;
+
+	if (t == NULL)
+		return;
+
+	if (rdonly)
+		h = malloc(sizeof(struct handle));
+
+	pthread_mutex_lock(&f->lock);
+	t->fs_opens++;
+	if (rdonly)
+		t->misses++;
+	if (h != NULL) {
+		size_t hash = ino % HANDLE_HASH_SIZE;
+
+		h->node = get_node(f, ino);
+		h->node->refctr++;
+		h->uid = ctx->uid;
+		h->gid = ctx->gid;
+		h->fi = *fi;
+		h->fi.flags &= ~O_TRUNC;
+		init_list_head(&h->parked);
+		h->next = t->array[hash];
+		t->array[hash] = h;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* Returns non-zero if a parked handle was taken over */
+static int handle_reuse(struct fuse *f, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	struct handle_table *t = f->handles;
+	struct handle *h;
+	struct timespec now;
+	int found = 0;
+
+	if (t == NULL || (fi->flags & (O_ACCMODE | O_TRUNC)) != O_RDONLY)
+		return 0;
+
+	curr_time(&now);
+	pthread_mutex_lock(&f->lock);
+	for (h = t->array[ino % HANDLE_HASH_SIZE]; h != NULL; h = h->next) {
+		if (h->node->nodeid == ino && !list_empty(&h->parked) &&
+		    h->fi.flags == fi->flags && h->uid == ctx->uid &&
+		    h->gid == ctx->gid &&
+		    diff_timespec(&now, &h->released) < f->conf.handle_cache) {
+			list_del(&h->parked);
+			init_list_head(&h->parked);
+			t->nparked--;
+			t->reuses++;
+
+			fi->fh = h->fi.fh;
+			fi->fh_old = h->fi.fh_old;
+			fi->direct_io = h->fi.direct_io;
+			fi->keep_cache = h->fi.keep_cache;
+			fi->nonseekable = h->fi.nonseekable;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return found;
+}
+
+/* Returns non-zero if the handle was parked instead of released */
+static int handle_park(struct fuse *f, fuse_ino_t ino,
+		       const struct fuse_file_info *fi)
+{
+	struct handle_table *t = f->handles;
+	struct handle *h;
+
+	if (t == NULL)
+		return 0;
+
+	pthread_mutex_lock(&f->lock);
+	for (h = t->array[ino % HANDLE_HASH_SIZE]; h != NULL; h = h->next) {
+		if (h->node->nodeid == ino && list_empty(&h->parked) &&
+		    h->fi.fh == fi->fh)
+			break;
+	}
+	if (h != NULL && !fi->flock_release && !h->node->is_hidden &&
+	    t->nparked < HANDLE_MAX_PARKED) {
+		curr_time(&h->released);
+		list_add_tail(&h->parked, &t->parked);
+		t->nparked++;
+		pthread_mutex_unlock(&f->lock);
+		return 1;
+	}
+	if (h != NULL) {
+		handle_unhash(f, h);
+		unref_node(f, h->node);
+	}
+	t->fs_releases++;
+	pthread_mutex_unlock(&f->lock);
+	free(h);
+
+	return 0;
+}
+
+/* Release a handle taken off the table, 'path' is looked up if NULL */
+static void handle_release(struct fuse *f, struct handle *h, const char *path)
+{
+	fuse_ino_t ino = h->node->nodeid;
+	char *tmppath = NULL;
+
+	if (path == NULL) {
+		get_path_nullok(f, ino, &tmppath);
+		path = tmppath;
+	}
+	if (path == NULL && !f->nullpath_ok && !f->conf.nopath)
+		path = "-";
+
+	fuse_fs_release(f->fs, path, &h->fi);
+	free_path(f, ino, tmppath);
+
+	pthread_mutex_lock(&f->lock);
+	unref_node(f, h->node);
+	f->handles->fs_releases++;
+	pthread_mutex_unlock(&f->lock);
+	free(h);
+}
+
+/* Release parked handles of 'node', 'path' is locked by the caller */
+static void handle_drop(struct fuse *f, struct node *node, const char *path)
+{
+	struct handle_table *t = f->handles;
+	struct handle *list = NULL;
+	struct handle **hp;
+	struct handle *h;
+
+	if (t == NULL || node == NULL)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	hp = &t->array[node->nodeid % HANDLE_HASH_SIZE];
+	while ((h = *hp) != NULL) {
+		if (h->node == node && !list_empty(&h->parked)) {
+			handle_unhash(f, h);
+			h->next = list;
+			list = h;
+		} else {
+			hp = &h->next;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	while ((h = list) != NULL) {
+		list = h->next;
+		handle_release(f, h, path);
+	}
+}
+
+/* Release handles parked for longer than handle_cache, or all of them */
+static void handle_expire(struct fuse *f, int all)
+{
+	struct handle_table *t = f->handles;
+	struct handle *list = NULL;
+	struct handle **tail = &list;
+	struct timespec now;
+
+	if (t == NULL)
+		return;
+
+	curr_time(&now);
+	pthread_mutex_lock(&f->lock);
+	while (!list_empty(&t->parked)) {
+		struct handle *h = list_entry(t->parked.next, struct handle,
+					      parked);
+
+		if (!all &&
+		    diff_timespec(&now, &h->released) < f->conf.handle_cache)
+			break;
+		handle_unhash(f, h);
+		*tail = h;
+		tail = &h->next;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (list != NULL && !all) {
+		struct fuse_context_i *c = fuse_get_context_internal();
+
+		memset(c, 0, sizeof(*c));
+		c->ctx.fuse = f;
+	}
+	while (list != NULL) {
+		struct handle *h = list;
+
+		list = h->next;
+		handle_release(f, h, NULL);
+	}
+}
+
+static struct fuse *req_fuse_prepare(fuse_req_t req)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	c->req = req;
+	c->ctx.fuse = req_fuse(req);
+	c->ctx.uid = ctx->uid;
+	c->ctx.gid = ctx->gid;
+	c->ctx.pid = ctx->pid;
+	c->ctx.umask = ctx->umask;
+	if (c->ctx.fuse->warm)
+		warm_foreground(c->ctx.fuse);
+	return c->ctx.fuse;
+}
+
+static inline void reply_err(fuse_req_t req, int err)
+{
+	/* fuse_reply_err() uses non-negated errno values */
+	fuse_reply_err(req, -err);
+}
+
+static void reply_entry(fuse_req_t req, const struct fuse_entry_param *e,
+			int err)
+{
+	if (!err) {
+		struct fuse *f = req_fuse(req);
+		if (fuse_reply_entry(req, e) == -ENOENT) {
+			/* Skip forget for negative result */
+			if  (e->ino != 0)
+				forget_node(f, e->ino, 1);
+		}
+	} else
+		reply_err(req, err);
+}
+
+enum fuse_async_op {
+	ASYNC_LOOKUP,
+	ASYNC_GETATTR,
+	ASYNC_OPEN,
+	ASYNC_READ,
+	ASYNC_WRITE,
+};
+
+/*
+ * State of a request which has been handed to an asynchronous
+ * operation.  The path lock is held until the filesystem completes it.
+ */
+struct fuse_async {
+	struct fuse *f;
+	fuse_req_t req;
+	enum fuse_async_op op;
+	fuse_ino_t nodeid;
+	char *path;
+	char *name;
+	struct node *dot;
+	struct fuse_file_info fi;
+	struct fuse_file_info *fip;
+	void *mem;
+};
+
+static struct fuse_async *fuse_async_new(struct fuse *f, fuse_req_t req,
+					 enum fuse_async_op op,
+					 fuse_ino_t nodeid, char *path,
+					 const struct fuse_file_info *fi)
+{
+	struct fuse_async *a;
+
+	a = (struct fuse_async *) calloc(1, sizeof(struct fuse_async));
+	if (a == NULL) {
+		fprintf(stderr, "fuse: failed to allocate async request\n");
+		return NULL;
+	}
+	a->f = f;
+	a->req = req;
+	a->op = op;
+	a->nodeid = nodeid;
+	a->path = path;
+	if (fi) {
+		a->fi = *fi;
+		a->fip = &a->fi;
+	}
+	return a;
+}
+
+static void fuse_async_free(struct fuse_async *a)
+{
+	free(a->name);
+	free(a->mem);
+	free(a);
+}
+
+/*
+ * Completion may happen on any thread, possibly one which is itself
+ * inside a filesystem operation, so install the context of the
+ * completed request and restore the original one afterwards.
+ */
+static void fuse_async_enter(struct fuse_async *a,
+			     struct fuse_context_i *saved)
+{
+	struct fuse_context_i *c = fuse_get_context_internal();
+
+	*saved = *c;
+	req_fuse_prepare(a->req);
+	c->ctx.private_data = a->f->fs->user_data;
+}
+
+static void fuse_async_leave(struct fuse_context_i *saved)
+{
+	*fuse_get_context_internal() = *saved;
+}
+
+static void fuse_async_getattr(struct fuse_async *a)
+{
+	struct fuse_fs *fs = a->f->fs;
+
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->debug)
+		fprintf(stderr, "getattr_async %s\n", a->path);
+
+	fs->op.getattr_async(a->path, a->fip, a);
+}
+
+int fuse_async_interrupted(struct fuse_async *a)
+{
+	return fuse_req_interrupted(a->req);
+}
+
+void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (!fs->op.write_buf)
+		conn->want &= ~FUSE_CAP_SPLICE_READ;
+	if (!fs->op.lock)
+		conn->want &= ~FUSE_CAP_POSIX_LOCKS;
+	if (!fs->op.flock)
+		conn->want &= ~FUSE_CAP_FLOCK_LOCKS;
+#ifdef __APPLE__
+	if (!fs->op.renamex)
+		conn->want &= ~(FUSE_CAP_RENAME_SWAP | FUSE_CAP_RENAME_EXCL);
+	if (!fs->op.fallocate)
+		conn->want &= ~FUSE_CAP_ALLOCATE;
+	if (!fs->op.exchange)
+		conn->want &= ~FUSE_CAP_EXCHANGE_DATA;
+	if (!fs->op.setvolname)
+		conn->want &= ~FUSE_CAP_VOL_RENAME;
+	if (!fs->op.getxtimes)
+		conn->want &= ~FUSE_CAP_XTIMES;
+#endif /* __APPLE__ */
+	if (fs->op.init)
+		fs->user_data = fs->op.init(conn);
+}
+
+static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
+{
+	struct fuse *f = (struct fuse *) data;
+	struct fuse_context_i *c = fuse_get_context_internal();
+
+	memset(c, 0, sizeof(*c));
+	c->ctx.fuse = f;
+	conn->want |= FUSE_CAP_EXPORT_SUPPORT;
+	fuse_fs_init(f->fs, conn);
+	if (f->warm)
+		warm_start(f);
+}
+
+void fuse_fs_destroy(struct fuse_fs *fs)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.destroy)
+		fs->op.destroy(fs->user_data);
+	if (fs->m)
+		fuse_put_module(fs->m);
+	free(fs);
+}
+
+static void fuse_lib_destroy(void *data)
+{
+	struct fuse *f = (struct fuse *) data;
+	struct fuse_context_i *c = fuse_get_context_internal();
+
+	memset(c, 0, sizeof(*c));
+	c->ctx.fuse = f;
+	warm_stop(f);
+	handle_expire(f, 1);
+	fuse_fs_destroy(f->fs);
+	f->fs = NULL;
+}
+
+static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
+			    const char *name)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	struct fuse_entry_param e;
+	char *path;
+	int err;
+	struct node *dot = NULL;
+
+	if (name[0] == '.') {
+		int len = strlen(name);
+
+		if (len == 1 || (name[1] == '.' && len == 2)) {
+			pthread_mutex_lock(&f->lock);
+			if (len == 1) {
+				if (f->conf.debug)
+					fprintf(stderr, "LOOKUP-DOT\n");
+				dot = get_node_nocheck(f, parent);
+				if (dot == NULL) {
 					pthread_mutex_unlock(&f->lock);
 					reply_entry(req, &e, -ESTALE);
 					return;
@@ -3097,12 +5380,47 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 	}
 
 	err = get_path_name(f, parent, name, &path);
-	if (!err) {
+	if (!err && name != NULL && f->dir_attr &&
+	    dir_attr_take(f, parent, name, &e.attr)) {
+		struct stat attr = e.attr;
+
+		if (f->conf.debug)
+			fprintf(stderr, "LOOKUP %s (readdir attributes)\n", path);
+		memset(&e, 0, sizeof(e));
+		e.attr = attr;
+		err = lookup_entry(f, parent, name, &e);
+		if (!err && f->warm)
+			warm_lookup(f, path, e.ino);
+		free_path(f, parent, path);
+	} else if (!err && f->fs->op.getattr_async) {
+		struct fuse_async *a;
+
+		if (f->conf.debug)
+			fprintf(stderr, "LOOKUP %s\n", path);
+		a = fuse_async_new(f, req, ASYNC_LOOKUP, parent, path,
+				   NULL);
+		if (a != NULL && name != NULL) {
+			a->name = strdup(name);
+			if (a->name == NULL) {
+				fuse_async_free(a);
+				a = NULL;
+			}
+		}
+		if (a != NULL) {
+			a->dot = dot;
+			fuse_async_getattr(a);
+			return;
+		}
+		free_path(f, parent, path);
+		err = -ENOMEM;
+	} else if (!err) {
 		struct fuse_intr_data d;
 		if (f->conf.debug)
 			fprintf(stderr, "LOOKUP %s\n", path);
 		fuse_prepare_interrupt(f, req, &d);
 		err = lookup_path(f, parent, name, path, &e, NULL);
+		if (!err && f->warm && name != NULL)
+			warm_lookup(f, path, e.ino);
 		if (err == -ENOENT && f->conf.negative_timeout != 0.0) {
 			e.ino = 0;
 			e.entry_timeout = f->conf.negative_timeout;
@@ -3117,6 +5435,7 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
 		pthread_mutex_unlock(&f->lock);
 	}
 	reply_entry(req, &e, err);
+	warm_lookup_replied(f);
 }
 
 static void do_forget(struct fuse *f, fuse_ino_t ino, uint64_t nlookup)
@@ -3134,19 +5453,46 @@ static void fuse_lib_forget(fuse_req_t req, fuse_ino_t ino,
 	fuse_reply_none(req);
 }
 
+/* The whole batch is forgotten under one acquisition of the lock */
 static void fuse_lib_forget_multi(fuse_req_t req, size_t count,
 				  struct fuse_forget_data *forgets)
 {
 	struct fuse *f = req_fuse(req);
 	size_t i;
 
-	for (i = 0; i < count; i++)
-		do_forget(f, forgets[i].ino, forgets[i].nlookup);
+	pthread_mutex_lock(&f->lock);
+	for (i = 0; i < count; i++) {
+		if (f->conf.debug)
+			fprintf(stderr, "FORGET %llu/%llu\n",
+				(unsigned long long) forgets[i].ino,
+				(unsigned long long) forgets[i].nlookup);
+		forget_node_locked(f, forgets[i].ino, forgets[i].nlookup);
+	}
+	pthread_mutex_unlock(&f->lock);
 
 	fuse_reply_none(req);
 }
 
 
+static void reply_attr(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+		       struct stat *buf, int err)
+{
+	if (!err) {
+		struct node *node;
+
+		pthread_mutex_lock(&f->lock);
+		node = get_node(f, ino);
+		if (node->is_hidden && buf->st_nlink > 0)
+			buf->st_nlink--;
+		if (f->conf.auto_cache)
+			update_stat(node, buf);
+		pthread_mutex_unlock(&f->lock);
+		set_stat(f, ino, buf);
+		fuse_reply_attr(req, buf, f->conf.attr_timeout);
+	} else
+		reply_err(req, err);
+}
+
 static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 			     struct fuse_file_info *fi)
 {
@@ -3157,11 +5503,22 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 
 	memset(&buf, 0, sizeof(buf));
 
-	if (fi != NULL && f->fs->op.fgetattr)
+	if (fi != NULL &&
+	    (f->fs->op.fgetattr || f->fs->op.getattr_async))
 		err = get_path_nullok(f, ino, &path);
 	else
 		err = get_path(f, ino, &path);
-	if (!err) {
+	if (!err && f->fs->op.getattr_async) {
+		struct fuse_async *a;
+
+		a = fuse_async_new(f, req, ASYNC_GETATTR, ino, path, fi);
+		if (a != NULL) {
+			fuse_async_getattr(a);
+			return;
+		}
+		free_path(f, ino, path);
+		err = -ENOMEM;
+	} else if (!err) {
 		struct fuse_intr_data d;
 		fuse_prepare_interrupt(f, req, &d);
 		if (fi)
@@ -3171,20 +5528,23 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
 	}
-	if (!err) {
-		struct node *node;
+	reply_attr(f, req, ino, &buf, err);
+}
 
-		pthread_mutex_lock(&f->lock);
-		node = get_node(f, ino);
-		if (node->is_hidden && buf.st_nlink > 0)
-			buf.st_nlink--;
-		if (f->conf.auto_cache)
-			update_stat(node, &buf);
-		pthread_mutex_unlock(&f->lock);
-		set_stat(f, ino, &buf);
-		fuse_reply_attr(req, &buf, f->conf.attr_timeout);
+int fuse_fs_setattr(struct fuse_fs *fs, const char *path,
+		    const struct stat *attr, int valid, struct stat *stbuf,
+		    struct fuse_file_info *fi)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.setattr) {
+		if (fs->debug)
+			fprintf(stderr, "setattr[%llu] %s valid: 0x%x\n",
+				fi ? (unsigned long long) fi->fh : 0,
+				path ? path : "-", valid);
+
+		return fs->op.setattr(path, attr, valid, stbuf, fi);
 	} else
-		reply_err(req, err);
+		return -ENOSYS;
 }
 
 int fuse_fs_chmod(struct fuse_fs *fs, const char *path, mode_t mode)
@@ -3289,6 +5649,7 @@ static void fuse_lib_setattr_x(fuse_req_t req, fuse_ino_t ino,
 				err = fuse_fs_getattr(f->fs, path, &buf);
 		}
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, ino);
 		free_path(f, ino, path);
 	}
 	if (!err) {
@@ -3305,123 +5666,137 @@ static void fuse_lib_setattr_x(fuse_req_t req, fuse_ino_t ino,
 
 #endif /* __APPLE__ */
 
-static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
-			     int valid, struct fuse_file_info *fi)
+/* Split a setattr into calls of the individual operations */
+static int setattr_split(struct fuse *f, const char *path, struct stat *attr,
+			 int valid, struct stat *buf,
+			 struct fuse_file_info *fi)
 {
-	struct fuse *f = req_fuse_prepare(req);
-	struct stat buf;
-	char *path;
-	int err;
+	int err = 0;
 
-	memset(&buf, 0, sizeof(buf));
-	if (valid == FUSE_SET_ATTR_SIZE && fi != NULL &&
-	    f->fs->op.ftruncate && f->fs->op.fgetattr)
-		err = get_path_nullok(f, ino, &path);
-	else
-		err = get_path(f, ino, &path);
-	if (!err) {
-		struct fuse_intr_data d;
-		fuse_prepare_interrupt(f, req, &d);
-		err = 0;
 #ifdef __APPLE__
-		if (!err && (valid & FUSE_SET_ATTR_FLAGS)) {
-			err = fuse_fs_chflags(f->fs, path, attr->st_flags);
-			if (err == -ENOSYS)
-				err = 0;
-		}
-		if (!err && (valid & FUSE_SET_ATTR_BKUPTIME)) {
-			struct timespec tv;
-			tv.tv_sec = (uint64_t)(attr->st_qspare[0]);
-			tv.tv_nsec = (uint32_t)(attr->st_lspare);
-			err = fuse_fs_setbkuptime(f->fs, path, &tv);
-		}
-		if (!err && (valid & FUSE_SET_ATTR_CHGTIME)) {
-			struct timespec tv;
-			tv.tv_sec = (uint64_t)(attr->st_ctime);
-			tv.tv_nsec = (uint32_t)(attr->st_ctimensec);
-			err = fuse_fs_setchgtime(f->fs, path, &tv);
-		}
-		if (!err && (valid & FUSE_SET_ATTR_CRTIME)) {
-			struct timespec tv;
-			tv.tv_sec = (uint64_t)(attr->st_qspare[1]);
-			tv.tv_nsec = (uint32_t)(attr->st_gen);
-			err = fuse_fs_setcrtime(f->fs, path, &tv);
-		}
+	if (!err && (valid & FUSE_SET_ATTR_FLAGS)) {
+		err = fuse_fs_chflags(f->fs, path, attr->st_flags);
+		if (err == -ENOSYS)
+			err = 0;
+	}
+	if (!err && (valid & FUSE_SET_ATTR_BKUPTIME)) {
+		struct timespec tv;
+		tv.tv_sec = (uint64_t)(attr->st_qspare[0]);
+		tv.tv_nsec = (uint32_t)(attr->st_lspare);
+		err = fuse_fs_setbkuptime(f->fs, path, &tv);
+	}
+	if (!err && (valid & FUSE_SET_ATTR_CHGTIME)) {
+		struct timespec tv;
+		tv.tv_sec = (uint64_t)(attr->st_ctime);
+		tv.tv_nsec = (uint32_t)(attr->st_ctimensec);
+		err = fuse_fs_setchgtime(f->fs, path, &tv);
+	}
+	if (!err && (valid & FUSE_SET_ATTR_CRTIME)) {
+		struct timespec tv;
+		tv.tv_sec = (uint64_t)(attr->st_qspare[1]);
+		tv.tv_nsec = (uint32_t)(attr->st_gen);
+		err = fuse_fs_setcrtime(f->fs, path, &tv);
+	}
 #endif /* __APPLE__ */
-		if (!err && (valid & FUSE_SET_ATTR_MODE))
-			err = fuse_fs_chmod(f->fs, path, attr->st_mode);
-		if (!err && (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
-			uid_t uid = (valid & FUSE_SET_ATTR_UID) ?
-				attr->st_uid : (uid_t) -1;
-			gid_t gid = (valid & FUSE_SET_ATTR_GID) ?
-				attr->st_gid : (gid_t) -1;
-			err = fuse_fs_chown(f->fs, path, uid, gid);
-		}
-		if (!err && (valid & FUSE_SET_ATTR_SIZE)) {
-			if (fi)
-				err = fuse_fs_ftruncate(f->fs, path,
-							attr->st_size, fi);
-			else
-				err = fuse_fs_truncate(f->fs, path,
-						       attr->st_size);
-		}
+	if (!err && (valid & FUSE_SET_ATTR_MODE))
+		err = fuse_fs_chmod(f->fs, path, attr->st_mode);
+	if (!err && (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (valid & FUSE_SET_ATTR_UID) ?
+			attr->st_uid : (uid_t) -1;
+		gid_t gid = (valid & FUSE_SET_ATTR_GID) ?
+			attr->st_gid : (gid_t) -1;
+		err = fuse_fs_chown(f->fs, path, uid, gid);
+	}
+	if (!err && (valid & FUSE_SET_ATTR_SIZE)) {
+		if (fi)
+			err = fuse_fs_ftruncate(f->fs, path,
+						attr->st_size, fi);
+		else
+			err = fuse_fs_truncate(f->fs, path,
+					       attr->st_size);
+	}
 #ifdef HAVE_UTIMENSAT
-		if (!err && f->utime_omit_ok &&
-		    (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
-			struct timespec tv[2];
-
-			tv[0].tv_sec = 0;
-			tv[1].tv_sec = 0;
-			tv[0].tv_nsec = UTIME_OMIT;
-			tv[1].tv_nsec = UTIME_OMIT;
-
-			if (valid & FUSE_SET_ATTR_ATIME_NOW)
-				tv[0].tv_nsec = UTIME_NOW;
-			else if (valid & FUSE_SET_ATTR_ATIME) {
-				tv[0].tv_sec = attr->st_atime;
-				tv[0].tv_nsec = ST_ATIM_NSEC(attr);
-			}
-
-			if (valid & FUSE_SET_ATTR_MTIME_NOW)
-				tv[1].tv_nsec = UTIME_NOW;
-			else if (valid & FUSE_SET_ATTR_MTIME) {
-				tv[1].tv_sec = attr->st_mtime;
-				tv[1].tv_nsec = ST_MTIM_NSEC(attr);
-			}
-
-			err = fuse_fs_utimens(f->fs, path, tv);
-		} else
-#endif
-		if (!err &&
-		    (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) ==
-		    (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
-			struct timespec tv[2];
+	if (!err && f->utime_omit_ok &&
+	    (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec tv[2];
+
+		tv[0].tv_sec = 0;
+		tv[1].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1].tv_nsec = UTIME_OMIT;
+
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME) {
 			tv[0].tv_sec = attr->st_atime;
 			tv[0].tv_nsec = ST_ATIM_NSEC(attr);
-			tv[1].tv_sec = attr->st_mtime;
-			tv[1].tv_nsec = ST_MTIM_NSEC(attr);
-			err = fuse_fs_utimens(f->fs, path, tv);
 		}
-#ifdef __APPLE__
-		else if (!err && (valid & FUSE_SET_ATTR_MTIME)) {
-			struct timeval now;
-			gettimeofday(&now, NULL);
 
-			struct timespec tv[2];
-			tv[0].tv_sec = now.tv_sec;
-			tv[0].tv_nsec = now.tv_usec * 1000;
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME) {
 			tv[1].tv_sec = attr->st_mtime;
 			tv[1].tv_nsec = ST_MTIM_NSEC(attr);
-			err = fuse_fs_utimens(f->fs, path, tv);
 		}
+
+		err = fuse_fs_utimens(f->fs, path, tv);
+	} else
+#endif
+	if (!err &&
+	    (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) ==
+	    (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+		tv[0].tv_sec = attr->st_atime;
+		tv[0].tv_nsec = ST_ATIM_NSEC(attr);
+		tv[1].tv_sec = attr->st_mtime;
+		tv[1].tv_nsec = ST_MTIM_NSEC(attr);
+		err = fuse_fs_utimens(f->fs, path, tv);
+	}
+#ifdef __APPLE__
+	else if (!err && (valid & FUSE_SET_ATTR_MTIME)) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+
+		struct timespec tv[2];
+		tv[0].tv_sec = now.tv_sec;
+		tv[0].tv_nsec = now.tv_usec * 1000;
+		tv[1].tv_sec = attr->st_mtime;
+		tv[1].tv_nsec = ST_MTIM_NSEC(attr);
+		err = fuse_fs_utimens(f->fs, path, tv);
+	}
 #endif /* __APPLE__ */
-		if (!err) {
-			if (fi)
-				err = fuse_fs_fgetattr(f->fs, path, &buf, fi);
-			else
-				err = fuse_fs_getattr(f->fs, path, &buf);
-		}
+	if (!err) {
+		if (fi)
+			err = fuse_fs_fgetattr(f->fs, path, buf, fi);
+		else
+			err = fuse_fs_getattr(f->fs, path, buf);
+	}
+
+	return err;
+}
+
+static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			     int valid, struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	struct stat buf;
+	char *path;
+	int err;
+
+	memset(&buf, 0, sizeof(buf));
+	if (valid == FUSE_SET_ATTR_SIZE && fi != NULL &&
+	    f->fs->op.ftruncate && f->fs->op.fgetattr)
+		err = get_path_nullok(f, ino, &path);
+	else
+		err = get_path(f, ino, &path);
+	if (!err) {
+		struct fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = fuse_fs_setattr(f->fs, path, attr, valid, &buf, fi);
+		if (err == -ENOSYS)
+			err = setattr_split(f, path, attr, valid, &buf, fi);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, ino);
 		free_path(f, ino, path);
 	}
 	if (!err) {
@@ -3487,28 +5862,39 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 	err = get_path_name(f, parent, name, &path);
 	if (!err) {
 		struct fuse_intr_data d;
+		int have_attr;
 
 		fuse_prepare_interrupt(f, req, &d);
+		memset(&e, 0, sizeof(e));
 		err = -ENOSYS;
 		if (S_ISREG(mode)) {
 			struct fuse_file_info fi;
 
 			memset(&fi, 0, sizeof(fi));
 			fi.flags = O_CREAT | O_EXCL | O_WRONLY;
-			err = fuse_fs_create(f->fs, path, mode, &fi);
+			err = fuse_fs_create_attr(f->fs, path, mode, &fi,
+						  &e.attr);
+			have_attr = !err;
+			if (err == -ENOSYS)
+				err = fuse_fs_create(f->fs, path, mode, &fi);
 			if (!err) {
-				err = lookup_path(f, parent, name, path, &e,
-						  &fi);
+				err = lookup_created(f, parent, name, path, &e,
+						     &fi, have_attr);
 				fuse_fs_release(f->fs, path, &fi);
 			}
 		}
 		if (err == -ENOSYS) {
-			err = fuse_fs_mknod(f->fs, path, mode, rdev);
+			err = fuse_fs_mknod_attr(f->fs, path, mode, rdev,
+						 &e.attr);
+			have_attr = !err;
+			if (err == -ENOSYS)
+				err = fuse_fs_mknod(f->fs, path, mode, rdev);
 			if (!err)
-				err = lookup_path(f, parent, name, path, &e,
-						  NULL);
+				err = lookup_created(f, parent, name, path, &e,
+						     NULL, have_attr);
 		}
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, parent);
 		free_path(f, parent, path);
 	}
 	reply_entry(req, &e, err);
@@ -3525,12 +5911,19 @@ static void fuse_lib_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 	err = get_path_name(f, parent, name, &path);
 	if (!err) {
 		struct fuse_intr_data d;
+		int have_attr;
 
 		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_mkdir(f->fs, path, mode);
+		memset(&e, 0, sizeof(e));
+		err = fuse_fs_mkdir_attr(f->fs, path, mode, &e.attr);
+		have_attr = !err;
+		if (err == -ENOSYS)
+			err = fuse_fs_mkdir(f->fs, path, mode);
 		if (!err)
-			err = lookup_path(f, parent, name, path, &e, NULL);
+			err = lookup_created(f, parent, name, path, &e, NULL,
+					     have_attr);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, parent);
 		free_path(f, parent, path);
 	}
 	reply_entry(req, &e, err);
@@ -3549,6 +5942,7 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
 		struct fuse_intr_data d;
 
 		fuse_prepare_interrupt(f, req, &d);
+		handle_drop(f, wnode, path);
 		if (!f->conf.hard_remove && is_open(f, parent, name)) {
 			err = hide_node(f, path, parent, name);
 		} else {
@@ -3557,6 +5951,9 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
 				remove_node(f, parent, name);
 		}
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, parent);
+		if (wnode != NULL)
+			dir_attr_changed(f, wnode->nodeid);
 		free_path_wrlock(f, parent, wnode, path);
 	}
 	reply_err(req, err);
@@ -3576,6 +5973,9 @@ static void fuse_lib_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_rmdir(f->fs, path);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, parent);
+		if (wnode != NULL)
+			dir_attr_changed(f, wnode->nodeid);
 		if (!err)
 			remove_node(f, parent, name);
 		free_path_wrlock(f, parent, wnode, path);
@@ -3594,12 +5994,19 @@ static void fuse_lib_symlink(fuse_req_t req, const char *linkname,
 	err = get_path_name(f, parent, name, &path);
 	if (!err) {
 		struct fuse_intr_data d;
+		int have_attr;
 
 		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_symlink(f->fs, linkname, path);
+		memset(&e, 0, sizeof(e));
+		err = fuse_fs_symlink_attr(f->fs, linkname, path, &e.attr);
+		have_attr = !err;
+		if (err == -ENOSYS)
+			err = fuse_fs_symlink(f->fs, linkname, path);
 		if (!err)
-			err = lookup_path(f, parent, name, path, &e, NULL);
+			err = lookup_created(f, parent, name, path, &e, NULL,
+					     have_attr);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, parent);
 		free_path(f, parent, path);
 	}
 	reply_entry(req, &e, err);
@@ -3622,15 +6029,18 @@ static void fuse_lib_rename(fuse_req_t req, fuse_ino_t olddir,
 		struct fuse_intr_data d;
 		err = 0;
 		fuse_prepare_interrupt(f, req, &d);
+		handle_drop(f, wnode2, newpath);
 		if (!f->conf.hard_remove && is_open(f, newdir, newname))
 			err = hide_node(f, newpath, newdir, newname);
 		if (!err) {
 			err = fuse_fs_rename(f->fs, oldpath, newpath);
 			if (!err)
-				err = rename_node(f, olddir, oldname, newdir,
-						  newname, 0);
+				err = rename_node(f, wnode1, olddir, oldname,
+						  newdir, newname, 0);
 		}
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, olddir);
+		dir_attr_changed(f, newdir);
 		free_path2(f, olddir, newdir, wnode1, wnode2, oldpath, newpath);
 	}
 	reply_err(req, err);
@@ -3664,6 +6074,8 @@ static void fuse_lib_renamex(fuse_req_t req, fuse_ino_t dir1, const char *name1,
 		fuse_prepare_interrupt(f, req, &d);
 		if ((flags & RENAME_EXCL) && wnode2)
 			err = EEXIST;
+		if (!err && !(flags & RENAME_SWAP))
+			handle_drop(f, wnode2, path2);
 		if (!err && !(flags & RENAME_SWAP) && !f->conf.hard_remove
 		    && is_open(f, dir2, name2))
 			err = hide_node(f, path2, dir2, name2);
@@ -3674,11 +6086,14 @@ static void fuse_lib_renamex(fuse_req_t req, fuse_ino_t dir1, const char *name1,
 					err = swap_nodes(f, dir1, name1, dir2,
 							 name2);
 				else
-					err = rename_node(f, dir1, name1, dir2,
-							  name2, 0);
+					err = rename_node(f, wnode1, dir1,
+							  name1, dir2, name2,
+							  0);
 			}
 		}
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, dir1);
+		dir_attr_changed(f, dir2);
 		free_path2(f, dir1, dir2, wnode1, wnode2, path1, path2);
 	}
 	reply_err(req, err);
@@ -3722,6 +6137,8 @@ static void fuse_lib_exchange(fuse_req_t req, fuse_ino_t dir1,
 		if (!err)
 			err = exchange_node(f, dir1, name1, dir2, name2);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, dir1);
+		dir_attr_changed(f, dir2);
 		free_path2(f, dir1, dir2, wnode1, wnode2, path1, path2);
 	}
 	reply_err(req, err);
@@ -3769,13 +6186,20 @@ static void fuse_lib_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
 			&oldpath, &newpath, NULL, NULL);
 	if (!err) {
 		struct fuse_intr_data d;
+		int have_attr;
 
 		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_link(f->fs, oldpath, newpath);
+		memset(&e, 0, sizeof(e));
+		err = fuse_fs_link_attr(f->fs, oldpath, newpath, &e.attr);
+		have_attr = !err;
+		if (err == -ENOSYS)
+			err = fuse_fs_link(f->fs, oldpath, newpath);
 		if (!err)
-			err = lookup_path(f, newparent, newname, newpath,
-					  &e, NULL);
+			err = lookup_created(f, newparent, newname, newpath,
+					     &e, NULL, have_attr);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, ino);
+		dir_attr_changed(f, newparent);
 		free_path2(f, ino, newparent, NULL, NULL, oldpath, newpath);
 	}
 	reply_entry(req, &e, err);
@@ -3793,7 +6217,8 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
 	else
 		compatpath = "-";
 
-	fuse_fs_release(f->fs, compatpath, fi);
+	if (!handle_park(f, ino, fi))
+		fuse_fs_release(f->fs, compatpath, fi);
 
 	pthread_mutex_lock(&f->lock);
 	node = get_node(f, ino);
@@ -3831,10 +6256,17 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 
 	err = get_path_name(f, parent, name, &path);
 	if (!err) {
+		int have_attr;
+
 		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_create(f->fs, path, mode, fi);
+		memset(&e, 0, sizeof(e));
+		err = fuse_fs_create_attr(f->fs, path, mode, fi, &e.attr);
+		have_attr = !err;
+		if (err == -ENOSYS)
+			err = fuse_fs_create(f->fs, path, mode, fi);
 		if (!err) {
-			err = lookup_path(f, parent, name, path, &e, fi);
+			err = lookup_created(f, parent, name, path, &e, fi,
+					     have_attr);
 			if (err)
 				fuse_fs_release(f->fs, path, fi);
 			else if (!S_ISREG(e.attr.st_mode)) {
@@ -3842,6 +6274,7 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 				fuse_fs_release(f->fs, path, fi);
 				forget_node(f, e.ino, 1);
 			} else {
+				handle_opened(f, e.ino, fi);
 				if (f->conf.direct_io)
 					fi->direct_io = 1;
 				if (f->conf.kernel_cache)
@@ -3850,6 +6283,7 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 			}
 		}
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, parent);
 	}
 	if (!err) {
 		pthread_mutex_lock(&f->lock);
@@ -3919,6 +6353,37 @@ static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
 	pthread_mutex_unlock(&f->lock);
 }
 
+static void open_setup(struct fuse *f, fuse_ino_t ino, const char *path,
+		       struct fuse_file_info *fi)
+{
+	if (f->conf.direct_io)
+		fi->direct_io = 1;
+	if (f->conf.kernel_cache)
+		fi->keep_cache = 1;
+
+	if (f->conf.auto_cache)
+		open_auto_cache(f, ino, path, fi);
+
+	if (fi->flags & O_TRUNC)
+		dir_attr_changed(f, ino);
+}
+
+static void reply_open(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+		       const char *path, struct fuse_file_info *fi, int err)
+{
+	if (!err) {
+		pthread_mutex_lock(&f->lock);
+		get_node(f, ino)->open_count++;
+		pthread_mutex_unlock(&f->lock);
+		if (fuse_reply_open(req, fi) == -ENOENT) {
+			/* The open syscall was interrupted, so it
+			   must be cancelled */
+			fuse_do_release(f, ino, path, fi);
+		}
+	} else
+		reply_err(req, err);
+}
+
 static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 			  struct fuse_file_info *fi)
 {
@@ -3928,33 +6393,278 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 	int err;
 
 	err = get_path(f, ino, &path);
-	if (!err) {
+	if (!err && handle_reuse(f, ino, fi)) {
+		open_setup(f, ino, path, fi);
+	} else if (!err && f->fs->op.open_async) {
+		struct fuse_async *a;
+
+		a = fuse_async_new(f, req, ASYNC_OPEN, ino, path, fi);
+		if (a != NULL) {
+			if (f->fs->debug)
+				fprintf(stderr, "open_async flags: 0x%x %s\n",
+					fi->flags, path);
+			f->fs->op.open_async(path, a->fip, a);
+			return;
+		}
+		err = -ENOMEM;
+	} else if (!err) {
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_open(f->fs, path, fi);
 		if (!err) {
-			if (f->conf.direct_io)
-				fi->direct_io = 1;
-			if (f->conf.kernel_cache)
-				fi->keep_cache = 1;
-
-			if (f->conf.auto_cache)
-				open_auto_cache(f, ino, path, fi);
+			handle_opened(f, ino, fi);
+			open_setup(f, ino, path, fi);
 		}
 		fuse_finish_interrupt(f, req, &d);
 	}
-	if (!err) {
-		pthread_mutex_lock(&f->lock);
-		get_node(f, ino)->open_count++;
-		pthread_mutex_unlock(&f->lock);
-		if (fuse_reply_open(req, fi) == -ENOENT) {
-			/* The open syscall was interrupted, so it
-			   must be cancelled */
-			fuse_do_release(f, ino, path, fi);
+	reply_open(f, req, ino, path, fi, err);
+	free_path(f, ino, path);
+}
+
+#define READ_BATCH_MAX_REQS 32
+#define READ_BATCH_MAX_SIZE (1024 * 1024)
+
+/*
+ * Adjacent reads of the same file handle received within the
+ * read_coalesce window are served by a single filesystem read.  The
+ * first request of a batch waits for the window, later ones append
+ * to it and return at once, and all are replied to by the first.
+ * The window is only waited for if another read of the same file
+ * handle is in flight, since otherwise nothing is likely to join.
+ */
+struct read_batch {
+	struct read_batch *next;
+	fuse_ino_t ino;
+	uint64_t fh;
+	off_t start;
+	off_t end;
+	int closed;
+	int count;
+	struct {
+		fuse_req_t req;
+		off_t off;
+		size_t size;
+	} reqs[READ_BATCH_MAX_REQS];
+};
+
+static int read_batch_join(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+			   size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct read_batch *b;
+
+	for (b = f->read_batches; b != NULL; b = b->next) {
+		if (!b->closed && b->ino == ino && b->fh == fi->fh &&
+		    b->end == off && b->count < READ_BATCH_MAX_REQS &&
+		    b->end - b->start + size <= READ_BATCH_MAX_SIZE) {
+			b->reqs[b->count].req = req;
+			b->reqs[b->count].off = off;
+			b->reqs[b->count].size = size;
+			b->count++;
+			b->end += size;
+			return 1;
 		}
-	} else
-		reply_err(req, err);
+	}
+	return 0;
+}
+
+static int read_batch_busy(struct fuse *f, struct read_batch *b)
+{
+	struct read_batch *o;
+
+	for (o = f->read_batches; o != NULL; o = o->next) {
+		if (o != b && o->ino == b->ino && o->fh == b->fh)
+			return 1;
+	}
+	return 0;
+}
+
+/* Make sure that every buffer of the vector can be addressed at an offset */
+static int read_batch_flatten(struct fuse *f, struct fuse_bufvec **bufp)
+{
+	struct fuse_bufvec *src = *bufp;
+	struct fuse_bufvec *dst;
+	size_t size = fuse_buf_size(src);
+	ssize_t res;
+	size_t i;
+
+	for (i = 0; i < src->count; i++) {
+		if ((src->buf[i].flags & FUSE_BUF_IS_FD) &&
+		    !(src->buf[i].flags & FUSE_BUF_FD_SEEK))
+			break;
+	}
+	if (i == src->count && src->idx == 0 && src->off == 0)
+		return 0;
+
+	dst = malloc(sizeof(struct fuse_bufvec));
+	if (dst == NULL)
+		return -ENOMEM;
+	*dst = FUSE_BUFVEC_INIT(size);
+	dst->buf[0].mem = fuse_alloc_data(f, size);
+	if (dst->buf[0].mem == NULL) {
+		free(dst);
+		return -ENOMEM;
+	}
+
+	res = fuse_buf_copy(dst, src, 0);
+	if (res < 0) {
+		fuse_free_buf(dst);
+		return res;
+	}
+	dst->buf[0].size = res;
+	fuse_free_buf(src);
+	*bufp = dst;
+
+	return 0;
+}
+
+/* Reply with the bytes [off, off + size) of buf, without copying them */
+static void read_batch_reply(fuse_req_t req, struct fuse_bufvec *buf,
+			     size_t off, size_t size)
+{
+	struct fuse_bufvec *slice;
+	size_t pos = 0;
+	size_t i;
+
+	slice = malloc(sizeof(struct fuse_bufvec) +
+		       buf->count * sizeof(struct fuse_buf));
+	if (slice == NULL) {
+		reply_err(req, -ENOMEM);
+		return;
+	}
+	*slice = FUSE_BUFVEC_INIT(0);
+	slice->count = 0;
+
+	for (i = 0; i < buf->count && size; pos += buf->buf[i++].size) {
+		const struct fuse_buf *b = &buf->buf[i];
+		struct fuse_buf *sb;
+		size_t skip;
+
+		if (pos + b->size <= off)
+			continue;
+
+		skip = off > pos ? off - pos : 0;
+		sb = &slice->buf[slice->count++];
+		*sb = *b;
+		sb->size = b->size - skip;
+		if (sb->size > size)
+			sb->size = size;
+		if (b->flags & FUSE_BUF_IS_FD)
+			sb->pos = b->pos + skip;
+		else
+			sb->mem = (char *) b->mem + skip;
+		size -= sb->size;
+	}
+	if (!slice->count)
+		slice->count = 1;
+
+	fuse_reply_data(req, slice, FUSE_BUF_SPLICE_MOVE);
+	free(slice);
+}
+
+static void fuse_lib_read_batch(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t off, struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	struct fuse_bufvec *buf = NULL;
+	struct read_batch b;
+	struct read_batch **bp;
+	struct timespec window;
+	size_t got = 0;
+	char *path = NULL;
+	int busy;
+	int res;
+	int i;
+
+	__sync_fetch_and_add(&f->read_requests, 1);
+	pthread_mutex_lock(&f->lock);
+	if (read_batch_join(f, req, ino, size, off, fi)) {
+		pthread_mutex_unlock(&f->lock);
+		return;
+	}
+	memset(&b, 0, sizeof(b));
+	b.ino = ino;
+	b.fh = fi->fh;
+	b.start = off;
+	b.end = off + size;
+	b.count = 1;
+	b.reqs[0].req = req;
+	b.reqs[0].off = off;
+	b.reqs[0].size = size;
+	b.next = f->read_batches;
+	f->read_batches = &b;
+	busy = read_batch_busy(f, &b);
+	pthread_mutex_unlock(&f->lock);
+	__sync_fetch_and_add(&f->read_calls, 1);
+
+	if (busy) {
+		window.tv_sec = (time_t) f->conf.read_coalesce;
+		window.tv_nsec = (f->conf.read_coalesce - window.tv_sec) * 1e9;
+		while (nanosleep(&window, &window) == -1 && errno == EINTR);
+	}
+
+	/* Stays on the list while the read is in flight, but can't grow */
+	pthread_mutex_lock(&f->lock);
+	b.closed = 1;
+	pthread_mutex_unlock(&f->lock);
+
+	if (f->conf.debug && b.count > 1)
+		fprintf(stderr, "READ coalesced %i requests, %llu bytes from %llu\n",
+			b.count, (unsigned long long) (b.end - b.start),
+			(unsigned long long) b.start);
+
+	res = get_path_nullok(f, ino, &path);
+	if (res == 0 && f->warm)
+		warm_read(f, ino, path, b.start, b.end - b.start);
+	if (res == 0) {
+		struct fuse_intr_data d;
+
+		fuse_prepare_interrupt(f, req, &d);
+		res = fuse_fs_read_buf(f->fs, path, &buf, b.end - b.start,
+				       b.start, fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (res == 0)
+		res = read_batch_flatten(f, &buf);
+	if (res == 0)
+		got = fuse_buf_size(buf);
 
+	for (i = 0; i < b.count; i++) {
+		fuse_req_t r = b.reqs[i].req;
+		size_t roff = b.reqs[i].off - b.start;
+		struct fuse_bufvec *rbuf = NULL;
+		struct fuse_intr_data d;
+		int err;
+
+		if (res != 0) {
+			reply_err(r, res);
+			continue;
+		}
+		if (roff + b.reqs[i].size <= got || got == b.end - b.start) {
+			read_batch_reply(r, buf, roff, b.reqs[i].size);
+			continue;
+		}
+		/*
+		 * A short read need not mean end of file, so a request
+		 * that was not fully covered is read again on its own.
+		 * Replying with the part we have would look like EOF.
+		 */
+		fuse_prepare_interrupt(f, r, &d);
+		err = fuse_fs_read_buf(f->fs, path, &rbuf, b.reqs[i].size,
+				       b.reqs[i].off, fi);
+		fuse_finish_interrupt(f, r, &d);
+		if (err == 0)
+			fuse_reply_data(r, rbuf, FUSE_BUF_SPLICE_MOVE);
+		else
+			reply_err(r, err);
+		fuse_free_buf(rbuf);
+	}
 	free_path(f, ino, path);
+
+	pthread_mutex_lock(&f->lock);
+	for (bp = &f->read_batches; *bp != &b; bp = &(*bp)->next);
+	*bp = b.next;
+	pthread_mutex_unlock(&f->lock);
+
+	fuse_free_buf(buf);
 }
 
 static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -3965,8 +6675,30 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	char *path;
 	int res;
 
+	if (f->conf.read_coalesce > 0 && !f->fs->op.read_async) {
+		fuse_lib_read_batch(req, ino, size, off, fi);
+		return;
+	}
+
 	res = get_path_nullok(f, ino, &path);
-	if (res == 0) {
+	if (res == 0 && f->warm)
+		warm_read(f, ino, path, off, size);
+	if (res == 0 && f->fs->op.read_async) {
+		struct fuse_async *a;
+
+		a = fuse_async_new(f, req, ASYNC_READ, ino, path, fi);
+		if (a != NULL) {
+			if (f->fs->debug)
+				fprintf(stderr,
+					"read_async[%llu] %zu bytes from %llu\n",
+					(unsigned long long) fi->fh, size,
+					(unsigned long long) off);
+			f->fs->op.read_async(path, size, off, a->fip, a);
+			return;
+		}
+		free_path(f, ino, path);
+		res = -ENOMEM;
+	} else if (res == 0) {
 		struct fuse_intr_data d;
 
 		fuse_prepare_interrupt(f, req, &d);
@@ -3992,12 +6724,42 @@ static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
 	int res;
 
 	res = get_path_nullok(f, ino, &path);
-	if (res == 0) {
+	if (res == 0 && f->fs->op.write_async) {
+		size_t size = fuse_buf_size(buf);
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		struct fuse_async *a;
+
+		/* The request buffer is reused once this returns */
+		a = fuse_async_new(f, req, ASYNC_WRITE, ino, path, fi);
+		if (a != NULL)
+			a->mem = fuse_alloc_data(f, size);
+		if (a != NULL && a->mem != NULL) {
+			dst.buf[0].mem = a->mem;
+			res = fuse_buf_copy(&dst, buf, 0);
+			if (res >= 0) {
+				if (f->fs->debug)
+					fprintf(stderr,
+						"write_async[%llu] %zu bytes to %llu\n",
+						(unsigned long long) fi->fh,
+						(size_t) res,
+						(unsigned long long) off);
+				f->fs->op.write_async(path, a->mem, res, off,
+						      a->fip, a);
+				return;
+			}
+		} else {
+			res = -ENOMEM;
+		}
+		if (a != NULL)
+			fuse_async_free(a);
+		free_path(f, ino, path);
+	} else if (res == 0) {
 		struct fuse_intr_data d;
 
 		fuse_prepare_interrupt(f, req, &d);
 		res = fuse_fs_write_buf(f->fs, path, buf, off, fi);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, ino);
 		free_path(f, ino, path);
 	}
 
@@ -4007,6 +6769,93 @@ static void fuse_lib_write_buf(fuse_req_t req, fuse_ino_t ino,
 		reply_err(req, res);
 }
 
+void fuse_async_reply_attr(struct fuse_async *a, int err,
+			   const struct stat *stbuf)
+{
+	struct fuse *f = a->f;
+	struct fuse_context_i saved;
+	struct stat buf;
+
+	assert(a->op == ASYNC_LOOKUP || a->op == ASYNC_GETATTR);
+	fuse_async_enter(a, &saved);
+	if (!err)
+		buf = *stbuf;
+	else
+		memset(&buf, 0, sizeof(buf));
+
+	if (a->op == ASYNC_LOOKUP) {
+		struct fuse_entry_param e;
+
+		memset(&e, 0, sizeof(e));
+		if (!err) {
+			e.attr = buf;
+			err = lookup_entry(f, a->nodeid, a->name, &e);
+			if (!err && f->warm && a->name != NULL)
+				warm_lookup(f, a->path, e.ino);
+		}
+		if (err == -ENOENT && f->conf.negative_timeout != 0.0) {
+			e.ino = 0;
+			e.entry_timeout = f->conf.negative_timeout;
+			err = 0;
+		}
+		free_path(f, a->nodeid, a->path);
+		if (a->dot) {
+			pthread_mutex_lock(&f->lock);
+			unref_node(f, a->dot);
+			pthread_mutex_unlock(&f->lock);
+		}
+		reply_entry(a->req, &e, err);
+		warm_lookup_replied(f);
+	} else {
+		free_path(f, a->nodeid, a->path);
+		reply_attr(f, a->req, a->nodeid, &buf, err);
+	}
+	fuse_async_free(a);
+	fuse_async_leave(&saved);
+}
+
+void fuse_async_reply_data(struct fuse_async *a, int err,
+			   struct fuse_bufvec *buf)
+{
+	struct fuse_context_i saved;
+
+	assert(a->op == ASYNC_READ);
+	fuse_async_enter(a, &saved);
+	free_path(a->f, a->nodeid, a->path);
+	if (!err)
+		fuse_reply_data(a->req, buf, FUSE_BUF_SPLICE_MOVE);
+	else
+		reply_err(a->req, err);
+	fuse_async_free(a);
+	fuse_async_leave(&saved);
+}
+
+void fuse_async_complete(struct fuse_async *a, int res)
+{
+	struct fuse *f = a->f;
+	struct fuse_context_i saved;
+
+	assert(a->op == ASYNC_OPEN || a->op == ASYNC_WRITE);
+	fuse_async_enter(a, &saved);
+	if (a->op == ASYNC_OPEN) {
+		if (!res) {
+			handle_opened(f, a->nodeid, &a->fi);
+			open_setup(f, a->nodeid, a->path, &a->fi);
+		}
+		reply_open(f, a->req, a->nodeid, a->path, &a->fi, res);
+		free_path(f, a->nodeid, a->path);
+	} else {
+		free_path(f, a->nodeid, a->path);
+		dir_attr_changed(f, a->nodeid);
+		if (res >= 0)
+			fuse_reply_write(a->req, res);
+		else
+			reply_err(a->req, res);
+	}
+	fuse_async_free(a);
+	fuse_async_leave(&saved);
+}
+
 static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 			   struct fuse_file_info *fi)
 {
@@ -4116,8 +6965,9 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		    off_t off)
 {
 	struct fuse_dh *dh = (struct fuse_dh *) dh_;
+	struct fuse_direntry ent;
 	struct stat stbuf;
-	size_t newlen;
+	size_t entsize;
 
 	if (statp)
 		stbuf = *statp;
@@ -4130,14 +6980,22 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		stbuf.st_ino = FUSE_UNKNOWN_INO;
 		if (dh->fuse->conf.readdir_ino) {
 			struct node *node;
+			fuse_ino_t ino = 0;
 			pthread_mutex_lock(&dh->fuse->lock);
-			node = lookup_node(dh->fuse, dh->nodeid, name);
+			node = lookup_node_ino(dh->fuse, dh->nodeid, name, &ino);
 			if (node)
-				stbuf.st_ino  = (ino_t) node->nodeid;
+				ino = node->nodeid;
 			pthread_mutex_unlock(&dh->fuse->lock);
+			if (ino)
+				stbuf.st_ino  = (ino_t) ino;
 		}
 	}
 
+	ent.name = name;
+	ent.namelen = strlen(name);
+	ent.ino = stbuf.st_ino;
+	ent.mode = stbuf.st_mode;
+
 	if (off) {
 		if (dh->filled) {
 			dh->error = -EIO;
@@ -4147,24 +7005,27 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		if (extend_contents(dh, dh->needlen) == -1)
 			return 1;
 
-		newlen = dh->len +
-			fuse_add_direntry(dh->req, dh->contents + dh->len,
-					  dh->needlen - dh->len, name,
-					  &stbuf, off);
-		if (newlen > dh->needlen)
+		ent.off = off;
+		if (!fuse_add_direntries(dh->req, dh->contents + dh->len,
+					 dh->needlen - dh->len, &ent, 1,
+					 &entsize))
 			return 1;
 	} else {
 		dh->filled = 1;
 
-		newlen = dh->len +
-			fuse_add_direntry(dh->req, NULL, 0, name, NULL, 0);
-		if (extend_contents(dh, newlen) == -1)
+		/* The offset of the next entry is the end of this one */
+		entsize = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + ent.namelen);
+		if (extend_contents(dh, dh->len + entsize) == -1)
 			return 1;
 
-		fuse_add_direntry(dh->req, dh->contents + dh->len,
-				  dh->size - dh->len, name, &stbuf, newlen);
+		ent.off = dh->len + entsize;
+		fuse_add_direntries(dh->req, dh->contents + dh->len, entsize,
+				    &ent, 1, &entsize);
 	}
-	dh->len = newlen;
+	dh->len += entsize;
+	if (statp && dh->fuse->dir_attr)
+		dir_attr_store(dh->fuse, dh->nodeid, name, statp,
+			       dh->attr_start);
 	return 0;
 }
 
@@ -4187,6 +7048,8 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 		dh->needlen = size;
 		dh->filled = 0;
 		dh->req = req;
+		if (f->dir_attr)
+			dh->attr_start = dir_attr_now();
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_readdir(f->fs, path, dh, fill_dir, off, fi);
 		fuse_finish_interrupt(f, req, &d);
@@ -4861,6 +7724,7 @@ static void fuse_lib_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_fallocate(f->fs, path, mode, offset, length, fi);
 		fuse_finish_interrupt(f, req, &d);
+		dir_attr_changed(f, ino);
 		free_path(f, ino, path);
 	}
 	reply_err(req, err);
@@ -4878,9 +7742,21 @@ static int clean_delay(struct fuse *f)
 	int sleep_time = f->conf.remember / 10;
 
 	if (sleep_time > max_sleep)
-		return max_sleep;
+		sleep_time = max_sleep;
 	if (sleep_time < min_sleep)
-		return min_sleep;
+		sleep_time = min_sleep;
+
+	/*
+	 * Spilling is checked once per interval, a node is spilled after
+	 * it was left unused for one to two intervals.
+	 */
+	if (f->cold && (!lru_enabled(f) || f->conf.node_spill < sleep_time))
+		sleep_time = f->conf.node_spill;
+
+	/* Likewise a parked handle is released one to two periods late */
+	if (f->handles && f->conf.handle_cache < sleep_time)
+		sleep_time = f->conf.handle_cache < 1 ? 1 : f->conf.handle_cache;
+
 	return sleep_time;
 }
 
@@ -4916,8 +7792,12 @@ int fuse_clean_cache(struct fuse *f)
 		unhash_name(f, node);
 		unref_node(f, node);
 	}
+	if (f->cold)
+		spill_nodes(f);
 	pthread_mutex_unlock(&f->lock);
 
+	handle_expire(f, 0);
+
 	return clean_delay(f);
 }
 
@@ -5094,15 +7974,44 @@ static int fuse_session_loop_remember(struct fuse *f)
 	return res < 0 ? -1 : 0;
 }
 
+int fuse_auto_tune_enabled(struct fuse *f)
+{
+	return f->conf.auto_tune > 0;
+}
+
+static int fuse_start_tune(struct fuse *f)
+{
+	if (f->conf.auto_tune > 0)
+		return fuse_session_tune_start(f->se, f->conf.auto_tune,
+					       NULL, NULL);
+
+	return 0;
+}
+
+static void fuse_stop_tune(struct fuse *f)
+{
+	if (f->conf.auto_tune > 0)
+		fuse_session_tune_stop(f->se);
+}
+
 int fuse_loop(struct fuse *f)
 {
+	int res;
+
 	if (!f)
 		return -1;
 
-	if (lru_enabled(f))
-		return fuse_session_loop_remember(f);
+	res = fuse_start_tune(f);
+	if (res)
+		return res;
+
+	if (cleanup_enabled(f))
+		res = fuse_session_loop_remember(f);
+	else
+		res = fuse_session_loop(f->se);
 
-	return fuse_session_loop(f->se);
+	fuse_stop_tune(f);
+	return res;
 }
 
 int fuse_invalidate(struct fuse *f, const char *path)
@@ -5176,11 +8085,13 @@ static const struct fuse_opt fuse_lib_opts[] = {
 	FUSE_OPT_KEY("--help",		      KEY_HELP),
 	FUSE_OPT_KEY("debug",		      FUSE_OPT_KEY_KEEP),
 	FUSE_OPT_KEY("-d",		      FUSE_OPT_KEY_KEEP),
+	FUSE_OPT_KEY("aligned_buffers",	      FUSE_OPT_KEY_KEEP),
 	FUSE_LIB_OPT("debug",		      debug, 1),
 	FUSE_LIB_OPT("-d",		      debug, 1),
 	FUSE_LIB_OPT("hard_remove",	      hard_remove, 1),
 	FUSE_LIB_OPT("use_ino",		      use_ino, 1),
 	FUSE_LIB_OPT("readdir_ino",	      readdir_ino, 1),
+	FUSE_LIB_OPT("readdir_attr",	      readdir_attr, 1),
 	FUSE_LIB_OPT("direct_io",	      direct_io, 1),
 	FUSE_LIB_OPT("kernel_cache",	      kernel_cache, 1),
 	FUSE_LIB_OPT("auto_cache",	      auto_cache, 1),
@@ -5196,8 +8107,18 @@ static const struct fuse_opt fuse_lib_opts[] = {
 	FUSE_LIB_OPT("ac_attr_timeout=%lf",   ac_attr_timeout, 0),
 	FUSE_LIB_OPT("ac_attr_timeout=",      ac_attr_timeout_set, 1),
 	FUSE_LIB_OPT("negative_timeout=%lf",  negative_timeout, 0),
+	FUSE_LIB_OPT("read_coalesce=%lf",     read_coalesce, 0),
+	FUSE_LIB_OPT("aligned_buffers",	      aligned_buffers, 1),
+	FUSE_LIB_OPT("auto_tune=%lf",	      auto_tune, 0),
 	FUSE_LIB_OPT("noforget",              remember, -1),
 	FUSE_LIB_OPT("remember=%u",           remember, 0),
+	FUSE_LIB_OPT("max_nodeid=%u",         max_nodeid, 0),
+	FUSE_LIB_OPT("node_spill=%u",         node_spill, 0),
+	FUSE_LIB_OPT("node_spill_dir=%s",     node_spill_dir, 0),
+	FUSE_LIB_OPT("warm_log=%s",           warm_log, 0),
+	FUSE_LIB_OPT("warm_record=%lf",       warm_record, 0),
+	FUSE_LIB_OPT("warm_budget=%u",        warm_budget, 0),
+	FUSE_LIB_OPT("handle_cache=%lf",      handle_cache, 0),
 	FUSE_LIB_OPT("nopath",                nopath, 1),
 	FUSE_LIB_OPT("intr",		      intr, 1),
 	FUSE_LIB_OPT("intr_signal=%d",	      intr_signal, 0),
@@ -5216,6 +8137,7 @@ static void fuse_lib_help(void)
 "    -o hard_remove         immediate removal (don't hide files)\n"
 "    -o use_ino             let filesystem set inode numbers\n"
 "    -o readdir_ino         try to fill in d_ino in readdir\n"
+"    -o readdir_attr        readdir fills in all attributes, reuse them\n"
 "    -o direct_io           use direct I/O\n"
 "    -o kernel_cache        cache files in kernel\n"
 "    -o [no]auto_cache      enable caching based on modification times (off)\n"
@@ -5226,8 +8148,17 @@ static void fuse_lib_help(void)
 "    -o negative_timeout=T  cache timeout for deleted names (0.0s)\n"
 "    -o attr_timeout=T      cache timeout for attributes (1.0s)\n"
 "    -o ac_attr_timeout=T   auto cache timeout for attributes (attr_timeout)\n"
+"    -o read_coalesce=T     merge adjacent reads arriving within T seconds (0s)\n"
+"    -o auto_tune=T         adapt max_background to the load every T seconds (0s)\n"
 "    -o noforget            never forget cached inodes\n"
 "    -o remember=T          remember cached inodes for T seconds (0s)\n"
+"    -o max_nodeid=N        reuse node IDs after N have been handed out\n"
+"    -o node_spill=T        move inodes unused for T seconds to a file (0s)\n"
+"    -o node_spill_dir=DIR  directory of the inode spill file ($TMPDIR)\n"
+"    -o warm_log=FILE       record accesses to FILE, replay them when mounting\n"
+"    -o warm_record=T       record the accesses of the first T seconds (300s)\n"
+"    -o warm_budget=N       read at most N megabytes when replaying (256)\n"
+"    -o handle_cache=T      reuse released read-only handles for T seconds (0s)\n"
 "    -o nopath              don't supply path if not necessary\n"
 "    -o intr                allow requests to be interrupted\n"
 "    -o intr_signal=NUM     signal to send on interrupt (%i)\n"
@@ -5330,6 +8261,7 @@ static int fuse_push_module(struct fuse *f, const char *module,
 	f->nullpath_ok = newfs->op.flag_nullpath_ok && f->nullpath_ok;
 	f->conf.nopath = newfs->op.flag_nopath && f->conf.nopath;
 	f->utime_omit_ok = newfs->op.flag_utime_omit_ok && f->utime_omit_ok;
+	f->readdir_attr_ok = newfs->op.flag_readdir_attr && f->readdir_attr_ok;
 #ifdef __APPLE__
 	f->statfs_x_ok = newfs->op.statfs_x != NULL && f->statfs_x_ok;
 #endif
@@ -5386,15 +8318,22 @@ static void *fuse_prune_nodes(void *fuse)
 
 int fuse_start_cleanup_thread(struct fuse *f)
 {
-	if (lru_enabled(f))
-		return fuse_start_thread(&f->prune_thread, fuse_prune_nodes, f);
+	if (fuse_start_tune(f) == -1)
+		return -1;
+
+	if (cleanup_enabled(f) &&
+	    fuse_start_thread(&f->prune_thread, fuse_prune_nodes, f) == -1) {
+		fuse_stop_tune(f);
+		return -1;
+	}
 
 	return 0;
 }
 
 void fuse_stop_cleanup_thread(struct fuse *f)
 {
-	if (lru_enabled(f)) {
+	fuse_stop_tune(f);
+	if (cleanup_enabled(f)) {
 		pthread_mutex_lock(&f->lock);
 		pthread_cancel(f->prune_thread);
 		pthread_mutex_unlock(&f->lock);
@@ -5402,6 +8341,83 @@ void fuse_stop_cleanup_thread(struct fuse *f)
 	}
 }
 
+/* Node table and caches, for the metrics exporter */
+static void fuse_lib_metrics(void *data, struct fuse_metrics_out *out)
+{
+	struct fuse *f = (struct fuse *) data;
+	size_t nodes;
+	size_t buckets;
+	uint64_t read_requests;
+	uint64_t read_calls;
+	uint64_t misses = 0;
+	uint64_t reuses = 0;
+	unsigned int nparked = 0;
+	uint64_t dir_attr_hits = 0;
+	size_t dir_attrs = 0;
+
+	pthread_mutex_lock(&f->lock);
+	nodes = f->id_table.use;
+	buckets = f->id_table.size + f->name_table.size;
+	read_requests = f->read_requests;
+	read_calls = f->read_calls;
+	if (f->handles) {
+		misses = f->handles->misses;
+		reuses = f->handles->reuses;
+		nparked = f->handles->nparked;
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (f->dir_attr) {
+		pthread_mutex_lock(&f->dir_attr->lock);
+		dir_attr_hits = f->dir_attr->hits;
+		dir_attrs = f->dir_attr->use;
+		pthread_mutex_unlock(&f->dir_attr->lock);
+	}
+
+	fuse_metrics_family(out, "fuse_nodes", "gauge",
+			    "Nodes in the node table.");
+	fuse_metrics_sample(out, "fuse_nodes", NULL, nodes);
+
+	if (f->dir_attr) {
+		fuse_metrics_family(out, "fuse_readdir_attr_hits", "counter",
+				    "Lookups answered from attributes returned by readdir.");
+		fuse_metrics_sample(out, "fuse_readdir_attr_hits_total", NULL,
+				    dir_attr_hits);
+	}
+	if (f->handles) {
+		fuse_metrics_family(out, "fuse_handle_opens", "counter",
+				    "Opens of read-only handles, by whether the filesystem was called.");
+		fuse_metrics_sample(out, "fuse_handle_opens_total",
+				    "result=\"miss\"", misses);
+		fuse_metrics_sample(out, "fuse_handle_opens_total",
+				    "result=\"hit\"", reuses);
+		fuse_metrics_family(out, "fuse_handles_parked", "gauge",
+				    "Released handles kept for reuse.");
+		fuse_metrics_sample(out, "fuse_handles_parked", NULL, nparked);
+	}
+	if (f->conf.read_coalesce > 0) {
+		fuse_metrics_family(out, "fuse_coalesced_reads", "counter",
+				    "Read requests, and the filesystem reads serving them.");
+		fuse_metrics_sample(out, "fuse_coalesced_reads_total",
+				    "kind=\"request\"", read_requests);
+		fuse_metrics_sample(out, "fuse_coalesced_reads_total",
+				    "kind=\"call\"", read_calls);
+	}
+
+	fuse_metrics_family(out, "fuse_lib_memory_bytes", "gauge",
+			    "Memory used by the high level library, approximately.");
+	fuse_metrics_sample(out, "fuse_lib_memory_bytes", "category=\"nodes\"",
+			    (double) nodes * get_node_size(f));
+	fuse_metrics_sample(out, "fuse_lib_memory_bytes",
+			    "category=\"node_tables\"",
+			    (double) buckets * sizeof(struct node *));
+	fuse_metrics_sample(out, "fuse_lib_memory_bytes",
+			    "category=\"handles\"",
+			    (double) nparked * sizeof(struct handle));
+	fuse_metrics_sample(out, "fuse_lib_memory_bytes",
+			    "category=\"dir_attr\"",
+			    (double) dir_attrs * sizeof(struct dir_attr));
+}
+
 struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 			     const struct fuse_operations *op,
 			     size_t op_size, void *user_data, int compat)
@@ -5433,6 +8449,7 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	f->nullpath_ok = fs->op.flag_nullpath_ok;
 	f->conf.nopath = fs->op.flag_nopath;
 	f->utime_omit_ok = fs->op.flag_utime_omit_ok;
+	f->readdir_attr_ok = fs->op.flag_readdir_attr;
 #ifdef __APPLE__
 	f->statfs_x_ok = fs->op.statfs_x != NULL;
 #endif
@@ -5446,6 +8463,8 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	f->conf.entry_timeout = 1.0;
 	f->conf.attr_timeout = 1.0;
 	f->conf.negative_timeout = 0.0;
+	f->conf.warm_record = 300.0;
+	f->conf.warm_budget = 256;
 	f->conf.intr_signal = FUSE_DEFAULT_INTR_SIGNAL;
 
 #ifdef __APPLE__
@@ -5579,12 +8598,18 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 		fprintf(stderr, "nullpath_ok: %i\n", f->nullpath_ok);
 		fprintf(stderr, "nopath: %i\n", f->conf.nopath);
 		fprintf(stderr, "utime_omit_ok: %i\n", f->utime_omit_ok);
+		fprintf(stderr, "readdir_attr_ok: %i\n", f->readdir_attr_ok);
 	}
 
 	/* Trace topmost layer by default */
 	f->fs->debug = f->conf.debug;
 	f->ctr = 0;
 	f->generation = 0;
+	f->ids.max = f->conf.max_nodeid;
+	if (f->ids.max == 0 || f->ids.max >= FUSE_UNKNOWN_INO)
+		f->ids.max = FUSE_UNKNOWN_INO - 1;
+	else if (f->ids.max <= FUSE_ROOT_ID)
+		f->ids.max = FUSE_ROOT_ID + 1;
 	if (node_table_init(&f->name_table) == -1)
 		goto out_free_session;
 
@@ -5593,10 +8618,41 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 
 	fuse_mutex_init(&f->lock);
 
+	if (f->conf.node_spill) {
+		const char *dir = f->conf.node_spill_dir;
+
+		if (dir == NULL)
+			dir = getenv("TMPDIR");
+		if (dir == NULL)
+			dir = "/tmp";
+
+		f->cold = cold_table_new(dir);
+		if (f->cold == NULL)
+			goto out_free_id_table;
+	}
+
+	if (f->conf.warm_log) {
+		f->warm = warm_new(f->conf.warm_log);
+		if (f->warm == NULL)
+			goto out_free_cold;
+	}
+
+	if (f->conf.readdir_attr || f->readdir_attr_ok) {
+		f->dir_attr = dir_attr_new();
+		if (f->dir_attr == NULL)
+			goto out_free_warm;
+	}
+
+	if (f->conf.handle_cache > 0) {
+		f->handles = handle_table_new();
+		if (f->handles == NULL)
+			goto out_free_dir_attr;
+	}
+
 	root = alloc_node(f);
 	if (root == NULL) {
 		fprintf(stderr, "fuse: memory allocation failed\n");
-		goto out_free_id_table;
+		goto out_free_handles;
 	}
 	if (lru_enabled(f)) {
 		struct node_lru *lnode = node_lru(root);
@@ -5616,10 +8672,24 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	inc_nlookup(root);
 	hash_id(f, root);
 
+	fuse_session_metrics_add(f->se, fuse_lib_metrics, f);
+
 	return f;
 
 out_free_root:
 	free(root);
+out_free_handles:
+	if (f->handles)
+		handle_table_free(f->handles);
+out_free_dir_attr:
+	if (f->dir_attr)
+		dir_attr_free(f->dir_attr);
+out_free_warm:
+	if (f->warm)
+		warm_free(f->warm);
+out_free_cold:
+	if (f->cold)
+		cold_table_free(f->cold);
 out_free_id_table:
 	free(f->id_table.array);
 out_free_name_table:
@@ -5632,6 +8702,8 @@ out_free_fs:
 	fs->op.destroy = NULL;
 	fuse_fs_destroy(f->fs);
 	free(f->conf.modules);
+	free(f->conf.node_spill_dir);
+	free(f->conf.warm_log);
 #ifdef __APPLE__
 	free(f->conf.iconpath);
 	free(f->conf.volicon);
@@ -5655,6 +8727,9 @@ void fuse_destroy(struct fuse *f)
 {
 	size_t i;
 
+	/* Its source reads the tables freed below */
+	fuse_session_metrics_stop(f->se);
+	warm_stop(f);
 	if (f->conf.intr && f->intr_installed)
 		fuse_restore_intr_signal(f->conf.intr_signal);
 
@@ -5664,6 +8739,7 @@ void fuse_destroy(struct fuse *f)
 		memset(c, 0, sizeof(*c));
 		c->ctx.fuse = f;
 
+		handle_expire(f, 1);
 		for (i = 0; i < f->id_table.size; i++) {
 			struct node *node;
 
@@ -5692,11 +8768,39 @@ void fuse_destroy(struct fuse *f)
 	assert(list_empty(&f->partial_slabs));
 	assert(list_empty(&f->full_slabs));
 
+	if (f->conf.read_coalesce > 0 && f->conf.debug)
+		fprintf(stderr, "fuse: %llu read requests, %llu filesystem reads\n",
+			(unsigned long long) f->read_requests,
+			(unsigned long long) f->read_calls);
+	if (f->dir_attr) {
+		if (f->conf.debug)
+			fprintf(stderr, "fuse: %llu lookups answered from readdir\n",
+				(unsigned long long) f->dir_attr->hits);
+		dir_attr_free(f->dir_attr);
+	}
+	if (f->handles) {
+		if (f->conf.debug)
+			fprintf(stderr, "fuse: %llu filesystem opens, %llu reused handles, %llu filesystem releases\n",
+				(unsigned long long) f->handles->fs_opens,
+				(unsigned long long) f->handles->reuses,
+				(unsigned long long) f->handles->fs_releases);
+		handle_table_free(f->handles);
+		/* fuse_lib_destroy() may still run from the session */
+		f->handles = NULL;
+	}
+	if (f->cold)
+		cold_table_free(f->cold);
+	free(f->ids.ranges);
+	free(f->ids.released);
 	free(f->id_table.array);
 	free(f->name_table.array);
 	pthread_mutex_destroy(&f->lock);
 	fuse_session_destroy(f->se);
+	if (f->warm)
+		warm_free(f->warm);
 	free(f->conf.modules);
+	free(f->conf.node_spill_dir);
+	free(f->conf.warm_log);
 	free(f);
 	fuse_delete_context_key();
 }
@@ -0,0 +1,319 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_misc.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define ADMIT_DEFAULT_MAX 64
+/* Multiplicative decrease of a limit */
+#define ADMIT_BACKOFF 0.7
+/* Weight of a new sample in the average latency */
+#define ADMIT_AVG_WEIGHT 0.125
+/* The lowest latency drifts up this slowly, to follow a slower backend */
+#define ADMIT_BASE_DRIFT (1.0 / 1024)
+
+static double admit_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the class plus one, zero for requests never held back */
+static int admit_class(int opcode)
+{
+	switch (opcode) {
+	case FUSE_READ:
+	case FUSE_READDIR:
+		return FUSE_ADMIT_READ + 1;
+
+	case FUSE_WRITE:
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+	case FUSE_FALLOCATE:
+	case FUSE_SETATTR:
+	case FUSE_SYMLINK:
+	case FUSE_MKNOD:
+	case FUSE_MKDIR:
+	case FUSE_UNLINK:
+	case FUSE_RMDIR:
+	case FUSE_RENAME:
+	case FUSE_LINK:
+	case FUSE_CREATE:
+	case FUSE_SETXATTR:
+	case FUSE_REMOVEXATTR:
+#ifdef __APPLE__
+	case FUSE_SETVOLNAME:
+	case FUSE_EXCHANGE:
+#endif
+		return FUSE_ADMIT_WRITE + 1;
+
+	case FUSE_LOOKUP:
+	case FUSE_GETATTR:
+	case FUSE_READLINK:
+	case FUSE_OPEN:
+	case FUSE_STATFS:
+	case FUSE_GETXATTR:
+	case FUSE_LISTXATTR:
+	case FUSE_OPENDIR:
+	case FUSE_GETLK:
+	case FUSE_SETLK:
+	case FUSE_ACCESS:
+	case FUSE_BMAP:
+	case FUSE_IOCTL:
+	case FUSE_POLL:
+#ifdef __APPLE__
+	case FUSE_GETXTIMES:
+#endif
+		return FUSE_ADMIT_META + 1;
+
+	default:
+		return 0;
+	}
+}
+
+/* Called with a->lock held */
+static void admit_reset(struct fuse_admit *a)
+{
+	int i;
+
+	if (!a->param.max_limit)
+		a->param.max_limit = ADMIT_DEFAULT_MAX;
+	if (!a->param.min_limit)
+		a->param.min_limit = 1;
+	if (a->param.min_limit > a->param.max_limit)
+		a->param.min_limit = a->param.max_limit;
+
+	for (i = 0; i < FUSE_ADMIT_NCLASS; i++) {
+		a->cls[i].limit = a->param.max_limit;
+		a->cls[i].latency = 0;
+		a->cls[i].base_latency = 0;
+		a->cls[i].last_decrease = 0;
+	}
+}
+
+/*
+ * Called with a->lock held.  Once per average latency at most, so that
+ * the completions of one slow period don't collapse the limit.
+ */
+static void admit_decrease(struct fuse_admit *a, struct fuse_admit_state *c,
+			   double now)
+{
+	if (c->last_decrease && now - c->last_decrease < c->latency)
+		return;
+
+	c->last_decrease = now;
+	c->limit *= ADMIT_BACKOFF;
+	if (c->limit < a->param.min_limit)
+		c->limit = a->param.min_limit;
+	c->decreases++;
+}
+
+/* Options were parsed into f->admit.param */
+void fuse_ll_admit_init(struct fuse_ll *f)
+{
+	struct fuse_admit *a = &f->admit;
+
+	fuse_mutex_init(&a->lock);
+	pthread_cond_init(&a->cond, NULL);
+	if (a->param.max_limit) {
+		admit_reset(a);
+		a->enabled = 1;
+	}
+}
+
+void fuse_ll_admit_destroy(struct fuse_ll *f)
+{
+	pthread_cond_destroy(&f->admit.cond);
+	pthread_mutex_destroy(&f->admit.lock);
+}
+
+/*
+ * Switched under a->lock by fuse_session_admit_start() and _stop(), but
+ * checked without it on the request path.
+ */
+int fuse_ll_admit_enabled(struct fuse_ll *f)
+{
+	return __sync_fetch_and_add(&f->admit.enabled, 0);
+}
+
+/*
+ * Called by the worker after receiving the request, where it can't be
+ * cancelled, so the wait gives up once the session is exiting.  Only
+ * this request waits: the loop goes on reading the device in other
+ * threads, so that requests which are never held back, like INTERRUPT,
+ * FORGET and notify replies, still get through.
+ */
+int fuse_ll_admit(struct fuse_session *se, struct fuse_ll *f,
+		  struct fuse_req *req, int opcode)
+{
+	struct fuse_admit *a = &f->admit;
+	struct fuse_admit_state *c;
+	int cls = admit_class(opcode);
+
+	if (!cls)
+		return 0;
+
+	c = &a->cls[cls - 1];
+	pthread_mutex_lock(&a->lock);
+	while (a->enabled && c->inflight >= (unsigned int) c->limit) {
+		int err = a->param.shed_errno[cls - 1];
+		struct timespec timeout;
+
+		if (err) {
+			c->shed++;
+			pthread_mutex_unlock(&a->lock);
+			return err;
+		}
+		if (fuse_session_exited(se)) {
+			pthread_mutex_unlock(&a->lock);
+			return ENOTCONN;
+		}
+		c->waiting++;
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+		pthread_cond_timedwait(&a->cond, &a->lock, &timeout);
+		c->waiting--;
+	}
+	if (a->enabled) {
+		c->inflight++;
+		c->admitted++;
+		req->admit_class = cls;
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	if (req->admit_class)
+		req->admit_time = admit_now();
+
+	return 0;
+}
+
+/* Called when the request is freed, after its reply */
+void fuse_ll_admit_done(struct fuse_ll *f, struct fuse_req *req)
+{
+	struct fuse_admit *a = &f->admit;
+	struct fuse_admit_state *c = &a->cls[req->admit_class - 1];
+	double now = admit_now();
+	double sample = now - req->admit_time;
+	int saturated;
+
+	req->admit_class = 0;
+
+	pthread_mutex_lock(&a->lock);
+	saturated = c->inflight >= (unsigned int) c->limit;
+	c->inflight--;
+
+	if (c->latency)
+		c->latency += (sample - c->latency) * ADMIT_AVG_WEIGHT;
+	else
+		c->latency = sample;
+	if (!c->base_latency || sample < c->base_latency)
+		c->base_latency = sample;
+	else
+		c->base_latency += (sample - c->base_latency) *
+			ADMIT_BASE_DRIFT;
+
+	if (a->enabled) {
+		if (a->param.latency_factor > 0 &&
+		    c->latency > c->base_latency * a->param.latency_factor)
+			admit_decrease(a, c, now);
+		else if (saturated && c->limit < a->param.max_limit)
+			c->limit += 1.0 / c->limit;
+	}
+
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+int fuse_session_admit_start(struct fuse_session *se,
+			     const struct fuse_admit_param *param)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_admit *a = &f->admit;
+
+	if (!param->max_limit)
+		return -1;
+
+	pthread_mutex_lock(&a->lock);
+	a->param = *param;
+	admit_reset(a);
+	__sync_lock_test_and_set(&a->enabled, 1);
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	return 0;
+}
+
+void fuse_session_admit_stop(struct fuse_session *se)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_admit *a = &f->admit;
+
+	pthread_mutex_lock(&a->lock);
+	__sync_lock_test_and_set(&a->enabled, 0);
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+void fuse_session_admit_overload(struct fuse_session *se,
+				 enum fuse_admit_class cls)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_admit *a = &f->admit;
+
+	if ((unsigned int) cls >= FUSE_ADMIT_NCLASS)
+		return;
+
+	pthread_mutex_lock(&a->lock);
+	if (a->enabled) {
+		admit_decrease(a, &a->cls[cls], admit_now());
+		if (f->debug)
+			fprintf(stderr, "ADMIT: class %i overloaded, limit %u\n",
+				cls, (unsigned int) a->cls[cls].limit);
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+int fuse_session_admit_stats(struct fuse_session *se,
+			     enum fuse_admit_class cls,
+			     struct fuse_admit_stats *stats)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_admit *a = &f->admit;
+	struct fuse_admit_state *c;
+	int res = -1;
+
+	if ((unsigned int) cls >= FUSE_ADMIT_NCLASS)
+		return -1;
+
+	c = &a->cls[cls];
+	pthread_mutex_lock(&a->lock);
+	if (a->enabled) {
+		stats->limit = (unsigned int) c->limit;
+		stats->inflight = c->inflight;
+		stats->waiting = c->waiting;
+		stats->admitted = c->admitted;
+		stats->shed = c->shed;
+		stats->decreases = c->decreases;
+		stats->latency = c->latency;
+		stats->base_latency = c->base_latency;
+		res = 0;
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return res;
+}
@@ -19,6 +19,8 @@
 
 struct fuse_chan;
 struct fuse_ll;
+struct fuse_fair;
+struct fuse_tune;
 
 struct fuse_session {
 	struct fuse_session_ops op;
@@ -45,6 +47,16 @@ struct fuse_req {
 	struct fuse_chan *ch;
 	int interrupted;
 	unsigned int ioctl_64bit : 1;
+	unsigned int inflight : 1;
+	/* Never answered, not on the list of requests in flight */
+	unsigned int noreply : 1;
+	/* Admission control class plus one, zero if not admitted */
+	unsigned int admit_class : 2;
+	/* Counted by the metrics exporter when freed */
+	unsigned int metrics : 1;
+	double admit_time;
+	uint32_t opcode;
+	double metrics_start;
 	union {
 		struct {
 			uint64_t unique;
@@ -63,7 +75,136 @@ struct fuse_notify_req {
 	void (*reply)(struct fuse_notify_req *, fuse_req_t, fuse_ino_t,
 		      const void *, const struct fuse_buf *);
 	struct fuse_notify_req *next;
-	struct fuse_notify_req *prev;
+};
+
+/*
+ * Notifications waiting for a reply, hashed by unique.  It has its own
+ * lock, so that matching a reply doesn't contend with f->lock.
+ */
+struct fuse_notify_table {
+	pthread_mutex_t lock;
+	struct fuse_notify_req **array;
+	size_t size;
+	size_t use;
+	/* Unused retrieve requests, linked through nreq.next */
+	struct fuse_notify_req *pool;
+	size_t pooled;
+};
+
+struct fuse_poll_ino;
+
+struct fuse_pollhandle {
+	uint64_t kh;
+	struct fuse_chan *ch;
+	struct fuse_ll *f;
+	int refctr;
+	fuse_ino_t ino;
+	uint64_t fh;
+	struct fuse_pollhandle *hash_next;
+	/* NULL once the file has been released */
+	struct fuse_poll_ino *pi;
+	/* Next handle of the same inode */
+	struct fuse_pollhandle *ino_next;
+	/* Polled since the last wakeup */
+	int armed;
+	struct fuse_pollhandle *armed_next;
+	struct fuse_pollhandle **armed_prevp;
+};
+
+/*
+ * Poll handles of open files, hashed by the kernel's handle, which is
+ * unique to each open file unlike fh
+ */
+struct fuse_poll_registry {
+	pthread_mutex_t lock;
+	struct fuse_pollhandle **handles;
+	size_t hsize;
+	size_t huse;
+	/* Handles grouped by inode, for waking them up together */
+	struct fuse_poll_ino **inodes;
+	size_t isize;
+	size_t iuse;
+};
+
+/* Number of low bits of a notify unique holding the worker index */
+#define FUSE_MP_WORKER_BITS 8
+#define FUSE_MP_MAX_WORKERS (1 << FUSE_MP_WORKER_BITS)
+
+/* State shared by the processes of fuse_session_loop_mp() */
+struct fuse_mp_shared {
+	uint64_t notify_ctr;
+};
+
+struct fuse_admit_state {
+	double limit;
+	unsigned int inflight;
+	unsigned int waiting;
+	uint64_t admitted;
+	uint64_t shed;
+	uint64_t decreases;
+	double latency;
+	double base_latency;
+	double last_decrease;
+};
+
+/* Admission control, see fuse_session_admit_start() */
+struct fuse_admit {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int enabled;
+	struct fuse_admit_param param;
+	struct fuse_admit_state cls[FUSE_ADMIT_NCLASS];
+};
+
+/* Opcodes counted by the metrics exporter, all but CUSE_INIT */
+#define FUSE_METRICS_NOPS 64
+/* Latency buckets, each four times the one before, from 1us to 4s */
+#define FUSE_METRICS_NBUCKETS 12
+#define FUSE_METRICS_MAX_SOURCES 8
+
+enum {
+	FUSE_METRICS_RECV_SPLICE,
+	FUSE_METRICS_RECV_COPY,
+	FUSE_METRICS_DATA_SPLICE,
+	FUSE_METRICS_DATA_COPY,
+	FUSE_METRICS_NEVENTS
+};
+
+/*
+ * Counters of one thread.  Only the thread owning them writes them,
+ * the exporter sums them up under the lock.  The counters of a thread
+ * which exited are taken over by the next thread needing them.
+ */
+struct fuse_metrics_thread {
+	struct fuse_metrics_thread *next;
+	struct fuse_metrics *m;
+	int owned;
+	uint64_t count[FUSE_METRICS_NOPS];
+	uint64_t bucket[FUSE_METRICS_NOPS][FUSE_METRICS_NBUCKETS];
+	double latency[FUSE_METRICS_NOPS];
+	double busy;
+	uint64_t events[FUSE_METRICS_NEVENTS];
+};
+
+struct fuse_metrics_source {
+	fuse_metrics_func_t func;
+	void *data;
+};
+
+struct fuse_metrics_server;
+
+/* Metrics exporter, see fuse_session_metrics_start() */
+struct fuse_metrics {
+	pthread_mutex_t lock;
+	int enabled;
+	pthread_key_t key;
+	struct fuse_metrics_thread *threads;
+	struct fuse_metrics_source sources[FUSE_METRICS_MAX_SOURCES];
+	int nsources;
+	struct fuse_metrics_server *server;
+	/* From the options, the exporter is started on INIT */
+	char *path;
+	unsigned int port;
 };
 
 struct fuse_ll {
@@ -79,6 +220,7 @@ struct fuse_ll {
 	int no_splice_write;
 	int no_splice_move;
 	int no_splice_read;
+	int aligned_buffers;
 	struct fuse_lowlevel_ops op;
 	int got_init;
 	struct cuse_data *cuse_data;
@@ -90,9 +232,25 @@ struct fuse_ll {
 	pthread_mutex_t lock;
 	int got_destroy;
 	pthread_key_t pipe_key;
+	pthread_key_t abuf_key;
+	pthread_key_t req_key;
+	/* The buffer passed to write_buf by this thread, while it runs */
+	pthread_key_t bufv_key;
 	int broken_splice_nonblock;
 	uint64_t notify_ctr;
-	struct fuse_notify_req notify_list;
+	struct fuse_notify_table notify;
+	struct fuse_poll_registry poll;
+	struct fuse_admit admit;
+	struct fuse_mp_shared *mp_shared;
+	unsigned int mp_worker;
+	struct fuse_fair *fair;
+	/* Requests between receiving and replying */
+	unsigned int inflight;
+	/* fusectl and backing device directories of the connection */
+	char *ctl_dir;
+	char *bdi_dir;
+	struct fuse_tune *tune;
+	struct fuse_metrics metrics;
 };
 
 struct fuse_cmd {
@@ -105,6 +263,8 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 			     const struct fuse_operations *op,
 			     size_t op_size, void *user_data, int compat);
 
+int fuse_auto_tune_enabled(struct fuse *f);
+
 int fuse_sync_compat_args(struct fuse_args *args);
 
 struct fuse_chan *fuse_kern_chan_new(int fd);
@@ -140,6 +300,36 @@ int fuse_kern_mount(const char *mountpoint, struct fuse_args *args);
 int fuse_send_reply_iov_nofree(fuse_req_t req, int error, struct iovec *iov,
 			       int count);
 void fuse_free_req(fuse_req_t req);
+uint64_t fuse_ll_notify_unique(struct fuse_ll *f);
+char *fuse_ll_alloc_recv_buf(struct fuse_ll *f, size_t bufsize, char **basep);
+size_t fuse_ll_recv_offset(struct fuse_ll *f);
+void fuse_ll_tune_stop(struct fuse_ll *f);
+int fuse_ll_tune_suspend(struct fuse_ll *f, double *intervalp,
+			 fuse_tune_func_t *funcp, void **datap);
+struct fuse_pollhandle *fuse_ll_poll_register(struct fuse_ll *f,
+					      fuse_ino_t ino, uint64_t fh,
+					      uint64_t kh,
+					      struct fuse_chan *ch);
+void fuse_ll_poll_release(struct fuse_ll *f, fuse_ino_t ino, uint64_t fh);
+void fuse_ll_poll_free(struct fuse_ll *f);
+void fuse_ll_admit_init(struct fuse_ll *f);
+void fuse_ll_admit_destroy(struct fuse_ll *f);
+int fuse_ll_admit_enabled(struct fuse_ll *f);
+int fuse_ll_admit(struct fuse_session *se, struct fuse_ll *f,
+		  struct fuse_req *req, int opcode);
+void fuse_ll_admit_done(struct fuse_ll *f, struct fuse_req *req);
+const char *fuse_ll_opname(int opcode);
+int fuse_ll_metrics_init(struct fuse_ll *f);
+void fuse_ll_metrics_destroy(struct fuse_ll *f);
+int fuse_ll_metrics_start(struct fuse_ll *f, const char *path,
+			  unsigned int port);
+void fuse_ll_metrics_stop(struct fuse_ll *f);
+int fuse_ll_metrics_suspend(struct fuse_ll *f, char **pathp,
+			    unsigned int *portp);
+double fuse_ll_metrics_now(void);
+void fuse_ll_metrics_done(struct fuse_ll *f, struct fuse_req *req);
+void fuse_ll_metrics_processed(struct fuse_ll *f, double start, int spliced);
+void fuse_ll_metrics_event(struct fuse_ll *f, int event);
 
 
 struct fuse *fuse_setup_common(int argc, char *argv[],
@@ -72,8 +72,12 @@ int fuse_session_loop_dispatch(struct fuse_session *se)
 		/*
 		 * Create a local buffer and copy because buf is huge, and the
 		 * data transferred is usually orders of magnitude smaller.
+		 * The copy keeps the alignment of "-o aligned_buffers".
 		 */
-		char *process_buf = (char *)malloc(res);
+		char *process_base;
+		char *process_buf = fuse_ll_alloc_recv_buf(
+			(struct fuse_ll *) fuse_session_data(se), res,
+			&process_base);
 		if (!process_buf) {
 			fprintf(stderr,
 				"fuse: failed to allocate process buffer\n");
@@ -86,7 +90,7 @@ int fuse_session_loop_dispatch(struct fuse_session *se)
 
 		dispatch_group_async(group, queue, ^{
 			fuse_session_process_buf(se, &fbuf, tmpch);
-			free(fbuf.mem);
+			free(process_base);
 		});
 	}
 
@@ -0,0 +1,552 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "fuse_lowlevel.h"
+#include "fuse_misc.h"
+#include "fuse_kernel.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define FAIR_DEFAULT_WORKERS 10
+#define FAIR_HASH_SIZE 256
+#define FAIR_MAX_TENANTS 4096
+/* Tenants beyond FAIR_MAX_TENANTS share this one, uid -1 is invalid */
+#define FAIR_OVERFLOW_TENANT ((uint32_t) -1)
+/* Tenants without requests for this long are forgotten */
+#define FAIR_IDLE_TIMEOUT 60.0
+/* Idle tenants are looked for at most this often, unless at the limit */
+#define FAIR_REAP_INTERVAL 1.0
+/* Receive buffers kept for reuse */
+#define FAIR_MAX_FREE 32
+
+/* The request is received directly into buf, and queued as it is */
+struct fair_req {
+	struct fair_req *next;
+	struct timespec arrival;
+	size_t len;
+	/* Points into the same allocation, see fuse_ll_alloc_recv_buf() */
+	char *buf;
+};
+
+struct fair_tenant {
+	struct fair_tenant *hash_next;
+	/* Links of the list of tenants with queued requests */
+	struct fair_tenant *prev;
+	struct fair_tenant *next;
+	uint32_t key;
+	unsigned int weight;
+	unsigned int deficit;
+	unsigned int queued;
+	unsigned int inflight;
+	struct fair_req *head;
+	struct fair_req **tailp;
+	uint64_t requests;
+	double total_latency;
+	double max_latency;
+	/* When the last request finished, if none is queued or in flight */
+	struct timespec idle_since;
+};
+
+struct fuse_fair {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fuse_session *se;
+	struct fuse_ll *f;
+	struct fuse_chan *ch;
+	struct fuse_fair_param param;
+	struct fair_tenant *hash[FAIR_HASH_SIZE];
+	unsigned int ntenants;
+	struct timespec last_reap;
+	/* Current position of the round robin, NULL if nothing is queued */
+	struct fair_tenant *cur;
+	size_t bufsize;
+	struct fair_req *free;
+	unsigned int nfree;
+	int exit;
+};
+
+static double fair_diff(const struct timespec *now,
+			const struct timespec *since)
+{
+	return (now->tv_sec - since->tv_sec) +
+		(now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static uint32_t fair_key(struct fuse_fair *fq, const struct fuse_in_header *in)
+{
+	switch (fq->param.key) {
+	case FUSE_FAIR_GID:
+		return in->gid;
+	case FUSE_FAIR_PID:
+		return in->pid;
+	default:
+		return in->uid;
+	}
+}
+
+/*
+ * Forget the tenants idle for at least min_idle seconds.  Their requests
+ * have all finished, so neither the round robin nor a worker refers to
+ * them.
+ */
+static void fair_reap(struct fuse_fair *fq, const struct timespec *now,
+		      double min_idle)
+{
+	unsigned int i;
+
+	fq->last_reap = *now;
+	for (i = 0; i < FAIR_HASH_SIZE; i++) {
+		struct fair_tenant **tp = &fq->hash[i];
+		struct fair_tenant *t;
+
+		while ((t = *tp) != NULL) {
+			if (!t->queued && !t->inflight &&
+			    fair_diff(now, &t->idle_since) >= min_idle) {
+				*tp = t->hash_next;
+				free(t);
+				fq->ntenants--;
+			} else {
+				tp = &t->hash_next;
+			}
+		}
+	}
+}
+
+static struct fair_tenant *fair_get_tenant(struct fuse_fair *fq, uint32_t key,
+					   const struct timespec *now)
+{
+	struct fair_tenant **tp = &fq->hash[key % FAIR_HASH_SIZE];
+	struct fair_tenant *t;
+
+	for (t = *tp; t != NULL; t = t->hash_next) {
+		if (t->key == key)
+			return t;
+	}
+
+	/* At the limit, any idle tenant makes room for a new one */
+	if (fq->ntenants >= FAIR_MAX_TENANTS)
+		fair_reap(fq, now, 0);
+	else if (fair_diff(now, &fq->last_reap) >= FAIR_REAP_INTERVAL)
+		fair_reap(fq, now, FAIR_IDLE_TIMEOUT);
+
+	if (fq->ntenants >= FAIR_MAX_TENANTS && key != FAIR_OVERFLOW_TENANT)
+		return fair_get_tenant(fq, FAIR_OVERFLOW_TENANT, now);
+
+	t = (struct fair_tenant *) calloc(1, sizeof(struct fair_tenant));
+	if (t == NULL)
+		return NULL;
+
+	t->key = key;
+	t->weight = 1;
+	if (fq->param.weight) {
+		t->weight = fq->param.weight(key, fq->param.data);
+		if (!t->weight)
+			t->weight = 1;
+	}
+	t->tailp = &t->head;
+	t->idle_since = *now;
+	t->hash_next = *tp;
+	*tp = t;
+	fq->ntenants++;
+
+	return t;
+}
+
+static void fair_activate(struct fuse_fair *fq, struct fair_tenant *t)
+{
+	if (fq->cur == NULL) {
+		t->prev = t->next = t;
+		t->deficit = t->weight;
+		fq->cur = t;
+	} else {
+		/* Join at the end of the current round */
+		t->next = fq->cur;
+		t->prev = fq->cur->prev;
+		t->prev->next = t;
+		fq->cur->prev = t;
+		t->deficit = 0;
+	}
+}
+
+static void fair_deactivate(struct fuse_fair *fq, struct fair_tenant *t)
+{
+	if (t->next == t) {
+		fq->cur = NULL;
+	} else {
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		if (fq->cur == t) {
+			fq->cur = t->next;
+			fq->cur->deficit = fq->cur->weight;
+		}
+	}
+	t->prev = t->next = NULL;
+	t->deficit = 0;
+}
+
+static int fair_capped(struct fuse_fair *fq, struct fair_tenant *t)
+{
+	return fq->param.max_inflight && t->inflight >= fq->param.max_inflight;
+}
+
+/*
+ * Deficit round robin with a cost of one per request: each tenant may
+ * take as many requests in a row as its weight before the turn passes
+ * on.  Tenants at their in-flight limit are skipped.
+ */
+static struct fair_req *fair_dequeue(struct fuse_fair *fq,
+				     struct fair_tenant **tp)
+{
+	struct fair_tenant *t;
+	struct fair_req *req;
+	unsigned int skipped = 0;
+
+	while ((t = fq->cur) != NULL) {
+		if (t->deficit && !fair_capped(fq, t))
+			break;
+
+		if (fair_capped(fq, t) && ++skipped > fq->ntenants)
+			return NULL;
+
+		fq->cur = t->next;
+		fq->cur->deficit = fq->cur->weight;
+	}
+	if (t == NULL)
+		return NULL;
+
+	req = t->head;
+	t->head = req->next;
+	if (t->head == NULL)
+		t->tailp = &t->head;
+	t->queued--;
+	t->inflight++;
+	t->deficit--;
+	if (!t->queued)
+		fair_deactivate(fq, t);
+
+	*tp = t;
+	return req;
+}
+
+static void *fair_worker(void *data)
+{
+	struct fuse_fair *fq = (struct fuse_fair *) data;
+
+	pthread_mutex_lock(&fq->lock);
+	while (!fq->exit) {
+		struct fair_tenant *t;
+		struct fair_req *req = fair_dequeue(fq, &t);
+		struct timespec now;
+		double latency;
+
+		if (req == NULL) {
+			pthread_cond_wait(&fq->cond, &fq->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&fq->lock);
+
+		fuse_session_process(fq->se, req->buf, req->len, fq->ch);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency = fair_diff(&now, &req->arrival);
+
+		pthread_mutex_lock(&fq->lock);
+		if (fq->nfree < FAIR_MAX_FREE) {
+			req->next = fq->free;
+			fq->free = req;
+			fq->nfree++;
+			req = NULL;
+		}
+		t->inflight--;
+		if (!t->queued && !t->inflight)
+			t->idle_since = now;
+		t->requests++;
+		t->total_latency += latency;
+		if (latency > t->max_latency)
+			t->max_latency = latency;
+		/* A capped tenant may have become eligible */
+		if (t->queued && t->inflight + 1 == fq->param.max_inflight)
+			pthread_cond_signal(&fq->cond);
+		if (req != NULL) {
+			pthread_mutex_unlock(&fq->lock);
+			free(req);
+			pthread_mutex_lock(&fq->lock);
+		}
+	}
+	pthread_mutex_unlock(&fq->lock);
+
+	return NULL;
+}
+
+/*
+ * Requests which must not wait behind others are processed by the
+ * reading thread right away.
+ */
+static int fair_is_urgent(const struct fuse_in_header *in)
+{
+	switch (in->opcode) {
+	case FUSE_INIT:
+	case FUSE_DESTROY:
+	case FUSE_INTERRUPT:
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_NOTIFY_REPLY:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static struct fair_req *fair_req_alloc(struct fuse_fair *fq)
+{
+	struct fair_req *req;
+
+	/*
+	 * The request header lives at the start of the allocation.  With
+	 * aligned buffers that is the unused part of the first page.
+	 */
+	if (fuse_ll_recv_offset(fq->f) >= sizeof(struct fair_req)) {
+		char *base;
+		char *mem = fuse_ll_alloc_recv_buf(fq->f, fq->bufsize, &base);
+
+		if (mem == NULL)
+			return NULL;
+		req = (struct fair_req *) base;
+		req->buf = mem;
+	} else {
+		req = (struct fair_req *) malloc(sizeof(struct fair_req) +
+						 fq->bufsize);
+		if (req == NULL)
+			return NULL;
+		req->buf = (char *) (req + 1);
+	}
+
+	return req;
+}
+
+/*
+ * Queue a received request, and take a buffer for the next one from
+ * the free list, if there is any.
+ */
+static int fair_enqueue(struct fuse_fair *fq, struct fair_req *req,
+			size_t len, struct fair_req **nextp)
+{
+	const struct fuse_in_header *in = (const struct fuse_in_header *)
+		req->buf;
+	struct fair_tenant *t;
+
+	req->next = NULL;
+	req->len = len;
+	clock_gettime(CLOCK_MONOTONIC, &req->arrival);
+
+	pthread_mutex_lock(&fq->lock);
+	t = fair_get_tenant(fq, fair_key(fq, in), &req->arrival);
+	if (t == NULL) {
+		pthread_mutex_unlock(&fq->lock);
+		return -1;
+	}
+	*t->tailp = req;
+	t->tailp = &req->next;
+	if (!t->queued++)
+		fair_activate(fq, t);
+	pthread_cond_signal(&fq->cond);
+	*nextp = fq->free;
+	if (fq->free != NULL) {
+		fq->free = fq->free->next;
+		fq->nfree--;
+	}
+	pthread_mutex_unlock(&fq->lock);
+
+	return 0;
+}
+
+/* Answer a request which was queued but never processed */
+static void fair_reply_unprocessed(struct fuse_fair *fq, struct fair_req *req)
+{
+	const struct fuse_in_header *in =
+		(const struct fuse_in_header *) req->buf;
+	struct fuse_out_header out = {
+		.len = sizeof(struct fuse_out_header),
+		.error = -ENOTCONN,
+		.unique = in->unique,
+	};
+	struct iovec iov = {
+		.iov_base = &out,
+		.iov_len = sizeof(struct fuse_out_header),
+	};
+
+	/* Fails harmlessly if the filesystem was already unmounted */
+	fuse_chan_send(fq->ch, &iov, 1);
+}
+
+static void fair_destroy(struct fuse_fair *fq)
+{
+	unsigned int i;
+
+	for (i = 0; i < FAIR_HASH_SIZE; i++) {
+		struct fair_tenant *t;
+		struct fair_tenant *next;
+
+		for (t = fq->hash[i]; t != NULL; t = next) {
+			struct fair_req *req;
+
+			next = t->hash_next;
+			while ((req = t->head) != NULL) {
+				t->head = req->next;
+				fair_reply_unprocessed(fq, req);
+				free(req);
+			}
+			free(t);
+		}
+	}
+	while (fq->free != NULL) {
+		struct fair_req *req = fq->free;
+
+		fq->free = req->next;
+		free(req);
+	}
+	pthread_cond_destroy(&fq->cond);
+	pthread_mutex_destroy(&fq->lock);
+	free(fq);
+}
+
+int fuse_session_loop_fair(struct fuse_session *se,
+			   const struct fuse_fair_param *param)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	struct fuse_fair *fq;
+	struct fair_req *req = NULL;
+	pthread_t *workers;
+	unsigned int numworker;
+	unsigned int i;
+	int res = 0;
+
+	fq = (struct fuse_fair *) calloc(1, sizeof(struct fuse_fair));
+	if (fq == NULL) {
+		fprintf(stderr, "fuse: failed to allocate fair queue\n");
+		return -1;
+	}
+	fq->se = se;
+	fq->f = f;
+	fq->ch = ch;
+	fq->bufsize = bufsize;
+	fq->param = *param;
+	fuse_mutex_init(&fq->lock);
+	pthread_cond_init(&fq->cond, NULL);
+
+	numworker = param->numworker ? param->numworker : FAIR_DEFAULT_WORKERS;
+	workers = (pthread_t *) calloc(numworker, sizeof(pthread_t));
+	if (workers == NULL) {
+		fprintf(stderr, "fuse: failed to allocate fair queue\n");
+		res = -1;
+		goto out_free;
+	}
+	for (i = 0; i < numworker; i++) {
+		if (fuse_start_thread(&workers[i], fair_worker, fq) == -1)
+			break;
+	}
+	numworker = i;
+	if (!numworker) {
+		res = -1;
+		goto out_free;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	f->fair = fq;
+	pthread_mutex_unlock(&f->lock);
+
+	while (!fuse_session_exited(se)) {
+		struct fuse_chan *tmpch = ch;
+		const struct fuse_in_header *in;
+
+		if (req == NULL) {
+			req = fair_req_alloc(fq);
+			if (req == NULL) {
+				fprintf(stderr, "fuse: failed to allocate read buffer\n");
+				res = -ENOMEM;
+				break;
+			}
+		}
+		res = fuse_chan_recv(&tmpch, req->buf, bufsize);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+			break;
+
+		in = (const struct fuse_in_header *) req->buf;
+		if (fair_is_urgent(in) || fair_enqueue(fq, req, res, &req) == -1)
+			fuse_session_process(se, req->buf, res, tmpch);
+	}
+	free(req);
+
+	pthread_mutex_lock(&f->lock);
+	f->fair = NULL;
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_mutex_lock(&fq->lock);
+	fq->exit = 1;
+	pthread_cond_broadcast(&fq->cond);
+	pthread_mutex_unlock(&fq->lock);
+	for (i = 0; i < numworker; i++)
+		pthread_join(workers[i], NULL);
+
+out_free:
+	free(workers);
+	fair_destroy(fq);
+	fuse_session_reset(se);
+	return res < 0 ? -1 : 0;
+}
+
+int fuse_session_fair_stats(struct fuse_session *se,
+			    struct fuse_fair_stats *stats, int count)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_fair *fq;
+	unsigned int i;
+	int n = 0;
+
+	pthread_mutex_lock(&f->lock);
+	fq = f->fair;
+	if (fq == NULL) {
+		pthread_mutex_unlock(&f->lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&fq->lock);
+	for (i = 0; i < FAIR_HASH_SIZE; i++) {
+		struct fair_tenant *t;
+
+		for (t = fq->hash[i]; t != NULL; t = t->hash_next, n++) {
+			struct fuse_fair_stats *st;
+
+			if (n >= count)
+				continue;
+
+			st = &stats[n];
+			st->tenant = t->key;
+			st->weight = t->weight;
+			st->queued = t->queued;
+			st->inflight = t->inflight;
+			st->requests = t->requests;
+			st->total_latency = t->total_latency;
+			st->max_latency = t->max_latency;
+		}
+	}
+	pthread_mutex_unlock(&fq->lock);
+	pthread_mutex_unlock(&f->lock);
+
+	return n;
+}
@@ -0,0 +1,383 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef __linux__
+#  ifndef FUSE_DEV_IOC_CLONE
+#    define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#  endif
+#endif
+
+struct fuse_mp {
+	struct fuse_session *se;
+	struct fuse_ll *f;
+	int numworker;
+	pid_t *pids;
+	/* sock[i][0] is read by worker i, sock[i][1] is used to send to it */
+	int (*sock)[2];
+	struct fuse_mp_shared *shared;
+	/* Session threads started before the fork, run by the first worker */
+	int metrics;
+	char *metrics_path;
+	unsigned int metrics_port;
+	int tune;
+	double tune_interval;
+	fuse_tune_func_t tune_func;
+	void *tune_data;
+};
+
+/* Run the session until the INIT request has been processed */
+static int mp_wait_init(struct fuse_mp *mp, struct fuse_chan *ch,
+			char *buf, size_t bufsize)
+{
+	while (!mp->f->got_init && !fuse_session_exited(mp->se)) {
+		struct fuse_chan *tmpch = ch;
+		int res = fuse_chan_recv(&tmpch, buf, bufsize);
+
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+			return res < 0 ? -1 : 0;
+
+		fuse_session_process(mp->se, buf, res, tmpch);
+	}
+	return 0;
+}
+
+/*
+ * Give the worker its own device fd if the kernel supports cloning, so
+ * that the non-blocking flag and the processing queue are private to
+ * it.  Otherwise all workers read the shared fd, and the parent
+ * restores its flags when the workers are gone.
+ */
+static struct fuse_chan *mp_worker_chan(struct fuse_session *se,
+				        struct fuse_chan *ch)
+{
+	int fd = fuse_chan_fd(ch);
+	struct fuse_chan *newch = ch;
+
+#ifdef FUSE_DEV_IOC_CLONE
+	int clonefd = open("/dev/fuse", O_RDWR);
+
+	if (clonefd != -1) {
+		uint32_t masterfd = fd;
+
+		if (ioctl(clonefd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+			close(clonefd);
+		} else {
+			newch = fuse_kern_chan_new(clonefd);
+			if (newch == NULL) {
+				close(clonefd);
+				newch = ch;
+			} else {
+				fuse_session_remove_chan(ch);
+				fuse_session_add_chan(se, newch);
+				fd = clonefd;
+			}
+		}
+	}
+#endif
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return newch;
+}
+
+/*
+ * Threads don't survive fork(), and a lock held by one of them would
+ * stay locked in the workers.  So the exporter and the tuner, which may
+ * have been started on INIT, are stopped first.  They serve the whole
+ * connection, so only the first worker starts them again.
+ */
+static void mp_suspend_threads(struct fuse_mp *mp)
+{
+	mp->metrics = fuse_ll_metrics_suspend(mp->f, &mp->metrics_path,
+					      &mp->metrics_port);
+	if (mp->metrics == -1)
+		fprintf(stderr, "fuse: failed to move metrics exporter to worker\n");
+	mp->tune = fuse_ll_tune_suspend(mp->f, &mp->tune_interval,
+					&mp->tune_func, &mp->tune_data);
+}
+
+static void mp_resume_threads(struct fuse_mp *mp)
+{
+	if (mp->metrics == 1)
+		fuse_ll_metrics_start(mp->f, mp->metrics_path,
+				      mp->metrics_port);
+	if (mp->tune)
+		fuse_session_tune_start(mp->se, mp->tune_interval,
+					mp->tune_func, mp->tune_data);
+}
+
+/*
+ * A notify reply is routed to the worker which sent the notification,
+ * because only that worker has the matching request in its list.
+ */
+static int mp_forward(struct fuse_mp *mp, const char *buf, size_t len)
+{
+	const struct fuse_in_header *in = (const struct fuse_in_header *) buf;
+	unsigned int owner;
+
+	if (in->opcode != FUSE_NOTIFY_REPLY)
+		return 0;
+
+	owner = in->unique & (FUSE_MP_MAX_WORKERS - 1);
+	if (owner == mp->f->mp_worker || owner >= (unsigned) mp->numworker)
+		return 0;
+
+	if (send(mp->sock[owner][1], buf, len, 0) == -1)
+		perror("fuse: forwarding notify reply");
+
+	return 1;
+}
+
+static int mp_worker_loop(struct fuse_mp *mp, struct fuse_chan *ch,
+			  char *buf, size_t bufsize)
+{
+	struct fuse_session *se = mp->se;
+	int sock = mp->sock[mp->f->mp_worker][0];
+	int res = 0;
+
+	while (!fuse_session_exited(se)) {
+		struct pollfd fds[2] = {
+			{ .fd = fuse_chan_fd(ch), .events = POLLIN },
+			{ .fd = sock, .events = POLLIN },
+		};
+
+		res = poll(fds, 2, -1);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("fuse: poll");
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			ssize_t len = recv(sock, buf, bufsize, 0);
+
+			if (len > 0)
+				fuse_session_process(se, buf, len, ch);
+		}
+		if (fds[0].revents) {
+			struct fuse_chan *tmpch = ch;
+
+			res = fuse_chan_recv(&tmpch, buf, bufsize);
+			if (res == -EINTR || res == -EAGAIN)
+				continue;
+			if (res <= 0)
+				break;
+
+			if (!mp_forward(mp, buf, res))
+				fuse_session_process(se, buf, res, tmpch);
+		}
+	}
+
+	return res < 0 ? -1 : 0;
+}
+
+static void mp_worker(struct fuse_mp *mp, int idx, struct fuse_chan *ch,
+		      char *buf, size_t bufsize)
+{
+	int i;
+	int res;
+
+	for (i = 0; i < mp->numworker; i++) {
+		if (i != idx)
+			close(mp->sock[i][0]);
+	}
+
+	mp->f->mp_worker = idx;
+	/* destroy() is called by the parent when the session is destroyed */
+	mp->f->op.destroy = NULL;
+
+	ch = mp_worker_chan(mp->se, ch);
+	if (idx == 0)
+		mp_resume_threads(mp);
+	res = mp_worker_loop(mp, ch, buf, bufsize);
+	/* Removes the metrics socket, which _exit() wouldn't */
+	fuse_ll_tune_stop(mp->f);
+	fuse_ll_metrics_stop(mp->f);
+	_exit(res ? 1 : 0);
+}
+
+static void mp_kill_workers(struct fuse_mp *mp, int sig)
+{
+	int i;
+
+	for (i = 0; i < mp->numworker; i++) {
+		if (mp->pids[i] > 0)
+			kill(mp->pids[i], sig);
+	}
+}
+
+static int mp_wait_workers(struct fuse_mp *mp)
+{
+	int remaining = 0;
+	int killed = 0;
+	int err = 0;
+	int i;
+
+	for (i = 0; i < mp->numworker; i++) {
+		if (mp->pids[i] > 0)
+			remaining++;
+	}
+
+	while (remaining) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid == -1) {
+			if (errno != EINTR)
+				break;
+			if (fuse_session_exited(mp->se) && !killed) {
+				mp_kill_workers(mp, SIGTERM);
+				killed = 1;
+			}
+			continue;
+		}
+		for (i = 0; i < mp->numworker; i++) {
+			if (mp->pids[i] == pid) {
+				mp->pids[i] = 0;
+				remaining--;
+				if (!WIFEXITED(status) ||
+				    WEXITSTATUS(status) != 0)
+					err = -1;
+			}
+		}
+		/* The first worker to stop ends the session */
+		if (!killed) {
+			mp_kill_workers(mp, SIGTERM);
+			killed = 1;
+		}
+	}
+	return err;
+}
+
+int fuse_session_loop_mp(struct fuse_session *se, int numworker)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	struct fuse_mp mp;
+	char *base = NULL;
+	char *buf;
+	int fdflags;
+	int err = -1;
+	int i;
+
+	if (numworker < 1 || numworker > FUSE_MP_MAX_WORKERS) {
+		fprintf(stderr, "fuse: invalid number of worker processes\n");
+		return -1;
+	}
+
+	memset(&mp, 0, sizeof(mp));
+	mp.se = se;
+	mp.f = (struct fuse_ll *) fuse_session_data(se);
+	mp.numworker = numworker;
+
+	buf = fuse_ll_alloc_recv_buf(mp.f, bufsize, &base);
+	mp.pids = (pid_t *) calloc(numworker, sizeof(pid_t));
+	mp.sock = calloc(numworker, sizeof(mp.sock[0]));
+	if (!buf || !mp.pids || !mp.sock) {
+		fprintf(stderr, "fuse: failed to allocate worker state\n");
+		goto out_free;
+	}
+
+	mp.shared = mmap(NULL, sizeof(struct fuse_mp_shared),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			 -1, 0);
+	if (mp.shared == MAP_FAILED) {
+		perror("fuse: mmap");
+		goto out_free;
+	}
+
+	for (i = 0; i < numworker; i++) {
+		int sndbuf = bufsize * 2;
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, mp.sock[i]) == -1) {
+			perror("fuse: socketpair");
+			numworker = i;
+			goto out_close;
+		}
+		setsockopt(mp.sock[i][1], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+			   sizeof(sndbuf));
+	}
+
+	/* Initialize once, the workers inherit the result */
+	err = mp_wait_init(&mp, ch, buf, bufsize);
+	if (err || fuse_session_exited(se))
+		goto out_close;
+
+	/* INIT has settled the size of the write header */
+	if (mp.f->aligned_buffers)
+		buf = base + fuse_ll_recv_offset(mp.f);
+
+	pthread_mutex_lock(&mp.f->lock);
+	mp.shared->notify_ctr = mp.f->notify_ctr;
+	mp.f->mp_shared = mp.shared;
+	pthread_mutex_unlock(&mp.f->lock);
+
+	mp_suspend_threads(&mp);
+
+	/* The flags are shared with workers which failed to clone the fd */
+	fdflags = fcntl(fuse_chan_fd(ch), F_GETFL);
+	for (i = 0; i < numworker; i++) {
+		pid_t pid = fork();
+
+		if (pid == -1) {
+			perror("fuse: fork");
+			mp_kill_workers(&mp, SIGTERM);
+			break;
+		}
+		if (pid == 0)
+			mp_worker(&mp, i, ch, buf, bufsize);
+		mp.pids[i] = pid;
+	}
+
+	err = mp_wait_workers(&mp);
+	fuse_session_reset(se);
+	if (fdflags != -1)
+		fcntl(fuse_chan_fd(ch), F_SETFL, fdflags);
+
+	pthread_mutex_lock(&mp.f->lock);
+	mp.f->mp_shared = NULL;
+	pthread_mutex_unlock(&mp.f->lock);
+
+out_close:
+	for (i = 0; i < numworker; i++) {
+		close(mp.sock[i][0]);
+		close(mp.sock[i][1]);
+	}
+	munmap(mp.shared, sizeof(struct fuse_mp_shared));
+out_free:
+	free(mp.metrics_path);
+	free(mp.sock);
+	free(mp.pids);
+	free(base);
+
+	return err;
+}
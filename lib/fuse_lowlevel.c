@@ -49,12 +49,6 @@
 			const typeof( ((type *)0)->member ) *__mptr = (ptr); \
 			(type *)( (char *)__mptr - offsetof(type,member) );})
 
-struct fuse_pollhandle {
-	uint64_t kh;
-	struct fuse_chan *ch;
-	struct fuse_ll *f;
-};
-
 static size_t pagesize;
 
 static __attribute__((constructor)) void fuse_ll_init_pagesize(void)
@@ -182,17 +176,43 @@ static void destroy_req(fuse_req_t req)
 	free(req);
 }
 
+/*
+ * A request that is never answered goes back to the spare slot of the
+ * thread freeing it, unless that slot is already taken.
+ */
+static void fuse_ll_free_noreply_req(struct fuse_ll *f, fuse_req_t req)
+{
+	if (pthread_getspecific(f->req_key) == NULL &&
+	    pthread_setspecific(f->req_key, req) == 0)
+		return;
+
+	destroy_req(req);
+}
+
 void fuse_free_req(fuse_req_t req)
 {
 	int ctr;
 	struct fuse_ll *f = req->f;
 
+	if (req->metrics)
+		fuse_ll_metrics_done(f, req);
+	if (req->noreply) {
+		fuse_ll_free_noreply_req(f, req);
+		return;
+	}
+
 	pthread_mutex_lock(&f->lock);
 	req->u.ni.func = NULL;
 	req->u.ni.data = NULL;
 	list_del_req(req);
+	if (req->inflight) {
+		req->inflight = 0;
+		f->inflight--;
+	}
 	ctr = --req->ctr;
 	pthread_mutex_unlock(&f->lock);
+	if (req->admit_class)
+		fuse_ll_admit_done(f, req);
 	if (!ctr)
 		destroy_req(req);
 }
@@ -214,6 +234,37 @@ static struct fuse_req *fuse_ll_alloc_req(struct fuse_ll *f)
 	return req;
 }
 
+/*
+ * FORGET and BATCH_FORGET are never answered and cannot be interrupted,
+ * so their requests stay off the list of requests in flight.  Each
+ * thread keeps a spare one, so that a storm of them doesn't allocate.
+ */
+static struct fuse_req *fuse_ll_alloc_noreply_req(struct fuse_ll *f)
+{
+	struct fuse_req *req = pthread_getspecific(f->req_key);
+
+	if (req == NULL) {
+		req = fuse_ll_alloc_req(f);
+		if (req != NULL)
+			req->noreply = 1;
+	} else {
+		pthread_setspecific(f->req_key, NULL);
+		req->interrupted = 0;
+		req->metrics = 0;
+		req->opcode = 0;
+		req->metrics_start = 0;
+		req->u.ni.func = NULL;
+		req->u.ni.data = NULL;
+	}
+
+	return req;
+}
+
+static void fuse_ll_req_destructor(void *data)
+{
+	destroy_req((fuse_req_t) data);
+}
+
 
 static int fuse_send_msg(struct fuse_ll *f, struct fuse_chan *ch,
 			 struct iovec *iov, int count)
@@ -305,22 +356,33 @@ size_t fuse_dirent_size(size_t namelen)
 	return FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
 }
 
-char *fuse_add_dirent(char *buf, const char *name, const struct stat *stbuf,
-		      off_t off)
+/*
+ * Entries are 8 byte aligned and the name starts at offset 24, so the
+ * padding always lies within the last 8 bytes of the entry.  Clear
+ * those with a single store before copying the name over them.
+ */
+static void pack_dirent(char *buf, size_t entsize, const char *name,
+			size_t namelen, uint64_t ino, mode_t mode, off_t off)
 {
-	unsigned namelen = strlen(name);
-	unsigned entlen = FUSE_NAME_OFFSET + namelen;
-	unsigned entsize = fuse_dirent_size(namelen);
-	unsigned padlen = entsize - entlen;
 	struct fuse_dirent *dirent = (struct fuse_dirent *) buf;
+	uint64_t zero = 0;
 
-	dirent->ino = stbuf->st_ino;
+	memcpy(buf + entsize - sizeof(zero), &zero, sizeof(zero));
+	dirent->ino = ino;
 	dirent->off = off;
 	dirent->namelen = namelen;
-	dirent->type = (stbuf->st_mode & 0170000) >> 12;
-	strncpy(dirent->name, name, namelen);
-	if (padlen)
-		memset(buf + entlen, 0, padlen);
+	dirent->type = (mode & 0170000) >> 12;
+	memcpy(dirent->name, name, namelen);
+}
+
+char *fuse_add_dirent(char *buf, const char *name, const struct stat *stbuf,
+		      off_t off)
+{
+	size_t namelen = strlen(name);
+	size_t entsize = fuse_dirent_size(namelen);
+
+	pack_dirent(buf, entsize, name, namelen, stbuf->st_ino,
+		    stbuf->st_mode, off);
 
 	return buf + entsize;
 }
@@ -328,15 +390,40 @@ char *fuse_add_dirent(char *buf, const char *name, const struct stat *stbuf,
 size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf, off_t off)
 {
-	size_t entsize;
+	size_t namelen = strlen(name);
+	size_t entsize = fuse_dirent_size(namelen);
 
 	(void) req;
-	entsize = fuse_dirent_size(strlen(name));
 	if (entsize <= bufsize && buf)
-		fuse_add_dirent(buf, name, stbuf, off);
+		pack_dirent(buf, entsize, name, namelen, stbuf->st_ino,
+			    stbuf->st_mode, off);
 	return entsize;
 }
 
+size_t fuse_add_direntries(fuse_req_t req, char *buf, size_t bufsize,
+			   const struct fuse_direntry *entries, size_t count,
+			   size_t *used)
+{
+	size_t len = 0;
+	size_t i;
+
+	(void) req;
+	for (i = 0; i < count; i++) {
+		const struct fuse_direntry *ent = &entries[i];
+		size_t entsize = fuse_dirent_size(ent->namelen);
+
+		if (entsize > bufsize - len)
+			break;
+
+		pack_dirent(buf + len, entsize, ent->name, ent->namelen,
+			    ent->ino, ent->mode, ent->off);
+		len += entsize;
+	}
+	*used = len;
+
+	return i;
+}
+
 static void convert_statfs(const struct statvfs *stbuf,
 			   struct fuse_kstatfs *kstatfs)
 {
@@ -536,6 +623,9 @@ static int fuse_send_data_iov_fallback(struct fuse_ll *f, struct fuse_chan *ch,
 	void *mbuf;
 	int res;
 
+	if (f->metrics.enabled)
+		fuse_ll_metrics_event(f, FUSE_METRICS_DATA_COPY);
+
 	/* Optimize common case */
 	if (buf->count == 1 && buf->idx == 0 && buf->off == 0 &&
 	    !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
@@ -620,6 +710,76 @@ static struct fuse_ll_pipe *fuse_ll_get_pipe(struct fuse_ll *f)
 }
 #endif
 
+struct fuse_ll_detached {
+	int pipe[2];
+	struct fuse_bufvec bufv;
+	char mem[];
+};
+
+struct fuse_bufvec *fuse_req_detach_buf(fuse_req_t req,
+					struct fuse_bufvec *bufv)
+{
+	struct fuse_ll_detached *d;
+	struct fuse_buf *buf;
+	size_t size;
+
+	if (bufv == NULL || bufv != pthread_getspecific(req->f->bufv_key) ||
+	    bufv->idx >= bufv->count)
+		return NULL;
+
+	buf = &bufv->buf[bufv->idx];
+	size = buf->size - bufv->off;
+	if (buf->flags & FUSE_BUF_IS_FD) {
+		struct fuse_ll_pipe *llp = pthread_getspecific(req->f->pipe_key);
+
+		if (llp == NULL || llp->pipe[0] != buf->fd)
+			return NULL;
+
+		d = malloc(sizeof(struct fuse_ll_detached));
+		if (d == NULL)
+			return NULL;
+
+		/* The next request will get a new pipe */
+		pthread_setspecific(req->f->pipe_key, NULL);
+		d->pipe[0] = llp->pipe[0];
+		d->pipe[1] = llp->pipe[1];
+		free(llp);
+
+		d->bufv = FUSE_BUFVEC_INIT(size);
+		d->bufv.buf[0].flags = FUSE_BUF_IS_FD;
+		d->bufv.buf[0].fd = d->pipe[0];
+	} else {
+		d = malloc(sizeof(struct fuse_ll_detached) + size);
+		if (d == NULL)
+			return NULL;
+
+		d->pipe[0] = d->pipe[1] = -1;
+		memcpy(d->mem, (char *) buf->mem + bufv->off, size);
+		d->bufv = FUSE_BUFVEC_INIT(size);
+		d->bufv.buf[0].mem = d->mem;
+	}
+
+	bufv->off = 0;
+	bufv->idx = bufv->count;
+
+	return &d->bufv;
+}
+
+void fuse_detached_buf_free(struct fuse_bufvec *bufv)
+{
+	struct fuse_ll_detached *d;
+
+	if (bufv == NULL)
+		return;
+
+	d = container_of(bufv, struct fuse_ll_detached, bufv);
+	if (d->pipe[0] != -1) {
+		close(d->pipe[0]);
+		close(d->pipe[1]);
+	}
+	free(d);
+}
+
 static void fuse_ll_clear_pipe(struct fuse_ll *f)
 {
 	struct fuse_ll_pipe *llp = pthread_getspecific(f->pipe_key);
@@ -629,6 +789,109 @@ static void fuse_ll_clear_pipe(struct fuse_ll *f)
 	}
 }
 
+/*
+ * With "-o aligned_buffers" requests are read at an offset into a page
+ * aligned buffer, chosen so that the data of a WRITE request starts on a
+ * page boundary.  The request itself stays contiguous, which keeps the
+ * parsing unchanged, and the data can be passed to O_DIRECT I/O as is.
+ */
+size_t fuse_ll_recv_offset(struct fuse_ll *f)
+{
+	size_t hdrsize = sizeof(struct fuse_in_header);
+
+	if (!f->aligned_buffers)
+		return 0;
+
+	if (f->conn.proto_minor < 9)
+		hdrsize += FUSE_COMPAT_WRITE_IN_SIZE;
+	else
+		hdrsize += sizeof(struct fuse_write_in);
+
+	return pagesize - hdrsize;
+}
+
+/*
+ * Allocate a receive buffer of bufsize bytes.  If aligned buffers are
+ * enabled the allocation is one page larger, so that it can be read at
+ * fuse_ll_recv_offset().  The memory to free is returned in *basep.
+ */
+char *fuse_ll_alloc_recv_buf(struct fuse_ll *f, size_t bufsize, char **basep)
+{
+	void *base;
+
+	if (!f->aligned_buffers) {
+		*basep = (char *) malloc(bufsize);
+		return *basep;
+	}
+
+	if (posix_memalign(&base, pagesize, bufsize + pagesize) != 0)
+		return NULL;
+
+	*basep = (char *) base;
+	return *basep + fuse_ll_recv_offset(f);
+}
+
+struct fuse_ll_abuf {
+	size_t size;
+	char *base;
+};
+
+static void fuse_ll_abuf_destructor(void *data)
+{
+	struct fuse_ll_abuf *abuf = data;
+
+	free(abuf->base);
+	free(abuf);
+}
+
+static char *fuse_ll_get_abuf(struct fuse_ll *f, size_t bufsize)
+{
+	struct fuse_ll_abuf *abuf = pthread_getspecific(f->abuf_key);
+
+	if (abuf != NULL && abuf->size < bufsize) {
+		pthread_setspecific(f->abuf_key, NULL);
+		fuse_ll_abuf_destructor(abuf);
+		abuf = NULL;
+	}
+	if (abuf == NULL) {
+		abuf = malloc(sizeof(struct fuse_ll_abuf));
+		if (abuf == NULL)
+			return NULL;
+
+		if (fuse_ll_alloc_recv_buf(f, bufsize, &abuf->base) == NULL) {
+			free(abuf);
+			return NULL;
+		}
+		abuf->size = bufsize;
+		pthread_setspecific(f->abuf_key, abuf);
+	}
+
+	/* The offset changes once INIT has set the protocol version */
+	return abuf->base + fuse_ll_recv_offset(f);
+}
+
+static int fuse_ll_recv(struct fuse_ll *f, struct fuse_buf *buf,
+			size_t bufsize, struct fuse_chan **chp)
+{
+	char *mem = buf->mem;
+	int res;
+
+	if (f->aligned_buffers) {
+		mem = fuse_ll_get_abuf(f, bufsize);
+		if (mem == NULL)
+			mem = buf->mem;
+	}
+
+	res = fuse_chan_recv(chp, mem, bufsize);
+	if (res <= 0)
+		return res;
+
+	buf->mem = mem;
+	buf->size = res;
+
+	return res;
+}
+
 #if defined(HAVE_SPLICE) && defined(HAVE_VMSPLICE)
 static int read_back(int fd, char *buf, size_t len)
 {
@@ -833,6 +1096,8 @@ static int fuse_send_data_iov(struct fuse_ll *f, struct fuse_chan *ch,
 			res, out->len);
 		goto clear_pipe;
 	}
+	if (f->metrics.enabled)
+		fuse_ll_metrics_event(f, FUSE_METRICS_DATA_SPLICE);
 	return 0;
 
 clear_pipe:
@@ -1120,7 +1385,7 @@ static void do_batch_forget(fuse_req_t req, fuse_ino_t nodeid,
 			struct fuse_forget_one *forget = &param[i];
 			struct fuse_req *dummy_req;
 
-			dummy_req = fuse_ll_alloc_req(req->f);
+			dummy_req = fuse_ll_alloc_noreply_req(req->f);
 			if (dummy_req == NULL)
 				break;
 
@@ -1485,7 +1750,14 @@ static void do_write_buf(fuse_req_t req, fuse_ino_t nodeid, const void *inarg,
 	}
 	bufv.buf[0].size = arg->size;
 
+	/*
+	 * bufv lives on this stack frame, so it may only be detached
+	 * from this thread during the call.  The request itself may be
+	 * gone once write_buf returns.
+	 */
+	pthread_setspecific(f->bufv_key, &bufv);
 	req->f->op.write_buf(req, nodeid, &bufv, arg->offset, &fi);
+	pthread_setspecific(f->bufv_key, NULL);
 
 out:
 	/* Need to reset the pipe if ->write_buf() didn't consume all data */
@@ -1529,6 +1801,9 @@ static void do_release(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fi.lock_owner = arg->lock_owner;
 	}
 
+	if (req->f->op.poll)
+		fuse_ll_poll_release(req->f, nodeid, arg->fh);
+
 	if (req->f->op.release)
 		req->f->op.release(req, nodeid, &fi);
 	else
@@ -1881,11 +2156,6 @@ static void do_ioctl(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_err(req, ENOSYS);
 }
 
-void fuse_pollhandle_destroy(struct fuse_pollhandle *ph)
-{
-	free(ph);
-}
-
 static void do_poll(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_poll_in *arg = (struct fuse_poll_in *) inarg;
@@ -1899,14 +2169,12 @@ static void do_poll(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		struct fuse_pollhandle *ph = NULL;
 
 		if (arg->flags & FUSE_POLL_SCHEDULE_NOTIFY) {
-			ph = malloc(sizeof(struct fuse_pollhandle));
+			ph = fuse_ll_poll_register(req->f, nodeid, arg->fh,
+						   arg->kh, req->ch);
 			if (ph == NULL) {
 				fuse_reply_err(req, ENOMEM);
 				return;
 			}
-			ph->kh = arg->kh;
-			ph->ch = req->ch;
-			ph->f = req->f;
 		}
 
 		req->f->op.poll(req, nodeid, &fi, ph);
@@ -2063,6 +2331,10 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	if (f->op.init)
 		f->op.init(f->userdata, &f->conn);
 
+	/* After fuse_daemonize(), which doesn't keep threads */
+	if (f->metrics.path || f->metrics.port)
+		fuse_ll_metrics_start(f, f->metrics.path, f->metrics.port);
+
 	if (f->no_splice_read)
 		f->conn.want &= ~FUSE_CAP_SPLICE_READ;
 	if (f->no_splice_write)
@@ -2153,48 +2425,94 @@ static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	send_reply_ok(req, NULL, 0);
 }
 
-static void list_del_nreq(struct fuse_notify_req *nreq)
+#define FUSE_NOTIFY_MIN_SIZE 64
+#define FUSE_NOTIFY_POOL_MAX 4096
+
+static size_t notify_hash(size_t size, uint64_t unique)
 {
-	struct fuse_notify_req *prev = nreq->prev;
-	struct fuse_notify_req *next = nreq->next;
-	prev->next = next;
-	next->prev = prev;
+	return (size_t) ((unique * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+/* Called with t->lock held */
+static int notify_resize(struct fuse_notify_table *t)
+{
+	size_t newsize = t->size ? t->size * 2 : FUSE_NOTIFY_MIN_SIZE;
+	struct fuse_notify_req **newarray;
+	size_t i;
+
+	newarray = calloc(newsize, sizeof(struct fuse_notify_req *));
+	if (newarray == NULL)
+		return -1;
+
+	for (i = 0; i < t->size; i++) {
+		struct fuse_notify_req *nreq;
+		struct fuse_notify_req *next;
+
+		for (nreq = t->array[i]; nreq != NULL; nreq = next) {
+			size_t hash = notify_hash(newsize, nreq->unique);
+
+			next = nreq->next;
+			nreq->next = newarray[hash];
+			newarray[hash] = nreq;
+		}
+	}
+	free(t->array);
+	t->array = newarray;
+	t->size = newsize;
+
+	return 0;
 }
 
-static void list_add_nreq(struct fuse_notify_req *nreq,
-			  struct fuse_notify_req *next)
+/* Called with t->lock held */
+static int notify_insert(struct fuse_notify_table *t,
+			 struct fuse_notify_req *nreq)
 {
-	struct fuse_notify_req *prev = next->prev;
-	nreq->next = next;
-	nreq->prev = prev;
-	prev->next = nreq;
-	next->prev = nreq;
+	size_t hash;
+
+	if (t->use >= t->size && notify_resize(t) == -1 && !t->size)
+		return -1;
+
+	hash = notify_hash(t->size, nreq->unique);
+	nreq->next = t->array[hash];
+	t->array[hash] = nreq;
+	t->use++;
+
+	return 0;
 }
 
-static void list_init_nreq(struct fuse_notify_req *nreq)
+/* Called with t->lock held */
+static struct fuse_notify_req *notify_remove(struct fuse_notify_table *t,
+					     uint64_t unique)
 {
-	nreq->next = nreq;
-	nreq->prev = nreq;
+	struct fuse_notify_req **nreqp;
+
+	if (!t->size)
+		return NULL;
+
+	nreqp = &t->array[notify_hash(t->size, unique)];
+	for (; *nreqp != NULL; nreqp = &(*nreqp)->next) {
+		struct fuse_notify_req *nreq = *nreqp;
+
+		if (nreq->unique == unique) {
+			*nreqp = nreq->next;
+			t->use--;
+			return nreq;
+		}
+	}
+	return NULL;
 }
 
 static void do_notify_reply(fuse_req_t req, fuse_ino_t nodeid,
 			    const void *inarg, const struct fuse_buf *buf)
 {
-	struct fuse_ll *f = req->f;
+	struct fuse_notify_table *t = &req->f->notify;
 	struct fuse_notify_req *nreq;
-	struct fuse_notify_req *head;
 
-	pthread_mutex_lock(&f->lock);
-	head = &f->notify_list;
-	for (nreq = head->next; nreq != head; nreq = nreq->next) {
-		if (nreq->unique == req->unique) {
-			list_del_nreq(nreq);
-			break;
-		}
-	}
-	pthread_mutex_unlock(&f->lock);
+	pthread_mutex_lock(&t->lock);
+	nreq = notify_remove(t, req->unique);
+	pthread_mutex_unlock(&t->lock);
 
-	if (nreq != head)
+	if (nreq != NULL)
 		nreq->reply(nreq, req, nodeid, inarg, buf);
 }
 
@@ -2358,6 +2676,22 @@ struct fuse_retrieve_req {
 	void *cookie;
 };
 
+static void fuse_ll_retrieve_put(struct fuse_ll *f,
+				 struct fuse_retrieve_req *rreq)
+{
+	struct fuse_notify_table *t = &f->notify;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->pooled < FUSE_NOTIFY_POOL_MAX) {
+		rreq->nreq.next = t->pool;
+		t->pool = &rreq->nreq;
+		t->pooled++;
+		rreq = NULL;
+	}
+	pthread_mutex_unlock(&t->lock);
+	free(rreq);
+}
+
 static void fuse_ll_retrieve_reply(struct fuse_notify_req *nreq,
 				   fuse_req_t req, fuse_ino_t ino,
 				   const void *inarg,
@@ -2371,6 +2705,10 @@ static void fuse_ll_retrieve_reply(struct fuse_notify_req *nreq,
 		.buf[0] = *ibuf,
 		.count = 1,
 	};
+	void *cookie = rreq->cookie;
+
+	/* The callback may start new retrieves, let it reuse this one */
+	fuse_ll_retrieve_put(f, rreq);
 
 	if (!(bufv.buf[0].flags & FUSE_BUF_IS_FD))
 		bufv.buf[0].mem = PARAM(arg);
@@ -2386,25 +2724,83 @@ static void fuse_ll_retrieve_reply(struct fuse_notify_req *nreq,
 	bufv.buf[0].size = arg->size;
 
 	if (req->f->op.retrieve_reply) {
-		req->f->op.retrieve_reply(req, rreq->cookie, ino,
+		req->f->op.retrieve_reply(req, cookie, ino,
 					  arg->offset, &bufv);
 	} else {
 		fuse_reply_none(req);
 	}
 out:
-	free(rreq);
 	if ((ibuf->flags & FUSE_BUF_IS_FD) && bufv.idx < bufv.count)
 		fuse_ll_clear_pipe(f);
 }
 
-int fuse_lowlevel_notify_retrieve(struct fuse_chan *ch, fuse_ino_t ino,
-				  size_t size, off_t offset, void *cookie)
+/*
+ * Allocate the unique of a notification expecting a reply.  In
+ * multi-process mode the counter is shared and the index of the worker
+ * is stored in the low bits, so that the reply can be routed back to it.
+ */
+uint64_t fuse_ll_notify_unique(struct fuse_ll *f)
+{
+	if (f->mp_shared) {
+		uint64_t ctr;
+
+		ctr = __sync_fetch_and_add(&f->mp_shared->notify_ctr, 1);
+		return (ctr << FUSE_MP_WORKER_BITS) | f->mp_worker;
+	}
+	return __sync_fetch_and_add(&f->notify_ctr, 1);
+}
+
+/* Number of retrieve requests set up under one lock */
+#define FUSE_RETRIEVE_CHUNK 32
+
+/*
+ * Take requests from the pool, or allocate them, and enter them in the
+ * table.  Returns the number of requests set up.
+ */
+static size_t fuse_ll_retrieve_get(struct fuse_ll *f,
+				   struct fuse_retrieve_req **rreqs,
+				   const struct fuse_retrieve_range *ranges,
+				   size_t count)
+{
+	struct fuse_notify_table *t = &f->notify;
+	size_t i;
+
+	pthread_mutex_lock(&t->lock);
+	for (i = 0; i < count; i++) {
+		struct fuse_retrieve_req *rreq;
+
+		if (t->pool != NULL) {
+			rreq = container_of(t->pool, struct fuse_retrieve_req,
+					    nreq);
+			t->pool = t->pool->next;
+			t->pooled--;
+		} else {
+			rreq = malloc(sizeof(*rreq));
+			if (rreq == NULL)
+				break;
+		}
+		rreq->cookie = ranges[i].cookie;
+		rreq->nreq.unique = fuse_ll_notify_unique(f);
+		rreq->nreq.reply = fuse_ll_retrieve_reply;
+		if (notify_insert(t, &rreq->nreq) == -1) {
+			free(rreq);
+			break;
+		}
+		rreqs[i] = rreq;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return i;
+}
+
+int fuse_lowlevel_notify_retrieve_batch(struct fuse_chan *ch,
+				const struct fuse_retrieve_range *ranges,
+				size_t count)
 {
-	struct fuse_notify_retrieve_out outarg;
+	struct fuse_retrieve_req *rreqs[FUSE_RETRIEVE_CHUNK];
 	struct fuse_ll *f;
-	struct iovec iov[2];
-	struct fuse_retrieve_req *rreq;
-	int err;
+	size_t sent = 0;
+	int err = 0;
 
 	if (!ch)
 		return -EINVAL;
@@ -2416,34 +2812,67 @@ int fuse_lowlevel_notify_retrieve(struct fuse_chan *ch, fuse_ino_t ino,
 	if (f->conn.proto_minor < 15)
 		return -ENOSYS;
 
-	rreq = malloc(sizeof(*rreq));
-	if (rreq == NULL)
-		return -ENOMEM;
+	while (sent < count && !err) {
+		size_t num = count - sent;
+		size_t got;
+		size_t i;
 
-	pthread_mutex_lock(&f->lock);
-	rreq->cookie = cookie;
-	rreq->nreq.unique = f->notify_ctr++;
-	rreq->nreq.reply = fuse_ll_retrieve_reply;
-	list_add_nreq(&rreq->nreq, &f->notify_list);
-	pthread_mutex_unlock(&f->lock);
+		if (num > FUSE_RETRIEVE_CHUNK)
+			num = FUSE_RETRIEVE_CHUNK;
 
-	outarg.notify_unique = rreq->nreq.unique;
-	outarg.nodeid = ino;
-	outarg.offset = offset;
-	outarg.size = size;
+		got = fuse_ll_retrieve_get(f, rreqs, ranges + sent, num);
+		if (!got) {
+			err = -ENOMEM;
+			break;
+		}
 
-	iov[1].iov_base = &outarg;
-	iov[1].iov_len = sizeof(outarg);
+		for (i = 0; i < got; i++) {
+			const struct fuse_retrieve_range *r = &ranges[sent];
+			struct fuse_notify_retrieve_out outarg;
+			struct iovec iov[2];
 
-	err = send_notify_iov(f, ch, FUSE_NOTIFY_RETRIEVE, iov, 2);
-	if (err) {
-		pthread_mutex_lock(&f->lock);
-		list_del_nreq(&rreq->nreq);
-		pthread_mutex_unlock(&f->lock);
-		free(rreq);
+			outarg.notify_unique = rreqs[i]->nreq.unique;
+			outarg.nodeid = r->ino;
+			outarg.offset = r->offset;
+			outarg.size = r->size;
+
+			iov[1].iov_base = &outarg;
+			iov[1].iov_len = sizeof(outarg);
+
+			/* Once sent, the reply may already be processed */
+			err = send_notify_iov(f, ch, FUSE_NOTIFY_RETRIEVE,
+					      iov, 2);
+			if (err)
+				break;
+			sent++;
+		}
+
+		/* Take back the requests that the kernel hasn't seen */
+		for (; i < got; i++) {
+			pthread_mutex_lock(&f->notify.lock);
+			notify_remove(&f->notify, rreqs[i]->nreq.unique);
+			pthread_mutex_unlock(&f->notify.lock);
+			fuse_ll_retrieve_put(f, rreqs[i]);
+		}
+		if (got < num && !err)
+			err = -ENOMEM;
 	}
 
-	return err;
+	return sent ? (int) sent : err;
+}
+
+int fuse_lowlevel_notify_retrieve(struct fuse_chan *ch, fuse_ino_t ino,
+				  size_t size, off_t offset, void *cookie)
+{
+	struct fuse_retrieve_range range = {
+		.ino = ino,
+		.size = size,
+		.offset = offset,
+		.cookie = cookie,
+	};
+	int res = fuse_lowlevel_notify_retrieve_batch(ch, &range, 1);
+
+	return res < 0 ? res : 0;
 }
 
 void *fuse_req_userdata(fuse_req_t req)
@@ -2558,6 +2987,11 @@ static const char *opname(enum fuse_opcode opcode)
 		return fuse_ll_ops[opcode].name;
 }
 
+const char *fuse_ll_opname(int opcode)
+{
+	return opname((enum fuse_opcode) opcode);
+}
+
 static int fuse_ll_copy_from_pipe(struct fuse_bufvec *dst,
 				  struct fuse_bufvec *src)
 {
@@ -2585,9 +3019,13 @@ static void fuse_ll_process_buf(void *data, const struct fuse_buf *buf,
 	const void *inarg;
 	struct fuse_req *req;
 	void *mbuf = NULL;
+	double start = 0;
 	int err;
 	int res;
 
+	if (f->metrics.enabled)
+		start = fuse_ll_metrics_now();
+
 	if (buf->flags & FUSE_BUF_IS_FD) {
 		if (buf->size < tmpbuf.buf[0].size)
 			tmpbuf.buf[0].size = buf->size;
@@ -2616,7 +3054,10 @@ static void fuse_ll_process_buf(void *data, const struct fuse_buf *buf,
 			(unsigned long) in->nodeid, buf->size, in->pid);
 	}
 
-	req = fuse_ll_alloc_req(f);
+	if (in->opcode == FUSE_FORGET || in->opcode == FUSE_BATCH_FORGET)
+		req = fuse_ll_alloc_noreply_req(f);
+	else
+		req = fuse_ll_alloc_req(f);
 	if (req == NULL) {
 		struct fuse_out_header out = {
 			.unique = in->unique,
@@ -2659,16 +3100,27 @@ static void fuse_ll_process_buf(void *data, const struct fuse_buf *buf,
 	err = ENOSYS;
 	if (in->opcode >= FUSE_MAXOP || !fuse_ll_ops[in->opcode].func)
 		goto reply_err;
-	if (in->opcode != FUSE_INTERRUPT) {
+	req->metrics = start != 0;
+	req->opcode = in->opcode;
+	req->metrics_start = start;
+	if (in->opcode != FUSE_INTERRUPT && !req->noreply) {
 		struct fuse_req *intr;
 		pthread_mutex_lock(&f->lock);
 		intr = check_interrupt(f, req);
 		list_add_req(req, &f->list);
+		req->inflight = 1;
+		f->inflight++;
 		pthread_mutex_unlock(&f->lock);
 		if (intr)
 			fuse_reply_err(intr, EAGAIN);
 	}
 
+	if (fuse_ll_admit_enabled(f)) {
+		err = fuse_ll_admit(fuse_chan_session(ch), f, req, in->opcode);
+		if (err)
+			goto reply_err;
+	}
+
 	if ((buf->flags & FUSE_BUF_IS_FD) && write_header_size < buf->size &&
 	    (in->opcode != FUSE_WRITE || !f->op.write_buf) &&
 	    in->opcode != FUSE_NOTIFY_REPLY) {
@@ -2701,6 +3153,9 @@ static void fuse_ll_process_buf(void *data, const struct fuse_buf *buf,
 
 out_free:
 	free(mbuf);
+	if (start)
+		fuse_ll_metrics_processed(f, start,
+					  buf->flags & FUSE_BUF_IS_FD);
 	return;
 
 reply_err:
@@ -2750,6 +3205,19 @@ static const struct fuse_opt fuse_ll_opts[] = {
 	{ "no_splice_move", offsetof(struct fuse_ll, no_splice_move), 1},
 	{ "splice_read", offsetof(struct fuse_ll, splice_read), 1},
 	{ "no_splice_read", offsetof(struct fuse_ll, no_splice_read), 1},
+	{ "aligned_buffers", offsetof(struct fuse_ll, aligned_buffers), 1},
+	{ "admit_limit=%u", offsetof(struct fuse_ll, admit.param.max_limit), 0},
+	{ "admit_min=%u", offsetof(struct fuse_ll, admit.param.min_limit), 0},
+	{ "admit_latency=%lf",
+	  offsetof(struct fuse_ll, admit.param.latency_factor), 0},
+	{ "admit_shed_meta=%i",
+	  offsetof(struct fuse_ll, admit.param.shed_errno[FUSE_ADMIT_META]), 0},
+	{ "admit_shed_read=%i",
+	  offsetof(struct fuse_ll, admit.param.shed_errno[FUSE_ADMIT_READ]), 0},
+	{ "admit_shed_write=%i",
+	  offsetof(struct fuse_ll, admit.param.shed_errno[FUSE_ADMIT_WRITE]), 0},
+	{ "metrics_socket=%s", offsetof(struct fuse_ll, metrics.path), 0},
+	{ "metrics_port=%u", offsetof(struct fuse_ll, metrics.port), 0},
 	FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_DISCARD),
 	FUSE_OPT_KEY("-h", KEY_HELP),
 	FUSE_OPT_KEY("--help", KEY_HELP),
@@ -2781,6 +3249,14 @@ static void fuse_ll_help(void)
 "    -o [no_]splice_write   use splice to write to the fuse device\n"
 "    -o [no_]splice_move    move data while splicing to the fuse device\n"
 "    -o [no_]splice_read    use splice to read from the fuse device\n"
+"    -o aligned_buffers     page align the data of write requests\n"
+"    -o admit_limit=N       limit requests in flight per class to N\n"
+"    -o admit_min=N         lower bound of the adaptive limits (1)\n"
+"    -o admit_latency=F     shrink limits when latency grows F times (0)\n"
+"    -o admit_shed_CLASS=E  fail meta, read or write requests over the\n"
+"                           limit with errno E instead of waiting\n"
+"    -o metrics_socket=PATH export metrics on a Unix domain socket\n"
+"    -o metrics_port=N      export metrics on a port of 127.0.0.1\n"
 );
 }
 
@@ -2810,11 +3286,37 @@ int fuse_lowlevel_is_lib_option(const char *opt)
 	return fuse_opt_match(fuse_ll_opts, opt);
 }
 
+/* Outstanding retrieves are never answered once the session is gone */
+static void fuse_ll_notify_free(struct fuse_notify_table *t)
+{
+	struct fuse_notify_req *nreq;
+	struct fuse_notify_req *next;
+	size_t i;
+
+	for (i = 0; i < t->size; i++) {
+		for (nreq = t->array[i]; nreq != NULL; nreq = next) {
+			next = nreq->next;
+			free(container_of(nreq, struct fuse_retrieve_req,
+					  nreq));
+		}
+	}
+	for (nreq = t->pool; nreq != NULL; nreq = next) {
+		next = nreq->next;
+		free(container_of(nreq, struct fuse_retrieve_req, nreq));
+	}
+	free(t->array);
+	pthread_mutex_destroy(&t->lock);
+}
+
 static void fuse_ll_destroy(void *data)
 {
 	struct fuse_ll *f = (struct fuse_ll *) data;
 	struct fuse_ll_pipe *llp;
+	struct fuse_ll_abuf *abuf;
+	struct fuse_req *req;
 
+	fuse_ll_tune_stop(f);
+	fuse_ll_metrics_stop(f);
 	if (f->got_init && !f->got_destroy) {
 		if (f->op.destroy)
 			f->op.destroy(f->userdata);
@@ -2823,7 +3325,22 @@ static void fuse_ll_destroy(void *data)
 	if (llp != NULL)
 		fuse_ll_pipe_free(llp);
 	pthread_key_delete(f->pipe_key);
+	abuf = pthread_getspecific(f->abuf_key);
+	if (abuf != NULL)
+		fuse_ll_abuf_destructor(abuf);
+	pthread_key_delete(f->abuf_key);
+	req = pthread_getspecific(f->req_key);
+	if (req != NULL)
+		destroy_req(req);
+	pthread_key_delete(f->req_key);
+	pthread_key_delete(f->bufv_key);
+	fuse_ll_notify_free(&f->notify);
+	fuse_ll_poll_free(f);
+	fuse_ll_admit_destroy(f);
+	fuse_ll_metrics_destroy(f);
 	pthread_mutex_destroy(&f->lock);
+	free(f->ctl_dir);
+	free(f->bdi_dir);
 	free(f->cuse_data);
 	free(f);
 }
@@ -2924,27 +3441,15 @@ static int fuse_ll_receive_buf(struct fuse_session *se, struct fuse_buf *buf,
 	return res;
 
 fallback:
-	res = fuse_chan_recv(chp, buf->mem, bufsize);
-	if (res <= 0)
-		return res;
-
-	buf->size = res;
-
-	return res;
+	return fuse_ll_recv(f, buf, bufsize, chp);
 }
 #else
 static int fuse_ll_receive_buf(struct fuse_session *se, struct fuse_buf *buf,
 			       struct fuse_chan **chp)
 {
-	(void) se;
-
-	int res = fuse_chan_recv(chp, buf->mem, buf->size);
-	if (res <= 0)
-		return res;
-
-	buf->size = res;
+	struct fuse_ll *f = fuse_session_data(se);
 
-	return res;
+	return fuse_ll_recv(f, buf, buf->size, chp);
 }
 #endif
 
@@ -2983,9 +3488,10 @@ struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
 	f->atomic_o_trunc = 0;
 	list_init_req(&f->list);
 	list_init_req(&f->interrupts);
-	list_init_nreq(&f->notify_list);
 	f->notify_ctr = 1;
 	fuse_mutex_init(&f->lock);
+	fuse_mutex_init(&f->notify.lock);
+	fuse_mutex_init(&f->poll.lock);
 
 	err = pthread_key_create(&f->pipe_key, fuse_ll_pipe_destructor);
 	if (err) {
@@ -2994,8 +3500,33 @@ struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
 		goto out_free;
 	}
 
-	if (fuse_opt_parse(args, f, fuse_ll_opts, fuse_ll_opt_proc) == -1)
+	err = pthread_key_create(&f->abuf_key, fuse_ll_abuf_destructor);
+	if (err) {
+		fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+			strerror(err));
 		goto out_key_destroy;
+	}
+
+	err = pthread_key_create(&f->req_key, fuse_ll_req_destructor);
+	if (err) {
+		fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+			strerror(err));
+		goto out_abuf_key_destroy;
+	}
+
+	err = pthread_key_create(&f->bufv_key, NULL);
+	if (err) {
+		fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+			strerror(err));
+		goto out_req_key_destroy;
+	}
+
+	if (fuse_opt_parse(args, f, fuse_ll_opts, fuse_ll_opt_proc) == -1)
+		goto out_bufv_key_destroy;
+
+	fuse_ll_admit_init(f);
+	if (fuse_ll_metrics_init(f) == -1)
+		goto out_admit_destroy;
 
 	if (f->debug)
 		fprintf(stderr, "FUSE library version: %s\n", PACKAGE_VERSION);
@@ -3006,16 +3537,28 @@ struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
 
 	se = fuse_session_new(&sop, f);
 	if (!se)
-		goto out_key_destroy;
+		goto out_metrics_destroy;
 
 	se->receive_buf = fuse_ll_receive_buf;
 	se->process_buf = fuse_ll_process_buf;
 
 	return se;
 
+out_metrics_destroy:
+	fuse_ll_metrics_destroy(f);
+out_admit_destroy:
+	fuse_ll_admit_destroy(f);
+out_bufv_key_destroy:
+	pthread_key_delete(f->bufv_key);
+out_req_key_destroy:
+	pthread_key_delete(f->req_key);
+out_abuf_key_destroy:
+	pthread_key_delete(f->abuf_key);
 out_key_destroy:
 	pthread_key_delete(f->pipe_key);
 out_free:
+	pthread_mutex_destroy(&f->poll.lock);
+	pthread_mutex_destroy(&f->notify.lock);
 	pthread_mutex_destroy(&f->lock);
 	free(f);
 out:
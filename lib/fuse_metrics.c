@@ -0,0 +1,773 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "fuse_lowlevel.h"
+#include "fuse_misc.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* How long a client may take to send its request or read the reply */
+#define METRICS_TIMEOUT_MS 1000
+
+struct fuse_metrics_server {
+	struct fuse_ll *f;
+	pthread_t thread;
+	int fd;
+	/* Written to by fuse_ll_metrics_stop() */
+	int wake[2];
+	/* The socket to remove, NULL for a port */
+	char *path;
+	unsigned int port;
+};
+
+struct fuse_metrics_out {
+	char *buf;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+/* Upper bounds of the latency buckets */
+static const double bucket_bound[FUSE_METRICS_NBUCKETS] = {
+	0.000001, 0.000004, 0.000016, 0.000064, 0.000256, 0.001024,
+	0.004096, 0.016384, 0.065536, 0.262144, 1.048576, 4.194304,
+};
+
+static const char *bucket_label[FUSE_METRICS_NBUCKETS] = {
+	"0.000001", "0.000004", "0.000016", "0.000064", "0.000256", "0.001024",
+	"0.004096", "0.016384", "0.065536", "0.262144", "1.048576", "4.194304",
+};
+
+double fuse_ll_metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void metrics_thread_release(void *data)
+{
+	struct fuse_metrics_thread *t = (struct fuse_metrics_thread *) data;
+
+	pthread_mutex_lock(&t->m->lock);
+	t->owned = 0;
+	pthread_mutex_unlock(&t->m->lock);
+}
+
+/* The lock is only taken the first time a thread counts something */
+static struct fuse_metrics_thread *metrics_thread(struct fuse_metrics *m)
+{
+	struct fuse_metrics_thread *t = pthread_getspecific(m->key);
+
+	if (t != NULL)
+		return t;
+
+	pthread_mutex_lock(&m->lock);
+	for (t = m->threads; t != NULL; t = t->next) {
+		if (!t->owned)
+			break;
+	}
+	if (t == NULL) {
+		t = (struct fuse_metrics_thread *)
+			calloc(1, sizeof(struct fuse_metrics_thread));
+		if (t != NULL) {
+			t->m = m;
+			t->next = m->threads;
+			m->threads = t;
+		}
+	}
+	if (t != NULL)
+		t->owned = 1;
+	pthread_mutex_unlock(&m->lock);
+
+	if (t != NULL && pthread_setspecific(m->key, t) != 0) {
+		metrics_thread_release(t);
+		t = NULL;
+	}
+	return t;
+}
+
+int fuse_ll_metrics_init(struct fuse_ll *f)
+{
+	struct fuse_metrics *m = &f->metrics;
+	int err;
+
+	err = pthread_key_create(&m->key, metrics_thread_release);
+	if (err) {
+		fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+			strerror(err));
+		free(m->path);
+		return -1;
+	}
+	fuse_mutex_init(&m->lock);
+
+	return 0;
+}
+
+void fuse_ll_metrics_destroy(struct fuse_ll *f)
+{
+	struct fuse_metrics *m = &f->metrics;
+	struct fuse_metrics_thread *t;
+
+	pthread_key_delete(m->key);
+	while ((t = m->threads) != NULL) {
+		m->threads = t->next;
+		free(t);
+	}
+	pthread_mutex_destroy(&m->lock);
+	free(m->path);
+}
+
+/* Called when the request is freed, after its reply */
+void fuse_ll_metrics_done(struct fuse_ll *f, struct fuse_req *req)
+{
+	struct fuse_metrics_thread *t = metrics_thread(&f->metrics);
+	unsigned int op = req->opcode;
+	double latency;
+	int i;
+
+	req->metrics = 0;
+	if (t == NULL || op >= FUSE_METRICS_NOPS)
+		return;
+
+	latency = fuse_ll_metrics_now() - req->metrics_start;
+	for (i = 0; i < FUSE_METRICS_NBUCKETS; i++) {
+		if (latency <= bucket_bound[i]) {
+			t->bucket[op][i]++;
+			break;
+		}
+	}
+	t->latency[op] += latency;
+	t->count[op]++;
+}
+
+/* Called when a thread is done processing a request it received */
+void fuse_ll_metrics_processed(struct fuse_ll *f, double start, int spliced)
+{
+	struct fuse_metrics_thread *t = metrics_thread(&f->metrics);
+
+	if (t == NULL)
+		return;
+
+	t->busy += fuse_ll_metrics_now() - start;
+	t->events[spliced ? FUSE_METRICS_RECV_SPLICE : FUSE_METRICS_RECV_COPY]++;
+}
+
+void fuse_ll_metrics_event(struct fuse_ll *f, int event)
+{
+	struct fuse_metrics_thread *t = metrics_thread(&f->metrics);
+
+	if (t != NULL)
+		t->events[event]++;
+}
+
+static void out_printf(struct fuse_metrics_out *out, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	if (out->failed)
+		return;
+
+	va_start(ap, fmt);
+	res = vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+	va_end(ap);
+	if (res < 0) {
+		out->failed = 1;
+		return;
+	}
+	if ((size_t) res >= out->size - out->len) {
+		size_t newsize = out->size * 2;
+		char *newbuf;
+
+		while (newsize - out->len <= (size_t) res)
+			newsize *= 2;
+		newbuf = realloc(out->buf, newsize);
+		if (newbuf == NULL) {
+			out->failed = 1;
+			return;
+		}
+		out->buf = newbuf;
+		out->size = newsize;
+
+		va_start(ap, fmt);
+		vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+		va_end(ap);
+	}
+	out->len += res;
+}
+
+void fuse_metrics_family(struct fuse_metrics_out *out, const char *name,
+			 const char *type, const char *help)
+{
+	out_printf(out, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+void fuse_metrics_sample(struct fuse_metrics_out *out, const char *name,
+			 const char *labels, double value)
+{
+	/* Counts are printed in full, not rounded to 9 digits */
+	if (value == (double) (long long) value)
+		out_printf(out, "%s%s%s%s %lld\n", name, labels ? "{" : "",
+			   labels ? labels : "", labels ? "}" : "",
+			   (long long) value);
+	else
+		out_printf(out, "%s%s%s%s %.9g\n", name, labels ? "{" : "",
+			   labels ? labels : "", labels ? "}" : "", value);
+}
+
+static void metrics_requests(struct fuse_metrics_out *out,
+			     const struct fuse_metrics_thread *sum)
+{
+	char labels[64];
+	int op;
+	int i;
+
+	fuse_metrics_family(out, "fuse_requests", "counter",
+			    "Requests completed, by opcode.");
+	for (op = 0; op < FUSE_METRICS_NOPS; op++) {
+		if (!sum->count[op])
+			continue;
+		snprintf(labels, sizeof(labels), "op=\"%s\"",
+			 fuse_ll_opname(op));
+		fuse_metrics_sample(out, "fuse_requests_total", labels,
+				    sum->count[op]);
+	}
+
+	fuse_metrics_family(out, "fuse_request_duration_seconds", "histogram",
+			    "Time from receiving a request to freeing it after the reply, by opcode.");
+	for (op = 0; op < FUSE_METRICS_NOPS; op++) {
+		uint64_t cumulative = 0;
+		const char *name;
+
+		if (!sum->count[op])
+			continue;
+		name = fuse_ll_opname(op);
+		for (i = 0; i < FUSE_METRICS_NBUCKETS; i++) {
+			cumulative += sum->bucket[op][i];
+			snprintf(labels, sizeof(labels), "op=\"%s\",le=\"%s\"",
+				 name, bucket_label[i]);
+			fuse_metrics_sample(out,
+					    "fuse_request_duration_seconds_bucket",
+					    labels, cumulative);
+		}
+		snprintf(labels, sizeof(labels), "op=\"%s\",le=\"+Inf\"", name);
+		fuse_metrics_sample(out, "fuse_request_duration_seconds_bucket",
+				    labels, sum->count[op]);
+		snprintf(labels, sizeof(labels), "op=\"%s\"", name);
+		fuse_metrics_sample(out, "fuse_request_duration_seconds_count",
+				    labels, sum->count[op]);
+		fuse_metrics_sample(out, "fuse_request_duration_seconds_sum",
+				    labels, sum->latency[op]);
+	}
+}
+
+static void metrics_admit(struct fuse_ll *f, struct fuse_metrics_out *out)
+{
+	static const char *class_label[FUSE_ADMIT_NCLASS] = {
+		"class=\"meta\"", "class=\"read\"", "class=\"write\"",
+	};
+	struct fuse_admit *a = &f->admit;
+	struct fuse_admit_state cls[FUSE_ADMIT_NCLASS];
+	int i;
+
+	pthread_mutex_lock(&a->lock);
+	if (!a->enabled) {
+		pthread_mutex_unlock(&a->lock);
+		return;
+	}
+	memcpy(cls, a->cls, sizeof(cls));
+	pthread_mutex_unlock(&a->lock);
+
+	fuse_metrics_family(out, "fuse_admit_limit", "gauge",
+			    "Requests of a class admitted at the same time.");
+	for (i = 0; i < FUSE_ADMIT_NCLASS; i++)
+		fuse_metrics_sample(out, "fuse_admit_limit", class_label[i],
+				    (unsigned int) cls[i].limit);
+	fuse_metrics_family(out, "fuse_admit_waiting", "gauge",
+			    "Requests waiting to be admitted.");
+	for (i = 0; i < FUSE_ADMIT_NCLASS; i++)
+		fuse_metrics_sample(out, "fuse_admit_waiting", class_label[i],
+				    cls[i].waiting);
+	fuse_metrics_family(out, "fuse_admit_shed", "counter",
+			    "Requests failed by admission control.");
+	for (i = 0; i < FUSE_ADMIT_NCLASS; i++)
+		fuse_metrics_sample(out, "fuse_admit_shed_total",
+				    class_label[i], cls[i].shed);
+}
+
+static void metrics_collect(struct fuse_ll *f, struct fuse_metrics_out *out)
+{
+	struct fuse_metrics *m = &f->metrics;
+	struct fuse_metrics_source sources[FUSE_METRICS_MAX_SOURCES];
+	struct fuse_metrics_thread *sum;
+	struct fuse_metrics_thread *t;
+	unsigned int nthreads = 0;
+	unsigned int nblocks = 0;
+	unsigned int inflight;
+	int nsources;
+	int op;
+	int i;
+
+	sum = (struct fuse_metrics_thread *)
+		calloc(1, sizeof(struct fuse_metrics_thread));
+	if (sum == NULL) {
+		out->failed = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	for (t = m->threads; t != NULL; t = t->next) {
+		for (op = 0; op < FUSE_METRICS_NOPS; op++) {
+			sum->count[op] += t->count[op];
+			sum->latency[op] += t->latency[op];
+			for (i = 0; i < FUSE_METRICS_NBUCKETS; i++)
+				sum->bucket[op][i] += t->bucket[op][i];
+		}
+		sum->busy += t->busy;
+		for (i = 0; i < FUSE_METRICS_NEVENTS; i++)
+			sum->events[i] += t->events[i];
+		if (t->owned)
+			nthreads++;
+		nblocks++;
+	}
+	/* Sources are called unlocked, they may take locks of their own */
+	nsources = m->nsources;
+	memcpy(sources, m->sources, sizeof(sources));
+	pthread_mutex_unlock(&m->lock);
+
+	pthread_mutex_lock(&f->lock);
+	inflight = f->inflight;
+	pthread_mutex_unlock(&f->lock);
+
+	metrics_requests(out, sum);
+
+	fuse_metrics_family(out, "fuse_requests_in_flight", "gauge",
+			    "Requests received and not yet replied to.");
+	fuse_metrics_sample(out, "fuse_requests_in_flight", NULL, inflight);
+
+	fuse_metrics_family(out, "fuse_threads", "gauge",
+			    "Running threads which processed or replied to requests.");
+	fuse_metrics_sample(out, "fuse_threads", NULL, nthreads);
+	fuse_metrics_family(out, "fuse_thread_busy_seconds", "counter",
+			    "Time threads spent processing requests they received.");
+	fuse_metrics_sample(out, "fuse_thread_busy_seconds_total", NULL,
+			    sum->busy);
+
+	fuse_metrics_family(out, "fuse_received", "counter",
+			    "Requests received, left in a pipe by splice or copied to memory.");
+	fuse_metrics_sample(out, "fuse_received_total", "mode=\"splice\"",
+			    sum->events[FUSE_METRICS_RECV_SPLICE]);
+	fuse_metrics_sample(out, "fuse_received_total", "mode=\"copy\"",
+			    sum->events[FUSE_METRICS_RECV_COPY]);
+	fuse_metrics_family(out, "fuse_data_replies", "counter",
+			    "Data replies sent, spliced or copied.");
+	fuse_metrics_sample(out, "fuse_data_replies_total", "mode=\"splice\"",
+			    sum->events[FUSE_METRICS_DATA_SPLICE]);
+	fuse_metrics_sample(out, "fuse_data_replies_total", "mode=\"copy\"",
+			    sum->events[FUSE_METRICS_DATA_COPY]);
+
+	metrics_admit(f, out);
+
+	fuse_metrics_family(out, "fuse_memory_bytes", "gauge",
+			    "Memory used by the session, approximately.");
+	fuse_metrics_sample(out, "fuse_memory_bytes", "category=\"requests\"",
+			    (double) inflight * sizeof(struct fuse_req));
+	fuse_metrics_sample(out, "fuse_memory_bytes", "category=\"metrics\"",
+			    (double) nblocks *
+			    sizeof(struct fuse_metrics_thread));
+
+	for (i = 0; i < nsources; i++)
+		sources[i].func(sources[i].data, out);
+
+	out_printf(out, "# EOF\n");
+	free(sum);
+}
+
+static int metrics_send(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t res = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		buf += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/*
+ * Wait briefly for an HTTP request.  Clients sending nothing, or
+ * closing their end, get the bare text.
+ */
+static void metrics_serve(struct fuse_metrics_server *s, int fd)
+{
+	struct fuse_metrics_out out = { .size = 16384 };
+	struct timeval timeout = {
+		.tv_sec = METRICS_TIMEOUT_MS / 1000,
+		.tv_usec = METRICS_TIMEOUT_MS % 1000 * 1000,
+	};
+	char req[1024];
+	size_t len = 0;
+	int http;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+	{
+		int one = 1;
+
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+	}
+#endif
+
+	while (len < sizeof(req) - 1) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		ssize_t res;
+
+		if (poll(&pfd, 1, METRICS_TIMEOUT_MS) <= 0)
+			break;
+		res = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (res <= 0)
+			break;
+		len += res;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	http = len >= 4 && strncmp(req, "GET ", 4) == 0;
+
+	out.buf = malloc(out.size);
+	if (out.buf == NULL)
+		return;
+	metrics_collect(s->f, &out);
+
+	if (out.failed) {
+		if (http) {
+			static const char reply[] =
+				"HTTP/1.0 500 Internal Server Error\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n";
+
+			metrics_send(fd, reply, sizeof(reply) - 1);
+		}
+	} else {
+		if (http) {
+			char header[256];
+			int hlen;
+
+			hlen = snprintf(header, sizeof(header),
+					"HTTP/1.0 200 OK\r\n"
+					"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+					"Content-Length: %zu\r\n"
+					"Connection: close\r\n\r\n", out.len);
+			if (metrics_send(fd, header, hlen) == -1)
+				goto out_free;
+		}
+		metrics_send(fd, out.buf, out.len);
+	}
+out_free:
+	free(out.buf);
+}
+
+static void *metrics_thread_func(void *data)
+{
+	struct fuse_metrics_server *s = (struct fuse_metrics_server *) data;
+
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = s->fd, .events = POLLIN },
+			{ .fd = s->wake[0], .events = POLLIN },
+		};
+		int fd;
+
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("fuse: metrics: poll");
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (!fds[0].revents)
+			continue;
+
+		fd = accept(s->fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+		metrics_serve(s, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static int metrics_listen_path(struct fuse_metrics_server *s,
+			       const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat stbuf;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "fuse: metrics socket path too long: %s\n",
+			path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	s->path = strdup(path);
+	if (s->path == NULL) {
+		fprintf(stderr, "fuse: failed to allocate metrics socket path\n");
+		return -1;
+	}
+
+	s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s->fd == -1) {
+		perror("fuse: metrics: socket");
+		return -1;
+	}
+	/* Replace the socket of an earlier run, but nothing else */
+	if (lstat(path, &stbuf) == 0 && S_ISSOCK(stbuf.st_mode))
+		unlink(path);
+	if (bind(s->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "fuse: failed to bind metrics socket %s: %s\n",
+			path, strerror(errno));
+		free(s->path);
+		s->path = NULL;
+		return -1;
+	}
+	/* Nobody can connect before listen() */
+	if (chmod(path, 0600) == -1) {
+		perror("fuse: metrics: chmod");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int metrics_listen_port(struct fuse_metrics_server *s,
+			       unsigned int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	if (!port || port > 65535) {
+		fprintf(stderr, "fuse: invalid metrics port: %u\n", port);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	s->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (s->fd == -1) {
+		perror("fuse: metrics: socket");
+		return -1;
+	}
+	setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(s->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "fuse: failed to bind metrics port %u: %s\n",
+			port, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void metrics_server_free(struct fuse_metrics_server *s)
+{
+	if (s->fd != -1)
+		close(s->fd);
+	if (s->wake[0] != -1) {
+		close(s->wake[0]);
+		close(s->wake[1]);
+	}
+	if (s->path) {
+		unlink(s->path);
+		free(s->path);
+	}
+	free(s);
+}
+
+int fuse_ll_metrics_start(struct fuse_ll *f, const char *path,
+			  unsigned int port)
+{
+	struct fuse_metrics *m = &f->metrics;
+	struct fuse_metrics_server *s;
+	int running;
+	int res;
+
+	/* Checked before binding, so that its socket isn't replaced */
+	pthread_mutex_lock(&m->lock);
+	running = m->server != NULL;
+	pthread_mutex_unlock(&m->lock);
+	if (running) {
+		fprintf(stderr, "fuse: metrics exporter already running\n");
+		return -1;
+	}
+
+	s = (struct fuse_metrics_server *)
+		calloc(1, sizeof(struct fuse_metrics_server));
+	if (s == NULL) {
+		fprintf(stderr, "fuse: failed to allocate metrics exporter\n");
+		return -1;
+	}
+	s->f = f;
+	s->fd = -1;
+	s->wake[0] = s->wake[1] = -1;
+	s->port = port;
+
+	if (path)
+		res = metrics_listen_path(s, path);
+	else
+		res = metrics_listen_port(s, port);
+	if (res == -1)
+		goto out_free;
+
+	fcntl(s->fd, F_SETFD, FD_CLOEXEC);
+	if (listen(s->fd, 16) == -1) {
+		perror("fuse: metrics: listen");
+		goto out_free;
+	}
+	if (pipe(s->wake) == -1) {
+		perror("fuse: metrics: pipe");
+		s->wake[0] = s->wake[1] = -1;
+		goto out_free;
+	}
+	fcntl(s->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(s->wake[1], F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_lock(&m->lock);
+	if (m->server != NULL) {
+		pthread_mutex_unlock(&m->lock);
+		fprintf(stderr, "fuse: metrics exporter already running\n");
+		goto out_free;
+	}
+	m->server = s;
+	m->enabled = 1;
+	pthread_mutex_unlock(&m->lock);
+
+	if (fuse_start_thread(&s->thread, metrics_thread_func, s) == -1) {
+		pthread_mutex_lock(&m->lock);
+		m->server = NULL;
+		m->enabled = 0;
+		pthread_mutex_unlock(&m->lock);
+		goto out_free;
+	}
+	return 0;
+
+out_free:
+	metrics_server_free(s);
+	return -1;
+}
+
+void fuse_ll_metrics_stop(struct fuse_ll *f)
+{
+	struct fuse_metrics *m = &f->metrics;
+	struct fuse_metrics_server *s;
+	char c = 0;
+
+	pthread_mutex_lock(&m->lock);
+	s = m->server;
+	m->server = NULL;
+	m->enabled = 0;
+	pthread_mutex_unlock(&m->lock);
+	if (s == NULL)
+		return;
+
+	while (write(s->wake[1], &c, 1) == -1 && errno == EINTR)
+		;
+	pthread_join(s->thread, NULL);
+	metrics_server_free(s);
+}
+
+/*
+ * Stop the exporter before fork(), so that it holds no lock the child
+ * inherits.  Returns 1 with the arguments for fuse_ll_metrics_start()
+ * if it was running, 0 if not and -1 if it can't be restarted.
+ */
+int fuse_ll_metrics_suspend(struct fuse_ll *f, char **pathp,
+			    unsigned int *portp)
+{
+	struct fuse_metrics *m = &f->metrics;
+	char *path = NULL;
+	int running;
+
+	pthread_mutex_lock(&m->lock);
+	running = m->server != NULL;
+	if (running) {
+		*portp = m->server->port;
+		if (m->server->path)
+			path = strdup(m->server->path);
+	}
+	pthread_mutex_unlock(&m->lock);
+	if (!running)
+		return 0;
+
+	fuse_ll_metrics_stop(f);
+	if (*portp == 0 && path == NULL)
+		return -1;
+	*pathp = path;
+	return 1;
+}
+
+int fuse_session_metrics_start(struct fuse_session *se, const char *path,
+			       unsigned int port)
+{
+	return fuse_ll_metrics_start((struct fuse_ll *) fuse_session_data(se),
+				     path, port);
+}
+
+void fuse_session_metrics_stop(struct fuse_session *se)
+{
+	fuse_ll_metrics_stop((struct fuse_ll *) fuse_session_data(se));
+}
+
+int fuse_session_metrics_add(struct fuse_session *se, fuse_metrics_func_t func,
+			     void *data)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_metrics *m = &f->metrics;
+	int res = -1;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->nsources < FUSE_METRICS_MAX_SOURCES) {
+		m->sources[m->nsources].func = func;
+		m->sources[m->nsources].data = data;
+		m->nsources++;
+		res = 0;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return res;
+}
@@ -0,0 +1,495 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "fuse_lowlevel.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define POLL_MIN_SIZE 64
+/* Wakeups are sent by several threads from this many handles on */
+#define POLL_PARALLEL_MIN 1024
+#define POLL_MAX_THREADS 4
+
+/* Open files of one inode with poll handles, and the armed ones */
+struct fuse_poll_ino {
+	fuse_ino_t ino;
+	struct fuse_poll_ino *next;
+	struct fuse_pollhandle *handles;
+	size_t nhandles;
+	size_t narmed;
+	struct fuse_pollhandle *armed;
+};
+
+struct poll_wakeup {
+	uint64_t kh;
+	struct fuse_chan *ch;
+};
+
+struct poll_sender {
+	struct fuse_ll *f;
+	struct poll_wakeup *w;
+	size_t count;
+	int err;
+};
+
+static size_t poll_hash(size_t size, uint64_t key)
+{
+	return (size_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+static int resize_handles(struct fuse_poll_registry *reg)
+{
+	size_t newsize = reg->hsize ? reg->hsize * 2 : POLL_MIN_SIZE;
+	struct fuse_pollhandle **newarray;
+	size_t i;
+
+	newarray = calloc(newsize, sizeof(struct fuse_pollhandle *));
+	if (newarray == NULL)
+		return -1;
+
+	for (i = 0; i < reg->hsize; i++) {
+		struct fuse_pollhandle *ph;
+		struct fuse_pollhandle *next;
+
+		for (ph = reg->handles[i]; ph != NULL; ph = next) {
+			size_t h = poll_hash(newsize, ph->kh);
+
+			next = ph->hash_next;
+			ph->hash_next = newarray[h];
+			newarray[h] = ph;
+		}
+	}
+	free(reg->handles);
+	reg->handles = newarray;
+	reg->hsize = newsize;
+
+	return 0;
+}
+
+static int resize_inodes(struct fuse_poll_registry *reg)
+{
+	size_t newsize = reg->isize ? reg->isize * 2 : POLL_MIN_SIZE;
+	struct fuse_poll_ino **newarray;
+	size_t i;
+
+	newarray = calloc(newsize, sizeof(struct fuse_poll_ino *));
+	if (newarray == NULL)
+		return -1;
+
+	for (i = 0; i < reg->isize; i++) {
+		struct fuse_poll_ino *pi;
+		struct fuse_poll_ino *next;
+
+		for (pi = reg->inodes[i]; pi != NULL; pi = next) {
+			size_t h = poll_hash(newsize, pi->ino);
+
+			next = pi->next;
+			pi->next = newarray[h];
+			newarray[h] = pi;
+		}
+	}
+	free(reg->inodes);
+	reg->inodes = newarray;
+	reg->isize = newsize;
+
+	return 0;
+}
+
+static struct fuse_pollhandle *find_handle(struct fuse_poll_registry *reg,
+					   uint64_t kh)
+{
+	struct fuse_pollhandle *ph;
+
+	if (!reg->hsize)
+		return NULL;
+
+	ph = reg->handles[poll_hash(reg->hsize, kh)];
+	for (; ph != NULL; ph = ph->hash_next)
+		if (ph->kh == kh)
+			return ph;
+
+	return NULL;
+}
+
+static struct fuse_poll_ino *find_ino(struct fuse_poll_registry *reg,
+				      fuse_ino_t ino)
+{
+	struct fuse_poll_ino *pi;
+
+	if (!reg->isize)
+		return NULL;
+
+	for (pi = reg->inodes[poll_hash(reg->isize, ino)]; pi != NULL;
+	     pi = pi->next)
+		if (pi->ino == ino)
+			return pi;
+
+	return NULL;
+}
+
+static struct fuse_poll_ino *get_ino(struct fuse_poll_registry *reg,
+				     fuse_ino_t ino)
+{
+	struct fuse_poll_ino *pi = find_ino(reg, ino);
+	size_t h;
+
+	if (pi != NULL)
+		return pi;
+
+	if (reg->iuse >= reg->isize && resize_inodes(reg) == -1 &&
+	    !reg->isize)
+		return NULL;
+
+	pi = calloc(1, sizeof(struct fuse_poll_ino));
+	if (pi == NULL)
+		return NULL;
+
+	pi->ino = ino;
+	h = poll_hash(reg->isize, ino);
+	pi->next = reg->inodes[h];
+	reg->inodes[h] = pi;
+	reg->iuse++;
+
+	return pi;
+}
+
+static void put_ino(struct fuse_poll_registry *reg, struct fuse_poll_ino *pi)
+{
+	struct fuse_poll_ino **pip;
+
+	if (pi->nhandles)
+		return;
+
+	pip = &reg->inodes[poll_hash(reg->isize, pi->ino)];
+	for (; *pip != NULL; pip = &(*pip)->next) {
+		if (*pip == pi) {
+			*pip = pi->next;
+			reg->iuse--;
+			free(pi);
+			return;
+		}
+	}
+}
+
+static void arm_handle(struct fuse_pollhandle *ph)
+{
+	struct fuse_poll_ino *pi = ph->pi;
+
+	ph->armed = 1;
+	ph->armed_next = pi->armed;
+	ph->armed_prevp = &pi->armed;
+	if (pi->armed)
+		pi->armed->armed_prevp = &ph->armed_next;
+	pi->armed = ph;
+	pi->narmed++;
+}
+
+static void disarm_handle(struct fuse_pollhandle *ph)
+{
+	*ph->armed_prevp = ph->armed_next;
+	if (ph->armed_next)
+		ph->armed_next->armed_prevp = ph->armed_prevp;
+	ph->armed = 0;
+	ph->pi->narmed--;
+}
+
+/*
+ * Called for each POLL request asking for a notification.  The handle
+ * of an open file is shared by all its POLL requests, each of which
+ * takes a reference for the filesystem.  Open files are told apart by
+ * kh, since the filesystem may give several of them the same fh.
+ */
+struct fuse_pollhandle *fuse_ll_poll_register(struct fuse_ll *f,
+					      fuse_ino_t ino, uint64_t fh,
+					      uint64_t kh,
+					      struct fuse_chan *ch)
+{
+	struct fuse_poll_registry *reg = &f->poll;
+	struct fuse_pollhandle *ph;
+
+	pthread_mutex_lock(&reg->lock);
+	ph = find_handle(reg, kh);
+	if (ph == NULL) {
+		size_t h;
+
+		if (reg->huse >= reg->hsize && resize_handles(reg) == -1 &&
+		    !reg->hsize)
+			goto out_err;
+
+		ph = calloc(1, sizeof(struct fuse_pollhandle));
+		if (ph == NULL)
+			goto out_err;
+
+		ph->pi = get_ino(reg, ino);
+		if (ph->pi == NULL) {
+			free(ph);
+			goto out_err;
+		}
+		ph->ino_next = ph->pi->handles;
+		ph->pi->handles = ph;
+		ph->pi->nhandles++;
+		ph->f = f;
+		ph->kh = kh;
+		ph->ino = ino;
+		ph->fh = fh;
+		/* The registry's reference, dropped on release */
+		ph->refctr = 1;
+
+		h = poll_hash(reg->hsize, kh);
+		ph->hash_next = reg->handles[h];
+		reg->handles[h] = ph;
+		reg->huse++;
+	}
+	ph->ch = ch;
+	if (!ph->armed)
+		arm_handle(ph);
+	__sync_add_and_fetch(&ph->refctr, 1);
+	pthread_mutex_unlock(&reg->lock);
+
+	return ph;
+
+out_err:
+	pthread_mutex_unlock(&reg->lock);
+	return NULL;
+}
+
+static void unhash_handle(struct fuse_poll_registry *reg,
+			  struct fuse_pollhandle *ph)
+{
+	struct fuse_pollhandle **php;
+
+	php = &reg->handles[poll_hash(reg->hsize, ph->kh)];
+	for (; *php != ph; php = &(*php)->hash_next)
+		;
+	*php = ph->hash_next;
+	reg->huse--;
+}
+
+static int poll_send(struct fuse_ll *f, struct poll_wakeup *w, size_t count);
+
+/*
+ * Called when a file is released, the kernel forgets its kh then.  The
+ * release only names fh, so if several polled files share it, all of
+ * them are dropped and the armed ones woken up.  Those still open poll
+ * again and get a new handle.
+ */
+void fuse_ll_poll_release(struct fuse_ll *f, fuse_ino_t ino, uint64_t fh)
+{
+	struct fuse_poll_registry *reg = &f->poll;
+	struct fuse_pollhandle **php;
+	struct fuse_pollhandle *ph;
+	struct fuse_poll_ino *pi;
+	struct poll_wakeup *w = NULL;
+	size_t count = 0;
+	size_t n = 0;
+
+	pthread_mutex_lock(&reg->lock);
+	pi = find_ino(reg, ino);
+	if (pi == NULL)
+		goto out;
+
+	for (ph = pi->handles; ph != NULL; ph = ph->ino_next) {
+		if (ph->fh == fh)
+			n++;
+	}
+	if (n > 1) {
+		w = malloc(n * sizeof(struct poll_wakeup));
+		/* Rather keep them than miss a wakeup */
+		if (w == NULL)
+			goto out;
+	}
+
+	php = &pi->handles;
+	while ((ph = *php) != NULL) {
+		if (ph->fh != fh) {
+			php = &ph->ino_next;
+			continue;
+		}
+		*php = ph->ino_next;
+		unhash_handle(reg, ph);
+		if (ph->armed) {
+			if (w != NULL) {
+				w[count].kh = ph->kh;
+				w[count].ch = ph->ch;
+				count++;
+			}
+			disarm_handle(ph);
+		}
+		pi->nhandles--;
+		ph->pi = NULL;
+		fuse_pollhandle_destroy(ph);
+	}
+	put_ino(reg, pi);
+out:
+	pthread_mutex_unlock(&reg->lock);
+
+	if (count)
+		poll_send(f, w, count);
+	free(w);
+}
+
+void fuse_ll_poll_free(struct fuse_ll *f)
+{
+	struct fuse_poll_registry *reg = &f->poll;
+	size_t i;
+
+	for (i = 0; i < reg->hsize; i++) {
+		struct fuse_pollhandle *ph;
+		struct fuse_pollhandle *next;
+
+		for (ph = reg->handles[i]; ph != NULL; ph = next) {
+			next = ph->hash_next;
+			/* The filesystem may still hold references */
+			ph->pi = NULL;
+			fuse_pollhandle_destroy(ph);
+		}
+	}
+	for (i = 0; i < reg->isize; i++) {
+		struct fuse_poll_ino *pi;
+		struct fuse_poll_ino *next;
+
+		for (pi = reg->inodes[i]; pi != NULL; pi = next) {
+			next = pi->next;
+			free(pi);
+		}
+	}
+	free(reg->handles);
+	free(reg->inodes);
+	pthread_mutex_destroy(&reg->lock);
+}
+
+/* The filesystem may drop its references without the registry lock */
+void fuse_pollhandle_destroy(struct fuse_pollhandle *ph)
+{
+	if (ph != NULL && __sync_sub_and_fetch(&ph->refctr, 1) == 0)
+		free(ph);
+}
+
+static int poll_send(struct fuse_ll *f, struct poll_wakeup *w, size_t count)
+{
+	int err = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		struct fuse_pollhandle tmp = {
+			.kh = w[i].kh,
+			.ch = w[i].ch,
+			.f = f,
+		};
+		int res = fuse_lowlevel_notify_poll(&tmp);
+
+		/* The file may have been released in the meantime */
+		if (res && res != -ENOENT && !err)
+			err = res;
+	}
+	return err;
+}
+
+static void *poll_sender_thread(void *data)
+{
+	struct poll_sender *s = data;
+
+	s->err = poll_send(s->f, s->w, s->count);
+	return NULL;
+}
+
+/* Large fan-outs are split between a few threads */
+static int poll_send_parallel(struct fuse_ll *f, struct poll_wakeup *w,
+			      size_t count)
+{
+	struct poll_sender senders[POLL_MAX_THREADS];
+	pthread_t threads[POLL_MAX_THREADS];
+	size_t nthreads = count / POLL_PARALLEL_MIN;
+	size_t per, i;
+	int started[POLL_MAX_THREADS];
+	int err;
+
+	if (nthreads > POLL_MAX_THREADS)
+		nthreads = POLL_MAX_THREADS;
+	if (nthreads < 2)
+		return poll_send(f, w, count);
+
+	per = (count + nthreads - 1) / nthreads;
+	for (i = 0; i < nthreads; i++) {
+		size_t start = i * per;
+
+		senders[i].f = f;
+		senders[i].w = w + start;
+		senders[i].count = start + per > count ? count - start : per;
+		senders[i].err = 0;
+		/* The calling thread takes the first slice */
+		started[i] = i && pthread_create(&threads[i], NULL,
+						 poll_sender_thread,
+						 &senders[i]) == 0;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (!started[i])
+			poll_sender_thread(&senders[i]);
+	}
+	err = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (senders[i].err && !err)
+			err = senders[i].err;
+	}
+	return err;
+}
+
+int fuse_lowlevel_notify_poll_ino(struct fuse_chan *ch, fuse_ino_t ino)
+{
+	struct fuse_poll_registry *reg;
+	struct fuse_poll_ino *pi;
+	struct poll_wakeup *w;
+	struct fuse_ll *f;
+	size_t count = 0;
+	int err;
+
+	if (!ch)
+		return -EINVAL;
+
+	f = (struct fuse_ll *) fuse_session_data(fuse_chan_session(ch));
+	if (!f)
+		return -ENODEV;
+
+	reg = &f->poll;
+	pthread_mutex_lock(&reg->lock);
+	pi = find_ino(reg, ino);
+	if (pi == NULL || !pi->narmed) {
+		pthread_mutex_unlock(&reg->lock);
+		return 0;
+	}
+	w = malloc(pi->narmed * sizeof(struct poll_wakeup));
+	if (w == NULL) {
+		pthread_mutex_unlock(&reg->lock);
+		return -ENOMEM;
+	}
+	/*
+	 * A handle stays disarmed until the kernel polls it again, so
+	 * wakeups before that are coalesced into one notification.
+	 */
+	while (pi->armed) {
+		struct fuse_pollhandle *ph = pi->armed;
+
+		w[count].kh = ph->kh;
+		w[count].ch = ph->ch;
+		count++;
+		disarm_handle(ph);
+	}
+	pthread_mutex_unlock(&reg->lock);
+
+	err = poll_send_parallel(f, w, count);
+	free(w);
+
+	return err;
+}
@@ -0,0 +1,482 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "fuse_lowlevel.h"
+#include "fuse_misc.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define FUSE_CTL_DIR "/sys/fs/fuse/connections"
+#define FUSE_BDI_DIR "/sys/class/bdi"
+
+/* The kernel limits max_background to 16 bits */
+#define TUNE_MAX_BACKGROUND ((1 << 16) - 1)
+/* How far the default policy may grow the background queue */
+#define TUNE_MAX_GROWTH 8
+
+struct fuse_tune {
+	struct fuse_session *se;
+	struct fuse_ll *f;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int exit;
+	double interval;
+	fuse_tune_func_t func;
+	void *data;
+	/* Limits found on the first round, used by the default policy */
+	struct fuse_conn_limits base;
+	int have_base;
+};
+
+/* Unescape the octal sequences used for white space in mountinfo */
+static void unescape(char *s)
+{
+	char *d = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = (s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0');
+			s += 4;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d = '\0';
+}
+
+/*
+ * Find the device number of the fuse mount at mountpoint without
+ * accessing the mount itself, which could deadlock a filesystem that
+ * is not yet processing requests.
+ */
+static int find_mount_dev(const char *mountpoint, unsigned int *majorp,
+			  unsigned int *minorp, int *fuseblkp)
+{
+	char line[PATH_MAX * 2 + 256];
+	FILE *fp;
+	int found = 0;
+
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (fp == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char mnt[PATH_MAX * 2];
+		char fstype[64];
+		unsigned int major, minor;
+		char *sep;
+
+		if (sscanf(line, "%*u %*u %u:%u %*s %s", &major, &minor,
+			   mnt) != 3)
+			continue;
+		sep = strstr(line, " - ");
+		if (sep == NULL || sscanf(sep + 3, "%63s", fstype) != 1)
+			continue;
+		if (strcmp(fstype, "fuse") != 0 &&
+		    strncmp(fstype, "fuse.", 5) != 0 &&
+		    strcmp(fstype, "fuseblk") != 0)
+			continue;
+
+		unescape(mnt);
+		if (strcmp(mnt, mountpoint) != 0)
+			continue;
+
+		/* The last match is the topmost mount */
+		*majorp = major;
+		*minorp = minor;
+		*fuseblkp = strcmp(fstype, "fuseblk") == 0;
+		found = 1;
+	}
+	fclose(fp);
+
+	return found ? 0 : -ENOENT;
+}
+
+int fuse_session_conn_attach(struct fuse_session *se, const char *mountpoint)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	char ctl_dir[sizeof(FUSE_CTL_DIR) + 16];
+	char bdi_dir[sizeof(FUSE_BDI_DIR) + 48];
+	unsigned int major, minor;
+	int fuseblk;
+	int res;
+
+	res = find_mount_dev(mountpoint, &major, &minor, &fuseblk);
+	if (res)
+		return res;
+
+	/* Directory names follow the kernel's encoding of the dev_t */
+	sprintf(ctl_dir, "%s/%u", FUSE_CTL_DIR, (major << 20) | minor);
+	if (access(ctl_dir, R_OK) == -1)
+		return -errno;
+	sprintf(bdi_dir, "%s/%u:%u%s", FUSE_BDI_DIR, major, minor,
+		fuseblk ? "-fuseblk" : "");
+
+	pthread_mutex_lock(&f->lock);
+	free(f->ctl_dir);
+	free(f->bdi_dir);
+	f->ctl_dir = strdup(ctl_dir);
+	f->bdi_dir = strdup(bdi_dir);
+	res = (f->ctl_dir && f->bdi_dir) ? 0 : -ENOMEM;
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+static int read_attr(const char *dir, const char *name, unsigned int *valp)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int res = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -errno;
+	if (fscanf(fp, "%u", valp) != 1)
+		res = -EIO;
+	fclose(fp);
+
+	return res;
+}
+
+static int write_attr(const char *dir, const char *name, unsigned int val)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int res = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return -errno;
+	if (fprintf(fp, "%u\n", val) < 0)
+		res = -EIO;
+	if (fclose(fp) == EOF && !res)
+		res = -errno;
+
+	return res;
+}
+
+/* Copy the directories, so that the lock isn't held during file I/O */
+static int get_dirs(struct fuse_ll *f, char *ctl_dir, char *bdi_dir)
+{
+	int res = -ENOTCONN;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->ctl_dir) {
+		strcpy(ctl_dir, f->ctl_dir);
+		strcpy(bdi_dir, f->bdi_dir);
+		res = 0;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+int fuse_session_conn_load(struct fuse_session *se,
+			   struct fuse_conn_load *load,
+			   struct fuse_conn_limits *limits)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	char ctl_dir[sizeof(FUSE_CTL_DIR) + 16];
+	char bdi_dir[sizeof(FUSE_BDI_DIR) + 48];
+	int res;
+
+	res = get_dirs(f, ctl_dir, bdi_dir);
+	if (res)
+		return res;
+
+	if (load) {
+		res = read_attr(ctl_dir, "waiting", &load->waiting);
+		if (res)
+			return res;
+		pthread_mutex_lock(&f->lock);
+		load->inflight = f->inflight;
+		pthread_mutex_unlock(&f->lock);
+	}
+	if (limits) {
+		unsigned int ra_kb;
+
+		res = read_attr(ctl_dir, "max_background",
+				&limits->max_background);
+		if (!res)
+			res = read_attr(ctl_dir, "congestion_threshold",
+					&limits->congestion_threshold);
+		if (res)
+			return res;
+		/* Readahead is a property of the backing device */
+		if (read_attr(bdi_dir, "read_ahead_kb", &ra_kb) == 0)
+			limits->max_readahead = ra_kb * 1024;
+		else
+			limits->max_readahead = 0;
+	}
+
+	return 0;
+}
+
+int fuse_session_conn_set_limits(struct fuse_session *se,
+				 const struct fuse_conn_limits *limits)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	char ctl_dir[sizeof(FUSE_CTL_DIR) + 16];
+	char bdi_dir[sizeof(FUSE_BDI_DIR) + 48];
+	unsigned int max_background = limits->max_background;
+	unsigned int congestion_threshold = limits->congestion_threshold;
+	int res;
+
+	res = get_dirs(f, ctl_dir, bdi_dir);
+	if (res)
+		return res;
+
+	if (max_background > TUNE_MAX_BACKGROUND)
+		max_background = TUNE_MAX_BACKGROUND;
+	if (max_background && congestion_threshold > max_background)
+		congestion_threshold = max_background;
+
+	if (max_background) {
+		res = write_attr(ctl_dir, "max_background", max_background);
+		if (res)
+			return res;
+	}
+	if (congestion_threshold) {
+		res = write_attr(ctl_dir, "congestion_threshold",
+				 congestion_threshold);
+		if (res)
+			return res;
+	}
+	if (limits->max_readahead) {
+		unsigned int ra_kb = (limits->max_readahead + 1023) / 1024;
+
+		res = write_attr(bdi_dir, "read_ahead_kb", ra_kb);
+		if (res)
+			return res;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	if (max_background)
+		f->conn.max_background = max_background;
+	if (congestion_threshold)
+		f->conn.congestion_threshold = congestion_threshold;
+	if (limits->max_readahead)
+		f->conn.max_readahead = limits->max_readahead;
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
+
+/*
+ * Grow the background queue by half while the kernel has it nearly
+ * full, and let it shrink back towards the initial size once the
+ * pressure is gone.  The congestion threshold follows at the kernel's
+ * default ratio of 3/4.  Readahead is left alone.
+ */
+static void tune_default(void *data, const struct fuse_conn_load *load,
+			 struct fuse_conn_limits *limits)
+{
+	struct fuse_tune *t = (struct fuse_tune *) data;
+	unsigned int base = t->base.max_background;
+	unsigned int cur = limits->max_background;
+
+	if (!base || !cur)
+		return;
+
+	if (load->waiting >= cur - cur / 10 && cur < base * TUNE_MAX_GROWTH)
+		cur += (cur + 1) / 2;
+	else if (load->waiting < cur / 4 && cur > base)
+		cur -= (cur - base + 3) / 4;
+	else
+		return;
+
+	if (cur > base * TUNE_MAX_GROWTH)
+		cur = base * TUNE_MAX_GROWTH;
+	limits->max_background = cur;
+	limits->congestion_threshold = cur * 3 / 4;
+}
+
+static void tune_round(struct fuse_tune *t)
+{
+	struct fuse_conn_load load;
+	struct fuse_conn_limits limits;
+	struct fuse_conn_limits old;
+	int res;
+
+	res = fuse_session_conn_load(t->se, &load, &limits);
+	if (res)
+		return;
+
+	if (!t->have_base) {
+		t->base = limits;
+		t->have_base = 1;
+	}
+
+	old = limits;
+	if (t->func)
+		t->func(t->data, &load, &limits);
+	else
+		tune_default(t, &load, &limits);
+
+	if (limits.max_background == old.max_background)
+		limits.max_background = 0;
+	if (limits.congestion_threshold == old.congestion_threshold)
+		limits.congestion_threshold = 0;
+	if (limits.max_readahead == old.max_readahead)
+		limits.max_readahead = 0;
+	if (!limits.max_background && !limits.congestion_threshold &&
+	    !limits.max_readahead)
+		return;
+
+	res = fuse_session_conn_set_limits(t->se, &limits);
+	if (res && t->f->debug)
+		fprintf(stderr, "fuse: failed to set limits: %s\n",
+			strerror(-res));
+	else if (t->f->debug)
+		fprintf(stderr, "TUNE: waiting=%u inflight=%u\n"
+			"   max_background=%u congestion_threshold=%u\n",
+			load.waiting, load.inflight,
+			t->f->conn.max_background,
+			t->f->conn.congestion_threshold);
+}
+
+static void *tune_thread(void *data)
+{
+	struct fuse_tune *t = (struct fuse_tune *) data;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->exit) {
+		struct timespec deadline;
+		double secs;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		secs = deadline.tv_nsec / 1e9 + t->interval;
+		deadline.tv_sec += (time_t) secs;
+		deadline.tv_nsec = (secs - (time_t) secs) * 1e9;
+
+		while (!t->exit &&
+		       pthread_cond_timedwait(&t->cond, &t->lock,
+					      &deadline) != ETIMEDOUT)
+			;
+		if (t->exit)
+			break;
+
+		pthread_mutex_unlock(&t->lock);
+		tune_round(t);
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+int fuse_session_tune_start(struct fuse_session *se, double interval,
+			    fuse_tune_func_t func, void *data)
+{
+	struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+	struct fuse_tune *t;
+
+	if (interval <= 0)
+		return -1;
+
+	t = (struct fuse_tune *) calloc(1, sizeof(struct fuse_tune));
+	if (t == NULL) {
+		fprintf(stderr, "fuse: failed to allocate tuner\n");
+		return -1;
+	}
+	t->se = se;
+	t->f = f;
+	t->interval = interval;
+	t->func = func;
+	t->data = data;
+	fuse_mutex_init(&t->lock);
+	pthread_cond_init(&t->cond, NULL);
+
+	pthread_mutex_lock(&f->lock);
+	if (f->tune != NULL) {
+		pthread_mutex_unlock(&f->lock);
+		fprintf(stderr, "fuse: tuner already running\n");
+		goto out_free;
+	}
+	f->tune = t;
+	pthread_mutex_unlock(&f->lock);
+
+	if (fuse_start_thread(&t->thread, tune_thread, t) == -1) {
+		pthread_mutex_lock(&f->lock);
+		f->tune = NULL;
+		pthread_mutex_unlock(&f->lock);
+		goto out_free;
+	}
+	return 0;
+
+out_free:
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+	return -1;
+}
+
+void fuse_ll_tune_stop(struct fuse_ll *f)
+{
+	struct fuse_tune *t;
+
+	pthread_mutex_lock(&f->lock);
+	t = f->tune;
+	f->tune = NULL;
+	pthread_mutex_unlock(&f->lock);
+	if (t == NULL)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	t->exit = 1;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thread, NULL);
+
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+/*
+ * Stop the tuner before fork(), so that it holds no lock the child
+ * inherits.  Returns whether it was running, and the arguments for
+ * fuse_session_tune_start().
+ */
+int fuse_ll_tune_suspend(struct fuse_ll *f, double *intervalp,
+			 fuse_tune_func_t *funcp, void **datap)
+{
+	struct fuse_tune *t;
+
+	pthread_mutex_lock(&f->lock);
+	t = f->tune;
+	if (t != NULL) {
+		*intervalp = t->interval;
+		*funcp = t->func;
+		*datap = t->data;
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (t == NULL)
+		return 0;
+
+	fuse_ll_tune_stop(f);
+	return 1;
+}
+
+void fuse_session_tune_stop(struct fuse_session *se)
+{
+	fuse_ll_tune_stop((struct fuse_ll *) fuse_session_data(se));
+}
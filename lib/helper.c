@@ -477,6 +477,10 @@ struct fuse *fuse_setup_common(int argc, char *argv[],
 	if (fuse == NULL)
 		goto err_unmount;
 
+	/* Failure is not fatal, the limits are just left alone */
+	if (fuse_auto_tune_enabled(fuse))
+		fuse_session_conn_attach(fuse_get_session(fuse), *mountpoint);
+
 	res = fuse_daemonize(foreground);
 	if (res == -1)
 		goto err_unmount;
@@ -0,0 +1,1766 @@
+/*
+  fuse diskcache module: keep file contents in local cache files
+  Copyright (C) 2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Ranges read from the next filesystem are stored at the same offsets
+ * in a sparse local file, one per path.  A compact extent list records
+ * which ranges are present, together with a validity key taken from
+ * the attributes (and optionally an xattr) at open time.  The list is
+ * saved next to the data when the last handle is released, so the
+ * cache survives a restart.  Hits are returned as file descriptor
+ * buffers, which are spliced to the device if splice writing is
+ * available.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include "fuse_misc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define DC_INDEX_MAGIC 0x46444331
+#define DC_DEFAULT_SIZE 1024
+#define DC_MIN_TABLE 256
+
+struct dc_key {
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t version;
+};
+
+struct dc_extent {
+	uint64_t off;
+	uint64_t len;
+};
+
+/* The index file is this header, the path and then the extents */
+struct dc_index {
+	uint32_t magic;
+	uint32_t pathlen;
+	uint64_t count;
+	struct dc_key key;
+};
+
+struct dc_entry {
+	uint64_t id;
+	char *path;
+	struct dc_entry *hash_next;
+	struct dc_entry *lru_prev;
+	struct dc_entry *lru_next;
+	int fd;
+	unsigned int nopen;
+	unsigned int writers;
+	struct dc_key key;
+	struct dc_extent *ext;
+	size_t count;
+	size_t alloc;
+	uint64_t bytes;
+	uint64_t gen;
+	/* The extents changed since the index was saved */
+	int dirty;
+	/* The index file is on disk */
+	int saved;
+	/* Written through this mount, the key needs refreshing */
+	int modified;
+	/* Removed from the table, freed on the last release */
+	int stale;
+	/* Serializes writes to the data file */
+	pthread_mutex_t wlock;
+};
+
+/* Replaces the file handle of the next filesystem */
+struct dc_file {
+	uint64_t fh;
+	struct dc_entry *e;
+};
+
+struct diskcache {
+	char *dir;
+	unsigned int size;
+	char *xattr;
+	uint64_t max_bytes;
+	uint64_t bytes;
+	pthread_mutex_t lock;
+	struct dc_entry **table;
+	size_t table_size;
+	size_t table_use;
+	struct dc_entry *lru_head;
+	struct dc_entry *lru_tail;
+	struct fuse_fs *next;
+};
+
+static struct diskcache *dc_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct dc_file *dc_file(struct fuse_file_info *fi)
+{
+	return (struct dc_file *) (uintptr_t) fi->fh;
+}
+
+static uint64_t dc_hash_mem(const char *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t dc_hash(const char *path)
+{
+	return dc_hash_mem(path, strlen(path));
+}
+
+static void dc_name(struct diskcache *d, uint64_t id, const char *suffix,
+		    char *buf)
+{
+	snprintf(buf, PATH_MAX, "%s/%016llx%s", d->dir,
+		 (unsigned long long) id, suffix);
+}
+
+static void dc_key_stat(struct dc_key *key, const struct stat *stbuf)
+{
+	key->mtime_sec = stbuf->st_mtime;
+	key->mtime_nsec = ST_MTIM_NSEC(stbuf);
+	key->size = stbuf->st_size;
+}
+
+static int dc_key_equal(const struct dc_key *a, const struct dc_key *b)
+{
+	return a->mtime_sec == b->mtime_sec &&
+		a->mtime_nsec == b->mtime_nsec &&
+		a->size == b->size && a->version == b->version;
+}
+
+/* Index of the first extent ending after off */
+static size_t ext_find(const struct dc_entry *e, uint64_t off)
+{
+	size_t lo = 0;
+	size_t hi = e->count;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (e->ext[mid].off + e->ext[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int ext_covered(const struct dc_entry *e, uint64_t off, uint64_t end)
+{
+	size_t i = ext_find(e, off);
+
+	return i < e->count && e->ext[i].off <= off &&
+		e->ext[i].off + e->ext[i].len >= end;
+}
+
+static int ext_reserve(struct dc_entry *e, size_t count)
+{
+	if (count > e->alloc) {
+		size_t alloc = e->alloc ? e->alloc * 2 : 4;
+		struct dc_extent *ext;
+
+		while (alloc < count)
+			alloc *= 2;
+		ext = realloc(e->ext, alloc * sizeof(struct dc_extent));
+		if (ext == NULL)
+			return -1;
+		e->ext = ext;
+		e->alloc = alloc;
+	}
+	return 0;
+}
+
+/* Add [off, end) merging with overlapping and adjacent extents */
+static int ext_add(struct dc_entry *e, uint64_t off, uint64_t end)
+{
+	size_t i = ext_find(e, off ? off - 1 : 0);
+	size_t j;
+	uint64_t removed = 0;
+
+	if (ext_reserve(e, e->count + 1) == -1)
+		return -1;
+
+	for (j = i; j < e->count && e->ext[j].off <= end; j++) {
+		uint64_t eend = e->ext[j].off + e->ext[j].len;
+
+		if (e->ext[j].off < off)
+			off = e->ext[j].off;
+		if (eend > end)
+			end = eend;
+		removed += e->ext[j].len;
+	}
+	memmove(&e->ext[i + 1], &e->ext[j],
+		(e->count - j) * sizeof(struct dc_extent));
+	e->ext[i].off = off;
+	e->ext[i].len = end - off;
+	e->count = e->count - (j - i) + 1;
+	e->bytes += end - off - removed;
+
+	return 0;
+}
+
+/* Remove [off, end), splitting an extent which straddles the range */
+static int ext_remove(struct dc_entry *e, uint64_t off, uint64_t end)
+{
+	struct dc_extent keep[2];
+	size_t nkeep = 0;
+	size_t i = ext_find(e, off);
+	size_t j;
+
+	if (ext_reserve(e, e->count + 1) == -1)
+		return -1;
+
+	for (j = i; j < e->count && e->ext[j].off < end; j++) {
+		uint64_t eend = e->ext[j].off + e->ext[j].len;
+
+		if (e->ext[j].off < off) {
+			keep[nkeep].off = e->ext[j].off;
+			keep[nkeep].len = off - e->ext[j].off;
+			nkeep++;
+		}
+		if (eend > end) {
+			keep[nkeep].off = end;
+			keep[nkeep].len = eend - end;
+			nkeep++;
+		}
+		e->bytes -= e->ext[j].len;
+	}
+	memmove(&e->ext[i + nkeep], &e->ext[j],
+		(e->count - j) * sizeof(struct dc_extent));
+	memcpy(&e->ext[i], keep, nkeep * sizeof(struct dc_extent));
+	e->count = e->count - (j - i) + nkeep;
+	for (j = 0; j < nkeep; j++)
+		e->bytes += keep[j].len;
+
+	return 0;
+}
+
+/* The functions below are called with d->lock held */
+
+static void lru_unlink(struct diskcache *d, struct dc_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		d->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		d->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(struct diskcache *d, struct dc_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = d->lru_head;
+	if (d->lru_head)
+		d->lru_head->lru_prev = e;
+	else
+		d->lru_tail = e;
+	d->lru_head = e;
+}
+
+static void lru_touch(struct diskcache *d, struct dc_entry *e)
+{
+	if (d->lru_head != e) {
+		lru_unlink(d, e);
+		lru_push(d, e);
+	}
+}
+
+static int dc_table_resize(struct diskcache *d)
+{
+	size_t newsize = d->table_size * 2;
+	struct dc_entry **newtable;
+	size_t i;
+
+	newtable = calloc(newsize, sizeof(struct dc_entry *));
+	if (newtable == NULL)
+		return -1;
+
+	for (i = 0; i < d->table_size; i++) {
+		struct dc_entry *e;
+		struct dc_entry *next;
+
+		for (e = d->table[i]; e != NULL; e = next) {
+			size_t hash = e->id & (newsize - 1);
+
+			next = e->hash_next;
+			e->hash_next = newtable[hash];
+			newtable[hash] = e;
+		}
+	}
+	free(d->table);
+	d->table = newtable;
+	d->table_size = newsize;
+
+	return 0;
+}
+
+static struct dc_entry *dc_lookup(struct diskcache *d, uint64_t id)
+{
+	struct dc_entry *e;
+
+	for (e = d->table[id & (d->table_size - 1)]; e; e = e->hash_next)
+		if (e->id == id)
+			return e;
+	return NULL;
+}
+
+static void dc_hash_insert(struct diskcache *d, struct dc_entry *e)
+{
+	size_t hash;
+
+	if (d->table_use >= d->table_size)
+		dc_table_resize(d);
+
+	hash = e->id & (d->table_size - 1);
+	e->hash_next = d->table[hash];
+	d->table[hash] = e;
+	d->table_use++;
+}
+
+static void dc_hash_remove(struct diskcache *d, struct dc_entry *e)
+{
+	struct dc_entry **ep = &d->table[e->id & (d->table_size - 1)];
+
+	for (; *ep; ep = &(*ep)->hash_next) {
+		if (*ep == e) {
+			*ep = e->hash_next;
+			d->table_use--;
+			return;
+		}
+	}
+}
+
+static struct dc_entry *dc_entry_new(const char *path, uint64_t id)
+{
+	struct dc_entry *e = calloc(1, sizeof(struct dc_entry));
+
+	if (e == NULL)
+		return NULL;
+
+	e->path = strdup(path);
+	if (e->path == NULL) {
+		free(e);
+		return NULL;
+	}
+	e->id = id;
+	e->fd = -1;
+	fuse_mutex_init(&e->wlock);
+
+	return e;
+}
+
+static void dc_entry_free(struct dc_entry *e)
+{
+	if (e->fd != -1)
+		close(e->fd);
+	pthread_mutex_destroy(&e->wlock);
+	free(e->ext);
+	free(e->path);
+	free(e);
+}
+
+/* The index no longer describes the data, don't trust it after a crash */
+static void dc_unsave(struct diskcache *d, struct dc_entry *e)
+{
+	char name[PATH_MAX];
+
+	e->dirty = 1;
+	if (e->saved) {
+		dc_name(d, e->id, ".idx", name);
+		unlink(name);
+		e->saved = 0;
+	}
+}
+
+static void dc_save(struct diskcache *d, struct dc_entry *e)
+{
+	char name[PATH_MAX];
+	char tmpname[PATH_MAX];
+	struct dc_index hdr;
+	size_t size = e->count * sizeof(struct dc_extent);
+	int fd;
+	int res;
+
+	dc_name(d, e->id, ".idx", name);
+	dc_name(d, e->id, ".idx.tmp", tmpname);
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DC_INDEX_MAGIC;
+	hdr.pathlen = strlen(e->path);
+	hdr.count = e->count;
+	hdr.key = e->key;
+	res = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		write(fd, e->path, hdr.pathlen) == (ssize_t) hdr.pathlen &&
+		write(fd, e->ext, size) == (ssize_t) size;
+	close(fd);
+
+	if (res && rename(tmpname, name) == 0) {
+		e->dirty = 0;
+		e->saved = 1;
+	} else {
+		unlink(tmpname);
+	}
+}
+
+/*
+ * Forget the entry and its files.  Open entries live on without their
+ * files until the last release, so that a new file with the same path
+ * gets a fresh entry.
+ */
+static void dc_drop(struct diskcache *d, struct dc_entry *e)
+{
+	char name[PATH_MAX];
+
+	dc_hash_remove(d, e);
+	lru_unlink(d, e);
+	d->bytes -= e->bytes;
+
+	dc_name(d, e->id, ".data", name);
+	unlink(name);
+	if (e->saved) {
+		dc_name(d, e->id, ".idx", name);
+		unlink(name);
+		e->saved = 0;
+	}
+
+	if (e->nopen) {
+		e->stale = 1;
+		e->gen++;
+		e->count = 0;
+		e->bytes = 0;
+	} else {
+		dc_entry_free(e);
+	}
+}
+
+static void dc_evict(struct diskcache *d)
+{
+	struct dc_entry *e = d->lru_tail;
+
+	while (d->bytes > d->max_bytes && e) {
+		struct dc_entry *prev = e->lru_prev;
+
+		if (!e->nopen)
+			dc_drop(d, e);
+		e = prev;
+	}
+}
+
+/* Directories are not in the table, look for entries below them */
+static void dc_drop_path(struct diskcache *d, const char *path)
+{
+	struct dc_entry *e = dc_lookup(d, dc_hash(path));
+	size_t len = strlen(path);
+	size_t i;
+
+	if (e && strcmp(e->path, path) == 0) {
+		dc_drop(d, e);
+		return;
+	}
+
+	for (i = 0; i < d->table_size; i++) {
+		struct dc_entry *next;
+
+		for (e = d->table[i]; e; e = next) {
+			next = e->hash_next;
+			if (strncmp(e->path, path, len) == 0 &&
+			    e->path[len] == '/')
+				dc_drop(d, e);
+		}
+	}
+}
+
+/* Drop the cached data, truncating the file only if nobody reads it */
+static void dc_reset(struct diskcache *d, struct dc_entry *e)
+{
+	e->gen++;
+	d->bytes -= e->bytes;
+	e->count = 0;
+	e->bytes = 0;
+	if (!e->nopen && e->fd != -1 && ftruncate(e->fd, 0) == -1)
+		perror("fuse-diskcache: truncating cache file");
+	dc_unsave(d, e);
+}
+
+static void dc_truncate(struct diskcache *d, struct dc_entry *e, off_t size)
+{
+	char name[PATH_MAX];
+	uint64_t bytes = e->bytes;
+	int res;
+
+	e->gen++;
+	if (ext_remove(e, size, UINT64_MAX) == -1) {
+		dc_reset(d, e);
+		return;
+	}
+	d->bytes -= bytes - e->bytes;
+	e->key.size = size;
+	e->modified = 1;
+	dc_unsave(d, e);
+
+	if (e->fd != -1) {
+		res = ftruncate(e->fd, size);
+	} else {
+		dc_name(d, e->id, ".data", name);
+		res = truncate(name, size);
+	}
+	if (res == -1)
+		dc_reset(d, e);
+}
+
+static void dc_truncate_path(struct diskcache *d, const char *path,
+			     off_t size)
+{
+	struct dc_entry *e;
+
+	pthread_mutex_lock(&d->lock);
+	e = dc_lookup(d, dc_hash(path));
+	if (e && strcmp(e->path, path) == 0)
+		dc_truncate(d, e, size);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void dc_invalidate(struct diskcache *d, struct dc_entry *e,
+			  uint64_t off, uint64_t end)
+{
+	uint64_t bytes;
+
+	pthread_mutex_lock(&d->lock);
+	bytes = e->bytes;
+	e->gen++;
+	e->modified = 1;
+	if (ext_remove(e, off, end) == -1)
+		dc_reset(d, e);
+	else
+		d->bytes -= bytes - e->bytes;
+	dc_unsave(d, e);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int dc_open_data(struct diskcache *d, struct dc_entry *e, int flags)
+{
+	char name[PATH_MAX];
+
+	dc_name(d, e->id, ".data", name);
+	e->fd = open(name, O_RDWR | O_CREAT | flags, 0600);
+
+	return e->fd == -1 ? -1 : 0;
+}
+
+/* Key of the file which was just opened with fi */
+static int dc_file_key(struct diskcache *d, const char *path,
+		       struct fuse_file_info *fi, struct dc_key *key)
+{
+	struct stat stbuf;
+	int res;
+
+	memset(key, 0, sizeof(*key));
+	if (fuse_fs_fgetattr(d->next, path, &stbuf, fi) != 0 ||
+	    !S_ISREG(stbuf.st_mode))
+		return -1;
+	dc_key_stat(key, &stbuf);
+
+	if (d->xattr) {
+		char value[256];
+
+#ifdef __APPLE__
+		res = fuse_fs_getxattr(d->next, path, d->xattr, value,
+				       sizeof(value), 0);
+#else
+		res = fuse_fs_getxattr(d->next, path, d->xattr, value,
+				       sizeof(value));
+#endif
+		if (res > 0)
+			key->version = dc_hash_mem(value, res);
+	}
+	return 0;
+}
+
+static struct dc_entry *dc_attach(struct diskcache *d, const char *path,
+				  const struct dc_key *key)
+{
+	uint64_t id = dc_hash(path);
+	struct dc_entry *e;
+
+	pthread_mutex_lock(&d->lock);
+	e = dc_lookup(d, id);
+	if (e == NULL) {
+		e = dc_entry_new(path, id);
+		if (e == NULL)
+			goto out;
+		if (dc_open_data(d, e, O_TRUNC) == -1) {
+			dc_entry_free(e);
+			e = NULL;
+			goto out;
+		}
+		e->key = *key;
+		e->dirty = 1;
+		dc_hash_insert(d, e);
+		lru_push(d, e);
+	} else if (strcmp(e->path, path) != 0) {
+		/* Another path has the same hash, this one isn't cached */
+		e = NULL;
+		goto out;
+	} else {
+		if (e->fd == -1 && dc_open_data(d, e, 0) == -1) {
+			e = NULL;
+			goto out;
+		}
+		if (!dc_key_equal(&e->key, key)) {
+			if (!e->nopen || !e->modified)
+				dc_reset(d, e);
+			e->key = *key;
+			e->dirty = 1;
+		}
+		lru_touch(d, e);
+	}
+	e->nopen++;
+out:
+	pthread_mutex_unlock(&d->lock);
+	return e;
+}
+
+static void dc_detach(struct diskcache *d, const char *path,
+		      struct dc_entry *e)
+{
+	struct stat stbuf;
+	int modified;
+
+	pthread_mutex_lock(&d->lock);
+	modified = e->nopen == 1 && e->modified && !e->stale;
+	pthread_mutex_unlock(&d->lock);
+
+	/* Pick up the times the writes left behind */
+	if (modified && (!path || fuse_fs_getattr(d->next, path, &stbuf) != 0))
+		modified = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (--e->nopen == 0) {
+		if (e->stale) {
+			dc_entry_free(e);
+		} else {
+			if (modified) {
+				uint64_t version = e->key.version;
+
+				dc_key_stat(&e->key, &stbuf);
+				e->key.version = version;
+				e->modified = 0;
+				e->dirty = 1;
+			} else if (e->modified) {
+				/* The key is unknown, start over next time */
+				dc_reset(d, e);
+				e->modified = 0;
+			}
+			close(e->fd);
+			e->fd = -1;
+			if (e->dirty)
+				dc_save(d, e);
+			dc_evict(d);
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Wrap the handle of the next filesystem after a successful open */
+static int dc_opened(struct diskcache *d, const char *path,
+		     struct fuse_file_info *fi)
+{
+	struct dc_file *f = calloc(1, sizeof(struct dc_file));
+	struct dc_key key;
+
+	if (f == NULL) {
+		fuse_fs_release(d->next, path, fi);
+		return -ENOMEM;
+	}
+
+	f->fh = fi->fh;
+	if (path && dc_file_key(d, path, fi, &key) == 0)
+		f->e = dc_attach(d, path, &key);
+	fi->fh = (uintptr_t) f;
+
+	return 0;
+}
+
+static int dc_is_flat(const struct fuse_bufvec *buf)
+{
+	return buf->count == 1 && buf->idx == 0 && buf->off == 0 &&
+		!(buf->buf[0].flags & FUSE_BUF_IS_FD);
+}
+
+/* Copy the data into a newly allocated vector with one memory buffer */
+static int dc_copy_buf(struct fuse_bufvec *src, struct fuse_bufvec **dstp)
+{
+	size_t size = fuse_buf_size(src);
+	struct fuse_bufvec *dst;
+	void *mem;
+	ssize_t res;
+
+	dst = malloc(sizeof(struct fuse_bufvec));
+	if (dst == NULL)
+		return -ENOMEM;
+	mem = malloc(size ? size : 1);
+	if (mem == NULL) {
+		free(dst);
+		return -ENOMEM;
+	}
+	*dst = FUSE_BUFVEC_INIT(size);
+	dst->buf[0].mem = mem;
+	res = fuse_buf_copy(dst, src, 0);
+	if (res < 0) {
+		free(mem);
+		free(dst);
+		return res;
+	}
+	/* The copy advanced the vector if the data came up short */
+	*dst = FUSE_BUFVEC_INIT(res);
+	dst->buf[0].mem = mem;
+	*dstp = dst;
+
+	return 0;
+}
+
+/*
+ * Flatten the data read from the next filesystem, freeing the original
+ * vector like fuse_free_buf() would.
+ */
+static int dc_flatten(struct fuse_bufvec **bufp)
+{
+	struct fuse_bufvec *src = *bufp;
+	size_t i;
+	int res;
+
+	if (dc_is_flat(src))
+		return 0;
+
+	res = dc_copy_buf(src, bufp);
+	if (res == 0) {
+		for (i = 0; i < src->count; i++)
+			if (!(src->buf[i].flags & FUSE_BUF_IS_FD))
+				free(src->buf[i].mem);
+		free(src);
+	}
+	return res;
+}
+
+static int dc_pwrite(int fd, const char *buf, size_t size, off_t off)
+{
+	while (size) {
+		ssize_t res = pwrite(fd, buf, size, off);
+
+		if (res <= 0)
+			return -1;
+		buf += res;
+		size -= res;
+		off += res;
+	}
+	return 0;
+}
+
+/*
+ * Store data fetched or written at generation gen.  Anything which
+ * could make the data stale bumps the generation first.
+ */
+static void dc_store(struct diskcache *d, struct dc_entry *e, uint64_t gen,
+		     const char *buf, size_t size, off_t off)
+{
+	int ok;
+
+	pthread_mutex_lock(&e->wlock);
+	pthread_mutex_lock(&d->lock);
+	ok = e->gen == gen && !e->writers && !e->stale;
+	pthread_mutex_unlock(&d->lock);
+
+	if (ok && dc_pwrite(e->fd, buf, size, off) == 0) {
+		pthread_mutex_lock(&d->lock);
+		if (e->gen == gen) {
+			uint64_t bytes = e->bytes;
+
+			if (ext_add(e, off, off + size) == 0) {
+				d->bytes += e->bytes - bytes;
+				e->dirty = 1;
+				dc_evict(d);
+			}
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+	pthread_mutex_unlock(&e->wlock);
+}
+
+static int dc_read_buf(const char *path, struct fuse_bufvec **bufp,
+		       size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	struct dc_entry *e = f->e;
+	struct fuse_bufvec *buf;
+	uint64_t gen = 0;
+	int cache = 0;
+	int err;
+
+	if (e) {
+		pthread_mutex_lock(&d->lock);
+		if (!e->stale && !e->writers) {
+			uint64_t end = offset + size;
+
+			if (end > e->key.size)
+				end = e->key.size;
+			if ((uint64_t) offset < end &&
+			    ext_covered(e, offset, end)) {
+				lru_touch(d, e);
+				pthread_mutex_unlock(&d->lock);
+
+				buf = malloc(sizeof(struct fuse_bufvec));
+				if (buf == NULL)
+					return -ENOMEM;
+				*buf = FUSE_BUFVEC_INIT(end - offset);
+				buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				buf->buf[0].fd = e->fd;
+				buf->buf[0].pos = offset;
+				*bufp = buf;
+				return 0;
+			}
+			gen = e->gen;
+			cache = 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	fi->fh = f->fh;
+	err = fuse_fs_read_buf(d->next, path, bufp, size, offset, fi);
+	fi->fh = (uintptr_t) f;
+
+	if (!err && cache && dc_flatten(bufp) == 0) {
+		buf = *bufp;
+		if (buf->buf[0].size)
+			dc_store(d, e, gen, buf->buf[0].mem,
+				 buf->buf[0].size, offset);
+	}
+	return err;
+}
+
+static int dc_write_buf(const char *path, struct fuse_bufvec *buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	struct dc_entry *e = f->e;
+	struct fuse_bufvec *mem = NULL;
+	size_t size = fuse_buf_size(buf);
+	uint64_t gen = 0;
+	int alone = 0;
+	int res;
+
+	/* The data is needed after the next filesystem consumed it */
+	if (e && !dc_is_flat(buf)) {
+		if (dc_copy_buf(buf, &mem) == 0)
+			buf = mem;
+		else
+			e = NULL;
+	}
+	if (e) {
+		pthread_mutex_lock(&d->lock);
+		alone = e->writers++ == 0;
+		gen = ++e->gen;
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	fi->fh = f->fh;
+	res = fuse_fs_write_buf(d->next, path, buf, offset, fi);
+	fi->fh = (uintptr_t) f;
+
+	if (e) {
+		int through;
+
+		pthread_mutex_lock(&d->lock);
+		e->writers--;
+		/* Write through only if no other write overlapped this one */
+		through = res > 0 && alone && e->gen == gen && !e->stale;
+		gen = ++e->gen;
+		if (res > 0 && (uint64_t) offset + res > e->key.size) {
+			e->key.size = offset + res;
+			e->modified = 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		if (through) {
+			pthread_mutex_lock(&e->wlock);
+			if (dc_pwrite(e->fd, buf->buf[0].mem, res, offset) == 0) {
+				pthread_mutex_lock(&d->lock);
+				if (e->gen == gen) {
+					uint64_t bytes = e->bytes;
+
+					if (ext_add(e, offset, offset + res) == 0)
+						d->bytes += e->bytes - bytes;
+					e->modified = 1;
+					dc_unsave(d, e);
+					dc_evict(d);
+				}
+				pthread_mutex_unlock(&d->lock);
+			} else {
+				through = 0;
+			}
+			pthread_mutex_unlock(&e->wlock);
+		}
+		if (!through)
+			dc_invalidate(d, e, offset, offset + size);
+	}
+	if (mem) {
+		free(mem->buf[0].mem);
+		free(mem);
+	}
+	return res;
+}
+
+static int dc_open(const char *path, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_open(d->next, path, fi);
+
+	if (!err)
+		err = dc_opened(d, path, fi);
+	return err;
+}
+
+static int dc_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_create(d->next, path, mode, fi);
+
+	if (!err)
+		err = dc_opened(d, path, fi);
+	return err;
+}
+
+static int dc_create_attr(const char *path, mode_t mode,
+			  struct fuse_file_info *fi, struct stat *stbuf)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_create_attr(d->next, path, mode, fi, stbuf);
+
+	if (!err)
+		err = dc_opened(d, path, fi);
+	return err;
+}
+
+static int dc_release(const char *path, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_release(d->next, path, fi);
+	fi->fh = (uintptr_t) f;
+
+	if (f->e)
+		dc_detach(d, path, f->e);
+	free(f);
+	return err;
+}
+
+static int dc_fgetattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_fgetattr(d->next, path, stbuf, fi);
+	fi->fh = (uintptr_t) f;
+	return err;
+}
+
+static int dc_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_flush(d->next, path, fi);
+	fi->fh = (uintptr_t) f;
+	return err;
+}
+
+static int dc_fsync(const char *path, int isdatasync,
+		    struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_fsync(d->next, path, isdatasync, fi);
+	fi->fh = (uintptr_t) f;
+	return err;
+}
+
+static int dc_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		   struct flock *lock)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_lock(d->next, path, fi, cmd, lock);
+	fi->fh = (uintptr_t) f;
+	return err;
+}
+
+static int dc_flock(const char *path, struct fuse_file_info *fi, int op)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_flock(d->next, path, fi, op);
+	fi->fh = (uintptr_t) f;
+	return err;
+}
+
+static int dc_ftruncate(const char *path, off_t size,
+			struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_ftruncate(d->next, path, size, fi);
+	fi->fh = (uintptr_t) f;
+
+	if (!err && f->e) {
+		pthread_mutex_lock(&d->lock);
+		if (!f->e->stale)
+			dc_truncate(d, f->e, size);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return err;
+}
+
+static int dc_fallocate(const char *path, int mode, off_t offset,
+			off_t length, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_fallocate(d->next, path, mode, offset, length, fi);
+	fi->fh = (uintptr_t) f;
+
+	/* Holes may have been punched, and the size may have changed */
+	if (!err && f->e) {
+		struct stat stbuf;
+
+		dc_invalidate(d, f->e, offset, offset + length);
+		if (fuse_fs_fgetattr(d->next, path, &stbuf, fi) == 0) {
+			pthread_mutex_lock(&d->lock);
+			f->e->key.size = stbuf.st_size;
+			pthread_mutex_unlock(&d->lock);
+		}
+	}
+	return err;
+}
+
+static int dc_setattr(const char *path, const struct stat *attr, int valid,
+		      struct stat *stbuf, struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = fi ? dc_file(fi) : NULL;
+	int err;
+
+	if (f)
+		fi->fh = f->fh;
+	err = fuse_fs_setattr(d->next, path, attr, valid, stbuf, fi);
+	if (f)
+		fi->fh = (uintptr_t) f;
+
+	if (!err && (valid & FUSE_SET_ATTR_SIZE)) {
+		if (f && f->e) {
+			pthread_mutex_lock(&d->lock);
+			if (!f->e->stale)
+				dc_truncate(d, f->e, attr->st_size);
+			pthread_mutex_unlock(&d->lock);
+		} else if (path) {
+			dc_truncate_path(d, path, attr->st_size);
+		}
+	}
+	return err;
+}
+
+static int dc_truncate_op(const char *path, off_t size)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_truncate(d->next, path, size);
+
+	if (!err)
+		dc_truncate_path(d, path, size);
+	return err;
+}
+
+static int dc_unlink(const char *path)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_unlink(d->next, path);
+
+	if (!err) {
+		pthread_mutex_lock(&d->lock);
+		dc_drop_path(d, path);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return err;
+}
+
+static int dc_rename(const char *from, const char *to)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_rename(d->next, from, to);
+
+	if (!err) {
+		pthread_mutex_lock(&d->lock);
+		dc_drop_path(d, from);
+		dc_drop_path(d, to);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return err;
+}
+
+static int dc_getattr(const char *path, struct stat *stbuf)
+{
+	return fuse_fs_getattr(dc_get()->next, path, stbuf);
+}
+
+static int dc_access(const char *path, int mask)
+{
+	return fuse_fs_access(dc_get()->next, path, mask);
+}
+
+static int dc_readlink(const char *path, char *buf, size_t size)
+{
+	return fuse_fs_readlink(dc_get()->next, path, buf, size);
+}
+
+static int dc_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_opendir(dc_get()->next, path, fi);
+}
+
+static int dc_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	return fuse_fs_readdir(dc_get()->next, path, buf, filler, offset, fi);
+}
+
+static int dc_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return fuse_fs_releasedir(dc_get()->next, path, fi);
+}
+
+static int dc_fsyncdir(const char *path, int isdatasync,
+		       struct fuse_file_info *fi)
+{
+	return fuse_fs_fsyncdir(dc_get()->next, path, isdatasync, fi);
+}
+
+static int dc_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	return fuse_fs_mknod(dc_get()->next, path, mode, rdev);
+}
+
+static int dc_mkdir(const char *path, mode_t mode)
+{
+	return fuse_fs_mkdir(dc_get()->next, path, mode);
+}
+
+static int dc_rmdir(const char *path)
+{
+	return fuse_fs_rmdir(dc_get()->next, path);
+}
+
+static int dc_symlink(const char *from, const char *path)
+{
+	return fuse_fs_symlink(dc_get()->next, from, path);
+}
+
+static int dc_link(const char *from, const char *to)
+{
+	return fuse_fs_link(dc_get()->next, from, to);
+}
+
+static int dc_chmod(const char *path, mode_t mode)
+{
+	return fuse_fs_chmod(dc_get()->next, path, mode);
+}
+
+static int dc_chown(const char *path, uid_t uid, gid_t gid)
+{
+	return fuse_fs_chown(dc_get()->next, path, uid, gid);
+}
+
+static int dc_utimens(const char *path, const struct timespec ts[2])
+{
+	return fuse_fs_utimens(dc_get()->next, path, ts);
+}
+
+static int dc_statfs(const char *path, struct statvfs *stbuf)
+{
+	return fuse_fs_statfs(dc_get()->next, path, stbuf);
+}
+
+#ifdef __APPLE__
+static int dc_setxattr(const char *path, const char *name, const char *value,
+		       size_t size, int flags, uint32_t position)
+{
+	return fuse_fs_setxattr(dc_get()->next, path, name, value, size, flags,
+				position);
+}
+
+static int dc_getxattr(const char *path, const char *name, char *value,
+		       size_t size, uint32_t position)
+{
+	return fuse_fs_getxattr(dc_get()->next, path, name, value, size,
+				position);
+}
+#else
+static int dc_setxattr(const char *path, const char *name, const char *value,
+		       size_t size, int flags)
+{
+	return fuse_fs_setxattr(dc_get()->next, path, name, value, size, flags);
+}
+
+static int dc_getxattr(const char *path, const char *name, char *value,
+		       size_t size)
+{
+	return fuse_fs_getxattr(dc_get()->next, path, name, value, size);
+}
+#endif
+
+static int dc_listxattr(const char *path, char *list, size_t size)
+{
+	return fuse_fs_listxattr(dc_get()->next, path, list, size);
+}
+
+static int dc_removexattr(const char *path, const char *name)
+{
+	return fuse_fs_removexattr(dc_get()->next, path, name);
+}
+
+static int dc_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	return fuse_fs_bmap(dc_get()->next, path, blocksize, idx);
+}
+
+static int dc_mknod_attr(const char *path, mode_t mode, dev_t rdev,
+			 struct stat *stbuf)
+{
+	return fuse_fs_mknod_attr(dc_get()->next, path, mode, rdev, stbuf);
+}
+
+static int dc_mkdir_attr(const char *path, mode_t mode, struct stat *stbuf)
+{
+	return fuse_fs_mkdir_attr(dc_get()->next, path, mode, stbuf);
+}
+
+static int dc_symlink_attr(const char *from, const char *path,
+			   struct stat *stbuf)
+{
+	return fuse_fs_symlink_attr(dc_get()->next, from, path, stbuf);
+}
+
+static int dc_link_attr(const char *from, const char *to, struct stat *stbuf)
+{
+	return fuse_fs_link_attr(dc_get()->next, from, to, stbuf);
+}
+
+#ifdef __APPLE__
+
+static int dc_setvolname(const char *volname)
+{
+	return fuse_fs_setvolname(dc_get()->next, volname);
+}
+
+static int dc_exchange(const char *path1, const char *path2,
+		       unsigned long options)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_exchange(d->next, path1, path2, options);
+
+	if (!err) {
+		pthread_mutex_lock(&d->lock);
+		dc_drop_path(d, path1);
+		dc_drop_path(d, path2);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return err;
+}
+
+static int dc_renamex(const char *from, const char *to, unsigned int flags)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_renamex(d->next, from, to, flags);
+
+	if (!err) {
+		pthread_mutex_lock(&d->lock);
+		dc_drop_path(d, from);
+		dc_drop_path(d, to);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return err;
+}
+
+static int dc_statfs_x(const char *path, struct statfs *stbuf)
+{
+	return fuse_fs_statfs_x(dc_get()->next, path, stbuf);
+}
+
+static int dc_setattr_x(const char *path, struct setattr_x *attr)
+{
+	struct diskcache *d = dc_get();
+	int err = fuse_fs_setattr_x(d->next, path, attr);
+
+	if (!err && SETATTR_WANTS_SIZE(attr))
+		dc_truncate_path(d, path, attr->size);
+	return err;
+}
+
+static int dc_fsetattr_x(const char *path, struct setattr_x *attr,
+			 struct fuse_file_info *fi)
+{
+	struct diskcache *d = dc_get();
+	struct dc_file *f = dc_file(fi);
+	int err;
+
+	fi->fh = f->fh;
+	err = fuse_fs_fsetattr_x(d->next, path, attr, fi);
+	fi->fh = (uintptr_t) f;
+
+	if (!err && SETATTR_WANTS_SIZE(attr) && f->e) {
+		pthread_mutex_lock(&d->lock);
+		if (!f->e->stale)
+			dc_truncate(d, f->e, attr->size);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return err;
+}
+
+static int dc_chflags(const char *path, uint32_t flags)
+{
+	return fuse_fs_chflags(dc_get()->next, path, flags);
+}
+
+static int dc_getxtimes(const char *path, struct timespec *bkuptime,
+			struct timespec *crtime)
+{
+	return fuse_fs_getxtimes(dc_get()->next, path, bkuptime, crtime);
+}
+
+static int dc_setbkuptime(const char *path, const struct timespec *bkuptime)
+{
+	return fuse_fs_setbkuptime(dc_get()->next, path, bkuptime);
+}
+
+static int dc_setchgtime(const char *path, const struct timespec *chgtime)
+{
+	return fuse_fs_setchgtime(dc_get()->next, path, chgtime);
+}
+
+static int dc_setcrtime(const char *path, const struct timespec *crtime)
+{
+	return fuse_fs_setcrtime(dc_get()->next, path, crtime);
+}
+
+#endif /* __APPLE__ */
+
+static void *dc_init(struct fuse_conn_info *conn)
+{
+	struct diskcache *d = dc_get();
+
+	/* Hits are file descriptor buffers, let them be spliced */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+	fuse_fs_init(d->next, conn);
+	return d;
+}
+
+static void dc_free(struct diskcache *d)
+{
+	size_t i;
+
+	for (i = 0; i < d->table_size; i++) {
+		struct dc_entry *e;
+		struct dc_entry *next;
+
+		for (e = d->table[i]; e; e = next) {
+			next = e->hash_next;
+			if (e->dirty)
+				dc_save(d, e);
+			dc_entry_free(e);
+		}
+	}
+	pthread_mutex_destroy(&d->lock);
+	free(d->table);
+	free(d->dir);
+	free(d->xattr);
+	free(d);
+}
+
+static void dc_destroy(void *data)
+{
+	struct diskcache *d = data;
+
+	fuse_fs_destroy(d->next);
+	dc_free(d);
+}
+
+static const struct fuse_operations dc_oper = {
+	.destroy	= dc_destroy,
+	.init		= dc_init,
+	.getattr	= dc_getattr,
+	.fgetattr	= dc_fgetattr,
+	.access		= dc_access,
+	.readlink	= dc_readlink,
+	.opendir	= dc_opendir,
+	.readdir	= dc_readdir,
+	.releasedir	= dc_releasedir,
+	.mknod		= dc_mknod,
+	.mkdir		= dc_mkdir,
+	.symlink	= dc_symlink,
+	.unlink		= dc_unlink,
+	.rmdir		= dc_rmdir,
+	.rename		= dc_rename,
+	.link		= dc_link,
+	.chmod		= dc_chmod,
+	.chown		= dc_chown,
+	.truncate	= dc_truncate_op,
+	.ftruncate	= dc_ftruncate,
+	.utimens	= dc_utimens,
+	.create		= dc_create,
+	.open		= dc_open,
+	.read_buf	= dc_read_buf,
+	.write_buf	= dc_write_buf,
+	.statfs		= dc_statfs,
+	.flush		= dc_flush,
+	.release	= dc_release,
+	.fsync		= dc_fsync,
+	.fsyncdir	= dc_fsyncdir,
+	.setxattr	= dc_setxattr,
+	.getxattr	= dc_getxattr,
+	.listxattr	= dc_listxattr,
+	.removexattr	= dc_removexattr,
+	.lock		= dc_lock,
+	.flock		= dc_flock,
+	.bmap		= dc_bmap,
+	.fallocate	= dc_fallocate,
+	.setattr	= dc_setattr,
+	.mknod_attr	= dc_mknod_attr,
+	.mkdir_attr	= dc_mkdir_attr,
+	.symlink_attr	= dc_symlink_attr,
+	.link_attr	= dc_link_attr,
+	.create_attr	= dc_create_attr,
+#ifdef __APPLE__
+	.renamex	= dc_renamex,
+	.statfs_x	= dc_statfs_x,
+	.setvolname	= dc_setvolname,
+	.exchange	= dc_exchange,
+	.getxtimes	= dc_getxtimes,
+	.setbkuptime	= dc_setbkuptime,
+	.setchgtime	= dc_setchgtime,
+	.setcrtime	= dc_setcrtime,
+	.chflags	= dc_chflags,
+	.setattr_x	= dc_setattr_x,
+	.fsetattr_x	= dc_fsetattr_x,
+#endif /* __APPLE__ */
+
+	.flag_readdir_attr = 1,
+};
+
+/* Returns the suffix of a cache file name, or NULL for other files */
+static const char *dc_parse_name(const char *name, uint64_t *id)
+{
+	char *end;
+
+	if (strlen(name) < 17 || name[16] != '.')
+		return NULL;
+
+	*id = strtoull(name, &end, 16);
+	if (end != name + 16)
+		return NULL;
+
+	end++;
+	if (strcmp(end, "data") != 0 && strcmp(end, "idx") != 0 &&
+	    strcmp(end, "idx.tmp") != 0)
+		return NULL;
+
+	return end;
+}
+
+struct dc_loaded {
+	struct dc_entry *e;
+	time_t mtime;
+};
+
+/* Read one index file, returns the entry or NULL if it's not usable */
+static struct dc_entry *dc_load_entry(struct diskcache *d, uint64_t id,
+				      time_t *mtime)
+{
+	char name[PATH_MAX];
+	struct dc_index hdr;
+	struct dc_entry *e = NULL;
+	struct stat stbuf;
+	char *path = NULL;
+	size_t size;
+	size_t i;
+	int fd;
+
+	dc_name(d, id, ".idx", name);
+	fd = open(name, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &stbuf) == -1 ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != DC_INDEX_MAGIC || hdr.pathlen >= PATH_MAX ||
+	    hdr.count > SIZE_MAX / sizeof(struct dc_extent))
+		goto out;
+	*mtime = stbuf.st_mtime;
+
+	path = malloc(hdr.pathlen + 1);
+	if (path == NULL ||
+	    read(fd, path, hdr.pathlen) != (ssize_t) hdr.pathlen)
+		goto out;
+	path[hdr.pathlen] = '\0';
+	if (dc_hash(path) != id)
+		goto out;
+
+	e = dc_entry_new(path, id);
+	if (e == NULL)
+		goto out;
+	size = hdr.count * sizeof(struct dc_extent);
+	if (ext_reserve(e, hdr.count) == -1 ||
+	    read(fd, e->ext, size) != (ssize_t) size)
+		goto out_free;
+	e->count = hdr.count;
+	for (i = 0; i < e->count; i++) {
+		if (!e->ext[i].len || (i && e->ext[i].off <=
+				       e->ext[i - 1].off + e->ext[i - 1].len))
+			goto out_free;
+		e->bytes += e->ext[i].len;
+	}
+	e->key = hdr.key;
+	e->saved = 1;
+
+	dc_name(d, id, ".data", name);
+	if (stat(name, &stbuf) == -1)
+		goto out_free;
+out:
+	close(fd);
+	free(path);
+	return e;
+
+out_free:
+	dc_entry_free(e);
+	e = NULL;
+	goto out;
+}
+
+static int dc_load_cmp(const void *a, const void *b)
+{
+	const struct dc_loaded *la = a;
+	const struct dc_loaded *lb = b;
+
+	return la->mtime < lb->mtime ? -1 : la->mtime > lb->mtime;
+}
+
+/*
+ * Pick up the entries left by a previous mount, least recently released
+ * at the tail of the LRU list.  Cache files which don't belong to a
+ * valid entry are removed.
+ */
+static void dc_load(struct diskcache *d)
+{
+	struct dc_loaded *loaded = NULL;
+	size_t nloaded = 0;
+	size_t i;
+	struct dirent *de;
+	DIR *dp;
+
+	dp = opendir(d->dir);
+	if (dp == NULL)
+		return;
+
+	while ((de = readdir(dp)) != NULL) {
+		const char *suffix;
+		struct dc_loaded *tmp;
+		struct dc_entry *e;
+		time_t mtime;
+		uint64_t id;
+
+		suffix = dc_parse_name(de->d_name, &id);
+		if (suffix == NULL || strcmp(suffix, "idx") != 0)
+			continue;
+
+		e = dc_load_entry(d, id, &mtime);
+		if (e == NULL)
+			continue;
+		tmp = realloc(loaded, (nloaded + 1) * sizeof(*loaded));
+		if (tmp == NULL) {
+			dc_entry_free(e);
+			break;
+		}
+		loaded = tmp;
+		loaded[nloaded].e = e;
+		loaded[nloaded].mtime = mtime;
+		nloaded++;
+	}
+
+	qsort(loaded, nloaded, sizeof(*loaded), dc_load_cmp);
+	for (i = 0; i < nloaded; i++) {
+		dc_hash_insert(d, loaded[i].e);
+		lru_push(d, loaded[i].e);
+		d->bytes += loaded[i].e->bytes;
+	}
+	free(loaded);
+
+	rewinddir(dp);
+	while ((de = readdir(dp)) != NULL) {
+		const char *suffix;
+		char name[PATH_MAX];
+		uint64_t id;
+
+		suffix = dc_parse_name(de->d_name, &id);
+		if (suffix == NULL ||
+		    (strcmp(suffix, "idx.tmp") != 0 && dc_lookup(d, id)))
+			continue;
+
+		snprintf(name, sizeof(name), "%s/%s", d->dir, de->d_name);
+		unlink(name);
+	}
+	closedir(dp);
+
+	dc_evict(d);
+}
+
+static const struct fuse_opt dc_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "diskcache_dir=%s", offsetof(struct diskcache, dir), 0 },
+	{ "diskcache_size=%u", offsetof(struct diskcache, size), 0 },
+	{ "diskcache_xattr=%s", offsetof(struct diskcache, xattr), 0 },
+	FUSE_OPT_END
+};
+
+static void dc_help(void)
+{
+	fprintf(stderr,
+"    -o diskcache_dir=DIR   directory holding the cache files (mandatory)\n"
+"    -o diskcache_size=N    size of the cache in megabytes (1024)\n"
+"    -o diskcache_xattr=NAME  attribute holding a version of the file\n");
+}
+
+static int dc_opt_proc(void *data, const char *arg, int key,
+		       struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		dc_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *dc_new(struct fuse_args *args, struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct diskcache *d;
+
+	d = calloc(1, sizeof(struct diskcache));
+	if (d == NULL) {
+		fprintf(stderr, "fuse-diskcache: memory allocation failed\n");
+		return NULL;
+	}
+	d->size = DC_DEFAULT_SIZE;
+
+	if (fuse_opt_parse(args, d, dc_opts, dc_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-diskcache: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (!d->dir) {
+		fprintf(stderr, "fuse-diskcache: missing 'diskcache_dir' option\n");
+		goto out_free;
+	}
+	if (mkdir(d->dir, 0700) == -1 && errno != EEXIST) {
+		fprintf(stderr, "fuse-diskcache: cannot create %s: %s\n",
+			d->dir, strerror(errno));
+		goto out_free;
+	}
+
+	d->max_bytes = (uint64_t) d->size << 20;
+	d->table_size = DC_MIN_TABLE;
+	d->table = calloc(d->table_size, sizeof(struct dc_entry *));
+	if (d->table == NULL) {
+		fprintf(stderr, "fuse-diskcache: memory allocation failed\n");
+		goto out_free;
+	}
+	fuse_mutex_init(&d->lock);
+	dc_load(d);
+
+	d->next = next[0];
+	fs = fuse_fs_new(&dc_oper, sizeof(dc_oper), d);
+	if (!fs) {
+		dc_free(d);
+		return NULL;
+	}
+	return fs;
+
+out_free:
+	free(d->dir);
+	free(d->xattr);
+	free(d);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(diskcache, dc_new);
@@ -770,6 +770,97 @@ static int iconv_fallocate(const char *path, int mode, off_t offset,
 	return err;
 }
 
+static int iconv_setattr(const char *path, const struct stat *attr,
+			  int valid, struct stat *stbuf,
+			  struct fuse_file_info *fi)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_setattr(ic->next, newpath, attr, valid, stbuf,
+				      fi);
+		free(newpath);
+	}
+	return err;
+}
+
+static int iconv_mknod_attr(const char *path, mode_t mode, dev_t rdev,
+			    struct stat *stbuf)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_mknod_attr(ic->next, newpath, mode, rdev, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
+static int iconv_mkdir_attr(const char *path, mode_t mode, struct stat *stbuf)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_mkdir_attr(ic->next, newpath, mode, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
+static int iconv_symlink_attr(const char *from, const char *to,
+			      struct stat *stbuf)
+{
+	struct iconv *ic = iconv_get();
+	char *newfrom;
+	char *newto;
+	int err = iconv_convpath(ic, from, &newfrom, 0);
+	if (!err) {
+		err = iconv_convpath(ic, to, &newto, 0);
+		if (!err) {
+			err = fuse_fs_symlink_attr(ic->next, newfrom, newto,
+						   stbuf);
+			free(newto);
+		}
+		free(newfrom);
+	}
+	return err;
+}
+
+static int iconv_link_attr(const char *from, const char *to,
+			   struct stat *stbuf)
+{
+	struct iconv *ic = iconv_get();
+	char *newfrom;
+	char *newto;
+	int err = iconv_convpath(ic, from, &newfrom, 0);
+	if (!err) {
+		err = iconv_convpath(ic, to, &newto, 0);
+		if (!err) {
+			err = fuse_fs_link_attr(ic->next, newfrom, newto,
+						stbuf);
+			free(newto);
+		}
+		free(newfrom);
+	}
+	return err;
+}
+
+static int iconv_create_attr(const char *path, mode_t mode,
+			     struct fuse_file_info *fi, struct stat *stbuf)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_create_attr(ic->next, newpath, mode, fi, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
 static void *iconv_init(struct fuse_conn_info *conn)
 {
 	struct iconv *ic = iconv_get();
@@ -828,6 +919,12 @@ static const struct fuse_operations iconv_oper = {
 	.flock		= iconv_flock,
 	.bmap		= iconv_bmap,
 	.fallocate	= iconv_fallocate,
+	.setattr	= iconv_setattr,
+	.mknod_attr	= iconv_mknod_attr,
+	.mkdir_attr	= iconv_mkdir_attr,
+	.symlink_attr	= iconv_symlink_attr,
+	.link_attr	= iconv_link_attr,
+	.create_attr	= iconv_create_attr,
 #ifdef __APPLE__
 	.renamex	= iconv_renamex,
 	.statfs_x	= iconv_statfs_x,
@@ -844,6 +941,7 @@ static const struct fuse_operations iconv_oper = {
 
 	.flag_nullpath_ok = 1,
 	.flag_nopath = 1,
+	.flag_readdir_attr = 1,
 };
 
 static const struct fuse_opt iconv_opts[] = {
@@ -754,6 +754,92 @@ static int subdir_fallocate(const char *path, int mode, off_t offset,
 	return err;
 }
 
+static int subdir_setattr(const char *path, const struct stat *attr,
+			   int valid, struct stat *stbuf,
+			   struct fuse_file_info *fi)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_setattr(d->next, newpath, attr, valid, stbuf,
+				      fi);
+		free(newpath);
+	}
+	return err;
+}
+
+static int subdir_mknod_attr(const char *path, mode_t mode, dev_t rdev,
+			     struct stat *stbuf)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_mknod_attr(d->next, newpath, mode, rdev, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
+static int subdir_mkdir_attr(const char *path, mode_t mode,
+			     struct stat *stbuf)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_mkdir_attr(d->next, newpath, mode, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
+static int subdir_symlink_attr(const char *from, const char *path,
+			       struct stat *stbuf)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_symlink_attr(d->next, from, newpath, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
+static int subdir_link_attr(const char *from, const char *to,
+			    struct stat *stbuf)
+{
+	struct subdir *d = subdir_get();
+	char *newfrom;
+	char *newto;
+	int err = subdir_addpath(d, from, &newfrom);
+	if (!err) {
+		err = subdir_addpath(d, to, &newto);
+		if (!err) {
+			err = fuse_fs_link_attr(d->next, newfrom, newto,
+						stbuf);
+			free(newto);
+		}
+		free(newfrom);
+	}
+	return err;
+}
+
+static int subdir_create_attr(const char *path, mode_t mode,
+			      struct fuse_file_info *fi, struct stat *stbuf)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_create_attr(d->next, newpath, mode, fi, stbuf);
+		free(newpath);
+	}
+	return err;
+}
+
 static void *subdir_init(struct fuse_conn_info *conn)
 {
 	struct subdir *d = subdir_get();
@@ -808,6 +894,12 @@ static const struct fuse_operations subdir_oper = {
 	.flock		= subdir_flock,
 	.bmap		= subdir_bmap,
 	.fallocate	= subdir_fallocate,
+	.setattr	= subdir_setattr,
+	.mknod_attr	= subdir_mknod_attr,
+	.mkdir_attr	= subdir_mkdir_attr,
+	.symlink_attr	= subdir_symlink_attr,
+	.link_attr	= subdir_link_attr,
+	.create_attr	= subdir_create_attr,
 #ifdef __APPLE__
 	.renamex	= subdir_renamex,
 	.statfs_x	= subdir_statfs_x,
@@ -824,6 +916,7 @@ static const struct fuse_operations subdir_oper = {
 
 	.flag_nullpath_ok = 1,
 	.flag_nopath = 1,
+	.flag_readdir_attr = 1,
 };
 
 static const struct fuse_opt subdir_opts[] = {
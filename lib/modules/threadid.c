@@ -575,6 +575,7 @@ static struct fuse_operations threadid_oper = {
 
 	.flag_nullpath_ok = 1,
 	.flag_nopath = 1,
+	.flag_readdir_attr = 1,
 };
 
 static struct fuse_opt threadid_opts[] = {
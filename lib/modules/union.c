@@ -0,0 +1,2114 @@
+/*
+  fuse union module: merge several directory trees into one
+  Copyright (C) 2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Each layer is a directory of the next filesystem, searched from the
+ * top down; the first layer holding a name wins.  A whiteout ".wh.NAME"
+ * hides NAME in the layers below it, and a directory holding
+ * ".wh..wh..opq" hides the directories of the same name below it.
+ * Only the optional upper layer is modified: files are copied up from
+ * a lower layer before they are changed, and names which are removed
+ * while a lower layer still holds them are whited out.
+ *
+ * To avoid probing every layer on every lookup, each directory keeps a
+ * Bloom filter of the names found in each layer contributing to it,
+ * built from a readdir of that layer when the directory is first used.
+ * A negative answer skips the layer, a positive one is confirmed with
+ * getattr.  The layers must not be modified behind the mount's back.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include "fuse_misc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define UNION_MAX_LAYERS 32
+#define UNION_HASH_SIZE 1024
+#define UNION_MAX_DIRS 4096
+#define UNION_BLOOM_BITS 10
+#define UNION_BLOOM_HASHES 7
+#define UNION_COPY_SIZE (128 << 10)
+#define UNION_WH_PREFIX ".wh."
+#define UNION_WH_PREFIX_LEN 4
+#define UNION_OPAQUE ".wh..wh..opq"
+
+enum {
+	UNION_MISSING,
+	UNION_FOUND,
+	UNION_WHITEOUT,
+};
+
+/* Names of one directory in one layer, or unknown if bits is NULL */
+struct union_filter {
+	uint64_t mask;
+	uint64_t *bits;
+};
+
+struct union_branch {
+	unsigned int layer;
+	struct union_filter filter;
+};
+
+/* The layers contributing to a directory, from the top down */
+struct union_dir {
+	char *path;
+	struct union_dir *hash_next;
+	struct union_dir *lru_prev;
+	struct union_dir *lru_next;
+	unsigned int refs;
+	/* Not in the table, freed when the last reference is dropped */
+	int stale;
+	unsigned int nbranches;
+	struct union_branch branch[];
+};
+
+/* A path being copied up, see union_copy_lock() */
+struct union_copy {
+	const char *path;
+	struct union_copy *next;
+};
+
+/* Replaces the file handle of the next filesystem */
+struct union_file {
+	uint64_t fh;
+	unsigned int layer;
+};
+
+struct unionfs {
+	char *layers_opt;
+	char *upper_opt;
+	/* Layer prefixes without a trailing slash, the upper one first */
+	char *layers[UNION_MAX_LAYERS];
+	unsigned int nlayers;
+	/* Layer 0 is writable */
+	int upper;
+	pthread_mutex_t lock;
+	/* Paths being copied up, so each is only copied once */
+	struct union_copy *copying;
+	pthread_cond_t copy_cond;
+	struct union_dir *table[UNION_HASH_SIZE];
+	unsigned int ndirs;
+	struct union_dir *lru_head;
+	struct union_dir *lru_tail;
+	struct fuse_fs *next;
+};
+
+static struct unionfs *union_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct union_file *union_file(struct fuse_file_info *fi)
+{
+	return (struct union_file *) (uintptr_t) fi->fh;
+}
+
+static uint64_t union_hash(const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char) *name;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int union_hidden(const char *name)
+{
+	return strncmp(name, UNION_WH_PREFIX, UNION_WH_PREFIX_LEN) == 0;
+}
+
+/* Path of NAME in directory DIR of a layer, NAME may be NULL */
+static char *union_path(struct unionfs *u, unsigned int layer,
+			const char *dir, const char *name)
+{
+	const char *base = u->layers[layer];
+	size_t len;
+	char *path;
+
+	if (strcmp(dir, "/") == 0)
+		dir = "";
+	len = strlen(base) + strlen(dir) + (name ? strlen(name) : 0) + 3;
+	path = malloc(len);
+	if (path == NULL)
+		return NULL;
+
+	snprintf(path, len, "%s%s%s%s", base, dir, name ? "/" : "",
+		 name ? name : "");
+	if (!path[0])
+		strcpy(path, "/");
+	return path;
+}
+
+/* Split PATH into a newly allocated parent and a pointer to the name */
+static char *union_split(const char *path, const char **namep)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = slash - path;
+	char *parent;
+
+	parent = malloc(len + 2);
+	if (parent == NULL)
+		return NULL;
+
+	if (len) {
+		memcpy(parent, path, len);
+		parent[len] = '\0';
+	} else {
+		strcpy(parent, "/");
+	}
+	*namep = slash + 1;
+	return parent;
+}
+
+static void union_filter_set(struct union_filter *f, uint64_t hash)
+{
+	uint64_t h2 = (hash >> 32) | 1;
+	unsigned int i;
+
+	for (i = 0; i < UNION_BLOOM_HASHES; i++, hash += h2)
+		f->bits[(hash & f->mask) / 64] |= 1ULL << (hash & 63);
+}
+
+static int union_filter_test(const struct union_filter *f, uint64_t hash)
+{
+	uint64_t h2 = (hash >> 32) | 1;
+	unsigned int i;
+
+	if (f->bits == NULL)
+		return 1;
+
+	for (i = 0; i < UNION_BLOOM_HASHES; i++, hash += h2)
+		if (!(f->bits[(hash & f->mask) / 64] & (1ULL << (hash & 63))))
+			return 0;
+	return 1;
+}
+
+struct union_names {
+	uint64_t *hashes;
+	size_t count;
+	size_t alloc;
+	int err;
+};
+
+static int union_collect(void *buf, const char *name,
+			 const struct stat *stbuf, off_t off)
+{
+	struct union_names *n = buf;
+
+	(void) stbuf; (void) off;
+
+	if (n->count == n->alloc) {
+		size_t alloc = n->alloc ? n->alloc * 2 : 64;
+		uint64_t *tmp = realloc(n->hashes, alloc * sizeof(uint64_t));
+
+		if (tmp == NULL) {
+			n->err = -ENOMEM;
+			return 1;
+		}
+		n->hashes = tmp;
+		n->alloc = alloc;
+	}
+	n->hashes[n->count++] = union_hash(name);
+	return 0;
+}
+
+/*
+ * Fill the filter of directory PATH in a layer.  A directory missing
+ * from the layer gets an empty filter, one which cannot be read an
+ * unknown one.
+ */
+static void union_filter_build(struct unionfs *u, unsigned int layer,
+			       const char *path, struct union_filter *f)
+{
+	struct union_names n = { .hashes = NULL };
+	struct fuse_file_info fi;
+	uint64_t nbits = 64;
+	char *lpath;
+	size_t i;
+	int err;
+
+	f->bits = NULL;
+	lpath = union_path(u, layer, path, NULL);
+	if (lpath == NULL)
+		return;
+
+	memset(&fi, 0, sizeof(fi));
+	err = fuse_fs_opendir(u->next, lpath, &fi);
+	if (!err) {
+		err = fuse_fs_readdir(u->next, lpath, &n, union_collect, 0,
+				      &fi);
+		fuse_fs_releasedir(u->next, lpath, &fi);
+		if (!err)
+			err = n.err;
+	} else if (err == -ENOENT || err == -ENOTDIR) {
+		err = 0;
+	}
+	free(lpath);
+	if (err)
+		goto out;
+
+	while (nbits < n.count * UNION_BLOOM_BITS)
+		nbits *= 2;
+	f->bits = calloc(nbits / 64, sizeof(uint64_t));
+	if (f->bits == NULL)
+		goto out;
+	f->mask = nbits - 1;
+	for (i = 0; i < n.count; i++)
+		union_filter_set(f, n.hashes[i]);
+out:
+	free(n.hashes);
+}
+
+static unsigned int union_dir_hash(const char *path)
+{
+	return union_hash(path) % UNION_HASH_SIZE;
+}
+
+static void union_dir_free(struct union_dir *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nbranches; i++)
+		free(d->branch[i].filter.bits);
+	free(d->path);
+	free(d);
+}
+
+static void union_lru_del(struct unionfs *u, struct union_dir *d)
+{
+	if (d->lru_prev)
+		d->lru_prev->lru_next = d->lru_next;
+	else
+		u->lru_head = d->lru_next;
+	if (d->lru_next)
+		d->lru_next->lru_prev = d->lru_prev;
+	else
+		u->lru_tail = d->lru_prev;
+	d->lru_prev = d->lru_next = NULL;
+}
+
+static void union_lru_push(struct unionfs *u, struct union_dir *d)
+{
+	d->lru_prev = NULL;
+	d->lru_next = u->lru_head;
+	if (u->lru_head)
+		u->lru_head->lru_prev = d;
+	else
+		u->lru_tail = d;
+	u->lru_head = d;
+}
+
+static struct union_dir *union_dir_lookup(struct unionfs *u, const char *path)
+{
+	struct union_dir *d;
+
+	for (d = u->table[union_dir_hash(path)]; d; d = d->hash_next)
+		if (strcmp(d->path, path) == 0)
+			return d;
+	return NULL;
+}
+
+/* Remove from the table, called with the lock held */
+static void union_dir_unhash(struct unionfs *u, struct union_dir *d)
+{
+	struct union_dir **dp = &u->table[union_dir_hash(d->path)];
+
+	for (; *dp; dp = &(*dp)->hash_next) {
+		if (*dp == d) {
+			*dp = d->hash_next;
+			break;
+		}
+	}
+	union_lru_del(u, d);
+	u->ndirs--;
+	d->stale = 1;
+	if (!d->refs)
+		union_dir_free(d);
+}
+
+static void union_dir_put(struct unionfs *u, struct union_dir *d)
+{
+	pthread_mutex_lock(&u->lock);
+	if (!--d->refs && d->stale)
+		union_dir_free(d);
+	pthread_mutex_unlock(&u->lock);
+}
+
+/* Forget what is known about a directory after it was changed */
+static void union_dir_invalidate(struct unionfs *u, const char *path)
+{
+	struct union_dir *d;
+
+	pthread_mutex_lock(&u->lock);
+	d = union_dir_lookup(u, path);
+	if (d)
+		union_dir_unhash(u, d);
+	pthread_mutex_unlock(&u->lock);
+}
+
+/* The same for a directory which was moved, and everything below it */
+static void union_dir_invalidate_tree(struct unionfs *u, const char *path)
+{
+	size_t len = strlen(path);
+	struct union_dir *d, *next;
+
+	pthread_mutex_lock(&u->lock);
+	for (d = u->lru_head; d; d = next) {
+		next = d->lru_next;
+		if (strncmp(d->path, path, len) == 0 &&
+		    (d->path[len] == '\0' || d->path[len] == '/'))
+			union_dir_unhash(u, d);
+	}
+	pthread_mutex_unlock(&u->lock);
+}
+
+/* A name was created in the upper layer of directory PATH */
+static void union_dir_add(struct unionfs *u, const char *path,
+			  const char *name)
+{
+	struct union_dir *d;
+
+	pthread_mutex_lock(&u->lock);
+	d = union_dir_lookup(u, path);
+	if (d && d->nbranches && d->branch[0].layer == 0 &&
+	    d->branch[0].filter.bits)
+		union_filter_set(&d->branch[0].filter, union_hash(name));
+	pthread_mutex_unlock(&u->lock);
+}
+
+static int union_maybe(struct unionfs *u, struct union_branch *b,
+		       const char *name)
+{
+	uint64_t hash = union_hash(name);
+	int res;
+
+	pthread_mutex_lock(&u->lock);
+	res = union_filter_test(&b->filter, hash);
+	pthread_mutex_unlock(&u->lock);
+	return res;
+}
+
+static int union_layer_getattr(struct unionfs *u, unsigned int layer,
+			       const char *dir, const char *name,
+			       struct stat *stbuf)
+{
+	char *lpath = union_path(u, layer, dir, name);
+	int err;
+
+	if (lpath == NULL)
+		return -ENOMEM;
+	err = fuse_fs_getattr(u->next, lpath, stbuf);
+	free(lpath);
+	return err;
+}
+
+/* Look for NAME in one layer of a directory */
+static int union_probe(struct unionfs *u, struct union_dir *d, unsigned int i,
+		       const char *name, struct stat *stbuf)
+{
+	struct union_branch *b = &d->branch[i];
+	char whname[UNION_WH_PREFIX_LEN + 256];
+	struct stat tmp;
+	int err;
+
+	if (union_maybe(u, b, name)) {
+		err = union_layer_getattr(u, b->layer, d->path, name, stbuf);
+		if (!err)
+			return UNION_FOUND;
+		if (err != -ENOENT && err != -ENOTDIR)
+			return err;
+	}
+
+	if (strlen(name) >= sizeof(whname) - UNION_WH_PREFIX_LEN)
+		return UNION_MISSING;
+	strcpy(whname, UNION_WH_PREFIX);
+	strcat(whname, name);
+	if (union_maybe(u, b, whname) &&
+	    union_layer_getattr(u, b->layer, d->path, whname, &tmp) == 0)
+		return UNION_WHITEOUT;
+
+	return UNION_MISSING;
+}
+
+/* Find the topmost layer of a directory holding NAME */
+static int union_find(struct unionfs *u, struct union_dir *d,
+		      unsigned int from, const char *name,
+		      unsigned int *layerp, struct stat *stbuf)
+{
+	unsigned int i;
+	int res;
+
+	if (union_hidden(name))
+		return -ENOENT;
+
+	for (i = from; i < d->nbranches; i++) {
+		res = union_probe(u, d, i, name, stbuf);
+		if (res < 0)
+			return res;
+		if (res == UNION_WHITEOUT)
+			break;
+		if (res == UNION_FOUND) {
+			*layerp = d->branch[i].layer;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static int union_dir_get(struct unionfs *u, const char *path,
+			 struct union_dir **dp);
+
+/* Work out which layers contribute to directory PATH */
+static int union_dir_build(struct unionfs *u, const char *path,
+			   struct union_dir **dp)
+{
+	struct union_branch branch[UNION_MAX_LAYERS];
+	struct union_dir *parent = NULL;
+	unsigned int n = 0;
+	unsigned int i;
+	const char *name = NULL;
+	struct union_dir *d;
+	struct stat stbuf;
+	char *ppath = NULL;
+	int err = 0;
+
+	if (strcmp(path, "/") != 0) {
+		ppath = union_split(path, &name);
+		if (ppath == NULL)
+			return -ENOMEM;
+		err = union_dir_get(u, ppath, &parent);
+		free(ppath);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < (parent ? parent->nbranches : u->nlayers); i++) {
+		unsigned int layer = parent ? parent->branch[i].layer : i;
+		struct union_branch *b = &branch[n];
+		struct stat tmp;
+		int res;
+
+		if (parent) {
+			if (union_hidden(name))
+				break;
+			res = union_probe(u, parent, i, name, &stbuf);
+			if (res < 0) {
+				err = res;
+				break;
+			}
+			if (res == UNION_WHITEOUT)
+				break;
+			if (res == UNION_MISSING)
+				continue;
+			if (!S_ISDIR(stbuf.st_mode))
+				break;
+		} else {
+			res = union_layer_getattr(u, layer, "/", NULL, &stbuf);
+			if (res || !S_ISDIR(stbuf.st_mode))
+				continue;
+		}
+
+		b->layer = layer;
+		union_filter_build(u, layer, path, &b->filter);
+		n++;
+		if (union_maybe(u, b, UNION_OPAQUE) &&
+		    union_layer_getattr(u, layer, path, UNION_OPAQUE, &tmp) == 0)
+			break;
+	}
+	if (parent)
+		union_dir_put(u, parent);
+
+	d = NULL;
+	if (!err) {
+		d = calloc(1, sizeof(struct union_dir) +
+			   n * sizeof(struct union_branch));
+		if (d)
+			d->path = strdup(path);
+		if (d == NULL || d->path == NULL) {
+			free(d);
+			d = NULL;
+			err = -ENOMEM;
+		}
+	}
+	if (d == NULL) {
+		for (i = 0; i < n; i++)
+			free(branch[i].filter.bits);
+		return err;
+	}
+	memcpy(d->branch, branch, n * sizeof(struct union_branch));
+	d->nbranches = n;
+	d->refs = 1;
+	*dp = d;
+	return 0;
+}
+
+/*
+ * Get the cached layers of directory PATH, working them out if needed.
+ * Directories which don't exist are not cached, so creating one only
+ * needs to invalidate its own entry.
+ */
+static int union_dir_get(struct unionfs *u, const char *path,
+			 struct union_dir **dp)
+{
+	struct union_dir *d, *old;
+	int err;
+
+	pthread_mutex_lock(&u->lock);
+	d = union_dir_lookup(u, path);
+	if (d) {
+		d->refs++;
+		union_lru_del(u, d);
+		union_lru_push(u, d);
+	}
+	pthread_mutex_unlock(&u->lock);
+	if (d) {
+		*dp = d;
+		return 0;
+	}
+
+	err = union_dir_build(u, path, &d);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&u->lock);
+	if (!d->nbranches) {
+		d->stale = 1;
+	} else if ((old = union_dir_lookup(u, path)) != NULL) {
+		old->refs++;
+		d->refs = 0;
+		union_dir_free(d);
+		d = old;
+	} else {
+		unsigned int idx = union_dir_hash(path);
+
+		d->hash_next = u->table[idx];
+		u->table[idx] = d;
+		union_lru_push(u, d);
+		if (++u->ndirs > UNION_MAX_DIRS)
+			union_dir_unhash(u, u->lru_tail);
+	}
+	pthread_mutex_unlock(&u->lock);
+	*dp = d;
+	return 0;
+}
+
+/* Find the layer providing PATH, and its attributes */
+static int union_resolve(struct unionfs *u, const char *path,
+			 unsigned int *layerp, struct stat *stbuf)
+{
+	struct union_dir *d;
+	const char *name;
+	char *ppath;
+	int err;
+
+	if (strcmp(path, "/") == 0) {
+		err = union_dir_get(u, path, &d);
+		if (err)
+			return err;
+		err = -ENOENT;
+		if (d->nbranches) {
+			*layerp = d->branch[0].layer;
+			err = union_layer_getattr(u, *layerp, "/", NULL,
+						  stbuf);
+		}
+		union_dir_put(u, d);
+		return err;
+	}
+
+	ppath = union_split(path, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+	err = union_dir_get(u, ppath, &d);
+	free(ppath);
+	if (err)
+		return err;
+
+	err = union_find(u, d, 0, name, layerp, stbuf);
+	union_dir_put(u, d);
+	return err;
+}
+
+/* Whether a layer below the upper one provides NAME in directory PATH */
+static int union_lower_has(struct unionfs *u, const char *path,
+			   const char *name)
+{
+	struct union_dir *d;
+	struct stat stbuf;
+	unsigned int layer;
+	unsigned int from = 0;
+	int err;
+
+	err = union_dir_get(u, path, &d);
+	if (err)
+		return err;
+	if (d->nbranches && d->branch[0].layer == 0)
+		from = 1;
+	err = union_find(u, d, from, name, &layer, &stbuf);
+	union_dir_put(u, d);
+	if (err == -ENOENT)
+		return 0;
+	return err ? err : 1;
+}
+
+static int union_mkfile(struct unionfs *u, const char *path, mode_t mode,
+			struct fuse_file_info *fi)
+{
+	int err;
+
+	fi->flags = O_WRONLY | O_CREAT | O_EXCL;
+	err = fuse_fs_create(u->next, path, mode, fi);
+	if (err == -ENOSYS) {
+		err = fuse_fs_mknod(u->next, path, S_IFREG | mode, 0);
+		if (!err) {
+			fi->flags = O_WRONLY;
+			err = fuse_fs_open(u->next, path, fi);
+		}
+	}
+	return err;
+}
+
+/* Create an empty file NAME in directory PATH of the upper layer */
+static int union_touch(struct unionfs *u, const char *path, const char *name)
+{
+	char *upath = union_path(u, 0, path, name);
+	struct fuse_file_info fi;
+	int err;
+
+	if (upath == NULL)
+		return -ENOMEM;
+	memset(&fi, 0, sizeof(fi));
+	err = union_mkfile(u, upath, 0644, &fi);
+	if (!err) {
+		fuse_fs_release(u->next, upath, &fi);
+		union_dir_add(u, path, name);
+	}
+	free(upath);
+	return err;
+}
+
+static int union_whiteout(struct unionfs *u, const char *path,
+			  const char *name)
+{
+	char whname[UNION_WH_PREFIX_LEN + 256];
+
+	if (strlen(name) >= sizeof(whname) - UNION_WH_PREFIX_LEN)
+		return -ENAMETOOLONG;
+	strcpy(whname, UNION_WH_PREFIX);
+	strcat(whname, name);
+	return union_touch(u, path, whname);
+}
+
+/* Remove the whiteout of NAME, returns 1 if there was one */
+static int union_unwhiteout(struct unionfs *u, const char *path,
+			    const char *name)
+{
+	char whname[UNION_WH_PREFIX_LEN + 256];
+	struct union_dir *d;
+	char *upath;
+	int err;
+
+	if (strlen(name) >= sizeof(whname) - UNION_WH_PREFIX_LEN)
+		return 0;
+	strcpy(whname, UNION_WH_PREFIX);
+	strcat(whname, name);
+
+	err = union_dir_get(u, path, &d);
+	if (err)
+		return err;
+	err = d->nbranches && d->branch[0].layer == 0 &&
+		!union_maybe(u, &d->branch[0], whname);
+	union_dir_put(u, d);
+	if (err)
+		return 0;
+
+	upath = union_path(u, 0, path, whname);
+	if (upath == NULL)
+		return -ENOMEM;
+	err = fuse_fs_unlink(u->next, upath);
+	free(upath);
+	if (err == -ENOENT)
+		return 0;
+	return err ? err : 1;
+}
+
+static int union_copy_data(struct unionfs *u, const char *from,
+			   const char *to, const struct stat *stbuf, int data)
+{
+	struct fuse_file_info ffi;
+	struct fuse_file_info tfi;
+	char *buf = NULL;
+	off_t off = 0;
+	int err;
+
+	memset(&ffi, 0, sizeof(ffi));
+	ffi.flags = O_RDONLY;
+	err = fuse_fs_open(u->next, from, &ffi);
+	if (err)
+		return err;
+
+	memset(&tfi, 0, sizeof(tfi));
+	err = union_mkfile(u, to, stbuf->st_mode & 07777, &tfi);
+	if (err)
+		goto out_release;
+
+	if (data) {
+		buf = malloc(UNION_COPY_SIZE);
+		if (buf == NULL)
+			err = -ENOMEM;
+	}
+	while (buf && !err) {
+		int res = fuse_fs_read(u->next, from, buf, UNION_COPY_SIZE,
+				       off, &ffi);
+		int done;
+
+		if (res <= 0) {
+			err = res;
+			break;
+		}
+		for (done = 0; done < res; done += err) {
+			err = fuse_fs_write(u->next, to, buf + done,
+					    res - done, off + done, &tfi);
+			if (err <= 0) {
+				err = err ? err : -EIO;
+				break;
+			}
+		}
+		if (err > 0)
+			err = 0;
+		off += res;
+	}
+	free(buf);
+
+	fuse_fs_release(u->next, to, &tfi);
+	if (err)
+		fuse_fs_unlink(u->next, to);
+out_release:
+	fuse_fs_release(u->next, from, &ffi);
+	return err;
+}
+
+/* Copy the extended attributes, as far as the upper layer takes them */
+static void union_copy_xattr(struct unionfs *u, const char *from,
+			     const char *to)
+{
+	char *list;
+	char *name;
+	char *value = NULL;
+	int size = fuse_fs_listxattr(u->next, from, NULL, 0);
+
+	if (size <= 0)
+		return;
+	list = malloc(size);
+	if (list == NULL)
+		return;
+	size = fuse_fs_listxattr(u->next, from, list, size);
+	for (name = list; size > 0 && name < list + size;
+	     name += strlen(name) + 1) {
+		int len;
+		char *tmp;
+
+#ifdef __APPLE__
+		len = fuse_fs_getxattr(u->next, from, name, NULL, 0, 0);
+#else
+		len = fuse_fs_getxattr(u->next, from, name, NULL, 0);
+#endif
+		if (len < 0)
+			continue;
+		tmp = realloc(value, len ? len : 1);
+		if (tmp == NULL)
+			break;
+		value = tmp;
+#ifdef __APPLE__
+		len = fuse_fs_getxattr(u->next, from, name, value, len, 0);
+		if (len >= 0)
+			fuse_fs_setxattr(u->next, to, name, value, len, 0, 0);
+#else
+		len = fuse_fs_getxattr(u->next, from, name, value, len);
+		if (len >= 0)
+			fuse_fs_setxattr(u->next, to, name, value, len, 0);
+#endif
+	}
+	free(value);
+	free(list);
+}
+
+/* Make a copy of PATH in the upper layer, its parent is already there */
+static int union_copy_one(struct unionfs *u, const char *path,
+			  unsigned int layer, const struct stat *stbuf,
+			  int data)
+{
+	struct timespec tv[2];
+	const char *name;
+	char *ppath;
+	char *from;
+	char *to;
+	int err;
+
+	ppath = union_split(path, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+
+	err = -ENOMEM;
+	from = union_path(u, layer, path, NULL);
+	to = union_path(u, 0, path, NULL);
+	if (from == NULL || to == NULL)
+		goto out_free_path;
+
+	if (S_ISDIR(stbuf->st_mode)) {
+		err = fuse_fs_mkdir(u->next, to, stbuf->st_mode & 07777);
+	} else if (S_ISREG(stbuf->st_mode)) {
+		err = union_copy_data(u, from, to, stbuf, data);
+	} else if (S_ISLNK(stbuf->st_mode)) {
+		char link[PATH_MAX];
+
+		err = fuse_fs_readlink(u->next, from, link, sizeof(link));
+		if (!err)
+			err = fuse_fs_symlink(u->next, link, to);
+	} else {
+		err = fuse_fs_mknod(u->next, to, stbuf->st_mode,
+				    stbuf->st_rdev);
+	}
+	if (err)
+		goto out_free_path;
+
+	/* Only possible with privileges, like in the lower layer */
+	fuse_fs_chown(u->next, to, stbuf->st_uid, stbuf->st_gid);
+	union_copy_xattr(u, from, to);
+	if (!S_ISLNK(stbuf->st_mode)) {
+		/* After chown, which may clear the set-id bits */
+		fuse_fs_chmod(u->next, to, stbuf->st_mode & 07777);
+		tv[0] = stbuf->st_atim;
+		tv[1] = stbuf->st_mtim;
+		fuse_fs_utimens(u->next, to, tv);
+	}
+	union_dir_add(u, ppath, name);
+	if (S_ISDIR(stbuf->st_mode))
+		union_dir_invalidate(u, path);
+
+out_free_path:
+	free(from);
+	free(to);
+	free(ppath);
+	return err;
+}
+
+/* Wait until no other thread copies PATH up, then claim it */
+static void union_copy_lock(struct unionfs *u, struct union_copy *c,
+			    const char *path)
+{
+	struct union_copy *p;
+
+	pthread_mutex_lock(&u->lock);
+	do {
+		for (p = u->copying; p != NULL; p = p->next) {
+			if (strcmp(p->path, path) == 0) {
+				pthread_cond_wait(&u->copy_cond, &u->lock);
+				break;
+			}
+		}
+	} while (p != NULL);
+	c->path = path;
+	c->next = u->copying;
+	u->copying = c;
+	pthread_mutex_unlock(&u->lock);
+}
+
+static void union_copy_unlock(struct unionfs *u, struct union_copy *c)
+{
+	struct union_copy **cp;
+
+	pthread_mutex_lock(&u->lock);
+	for (cp = &u->copying; *cp != c; cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	pthread_cond_broadcast(&u->copy_cond);
+	pthread_mutex_unlock(&u->lock);
+}
+
+/*
+ * Make sure PATH is in the upper layer, copying it and the directories
+ * above it up if needed.  The contents are not copied if DATA is zero.
+ * Only copies of the same path wait for each other.
+ */
+static int union_copyup(struct unionfs *u, const char *path, int data)
+{
+	struct union_copy c;
+	struct stat stbuf;
+	unsigned int layer;
+	const char *name;
+	char *ppath;
+	int err;
+
+	if (!u->upper)
+		return -EROFS;
+
+	err = union_resolve(u, path, &layer, &stbuf);
+	if (err || layer == 0)
+		return err;
+	if (strcmp(path, "/") == 0)
+		return -EROFS;
+
+	ppath = union_split(path, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+	err = union_copyup(u, ppath, 1);
+	free(ppath);
+	if (err)
+		return err;
+
+	union_copy_lock(u, &c, path);
+	/* Another thread may have copied it meanwhile */
+	err = union_resolve(u, path, &layer, &stbuf);
+	if (!err && layer != 0)
+		err = union_copy_one(u, path, layer, &stbuf, data);
+	union_copy_unlock(u, &c);
+	return err;
+}
+
+/* Copy up PATH and return its name in the upper layer */
+static int union_upper_path(struct unionfs *u, const char *path,
+			    char **upathp)
+{
+	int err = union_copyup(u, path, 1);
+
+	if (err)
+		return err;
+	*upathp = union_path(u, 0, path, NULL);
+	return *upathp ? 0 : -ENOMEM;
+}
+
+/* Prepare creating PATH in the upper layer, returns its upper name */
+static int union_prepare_create(struct unionfs *u, const char *path,
+				char **upathp)
+{
+	struct stat stbuf;
+	unsigned int layer;
+	const char *name;
+	char *ppath;
+	int err;
+
+	if (!u->upper)
+		return -EROFS;
+
+	ppath = union_split(path, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+	if (union_hidden(name)) {
+		err = -EINVAL;
+		goto out;
+	}
+	err = union_resolve(u, path, &layer, &stbuf);
+	if (!err)
+		err = -EEXIST;
+	else if (err == -ENOENT)
+		err = union_copyup(u, ppath, 1);
+	if (!err) {
+		*upathp = union_path(u, 0, path, NULL);
+		if (*upathp == NULL)
+			err = -ENOMEM;
+	}
+out:
+	free(ppath);
+	return err;
+}
+
+/* PATH was created in the upper layer, hide what was below it */
+static int union_finish_create(struct unionfs *u, const char *path, int dir)
+{
+	const char *name;
+	char *ppath;
+	int err;
+
+	ppath = union_split(path, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+	union_dir_add(u, ppath, name);
+	err = union_unwhiteout(u, ppath, name);
+	if (err == 1 && dir) {
+		/* A lower directory of this name was removed before */
+		err = union_touch(u, path, UNION_OPAQUE);
+	}
+	if (dir)
+		union_dir_invalidate(u, path);
+	free(ppath);
+	return err < 0 ? err : 0;
+}
+
+/* PATH was removed from the upper layer, hide what is still below it */
+static int union_finish_remove(struct unionfs *u, const char *path)
+{
+	const char *name;
+	char *ppath;
+	int err;
+
+	ppath = union_split(path, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+	err = union_lower_has(u, ppath, name);
+	if (err == 1) {
+		err = union_copyup(u, ppath, 1);
+		if (!err)
+			err = union_whiteout(u, ppath, name);
+	}
+	free(ppath);
+	return err;
+}
+
+static int union_getattr(const char *path, struct stat *stbuf)
+{
+	unsigned int layer;
+
+	return union_resolve(union_get(), path, &layer, stbuf);
+}
+
+/* Name of PATH in the layer providing it */
+static int union_lower_path(struct unionfs *u, const char *path,
+			    char **lpathp)
+{
+	struct stat stbuf;
+	unsigned int layer;
+	int err = union_resolve(u, path, &layer, &stbuf);
+
+	if (err)
+		return err;
+	*lpathp = union_path(u, layer, path, NULL);
+	return *lpathp ? 0 : -ENOMEM;
+}
+
+static int union_access(const char *path, int mask)
+{
+	struct unionfs *u = union_get();
+	char *lpath;
+	int err;
+
+	if ((mask & W_OK) && !u->upper)
+		return -EROFS;
+	err = union_lower_path(u, path, &lpath);
+	if (!err) {
+		err = fuse_fs_access(u->next, lpath, mask);
+		free(lpath);
+	}
+	return err;
+}
+
+static int union_readlink(const char *path, char *buf, size_t size)
+{
+	struct unionfs *u = union_get();
+	char *lpath;
+	int err = union_lower_path(u, path, &lpath);
+
+	if (!err) {
+		err = fuse_fs_readlink(u->next, lpath, buf, size);
+		free(lpath);
+	}
+	return err;
+}
+
+struct union_seen {
+	char **names;
+	size_t count;
+	size_t size;
+};
+
+/* Add NAME to the set, returns 1 if it was already there */
+static int union_seen_add(struct union_seen *s, const char *name)
+{
+	size_t i;
+
+	if (s->count * 2 >= s->size) {
+		struct union_seen n = { .size = s->size ? s->size * 2 : 64 };
+
+		n.names = calloc(n.size, sizeof(char *));
+		if (n.names == NULL)
+			return -ENOMEM;
+		for (i = 0; i < s->size; i++) {
+			size_t j;
+
+			if (s->names[i] == NULL)
+				continue;
+			j = union_hash(s->names[i]) & (n.size - 1);
+			while (n.names[j])
+				j = (j + 1) & (n.size - 1);
+			n.names[j] = s->names[i];
+		}
+		free(s->names);
+		s->names = n.names;
+		s->size = n.size;
+	}
+
+	i = union_hash(name) & (s->size - 1);
+	for (; s->names[i]; i = (i + 1) & (s->size - 1))
+		if (strcmp(s->names[i], name) == 0)
+			return 1;
+	s->names[i] = strdup(name);
+	if (s->names[i] == NULL)
+		return -ENOMEM;
+	s->count++;
+	return 0;
+}
+
+static void union_seen_free(struct union_seen *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->size; i++)
+		free(s->names[i]);
+	free(s->names);
+}
+
+struct union_fill {
+	struct union_seen seen;
+	void *buf;
+	fuse_fill_dir_t filler;
+	int full;
+	int err;
+};
+
+static int union_fill(void *buf, const char *name, const struct stat *stbuf,
+		      off_t off)
+{
+	struct union_fill *uf = buf;
+	int res;
+
+	(void) off;
+
+	if (union_hidden(name)) {
+		/* A whiteout hides the name in the layers below */
+		if (strcmp(name, UNION_OPAQUE) != 0)
+			name += UNION_WH_PREFIX_LEN;
+		res = union_seen_add(&uf->seen, name);
+		if (res < 0)
+			uf->err = res;
+		return res < 0;
+	}
+
+	res = union_seen_add(&uf->seen, name);
+	if (res < 0) {
+		uf->err = res;
+		return 1;
+	}
+	if (!res && uf->filler(uf->buf, name, stbuf, 0))
+		uf->full = 1;
+	return uf->full;
+}
+
+/* List the merged directory PATH, the topmost entry of each name wins */
+static int union_list(struct unionfs *u, const char *path, void *buf,
+		      fuse_fill_dir_t filler)
+{
+	struct union_fill uf = { .buf = buf, .filler = filler };
+	struct union_dir *d;
+	unsigned int i;
+	int err;
+
+	err = union_dir_get(u, path, &d);
+	if (err)
+		return err;
+	if (!d->nbranches)
+		err = -ENOENT;
+
+	for (i = 0; !err && !uf.full && i < d->nbranches; i++) {
+		char *lpath = union_path(u, d->branch[i].layer, path, NULL);
+		struct fuse_file_info fi;
+
+		if (lpath == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		memset(&fi, 0, sizeof(fi));
+		err = fuse_fs_opendir(u->next, lpath, &fi);
+		if (!err) {
+			err = fuse_fs_readdir(u->next, lpath, &uf, union_fill,
+					      0, &fi);
+			fuse_fs_releasedir(u->next, lpath, &fi);
+		}
+		free(lpath);
+		if (!err)
+			err = uf.err;
+	}
+	union_dir_put(u, d);
+	union_seen_free(&uf.seen);
+	return err;
+}
+
+static int union_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct stat stbuf;
+	unsigned int layer;
+	char *dpath;
+	int err;
+
+	err = union_resolve(u, path, &layer, &stbuf);
+	if (err)
+		return err;
+	if (!S_ISDIR(stbuf.st_mode))
+		return -ENOTDIR;
+
+	dpath = strdup(path);
+	if (dpath == NULL)
+		return -ENOMEM;
+	fi->fh = (uintptr_t) dpath;
+	return 0;
+}
+
+static int union_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	(void) path; (void) offset;
+
+	return union_list(union_get(), (char *) (uintptr_t) fi->fh, buf,
+			  filler);
+}
+
+static int union_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	free((char *) (uintptr_t) fi->fh);
+	return 0;
+}
+
+static int union_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_prepare_create(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_mknod(u->next, upath, mode, rdev);
+		if (!err)
+			err = union_finish_create(u, path, 0);
+		free(upath);
+	}
+	return err;
+}
+
+static int union_mkdir(const char *path, mode_t mode)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_prepare_create(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_mkdir(u->next, upath, mode);
+		if (!err)
+			err = union_finish_create(u, path, 1);
+		free(upath);
+	}
+	return err;
+}
+
+static int union_symlink(const char *from, const char *path)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_prepare_create(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_symlink(u->next, from, upath);
+		if (!err)
+			err = union_finish_create(u, path, 0);
+		free(upath);
+	}
+	return err;
+}
+
+static int union_unlink(const char *path)
+{
+	struct unionfs *u = union_get();
+	struct stat stbuf;
+	unsigned int layer;
+	char *upath;
+	int err;
+
+	if (!u->upper)
+		return -EROFS;
+	err = union_resolve(u, path, &layer, &stbuf);
+	if (err)
+		return err;
+	if (S_ISDIR(stbuf.st_mode))
+		return -EISDIR;
+
+	if (layer == 0) {
+		upath = union_path(u, 0, path, NULL);
+		if (upath == NULL)
+			return -ENOMEM;
+		err = fuse_fs_unlink(u->next, upath);
+		free(upath);
+		if (err)
+			return err;
+	}
+	return union_finish_remove(u, path);
+}
+
+static int union_count(void *buf, const char *name, const struct stat *stbuf,
+		       off_t off)
+{
+	(void) stbuf; (void) off;
+
+	if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+		*(int *) buf = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static int union_collect_hidden(void *buf, const char *name,
+				const struct stat *stbuf, off_t off)
+{
+	(void) stbuf; (void) off;
+
+	if (union_hidden(name) && union_seen_add(buf, name) < 0)
+		return 1;
+	return 0;
+}
+
+/* Remove the whiteouts left in the upper layer of directory PATH */
+static int union_clear_dir(struct unionfs *u, const char *path)
+{
+	struct union_seen names = { .names = NULL };
+	struct fuse_file_info fi;
+	char *upath;
+	size_t i;
+	int err;
+
+	upath = union_path(u, 0, path, NULL);
+	if (upath == NULL)
+		return -ENOMEM;
+
+	memset(&fi, 0, sizeof(fi));
+	err = fuse_fs_opendir(u->next, upath, &fi);
+	if (!err) {
+		err = fuse_fs_readdir(u->next, upath, &names,
+				      union_collect_hidden, 0, &fi);
+		fuse_fs_releasedir(u->next, upath, &fi);
+	}
+	for (i = 0; !err && i < names.size; i++) {
+		char *whpath;
+
+		if (names.names[i] == NULL)
+			continue;
+		whpath = union_path(u, 0, path, names.names[i]);
+		if (whpath == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		err = fuse_fs_unlink(u->next, whpath);
+		free(whpath);
+	}
+	union_seen_free(&names);
+	free(upath);
+	return err;
+}
+
+static int union_rmdir(const char *path)
+{
+	struct unionfs *u = union_get();
+	struct stat stbuf;
+	unsigned int layer;
+	int notempty = 0;
+	char *upath;
+	int err;
+
+	if (!u->upper)
+		return -EROFS;
+	err = union_resolve(u, path, &layer, &stbuf);
+	if (err)
+		return err;
+	if (!S_ISDIR(stbuf.st_mode))
+		return -ENOTDIR;
+	err = union_list(u, path, &notempty, union_count);
+	if (err)
+		return err;
+	if (notempty)
+		return -ENOTEMPTY;
+
+	if (layer == 0) {
+		err = union_clear_dir(u, path);
+		if (err)
+			return err;
+		upath = union_path(u, 0, path, NULL);
+		if (upath == NULL)
+			return -ENOMEM;
+		err = fuse_fs_rmdir(u->next, upath);
+		free(upath);
+		if (err)
+			return err;
+	}
+	union_dir_invalidate(u, path);
+	return union_finish_remove(u, path);
+}
+
+static int union_rename(const char *from, const char *to)
+{
+	struct unionfs *u = union_get();
+	struct stat stbuf;
+	struct stat tstbuf;
+	unsigned int layer;
+	const char *name;
+	char *ufrom = NULL;
+	char *uto = NULL;
+	char *ppath;
+	int dir;
+	int err;
+
+	if (!u->upper)
+		return -EROFS;
+	err = union_resolve(u, from, &layer, &stbuf);
+	if (err)
+		return err;
+	dir = S_ISDIR(stbuf.st_mode);
+
+	ppath = union_split(to, &name);
+	if (ppath == NULL)
+		return -ENOMEM;
+	err = -EINVAL;
+	if (union_hidden(name))
+		goto out;
+
+	err = union_resolve(u, to, &layer, &tstbuf);
+	if (!err && !dir && S_ISDIR(tstbuf.st_mode)) {
+		err = -EISDIR;
+		goto out;
+	}
+	if (err && err != -ENOENT)
+		goto out;
+
+	if (dir) {
+		/* Merging directories of several layers is left to the caller */
+		err = union_lower_has(u, ppath, name);
+		if (!err) {
+			const char *fname;
+			char *fpath = union_split(from, &fname);
+
+			err = -ENOMEM;
+			if (fpath)
+				err = union_lower_has(u, fpath, fname);
+			free(fpath);
+		}
+		if (err) {
+			err = err < 0 ? err : -EXDEV;
+			goto out;
+		}
+	} else {
+		err = union_copyup(u, from, 1);
+		if (err)
+			goto out;
+	}
+	err = union_copyup(u, ppath, 1);
+	if (err)
+		goto out;
+
+	err = -ENOMEM;
+	ufrom = union_path(u, 0, from, NULL);
+	uto = union_path(u, 0, to, NULL);
+	if (ufrom == NULL || uto == NULL)
+		goto out;
+	err = fuse_fs_rename(u->next, ufrom, uto);
+	if (err)
+		goto out;
+
+	if (dir) {
+		union_dir_invalidate_tree(u, from);
+		union_dir_invalidate_tree(u, to);
+	}
+	err = union_finish_create(u, to, dir);
+	if (!err && !dir)
+		err = union_finish_remove(u, from);
+out:
+	free(ufrom);
+	free(uto);
+	free(ppath);
+	return err;
+}
+
+static int union_link(const char *from, const char *to)
+{
+	struct unionfs *u = union_get();
+	char *ufrom;
+	char *uto;
+	int err;
+
+	err = union_upper_path(u, from, &ufrom);
+	if (err)
+		return err;
+	err = union_prepare_create(u, to, &uto);
+	if (!err) {
+		err = fuse_fs_link(u->next, ufrom, uto);
+		if (!err)
+			err = union_finish_create(u, to, 0);
+		free(uto);
+	}
+	free(ufrom);
+	return err;
+}
+
+static int union_chmod(const char *path, mode_t mode)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_upper_path(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_chmod(u->next, upath, mode);
+		free(upath);
+	}
+	return err;
+}
+
+static int union_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_upper_path(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_chown(u->next, upath, uid, gid);
+		free(upath);
+	}
+	return err;
+}
+
+static int union_truncate(const char *path, off_t size)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err;
+
+	/* Nothing needs to be copied if it's truncated to zero anyway */
+	err = union_copyup(u, path, size != 0);
+	if (err)
+		return err;
+	upath = union_path(u, 0, path, NULL);
+	if (upath == NULL)
+		return -ENOMEM;
+	err = fuse_fs_truncate(u->next, upath, size);
+	free(upath);
+	return err;
+}
+
+static int union_utimens(const char *path, const struct timespec ts[2])
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_upper_path(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_utimens(u->next, upath, ts);
+		free(upath);
+	}
+	return err;
+}
+
+static int union_wrap(struct unionfs *u, const char *path, unsigned int layer,
+		      struct fuse_file_info *fi)
+{
+	struct union_file *f = calloc(1, sizeof(struct union_file));
+
+	if (f == NULL) {
+		fuse_fs_release(u->next, path, fi);
+		return -ENOMEM;
+	}
+	f->fh = fi->fh;
+	f->layer = layer;
+	fi->fh = (uintptr_t) f;
+	return 0;
+}
+
+static int union_open(const char *path, struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct stat stbuf;
+	unsigned int layer = 0;
+	char *lpath;
+	int err;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+		err = union_copyup(u, path, !(fi->flags & O_TRUNC));
+	else
+		err = union_resolve(u, path, &layer, &stbuf);
+	if (err)
+		return err;
+
+	lpath = union_path(u, layer, path, NULL);
+	if (lpath == NULL)
+		return -ENOMEM;
+	err = fuse_fs_open(u->next, lpath, fi);
+	if (!err)
+		err = union_wrap(u, lpath, layer, fi);
+	free(lpath);
+	return err;
+}
+
+static int union_create(const char *path, mode_t mode,
+			struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_prepare_create(u, path, &upath);
+
+	if (err)
+		return err;
+	err = fuse_fs_create(u->next, upath, mode, fi);
+	if (!err) {
+		err = union_wrap(u, upath, 0, fi);
+		if (!err)
+			union_finish_create(u, path, 0);
+	}
+	free(upath);
+	return err;
+}
+
+/* Name of an open file in its layer, NULL if the path isn't known */
+static int union_file_path(struct unionfs *u, const char *path,
+			   struct union_file *f, char **lpathp)
+{
+	*lpathp = NULL;
+	if (path && (*lpathp = union_path(u, f->layer, path, NULL)) == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+static int union_fgetattr(const char *path, struct stat *stbuf,
+			  struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_fgetattr(u->next, lpath, stbuf, fi);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_ftruncate(const char *path, off_t size,
+			   struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_ftruncate(u->next, lpath, size, fi);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_read_buf(const char *path, struct fuse_bufvec **bufp,
+			  size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_read_buf(u->next, lpath, bufp, size, off, fi);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_write_buf(const char *path, struct fuse_bufvec *buf,
+			   off_t off, struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_write_buf(u->next, lpath, buf, off, fi);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_flush(u->next, lpath, fi);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_fsync(const char *path, int isdatasync,
+		       struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_fsync(u->next, lpath, isdatasync, fi);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		      struct flock *lock)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_lock(u->next, lpath, fi, cmd, lock);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_flock(const char *path, struct fuse_file_info *fi, int op)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath;
+	int err = union_file_path(u, path, f, &lpath);
+
+	if (err)
+		return err;
+	fi->fh = f->fh;
+	err = fuse_fs_flock(u->next, lpath, fi, op);
+	fi->fh = (uintptr_t) f;
+	free(lpath);
+	return err;
+}
+
+static int union_release(const char *path, struct fuse_file_info *fi)
+{
+	struct unionfs *u = union_get();
+	struct union_file *f = union_file(fi);
+	char *lpath = NULL;
+
+	/* The handle must go even if the path can't be built */
+	if (path)
+		lpath = union_path(u, f->layer, path, NULL);
+	fi->fh = f->fh;
+	fuse_fs_release(u->next, lpath, fi);
+	free(lpath);
+	free(f);
+	return 0;
+}
+
+static int union_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct unionfs *u = union_get();
+	char *lpath = union_path(u, 0, "/", NULL);
+	int err;
+
+	(void) path;
+
+	if (lpath == NULL)
+		return -ENOMEM;
+	err = fuse_fs_statfs(u->next, lpath, stbuf);
+	free(lpath);
+	return err;
+}
+
+#ifdef __APPLE__
+static int union_setxattr(const char *path, const char *name,
+			  const char *value, size_t size, int flags,
+			  uint32_t position)
+#else
+static int union_setxattr(const char *path, const char *name,
+			  const char *value, size_t size, int flags)
+#endif
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_upper_path(u, path, &upath);
+
+	if (!err) {
+#ifdef __APPLE__
+		err = fuse_fs_setxattr(u->next, upath, name, value, size,
+				       flags, position);
+#else
+		err = fuse_fs_setxattr(u->next, upath, name, value, size,
+				       flags);
+#endif
+		free(upath);
+	}
+	return err;
+}
+
+#ifdef __APPLE__
+static int union_getxattr(const char *path, const char *name, char *value,
+			  size_t size, uint32_t position)
+#else
+static int union_getxattr(const char *path, const char *name, char *value,
+			  size_t size)
+#endif
+{
+	struct unionfs *u = union_get();
+	char *lpath;
+	int err = union_lower_path(u, path, &lpath);
+
+	if (!err) {
+#ifdef __APPLE__
+		err = fuse_fs_getxattr(u->next, lpath, name, value, size,
+				       position);
+#else
+		err = fuse_fs_getxattr(u->next, lpath, name, value, size);
+#endif
+		free(lpath);
+	}
+	return err;
+}
+
+static int union_listxattr(const char *path, char *list, size_t size)
+{
+	struct unionfs *u = union_get();
+	char *lpath;
+	int err = union_lower_path(u, path, &lpath);
+
+	if (!err) {
+		err = fuse_fs_listxattr(u->next, lpath, list, size);
+		free(lpath);
+	}
+	return err;
+}
+
+static int union_removexattr(const char *path, const char *name)
+{
+	struct unionfs *u = union_get();
+	char *upath;
+	int err = union_upper_path(u, path, &upath);
+
+	if (!err) {
+		err = fuse_fs_removexattr(u->next, upath, name);
+		free(upath);
+	}
+	return err;
+}
+
+static void *union_init(struct fuse_conn_info *conn)
+{
+	struct unionfs *u = union_get();
+
+	fuse_fs_init(u->next, conn);
+	return u;
+}
+
+static void union_free(struct unionfs *u)
+{
+	unsigned int i;
+
+	while (u->lru_head)
+		union_dir_unhash(u, u->lru_head);
+	for (i = 0; i < u->nlayers; i++)
+		free(u->layers[i]);
+	pthread_mutex_destroy(&u->lock);
+	pthread_cond_destroy(&u->copy_cond);
+	free(u->layers_opt);
+	free(u->upper_opt);
+	free(u);
+}
+
+static void union_destroy(void *data)
+{
+	struct unionfs *u = data;
+
+	fuse_fs_destroy(u->next);
+	union_free(u);
+}
+
+static const struct fuse_operations union_oper = {
+	.destroy	= union_destroy,
+	.init		= union_init,
+	.getattr	= union_getattr,
+	.fgetattr	= union_fgetattr,
+	.access		= union_access,
+	.readlink	= union_readlink,
+	.opendir	= union_opendir,
+	.readdir	= union_readdir,
+	.releasedir	= union_releasedir,
+	.mknod		= union_mknod,
+	.mkdir		= union_mkdir,
+	.symlink	= union_symlink,
+	.unlink		= union_unlink,
+	.rmdir		= union_rmdir,
+	.rename		= union_rename,
+	.link		= union_link,
+	.chmod		= union_chmod,
+	.chown		= union_chown,
+	.truncate	= union_truncate,
+	.ftruncate	= union_ftruncate,
+	.utimens	= union_utimens,
+	.create		= union_create,
+	.open		= union_open,
+	.read_buf	= union_read_buf,
+	.write_buf	= union_write_buf,
+	.statfs		= union_statfs,
+	.flush		= union_flush,
+	.release	= union_release,
+	.fsync		= union_fsync,
+	.setxattr	= union_setxattr,
+	.getxattr	= union_getxattr,
+	.listxattr	= union_listxattr,
+	.removexattr	= union_removexattr,
+	.lock		= union_lock,
+	.flock		= union_flock,
+
+	.flag_nullpath_ok = 1,
+	.flag_nopath = 1,
+	.flag_utime_omit_ok = 1,
+	.flag_readdir_attr = 1,
+};
+
+static const struct fuse_opt union_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "union_layers=%s", offsetof(struct unionfs, layers_opt), 0 },
+	{ "union_upper=%s", offsetof(struct unionfs, upper_opt), 0 },
+	FUSE_OPT_END
+};
+
+static void union_help(void)
+{
+	fprintf(stderr,
+"    -o union_layers=DIR[:DIR...]  read-only layers, topmost first (mandatory)\n"
+"    -o union_upper=DIR     writable layer on top of them\n");
+}
+
+static int union_opt_proc(void *data, const char *arg, int key,
+			  struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		union_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static int union_add_layer(struct unionfs *u, const char *dir, size_t len)
+{
+	char *layer;
+
+	if (u->nlayers == UNION_MAX_LAYERS) {
+		fprintf(stderr, "fuse-union: at most %u layers allowed\n",
+			UNION_MAX_LAYERS);
+		return -1;
+	}
+	if (!len || dir[0] != '/') {
+		fprintf(stderr, "fuse-union: layer '%.*s' is not an absolute path\n",
+			(int) len, dir);
+		return -1;
+	}
+	while (len && dir[len - 1] == '/')
+		len--;
+
+	layer = malloc(len + 1);
+	if (layer == NULL) {
+		fprintf(stderr, "fuse-union: memory allocation failed\n");
+		return -1;
+	}
+	memcpy(layer, dir, len);
+	layer[len] = '\0';
+	u->layers[u->nlayers++] = layer;
+	return 0;
+}
+
+static struct fuse_fs *union_new(struct fuse_args *args,
+				 struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct unionfs *u;
+	const char *s;
+
+	u = calloc(1, sizeof(struct unionfs));
+	if (u == NULL) {
+		fprintf(stderr, "fuse-union: memory allocation failed\n");
+		return NULL;
+	}
+	fuse_mutex_init(&u->lock);
+	pthread_cond_init(&u->copy_cond, NULL);
+
+	if (fuse_opt_parse(args, u, union_opts, union_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-union: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (!u->layers_opt) {
+		fprintf(stderr, "fuse-union: missing 'union_layers' option\n");
+		goto out_free;
+	}
+	if (u->upper_opt) {
+		if (union_add_layer(u, u->upper_opt, strlen(u->upper_opt)) == -1)
+			goto out_free;
+		u->upper = 1;
+	}
+	for (s = u->layers_opt; ; s++) {
+		size_t len = strcspn(s, ":");
+
+		if (union_add_layer(u, s, len) == -1)
+			goto out_free;
+		s += len;
+		if (!*s)
+			break;
+	}
+
+	u->next = next[0];
+	fs = fuse_fs_new(&union_oper, sizeof(union_oper), u);
+	if (!fs)
+		goto out_free;
+	return fs;
+
+out_free:
+	union_free(u);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(union, union_new);
@@ -0,0 +1,362 @@
+/*
+  Disk cache benchmark
+
+  Reads a set of files through the "diskcache" module, stacked on a
+  slow in-memory filesystem, by feeding OPEN, READ and RELEASE requests
+  to the high level library through an in-memory channel.  Reports the
+  throughput and the hits and misses of a cold pass, a warm pass, and a
+  pass after the filesystem was destroyed and created again, which must
+  be served from the index left on disk.  Every reply is checked against
+  the expected contents.
+
+  Usage: cachebench [FILES] [-o OPTIONS...]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "perfcount.h"
+#include "fuse_kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/uio.h>
+
+#define FILE_SIZE (4 << 20)
+#define READ_SIZE (128 << 10)
+/* Cost of one read from the backend, like a network round trip */
+#define BACKEND_DELAY 200
+
+static uint64_t unique;
+static int reading;
+static int last_error;
+static uint64_t last_nodeid;
+static uint64_t last_fh;
+static unsigned int cur_file;
+static off_t cur_off;
+static unsigned long long received;
+static unsigned long long backend_reads;
+static int corrupt;
+
+static unsigned char pattern(unsigned int file, off_t off)
+{
+	return (off * 131 + file * 7 + (off >> 12)) & 0xff;
+}
+
+static int cb_getattr(const char *path, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mtime = 1000000000;
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = FILE_SIZE;
+	}
+	return 0;
+}
+
+static int cb_open(const char *path, struct fuse_file_info *fi)
+{
+	unsigned int file;
+
+	if (sscanf(path, "/file%u", &file) != 1)
+		return -ENOENT;
+	fi->fh = file;
+	return 0;
+}
+
+static int cb_read(const char *path, char *buf, size_t size, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	size_t i;
+
+	(void) path;
+
+	backend_reads++;
+	usleep(BACKEND_DELAY);
+	if (offset >= FILE_SIZE)
+		return 0;
+	if (offset + size > FILE_SIZE)
+		size = FILE_SIZE - offset;
+	for (i = 0; i < size; i++)
+		buf[i] = pattern(fi->fh, offset + i);
+	return size;
+}
+
+static struct fuse_operations cb_oper = {
+	.getattr	= cb_getattr,
+	.open		= cb_open,
+	.read		= cb_read,
+};
+
+static void cb_check(const struct iovec iov[], size_t count)
+{
+	const unsigned char *data;
+	size_t i, j;
+
+	for (i = 1; i < count; i++) {
+		data = iov[i].iov_base;
+		for (j = 0; j < iov[i].iov_len; j++, cur_off++)
+			if (data[j] != pattern(cur_file, cur_off))
+				corrupt = 1;
+		received += iov[i].iov_len;
+	}
+}
+
+static int cb_send(struct fuse_chan *ch, const struct iovec iov[],
+		   size_t count)
+{
+	const struct fuse_out_header *out;
+
+	(void) ch;
+
+	if (!count)
+		return 0;
+
+	out = iov[0].iov_base;
+	last_error = out->error;
+	if (out->error)
+		return 0;
+
+	if (reading)
+		cb_check(iov, count);
+	else if (count < 2)
+		return 0;
+	else if (iov[1].iov_len == sizeof(struct fuse_entry_out)) {
+		const struct fuse_entry_out *arg = iov[1].iov_base;
+		last_nodeid = arg->nodeid;
+	} else if (iov[1].iov_len == sizeof(struct fuse_open_out)) {
+		const struct fuse_open_out *arg = iov[1].iov_base;
+		last_fh = arg->fh;
+	}
+	return 0;
+}
+
+static struct fuse_chan_ops cb_chan_ops = {
+	.send		= cb_send,
+};
+
+static void cb_request(struct fuse_session *se, struct fuse_chan *ch,
+		       uint32_t opcode, uint64_t nodeid,
+		       const void *arg, size_t argsize)
+{
+	char buf[512];
+	struct fuse_in_header *in = (struct fuse_in_header *) buf;
+
+	memset(in, 0, sizeof(*in));
+	in->len = sizeof(*in) + argsize;
+	in->opcode = opcode;
+	in->unique = ++unique;
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	memcpy(buf + sizeof(*in), arg, argsize);
+
+	fuse_session_process(se, buf, in->len, ch);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The options are consumed by fuse_new(), so they are built each time */
+static struct fuse *cb_mount(int argc, char *argv[], const char *dir,
+			     struct fuse_chan **chp, uint64_t *nodeids,
+			     unsigned int num)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char opt[1024];
+	struct fuse_init_in init = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+	};
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	unsigned int i;
+	int argi;
+
+	/* There is no device to splice to */
+	snprintf(opt, sizeof(opt),
+		 "-omodules=diskcache,diskcache_dir=%s,no_splice_write", dir);
+	if (fuse_opt_add_arg(&args, argv[0]) == -1 ||
+	    fuse_opt_add_arg(&args, opt) == -1)
+		goto out_free;
+	for (argi = 1; argi < argc; argi++) {
+		if (fuse_opt_add_arg(&args, argv[argi]) == -1)
+			goto out_free;
+	}
+
+	ch = fuse_chan_new(&cb_chan_ops, -1, 0x21000, NULL);
+	if (ch == NULL)
+		goto out_free;
+	fuse = fuse_new(ch, &args, &cb_oper, sizeof(cb_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (fuse == NULL)
+		return NULL;
+	se = fuse_get_session(fuse);
+
+	cb_request(se, ch, FUSE_INIT, 0, &init, sizeof(init));
+	for (i = 0; i < num; i++) {
+		char name[32];
+		int len = sprintf(name, "file%04u", i);
+
+		cb_request(se, ch, FUSE_LOOKUP, FUSE_ROOT_ID, name, len + 1);
+		if (last_error) {
+			fprintf(stderr, "lookup %s failed: %s\n", name,
+				strerror(-last_error));
+			fuse_destroy(fuse);
+			return NULL;
+		}
+		nodeids[i] = last_nodeid;
+	}
+	*chp = ch;
+	return fuse;
+
+out_free:
+	fuse_opt_free_args(&args);
+	return NULL;
+}
+
+static int cb_pass(struct fuse *fuse, struct fuse_chan *ch, const char *phase,
+		   uint64_t *nodeids, unsigned int num)
+{
+	struct fuse_session *se = fuse_get_session(fuse);
+	unsigned long long reads = 0;
+	unsigned long long before = backend_reads;
+	double start = now();
+	double secs;
+	unsigned int i;
+
+	received = 0;
+	pc_start();
+	for (i = 0; i < num; i++) {
+		struct fuse_open_in open_in = { .flags = 0 };
+		struct fuse_release_in release_in;
+		struct fuse_read_in read_in;
+
+		cb_request(se, ch, FUSE_OPEN, nodeids[i], &open_in,
+			   sizeof(open_in));
+		if (last_error) {
+			fprintf(stderr, "open failed: %s\n",
+				strerror(-last_error));
+			return -1;
+		}
+
+		memset(&read_in, 0, sizeof(read_in));
+		read_in.fh = last_fh;
+		read_in.size = READ_SIZE;
+		cur_file = i;
+		cur_off = 0;
+		for (; cur_off < FILE_SIZE; reads++) {
+			off_t off = cur_off;
+
+			read_in.offset = off;
+			reading = 1;
+			cb_request(se, ch, FUSE_READ, nodeids[i], &read_in,
+				   sizeof(read_in));
+			reading = 0;
+			if (last_error || corrupt || cur_off == off) {
+				fprintf(stderr, "%s read of file%04u at %llu failed\n",
+					corrupt ? "corrupt" : "short", i,
+					(unsigned long long) off);
+				return -1;
+			}
+		}
+
+		memset(&release_in, 0, sizeof(release_in));
+		release_in.fh = read_in.fh;
+		cb_request(se, ch, FUSE_RELEASE, nodeids[i], &release_in,
+			   sizeof(release_in));
+	}
+	secs = now() - start;
+
+	printf("%-9s %8.1f MB/s  %6llu hits  %6llu misses\n", phase,
+	       received / secs / (1 << 20), reads - (backend_reads - before),
+	       backend_reads - before);
+	pc_report(phase, reads, secs * 1e9 / reads);
+	return 0;
+}
+
+static void cb_cleanup(const char *dir)
+{
+	struct dirent *de;
+	DIR *dp = opendir(dir);
+
+	if (dp != NULL) {
+		while ((de = readdir(dp)) != NULL) {
+			char name[1024];
+
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+			unlink(name);
+		}
+		closedir(dp);
+	}
+	rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/cachebench.XXXXXX";
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	unsigned int num = 32;
+	uint64_t *nodeids;
+	int err = 1;
+
+	if (argc > 1 && argv[1][0] != '-') {
+		num = strtoul(argv[1], NULL, 0);
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
+
+	pc_init(argv[0]);
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	nodeids = calloc(num, sizeof(uint64_t));
+	if (!nodeids)
+		goto out;
+
+	printf("files:    %9u x %u MB\n", num, FILE_SIZE >> 20);
+
+	fuse = cb_mount(argc, argv, dir, &ch, nodeids, num);
+	if (fuse == NULL)
+		goto out;
+	if (cb_pass(fuse, ch, "cold:", nodeids, num) == -1 ||
+	    cb_pass(fuse, ch, "warm:", nodeids, num) == -1) {
+		fuse_destroy(fuse);
+		goto out;
+	}
+	fuse_destroy(fuse);
+
+	fuse = cb_mount(argc, argv, dir, &ch, nodeids, num);
+	if (fuse == NULL)
+		goto out;
+	if (cb_pass(fuse, ch, "restart:", nodeids, num) == 0)
+		err = 0;
+	fuse_destroy(fuse);
+
+out:
+	free(nodeids);
+	cb_cleanup(dir);
+	return err;
+}
@@ -0,0 +1,118 @@
+/*
+  Directory entry encoding benchmark
+
+  Packs a large directory of short names into readdir sized buffers,
+  once with fuse_add_direntry() per entry and once with
+  fuse_add_direntries(), and reports the encoding throughput.
+
+  Usage: direntbench [ENTRIES] [BUFSIZE]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include "perfcount.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *method, double start, size_t num,
+		   size_t bytes)
+{
+	double secs = now() - start;
+
+	printf("%-12s %8.1f Mentries/s %8.1f MB/s\n", method,
+	       num / secs / 1e6, bytes / secs / 1e6);
+	pc_report(method, num, secs * 1e9 / num);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t num = argc > 1 ? strtoul(argv[1], NULL, 0) : 4000000;
+	size_t bufsize = argc > 2 ? strtoul(argv[2], NULL, 0) : 131072;
+	struct fuse_direntry *ents;
+	char *names;
+	char *buf;
+	size_t bytes;
+	size_t i;
+	double start;
+
+	if (bufsize < 4096) {
+		fprintf(stderr, "buffer size must be at least 4096\n");
+		return 1;
+	}
+
+	ents = calloc(num, sizeof(struct fuse_direntry));
+	names = malloc(num * 16);
+	buf = malloc(bufsize);
+	if (!ents || !names || !buf) {
+		fprintf(stderr, "failed to allocate memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		char *name = names + i * 16;
+
+		ents[i].name = name;
+		ents[i].namelen = sprintf(name, "f%zu", i);
+		ents[i].ino = i + 2;
+		ents[i].mode = S_IFREG;
+		ents[i].off = i + 1;
+	}
+
+	pc_init(argv[0]);
+	printf("entries:     %10zu\n", num);
+
+	bytes = 0;
+	start = now();
+	pc_start();
+	for (i = 0; i < num;) {
+		size_t len = 0;
+
+		for (; i < num; i++) {
+			struct stat stbuf;
+			size_t entsize;
+
+			memset(&stbuf, 0, sizeof(stbuf));
+			stbuf.st_ino = ents[i].ino;
+			stbuf.st_mode = ents[i].mode;
+			entsize = fuse_add_direntry(NULL, buf + len,
+						    bufsize - len,
+						    ents[i].name, &stbuf,
+						    ents[i].off);
+			if (entsize > bufsize - len)
+				break;
+			len += entsize;
+		}
+		bytes += len;
+	}
+	report("single:", start, num, bytes);
+
+	bytes = 0;
+	start = now();
+	pc_start();
+	for (i = 0; i < num;) {
+		size_t len;
+
+		i += fuse_add_direntries(NULL, buf, bufsize, ents + i,
+					 num - i, &len);
+		bytes += len;
+	}
+	report("bulk:", start, num, bytes);
+
+	free(buf);
+	free(names);
+	free(ents);
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*
+  Forget benchmark
+
+  Looks up a set of nodes and forgets them again by feeding LOOKUP,
+  FORGET and BATCH_FORGET requests to the high level library through
+  an in-memory channel, the way the kernel does after its dentry cache
+  was dropped.  Reports the cost of a forget sent one at a time and in
+  batches of increasing size, and checks that every node is gone
+  afterwards by looking it up again and expecting a new node id.
+
+  Usage: forgetbench [NODES] [-o OPTIONS...]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "perfcount.h"
+#include "fuse_kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define MAX_BATCH 1024
+
+static uint64_t unique;
+static uint64_t last_nodeid;
+static uint64_t last_generation;
+static int last_error;
+static uint64_t *nodeids;
+static uint64_t *generations;
+static int replied;
+
+static int fb_getattr(const char *path, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+	}
+	return 0;
+}
+
+static struct fuse_operations fb_oper = {
+	.getattr	= fb_getattr,
+};
+
+static int fb_send(struct fuse_chan *ch, const struct iovec iov[],
+		   size_t count)
+{
+	const struct fuse_out_header *out;
+
+	(void) ch;
+
+	/* FORGET and BATCH_FORGET are answered with an empty reply */
+	if (!count)
+		return 0;
+
+	replied = 1;
+	out = iov[0].iov_base;
+	last_error = out->error;
+	if (!out->error && count > 1 &&
+	    iov[1].iov_len >= sizeof(struct fuse_entry_out)) {
+		const struct fuse_entry_out *arg = iov[1].iov_base;
+		last_nodeid = arg->nodeid;
+		last_generation = arg->generation;
+	}
+	return 0;
+}
+
+static struct fuse_chan_ops fb_chan_ops = {
+	.send		= fb_send,
+};
+
+static void fb_request(struct fuse_session *se, struct fuse_chan *ch,
+		       uint32_t opcode, uint64_t nodeid,
+		       const void *arg, size_t argsize)
+{
+	static char buf[sizeof(struct fuse_in_header) +
+			sizeof(struct fuse_batch_forget_in) +
+			MAX_BATCH * sizeof(struct fuse_forget_one)];
+	struct fuse_in_header *in = (struct fuse_in_header *) buf;
+
+	memset(in, 0, sizeof(*in));
+	in->len = sizeof(*in) + argsize;
+	in->opcode = opcode;
+	in->unique = ++unique;
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	memcpy(buf + sizeof(*in), arg, argsize);
+
+	fuse_session_process(se, buf, in->len, ch);
+}
+
+static int fb_lookup_all(struct fuse_session *se, struct fuse_chan *ch,
+			 unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		char name[32];
+		int len = sprintf(name, "file%08u", i);
+
+		fb_request(se, ch, FUSE_LOOKUP, FUSE_ROOT_ID, name, len + 1);
+		if (last_error) {
+			fprintf(stderr, "lookup %s failed: %s\n", name,
+				strerror(-last_error));
+			return -1;
+		}
+		/* A forgotten node must not be found again */
+		if (nodeids[i] == last_nodeid &&
+		    generations[i] == last_generation) {
+			fprintf(stderr, "node %llu of %s was not forgotten\n",
+				(unsigned long long) last_nodeid, name);
+			return -1;
+		}
+		nodeids[i] = last_nodeid;
+		generations[i] = last_generation;
+	}
+	return 0;
+}
+
+static void fb_forget_all(struct fuse_session *se, struct fuse_chan *ch,
+			  unsigned int num, unsigned int batch)
+{
+	static char arg[sizeof(struct fuse_batch_forget_in) +
+			MAX_BATCH * sizeof(struct fuse_forget_one)];
+	struct fuse_batch_forget_in *bf = (struct fuse_batch_forget_in *) arg;
+	struct fuse_forget_one *one = (struct fuse_forget_one *) (bf + 1);
+	struct fuse_forget_in forget = { .nlookup = 1 };
+	unsigned int i, j;
+
+	for (i = 0; i < num; i += batch) {
+		if (batch == 1) {
+			fb_request(se, ch, FUSE_FORGET, nodeids[i], &forget,
+				   sizeof(forget));
+			continue;
+		}
+		memset(bf, 0, sizeof(*bf));
+		for (j = 0; j < batch && i + j < num; j++) {
+			one[j].nodeid = nodeids[i + j];
+			one[j].nlookup = 1;
+		}
+		bf->count = j;
+		fb_request(se, ch, FUSE_BATCH_FORGET, 0, arg,
+			   sizeof(*bf) + j * sizeof(*one));
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int batches[] = { 1, 16, 256, MAX_BATCH };
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_init_in init = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+	};
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	unsigned int num = 100000;
+	unsigned int i;
+	int argi = 1;
+	int err = 1;
+
+	if (argc > 1 && argv[1][0] != '-')
+		num = strtoul(argv[argi++], NULL, 0);
+
+	pc_init(argv[0]);
+	nodeids = calloc(num, sizeof(uint64_t));
+	generations = calloc(num, sizeof(uint64_t));
+	if (!nodeids || !generations || fuse_opt_add_arg(&args, argv[0]) == -1)
+		return 1;
+	for (; argi < argc; argi++) {
+		if (fuse_opt_add_arg(&args, argv[argi]) == -1)
+			return 1;
+	}
+
+	ch = fuse_chan_new(&fb_chan_ops, -1, 0x21000, NULL);
+	if (ch == NULL)
+		return 1;
+	fuse = fuse_new(ch, &args, &fb_oper, sizeof(fb_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (fuse == NULL)
+		return 1;
+	se = fuse_get_session(fuse);
+
+	fb_request(se, ch, FUSE_INIT, 0, &init, sizeof(init));
+
+	printf("nodes:       %10u\n", num);
+
+	for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		char phase[32];
+		double start;
+		double ns;
+
+		if (fb_lookup_all(se, ch, num) == -1)
+			goto out;
+
+		replied = 0;
+		start = now();
+		pc_start();
+		fb_forget_all(se, ch, num, batches[i]);
+		ns = (now() - start) * 1e9 / num;
+		sprintf(phase, "batch %u", batches[i]);
+		printf("batch %-6u %10.1f ns/forget\n", batches[i], ns);
+		pc_report(phase, num, ns);
+		if (replied) {
+			fprintf(stderr, "forget was answered\n");
+			goto out;
+		}
+	}
+
+	/* Every node of the last round must be gone */
+	if (fb_lookup_all(se, ch, num) == 0)
+		err = 0;
+
+out:
+	fuse_destroy(fuse);
+	free(nodeids);
+	free(generations);
+	return err;
+}
@@ -0,0 +1,266 @@
+/*
+  Node table benchmark
+
+  Feeds LOOKUP and FORGET requests to the high level library through an
+  in-memory channel, so nothing is mounted, and reports the cost of
+  keeping nodes hot, spilling them with "-o node_spill" and faulting
+  them back in.  Node ids are limited with "-o max_nodeid" so that the
+  final phase runs after the id space has wrapped around.
+
+  Usage: nodebench [NODES] [-o OPTIONS...]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "perfcount.h"
+#include "fuse_kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+static uint64_t unique;
+static uint64_t last_nodeid;
+static int last_error;
+static uint64_t *nodeids;
+
+static int nb_getattr(const char *path, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+	}
+	return 0;
+}
+
+static struct fuse_operations nb_oper = {
+	.getattr	= nb_getattr,
+};
+
+static int nb_send(struct fuse_chan *ch, const struct iovec iov[],
+		   size_t count)
+{
+	const struct fuse_out_header *out;
+
+	(void) ch;
+
+	/* FORGET is answered with an empty reply */
+	if (!count)
+		return 0;
+
+	out = iov[0].iov_base;
+	last_error = out->error;
+	if (!out->error && count > 1 &&
+	    iov[1].iov_len >= sizeof(struct fuse_entry_out)) {
+		const struct fuse_entry_out *arg = iov[1].iov_base;
+		last_nodeid = arg->nodeid;
+	}
+	return 0;
+}
+
+static struct fuse_chan_ops nb_chan_ops = {
+	.send		= nb_send,
+};
+
+static void nb_request(struct fuse_session *se, struct fuse_chan *ch,
+		       uint32_t opcode, uint64_t nodeid,
+		       const void *arg, size_t argsize)
+{
+	char buf[512];
+	struct fuse_in_header *in = (struct fuse_in_header *) buf;
+
+	memset(in, 0, sizeof(*in));
+	in->len = sizeof(*in) + argsize;
+	in->opcode = opcode;
+	in->unique = ++unique;
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	memcpy(buf + sizeof(*in), arg, argsize);
+
+	fuse_session_process(se, buf, in->len, ch);
+}
+
+static int nb_lookup(struct fuse_session *se, struct fuse_chan *ch,
+		     unsigned int i)
+{
+	char name[32];
+	int len = sprintf(name, "file%08u", i);
+
+	nb_request(se, ch, FUSE_LOOKUP, FUSE_ROOT_ID, name, len + 1);
+	if (last_error) {
+		fprintf(stderr, "lookup %s failed: %s\n", name,
+			strerror(-last_error));
+		return -1;
+	}
+	if (nodeids[i] && nodeids[i] != last_nodeid) {
+		fprintf(stderr, "lookup %s returned node %llu instead of %llu\n",
+			name, (unsigned long long) last_nodeid,
+			(unsigned long long) nodeids[i]);
+		return -1;
+	}
+	nodeids[i] = last_nodeid;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long resident_kb(void)
+{
+	long size, resident;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (fp == NULL)
+		return -1;
+	if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(fp);
+
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void report(const char *phase, double start, unsigned int num)
+{
+	double ns = (now() - start) * 1e9 / num;
+
+	printf("%-12s %10.1f ns/node\n", phase, ns);
+	pc_report(phase, num, ns);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_init_in init = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+	};
+	struct fuse_forget_in forget;
+	char maxopt[64];
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	unsigned int num = 100000;
+	unsigned int i, round;
+	long hot_kb, cold_kb;
+	double start;
+	int argi = 1;
+
+	if (argc > 1 && argv[1][0] != '-')
+		num = strtoul(argv[argi++], NULL, 0);
+	pc_init(argv[0]);
+
+	/* Room for one and a half rounds of nodes before wrapping around */
+	sprintf(maxopt, "-omax_nodeid=%u", num + num / 2 + 1);
+	nodeids = calloc(num, sizeof(uint64_t));
+	if (!nodeids || fuse_opt_add_arg(&args, argv[0]) == -1 ||
+	    fuse_opt_add_arg(&args, "-onode_spill=3600") == -1 ||
+	    fuse_opt_add_arg(&args, maxopt) == -1)
+		return 1;
+	for (; argi < argc; argi++) {
+		if (fuse_opt_add_arg(&args, argv[argi]) == -1)
+			return 1;
+	}
+
+	ch = fuse_chan_new(&nb_chan_ops, -1, 0x21000, NULL);
+	if (ch == NULL)
+		return 1;
+	fuse = fuse_new(ch, &args, &nb_oper, sizeof(nb_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (fuse == NULL)
+		return 1;
+	se = fuse_get_session(fuse);
+
+	nb_request(se, ch, FUSE_INIT, 0, &init, sizeof(init));
+
+	printf("nodes:       %10u\n", num);
+
+	start = now();
+	pc_start();
+	for (i = 0; i < num; i++)
+		if (nb_lookup(se, ch, i) == -1)
+			goto out_err;
+	report("create:", start, num);
+
+	start = now();
+	pc_start();
+	for (i = 0; i < num; i++)
+		if (nb_lookup(se, ch, i) == -1)
+			goto out_err;
+	report("hot lookup:", start, num);
+	hot_kb = resident_kb();
+
+	/* The first pass only clears the accessed flags */
+	start = now();
+	pc_start();
+	fuse_clean_cache(fuse);
+	report("scan:", start, num);
+
+	start = now();
+	pc_start();
+	fuse_clean_cache(fuse);
+	report("spill:", start, num);
+	cold_kb = resident_kb();
+
+	start = now();
+	pc_start();
+	for (i = 0; i < num; i++)
+		if (nb_lookup(se, ch, i) == -1)
+			goto out_err;
+	report("fault-in:", start, num);
+
+	fuse_clean_cache(fuse);
+	fuse_clean_cache(fuse);
+
+	forget.nlookup = 3;
+	start = now();
+	pc_start();
+	for (i = 0; i < num; i++)
+		nb_request(se, ch, FUSE_FORGET, nodeids[i], &forget,
+			   sizeof(forget));
+	report("cold forget:", start, num);
+
+	/* Create and forget the nodes a few times, reusing freed ids */
+	forget.nlookup = 1;
+	start = now();
+	pc_start();
+	for (round = 0; round < 4; round++) {
+		memset(nodeids, 0, num * sizeof(uint64_t));
+		for (i = 0; i < num; i++)
+			if (nb_lookup(se, ch, i) == -1)
+				goto out_err;
+		for (i = 0; i < num; i++)
+			nb_request(se, ch, FUSE_FORGET, nodeids[i], &forget,
+				   sizeof(forget));
+	}
+	report("id reuse:", start, num * round);
+
+	if (hot_kb >= 0 && cold_kb >= 0)
+		printf("resident:    %10ld kB hot, %ld kB spilled\n",
+		       hot_kb, cold_kb);
+
+	fuse_destroy(fuse);
+	free(nodeids);
+	return 0;
+
+out_err:
+	fuse_destroy(fuse);
+	free(nodeids);
+	return 1;
+}
@@ -0,0 +1,195 @@
+/*
+  Hardware counters for the benchmarks
+
+  With BENCH_PERF set in the environment, pc_start() and pc_report()
+  count the cycles, instructions, last level cache misses, branch
+  misses and context switches of the process and the threads it starts
+  during a phase, with perf_event_open() on Linux, and print them per
+  request.  Counters which the system doesn't provide are shown as "-".
+
+  With BENCH_RESULTS=FILE every phase is also appended to FILE as a tab
+  separated line: BENCH_LABEL (for example the commit being measured),
+  program, phase, requests, ns/request and the counters per request.
+
+  Include this before fuse_kernel.h, which redefines the kernel's
+  integer types.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+enum {
+	PC_CYCLES,
+	PC_INSTRUCTIONS,
+	PC_LLC_MISSES,
+	PC_BRANCH_MISSES,
+	PC_CSWITCHES,
+	PC_NUM
+};
+
+static const char *pc_names[PC_NUM] = {
+	"cycles", "instructions", "llc-misses", "branch-misses", "cswitches"
+};
+
+static int pc_fd[PC_NUM] = { -1, -1, -1, -1, -1 };
+static double pc_value[PC_NUM];
+static int pc_enabled;
+static const char *pc_prog;
+static const char *pc_label;
+static FILE *pc_results;
+
+#ifdef __linux__
+static int pc_open(unsigned int idx)
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[PC_NUM] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[idx].type;
+	attr.config = events[idx].config;
+	attr.disabled = 1;
+	/* Threads started later are counted as well */
+	attr.inherit = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd == -1 && errno == EACCES) {
+		/* Unprivileged users may only count user space */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	if (fd == -1)
+		fprintf(stderr, "counter %s unavailable: %s\n",
+			pc_names[idx], strerror(errno));
+	return fd;
+}
+#endif
+
+/* Call before any threads are started */
+static void pc_init(const char *prog)
+{
+	const char *results = getenv("BENCH_RESULTS");
+	unsigned int i;
+
+	pc_prog = strrchr(prog, '/') ? strrchr(prog, '/') + 1 : prog;
+	pc_label = getenv("BENCH_LABEL") ? getenv("BENCH_LABEL") : "-";
+	if (results) {
+		pc_results = fopen(results, "a");
+		if (pc_results == NULL)
+			perror(results);
+		else if (fseek(pc_results, 0, SEEK_END) == 0 &&
+			 ftell(pc_results) == 0)
+			fprintf(pc_results, "#label\tprogram\tphase\trequests\t"
+				"ns\tcycles\tinstructions\tllc-misses\t"
+				"branch-misses\tcswitches\n");
+	}
+
+	if (!getenv("BENCH_PERF"))
+		return;
+#ifdef __linux__
+	for (i = 0; i < PC_NUM; i++)
+		pc_fd[i] = pc_open(i);
+	pc_enabled = 1;
+#else
+	(void) i;
+	fprintf(stderr, "hardware counters are only available on Linux\n");
+#endif
+}
+
+static void pc_start(void)
+{
+#ifdef __linux__
+	unsigned int i;
+
+	for (i = 0; i < PC_NUM; i++) {
+		if (pc_fd[i] == -1)
+			continue;
+		ioctl(pc_fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(pc_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static void pc_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < PC_NUM; i++) {
+		pc_value[i] = -1;
+#ifdef __linux__
+		if (pc_fd[i] != -1) {
+			/* Value, time enabled and time running */
+			uint64_t val[3];
+
+			ioctl(pc_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(pc_fd[i], val, sizeof(val)) == sizeof(val) &&
+			    val[2])
+				/* Scaled up if the counter was multiplexed */
+				pc_value[i] = (double) val[0] * val[1] / val[2];
+		}
+#endif
+	}
+}
+
+/* Stop counting and report the phase, NS is the time per request */
+static void pc_report(const char *phase, double requests, double ns)
+{
+	size_t len = strlen(phase);
+	unsigned int i;
+
+	pc_stop();
+	if (len && phase[len - 1] == ':')
+		len--;
+
+	if (pc_enabled) {
+		printf("%12s", "");
+		for (i = 0; i < PC_NUM; i++) {
+			if (pc_value[i] < 0)
+				printf(" - %s", pc_names[i]);
+			else
+				printf(" %.2f %s", pc_value[i] / requests,
+				       pc_names[i]);
+		}
+		if (pc_value[PC_CYCLES] > 0 && pc_value[PC_INSTRUCTIONS] >= 0)
+			printf(" (%.2f IPC)", pc_value[PC_INSTRUCTIONS] /
+			       pc_value[PC_CYCLES]);
+		printf("\n");
+	}
+
+	if (pc_results) {
+		fprintf(pc_results, "%s\t%s\t%.*s\t%.0f\t%.1f", pc_label,
+			pc_prog, (int) len, phase, requests, ns);
+		for (i = 0; i < PC_NUM; i++) {
+			if (pc_value[i] < 0)
+				fprintf(pc_results, "\t-");
+			else
+				fprintf(pc_results, "\t%.2f",
+					pc_value[i] / requests);
+		}
+		fprintf(pc_results, "\n");
+		fflush(pc_results);
+	}
+}
@@ -0,0 +1,297 @@
+/*
+  Rename benchmark
+
+  Feeds rename storms to the high level library through an in-memory
+  channel from several threads.  Each thread looks up a temporary name,
+  renames it over its target and forgets the replaced node, the way
+  editors and build tools save files atomically.  The threads share one
+  directory in the first phase and use a directory each in the others,
+  and the last phase uses names too long to be stored inline in the
+  node.  The reported time includes the LOOKUP and the FORGET.
+
+  Usage: renamebench [RENAMES [THREADS]] [-o OPTIONS...]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "perfcount.h"
+#include "fuse_kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define MAX_THREADS 64
+#define LONG_PREFIX "a-file-name-too-long-for-the-inline-buffer"
+
+static uint64_t unique;
+static __thread uint64_t last_nodeid;
+static __thread int last_error;
+
+static struct fuse_session *rb_se;
+static struct fuse_chan *rb_ch;
+static uint64_t dirs[MAX_THREADS];
+static unsigned int num = 100000;
+
+struct rb_thread {
+	pthread_t id;
+	unsigned int idx;
+	uint64_t dir;
+	const char *prefix;
+	int err;
+};
+
+static int rb_getattr(const char *path, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0 || strchr(path + 1, '/') == NULL) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+	}
+	return 0;
+}
+
+static int rb_rename(const char *from, const char *to)
+{
+	(void) from;
+	(void) to;
+	return 0;
+}
+
+static struct fuse_operations rb_oper = {
+	.getattr	= rb_getattr,
+	.rename		= rb_rename,
+};
+
+static int rb_send(struct fuse_chan *ch, const struct iovec iov[],
+		   size_t count)
+{
+	const struct fuse_out_header *out;
+
+	(void) ch;
+
+	/* FORGET is answered with an empty reply */
+	if (!count)
+		return 0;
+
+	out = iov[0].iov_base;
+	last_error = out->error;
+	if (!out->error && count > 1 &&
+	    iov[1].iov_len >= sizeof(struct fuse_entry_out)) {
+		const struct fuse_entry_out *arg = iov[1].iov_base;
+		last_nodeid = arg->nodeid;
+	}
+	return 0;
+}
+
+static struct fuse_chan_ops rb_chan_ops = {
+	.send		= rb_send,
+};
+
+static void rb_request(uint32_t opcode, uint64_t nodeid,
+		       const void *arg, size_t argsize)
+{
+	char buf[512];
+	struct fuse_in_header *in = (struct fuse_in_header *) buf;
+
+	memset(in, 0, sizeof(*in));
+	in->len = sizeof(*in) + argsize;
+	in->opcode = opcode;
+	in->unique = __sync_add_and_fetch(&unique, 1);
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	memcpy(buf + sizeof(*in), arg, argsize);
+
+	fuse_session_process(rb_se, buf, in->len, rb_ch);
+}
+
+static int rb_lookup(uint64_t dir, const char *name, uint64_t *nodeid)
+{
+	rb_request(FUSE_LOOKUP, dir, name, strlen(name) + 1);
+	if (last_error) {
+		fprintf(stderr, "lookup %s failed: %s\n", name,
+			strerror(-last_error));
+		return -1;
+	}
+	*nodeid = last_nodeid;
+	return 0;
+}
+
+static int rb_move(uint64_t dir, const char *oldname, const char *newname)
+{
+	char buf[256];
+	struct fuse_rename_in *arg = (struct fuse_rename_in *) buf;
+	size_t oldlen = strlen(oldname) + 1;
+	size_t newlen = strlen(newname) + 1;
+
+	memset(arg, 0, sizeof(*arg));
+	arg->newdir = dir;
+	memcpy(buf + sizeof(*arg), oldname, oldlen);
+	memcpy(buf + sizeof(*arg) + oldlen, newname, newlen);
+
+	rb_request(FUSE_RENAME, dir, buf, sizeof(*arg) + oldlen + newlen);
+	if (last_error) {
+		fprintf(stderr, "rename %s to %s failed: %s\n", oldname,
+			newname, strerror(-last_error));
+		return -1;
+	}
+	return 0;
+}
+
+static void rb_forget(uint64_t nodeid, uint64_t nlookup)
+{
+	struct fuse_forget_in forget = { .nlookup = nlookup };
+
+	rb_request(FUSE_FORGET, nodeid, &forget, sizeof(forget));
+}
+
+static void *rb_storm(void *data)
+{
+	struct rb_thread *t = data;
+	char tmpname[128];
+	char name[128];
+	uint64_t prev = 0;
+	uint64_t nodeid;
+	unsigned int i;
+
+	t->err = -1;
+	sprintf(name, "%s.%u", t->prefix, t->idx);
+	for (i = 0; i < num; i++) {
+		sprintf(tmpname, "%s.%u.%u.tmp", t->prefix, t->idx, i);
+		if (rb_lookup(t->dir, tmpname, &nodeid) == -1 ||
+		    rb_move(t->dir, tmpname, name) == -1)
+			return NULL;
+		if (prev)
+			rb_forget(prev, 1);
+		prev = nodeid;
+	}
+
+	/* The target must now resolve to the last renamed node */
+	if (rb_lookup(t->dir, name, &nodeid) == -1)
+		return NULL;
+	if (nodeid != prev) {
+		fprintf(stderr, "lookup %s returned node %llu instead of %llu\n",
+			name, (unsigned long long) nodeid,
+			(unsigned long long) prev);
+		return NULL;
+	}
+	rb_forget(nodeid, 2);
+	t->err = 0;
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int rb_phase(const char *phase, unsigned int nthreads, int shared,
+		    const char *prefix)
+{
+	struct rb_thread threads[MAX_THREADS];
+	double start = now();
+	unsigned int i;
+	int err = 0;
+
+	pc_start();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].idx = i;
+		threads[i].dir = dirs[shared ? 0 : i];
+		threads[i].prefix = prefix;
+		if (pthread_create(&threads[i].id, NULL, rb_storm,
+				   &threads[i]) != 0) {
+			fprintf(stderr, "failed to create thread\n");
+			nthreads = i;
+			err = -1;
+			break;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].id, NULL);
+		if (threads[i].err)
+			err = -1;
+	}
+	if (!err) {
+		double ns = (now() - start) * 1e9 / ((double) num * nthreads);
+
+		printf("%-12s %10.1f ns/rename\n", phase, ns);
+		pc_report(phase, (double) num * nthreads, ns);
+	}
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_init_in init = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+	};
+	struct fuse *fuse;
+	unsigned int nthreads = 4;
+	unsigned int i;
+	int argi = 1;
+	int err = 1;
+
+	if (argi < argc && argv[argi][0] != '-')
+		num = strtoul(argv[argi++], NULL, 0);
+	if (argi < argc && argv[argi][0] != '-')
+		nthreads = strtoul(argv[argi++], NULL, 0);
+	if (nthreads < 1 || nthreads > MAX_THREADS) {
+		fprintf(stderr, "threads must be between 1 and %u\n",
+			MAX_THREADS);
+		return 1;
+	}
+
+	pc_init(argv[0]);
+	if (fuse_opt_add_arg(&args, argv[0]) == -1)
+		return 1;
+	for (; argi < argc; argi++) {
+		if (fuse_opt_add_arg(&args, argv[argi]) == -1)
+			return 1;
+	}
+
+	rb_ch = fuse_chan_new(&rb_chan_ops, -1, 0x21000, NULL);
+	if (rb_ch == NULL)
+		return 1;
+	fuse = fuse_new(rb_ch, &args, &rb_oper, sizeof(rb_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (fuse == NULL)
+		return 1;
+	rb_se = fuse_get_session(fuse);
+
+	rb_request(FUSE_INIT, 0, &init, sizeof(init));
+	for (i = 0; i < nthreads; i++) {
+		char name[32];
+
+		sprintf(name, "dir%u", i);
+		if (rb_lookup(FUSE_ROOT_ID, name, &dirs[i]) == -1)
+			goto out;
+	}
+
+	printf("renames:     %10u x %u threads\n", num, nthreads);
+
+	if (rb_phase("one dir:", nthreads, 1, "file") == 0 &&
+	    rb_phase("many dirs:", nthreads, 0, "file") == 0 &&
+	    rb_phase("long names:", nthreads, 0, LONG_PREFIX) == 0)
+		err = 0;
+
+out:
+	fuse_destroy(fuse);
+	return err;
+}
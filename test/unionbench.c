@@ -0,0 +1,268 @@
+/*
+  Union benchmark
+
+  Looks names up through the "union" module, stacked on an in-memory
+  filesystem holding one directory per layer, by feeding LOOKUP and
+  FORGET requests to the high level library through an in-memory
+  channel.  Each layer holds its own share of the names, so most of
+  them are found deep in the stack.  Reports the cost of a lookup and
+  the number of getattr calls reaching the layers per lookup, for names
+  which exist and for names which don't, and checks that every name is
+  found in the right layer.
+
+  Usage: unionbench [NAMES [LAYERS]] [-o OPTIONS...]
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "perfcount.h"
+#include "fuse_kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define MAX_LAYERS 32
+
+static uint64_t unique;
+static uint64_t last_nodeid;
+static uint64_t last_size;
+static int last_error;
+static unsigned long long getattrs;
+static unsigned int num = 100000;
+static unsigned int nlayers = 8;
+
+/* Name I lives in layer I % nlayers, its size tells the layer */
+static int ub_parse(const char *path, unsigned int *layer, unsigned int *idx)
+{
+	int len = 0;
+
+	if (sscanf(path, "/l%u%n", layer, &len) != 1 || *layer >= nlayers)
+		return -1;
+	if (path[len] == '\0')
+		return 0;
+	if (sscanf(path + len, "/name%u", idx) != 1 || *idx >= num ||
+	    *idx % nlayers != *layer)
+		return -1;
+	return 1;
+}
+
+static int ub_getattr(const char *path, struct stat *stbuf)
+{
+	unsigned int layer, idx;
+	int res;
+
+	getattrs++;
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	res = ub_parse(path, &layer, &idx);
+	if (res == -1)
+		return -ENOENT;
+	if (res == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = layer;
+	}
+	return 0;
+}
+
+static int ub_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	unsigned int layer, idx;
+	char name[32];
+
+	(void) offset; (void) fi;
+
+	if (strcmp(path, "/") == 0)
+		return 0;
+	if (ub_parse(path, &layer, &idx) != 0)
+		return -ENOTDIR;
+
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	for (idx = layer; idx < num; idx += nlayers) {
+		sprintf(name, "name%u", idx);
+		if (filler(buf, name, NULL, 0))
+			break;
+	}
+	return 0;
+}
+
+static struct fuse_operations ub_oper = {
+	.getattr	= ub_getattr,
+	.readdir	= ub_readdir,
+};
+
+static int ub_send(struct fuse_chan *ch, const struct iovec iov[],
+		   size_t count)
+{
+	const struct fuse_out_header *out;
+
+	(void) ch;
+
+	/* FORGET is answered with an empty reply */
+	if (!count)
+		return 0;
+
+	out = iov[0].iov_base;
+	last_error = out->error;
+	if (!out->error && count > 1 &&
+	    iov[1].iov_len >= sizeof(struct fuse_entry_out)) {
+		const struct fuse_entry_out *arg = iov[1].iov_base;
+		last_nodeid = arg->nodeid;
+		last_size = arg->attr.size;
+	}
+	return 0;
+}
+
+static struct fuse_chan_ops ub_chan_ops = {
+	.send		= ub_send,
+};
+
+static void ub_request(struct fuse_session *se, struct fuse_chan *ch,
+		       uint32_t opcode, uint64_t nodeid,
+		       const void *arg, size_t argsize)
+{
+	char buf[512];
+	struct fuse_in_header *in = (struct fuse_in_header *) buf;
+
+	memset(in, 0, sizeof(*in));
+	in->len = sizeof(*in) + argsize;
+	in->opcode = opcode;
+	in->unique = ++unique;
+	in->nodeid = nodeid;
+	in->uid = getuid();
+	in->gid = getgid();
+	in->pid = getpid();
+	memcpy(buf + sizeof(*in), arg, argsize);
+
+	fuse_session_process(se, buf, in->len, ch);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Look every name up once and forget it again */
+static int ub_pass(struct fuse_session *se, struct fuse_chan *ch,
+		   const char *phase, const char *fmt, int exist)
+{
+	struct fuse_forget_in forget = { .nlookup = 1 };
+	unsigned long long before = getattrs;
+	double start = now();
+	unsigned int i;
+	double ns;
+
+	pc_start();
+	for (i = 0; i < num; i++) {
+		char name[32];
+		int len = sprintf(name, fmt, i);
+
+		ub_request(se, ch, FUSE_LOOKUP, FUSE_ROOT_ID, name, len + 1);
+		if (!exist) {
+			if (last_error != -ENOENT) {
+				fprintf(stderr, "lookup %s did not fail\n",
+					name);
+				return -1;
+			}
+			continue;
+		}
+		if (last_error) {
+			fprintf(stderr, "lookup %s failed: %s\n", name,
+				strerror(-last_error));
+			return -1;
+		}
+		if (last_size != i % nlayers) {
+			fprintf(stderr, "%s found in layer %llu instead of %u\n",
+				name, (unsigned long long) last_size,
+				i % nlayers);
+			return -1;
+		}
+		ub_request(se, ch, FUSE_FORGET, last_nodeid, &forget,
+			   sizeof(forget));
+	}
+
+	ns = (now() - start) * 1e9 / num;
+	printf("%-9s %10.1f ns/lookup %6.2f getattr/lookup\n", phase, ns,
+	       (double) (getattrs - before) / num);
+	pc_report(phase, num, ns);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_init_in init = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+	};
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	char opt[MAX_LAYERS * 8 + 64];
+	unsigned int i;
+	int argi = 1;
+	int err = 1;
+
+	if (argi < argc && argv[argi][0] != '-')
+		num = strtoul(argv[argi++], NULL, 0);
+	if (argi < argc && argv[argi][0] != '-')
+		nlayers = strtoul(argv[argi++], NULL, 0);
+	if (nlayers < 1 || nlayers > MAX_LAYERS) {
+		fprintf(stderr, "layers must be between 1 and %u\n",
+			MAX_LAYERS);
+		return 1;
+	}
+
+	pc_init(argv[0]);
+	strcpy(opt, "-omodules=union,union_layers=");
+	for (i = 0; i < nlayers; i++)
+		sprintf(opt + strlen(opt), "%s/l%u", i ? ":" : "", i);
+	if (fuse_opt_add_arg(&args, argv[0]) == -1 ||
+	    fuse_opt_add_arg(&args, opt) == -1)
+		return 1;
+	for (; argi < argc; argi++) {
+		if (fuse_opt_add_arg(&args, argv[argi]) == -1)
+			return 1;
+	}
+
+	ch = fuse_chan_new(&ub_chan_ops, -1, 0x21000, NULL);
+	if (ch == NULL)
+		return 1;
+	fuse = fuse_new(ch, &args, &ub_oper, sizeof(ub_oper), NULL);
+	fuse_opt_free_args(&args);
+	if (fuse == NULL)
+		return 1;
+	se = fuse_get_session(fuse);
+
+	ub_request(se, ch, FUSE_INIT, 0, &init, sizeof(init));
+
+	printf("names:    %10u in %u layers\n", num, nlayers);
+
+	/* The first pass reads the layers to build the filters */
+	if (ub_pass(se, ch, "cold:", "name%u", 1) == 0 &&
+	    ub_pass(se, ch, "warm:", "name%u", 1) == 0 &&
+	    ub_pass(se, ch, "missing:", "none%u", 0) == 0)
+		err = 0;
+
+	fuse_destroy(fuse);
+	return err;
+}